@@ -0,0 +1,93 @@
+/*
+   File: crc16-bench.c
+
+   	  Microbenchmark comparing the bitwise and table-driven CRC16 implementations
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc16.h"
+
+
+volatile unsigned long bench_sink;		// Keeps results from being optimised away
+
+
+static double elapsed (struct timespec *start)
+{
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+int main (int argc, char **argv)
+{
+	unsigned int length = 1024;		// Typical DSMR 5 telegram size
+	unsigned long rounds = 100000;
+	unsigned long round;
+	unsigned int idx;
+	uint16_t crc_incremental;
+	struct timespec start;
+	double t_bitwise, t_table;
+	
+	if (argc >= 2)
+		length = atoi(argv[1]);
+	if (argc >= 3)
+		rounds = atol(argv[2]);
+	
+	if (length == 0 || rounds == 0) {
+		printf("Usage: %s [<block length> [<rounds>]]\n", argv[0]);
+		exit(1);
+	}
+	
+	uint8_t *data = malloc(length);
+	if (data == NULL) {
+		printf("Could not allocate %u bytes\n", length);
+		exit(1);
+	}
+	
+	srand(1);
+	for (idx = 0 ; idx < length ; idx++) {
+		data[idx] = rand() & 0xff;
+	}
+	
+	// Check that all implementations agree, also when feeding data in small chunks
+	
+	crc_incremental = 0;
+	for (idx = 0 ; idx < length ; idx += 13) {
+		crc_incremental = crc16_update(crc_incremental, data + idx, (length - idx < 13) ? length - idx : 13);
+	}
+	
+	if (crc16_bitwise(data, length) != crc16(data, length) || crc_incremental != crc16(data, length)) {
+		printf("CRC mismatch: bitwise 0x%04x, table 0x%04x, incremental 0x%04x\n", 
+			crc16_bitwise(data, length), crc16(data, length), crc_incremental);
+		exit(2);
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 0 ; round < rounds ; round++) {
+		data[0] = round;
+		bench_sink += crc16_bitwise(data, length);
+	}
+	t_bitwise = elapsed(&start);
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 0 ; round < rounds ; round++) {
+		data[0] = round;
+		bench_sink += crc16(data, length);
+	}
+	t_table = elapsed(&start);
+	
+	printf("CRC16 of %lu x %u bytes\n", rounds, length);
+	printf("bitwise:      %8.1f ns/block %8.1f MB/s\n", t_bitwise * 1e9 / rounds, (double)length * rounds / t_bitwise / 1e6);
+	printf("slicing-by-8: %8.1f ns/block %8.1f MB/s\n", t_table * 1e9 / rounds, (double)length * rounds / t_table / 1e6);
+	printf("speed-up:     %8.1fx\n", t_bitwise / t_table);
+	
+	free(data);
+	
+	return 0;
+}
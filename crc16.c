@@ -6,6 +6,15 @@
 
 #include <inttypes.h>
 
+#include "crc16.h"
+
+#ifdef MAKECRCH
+#  include <stdio.h>
+#else
+#  include "crc16-table.h"
+#endif
+
+
 uint16_t crc16_ccitt (const uint8_t *data, unsigned int length)
 {
 	// Polynomial: x^16 + x^12 + x^5 + 1 (0x8408)
@@ -24,11 +33,11 @@ uint16_t crc16_ccitt (const uint8_t *data, unsigned int length)
 }
 
 
-uint16_t crc16 (const uint8_t *data, unsigned int length)
+uint16_t crc16_bitwise (const uint8_t *data, unsigned int length)
 {
     // Polynomial: x^16 + x^15 + x^2 + 1 (0xa001)
+    // Reference implementation, one bit at a time
 	
-    uint8_t x;
     uint16_t crc = 0;
 
     while (length--) {
@@ -46,3 +55,76 @@ uint16_t crc16 (const uint8_t *data, unsigned int length)
     
     return crc;
 }
+
+
+#ifndef MAKECRCH
+
+uint16_t crc16_update (uint16_t crc, const uint8_t *data, unsigned int length)
+{
+	// Polynomial: x^16 + x^15 + x^2 + 1 (0xa001), CRC16/ARC as used in DSMR P1 telegrams
+	// Continue a CRC calculation with the next block of data, 8 bytes at a time ("slicing-by-8").
+	// Bytes are loaded one by one, so this works regardless of alignment and endianness.
+	
+	while (length >= 8) {
+		crc = crc16_table[7][(data[0] ^ crc) & 0xff] ^
+			  crc16_table[6][data[1] ^ (crc >> 8)] ^
+			  crc16_table[5][data[2]] ^
+			  crc16_table[4][data[3]] ^
+			  crc16_table[3][data[4]] ^
+			  crc16_table[2][data[5]] ^
+			  crc16_table[1][data[6]] ^
+			  crc16_table[0][data[7]];
+		data += 8;
+		length -= 8;
+	}
+	
+	while (length--) {
+		crc = (crc >> 8) ^ crc16_table[0][(crc ^ *data++) & 0xff];
+	}
+	
+	return crc;
+}
+
+
+uint16_t crc16 (const uint8_t *data, unsigned int length)
+{
+    // Polynomial: x^16 + x^15 + x^2 + 1 (0xa001)
+	
+	return crc16_update(0, data, length);
+}
+
+#else
+
+// Generate crc16-table.h: gcc -DMAKECRCH -o crc16-maketable crc16.c && ./crc16-maketable > crc16-table.h
+
+int main (void)
+{
+	uint16_t table[8][256];
+	int n, k;
+	
+	for (n = 0 ; n < 256 ; n++) {
+		uint8_t byte = n;
+		table[0][n] = crc16_bitwise(&byte, 1);
+	}
+	
+	for (k = 1 ; k < 8 ; k++) {
+		for (n = 0 ; n < 256 ; n++) {
+			table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xff];	// CRC of byte n followed by k zero bytes
+		}
+	}
+	
+	printf("/*\n   File: crc16-table.h\n\n   \t  Lookup tables for slicing-by-8 CRC16 (polynomial 0xa001), generated by crc16.c with MAKECRCH defined\n*/\n\n");
+	printf("static const uint16_t crc16_table[8][256] = {\n");
+	for (k = 0 ; k < 8 ; k++) {
+		printf("\t{\n");
+		for (n = 0 ; n < 256 ; n++) {
+			printf("%s0x%04x%s", (n % 8 == 0) ? "\t\t" : "", table[k][n], (n == 255) ? "\n" : ((n % 8 == 7) ? ",\n" : ", "));
+		}
+		printf("\t}%s\n", (k == 7) ? "" : ",");
+	}
+	printf("};\n");
+	
+	return 0;
+}
+
+#endif
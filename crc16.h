@@ -8,3 +8,5 @@
 
 uint16_t crc16_ccitt (const uint8_t *data, unsigned int length);
 uint16_t crc16 (const uint8_t *data, unsigned int length);
+uint16_t crc16_update (uint16_t crc, const uint8_t *data, unsigned int length);
+uint16_t crc16_bitwise (const uint8_t *data, unsigned int length);
@@ -0,0 +1,271 @@
+/*
+   File: dsmr-aggregate.c
+
+   	  Streaming aggregation of smart meter readings into fixed windows, see dsmr-aggregate.h.
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "logmsg.h"
+
+#include "p1-parser.h"
+#include "dsmr-aggregate.h"
+
+
+// Channel table, one channel per (array element of a) field with statistics
+
+#if MAX_PHASES != 3
+#error "Channel table in dsmr-aggregate.c must be updated for the array sizes in dsmr-data.h"
+#endif
+
+typedef struct {
+	const char *name;
+	size_t data, record;		// Offsets in struct dsmr_data_struct and dsmr_aggregate_record
+} dsmr_aggregate_channel;
+
+#define CHAN(name, field) \
+	{ name, offsetof(struct dsmr_data_struct, field), offsetof(dsmr_aggregate_record, field) }
+#define CHAN3(field) \
+	CHAN(#field "[0]", field[0]), CHAN(#field "[1]", field[1]), CHAN(#field "[2]", field[2])
+
+static const dsmr_aggregate_channel dsmr_aggregate_channels[AGGREGATE_CHANNELS] = {
+	CHAN("P_in_total", P_in_total),
+	CHAN("P_out_total", P_out_total),
+	CHAN3(P_in),
+	CHAN3(P_out),
+	CHAN3(V),
+	CHAN3(I),
+};
+
+#define DATA_CHANNEL(data, c)	((const double *)((const uint8_t *)(data) + dsmr_aggregate_channels[c].data))
+#define RECORD_STAT(rec, c)		((dsmr_aggregate_stat *)((uint8_t *)(rec) + dsmr_aggregate_channels[c].record))
+#define RECORD_CSTAT(rec, c)	((const dsmr_aggregate_stat *)((const uint8_t *)(rec) + dsmr_aggregate_channels[c].record))
+
+
+int dsmr_aggregate_init (dsmr_aggregate *agg, unsigned int period, dsmr_aggregate_callback callback, void *userdata)
+{
+	// Set up an aggregator for windows of the given number of seconds, in the default meter timezone
+
+	if (agg == NULL || period == 0) {
+		return -1;
+	}
+
+	memset(agg, 0, sizeof(dsmr_aggregate));
+	agg->logger = &logger;
+	agg->period = period;
+	agg->meter_timezone = METER_TIMEZONE;
+	meter_tz_init(&(agg->tz));
+	agg->callback = callback;
+	agg->userdata = userdata;
+
+	return 0;
+}
+
+
+static void dsmr_aggregate_window (dsmr_aggregate *agg, uint32_t t)
+{
+	// Find the window that holds time t. Windows that divide an hour are aligned on UNIX time,
+	// which is the same as meter time for timezones with whole-hour offsets, whether DST is in
+	// effect or not. Longer windows (like days) are aligned on meter time, so that days start at
+	// local midnight, and are an hour shorter or longer when DST starts or ends.
+
+	int64_t local, start, end;
+	long offset;
+
+	if (3600 % agg->period == 0) {
+		agg->rec.start = t - t % agg->period;
+		agg->rec.end = agg->rec.start + agg->period;
+		return;
+	}
+
+	agg->tz.logger = agg->logger;
+	offset = meter_tz_offset(&(agg->tz), agg->meter_timezone, t);
+	local = (int64_t)t + offset;
+	start = local - local % agg->period;
+	end = start + agg->period;
+	start -= meter_tz_offset(&(agg->tz), agg->meter_timezone, start - offset);
+	end -= meter_tz_offset(&(agg->tz), agg->meter_timezone, end - offset);
+
+	agg->rec.start = start <= t ? start : t;
+	agg->rec.end = end > t ? end : (int64_t)t + 1;
+}
+
+
+static void dsmr_aggregate_close (dsmr_aggregate *agg)
+{
+	// Finish the open window and pass it to the callback. Its last counters become the reference for the next window.
+
+	dsmr_aggregate_record *rec = &(agg->rec);
+	int c, t;
+
+	for (c = 0 ; c < AGGREGATE_CHANNELS ; c++)
+		RECORD_STAT(rec, c)->mean = agg->sum[c] / rec->readings;
+
+	for (t = 0 ; t <= MAX_TARIFFS ; t++) {
+		rec->E_in[t] = rec->E_in_end[t] - agg->E_in_ref[t];
+		rec->E_out[t] = rec->E_out_end[t] - agg->E_out_ref[t];
+	}
+	rec->E_since = agg->ref_time;
+
+	agg->open = 0;
+	agg->windows++;
+	if (agg->callback)
+		agg->callback(agg, rec, agg->userdata);
+
+	memcpy(agg->E_in_ref, rec->E_in_end, sizeof(agg->E_in_ref));
+	memcpy(agg->E_out_ref, rec->E_out_end, sizeof(agg->E_out_ref));
+	agg->ref_time = rec->last;
+}
+
+
+int dsmr_aggregate_add_record (dsmr_aggregate *agg, const dsmr_aggregate_record *in)
+{
+	// Add a record of a shorter window to the aggregate. Returns 1 if this closed a window,
+	// 0 if not, and -1 if the record was dropped because it doesn't follow the last reading.
+
+	dsmr_aggregate_record *rec = &(agg->rec);
+	const dsmr_aggregate_stat *s;
+	dsmr_aggregate_stat *stat;
+	uint32_t gap;
+	int closed = 0, c, t;
+
+	if (in->readings == 0) {
+		return 0;
+	}
+
+	if (in->first == 0 || in->first <= agg->last_time) {
+		logmsg_to(agg->logger, LL_VERBOSE, "Dropped reading at %lu, not after the last reading at %lu\n", (unsigned long)(in->first), (unsigned long)(agg->last_time));
+		agg->dropped += in->readings;
+		return -1;
+	}
+
+	if (agg->open && in->start >= rec->end) {
+		dsmr_aggregate_close(agg);
+		closed = 1;
+	}
+
+	if (!agg->open) {
+		dsmr_aggregate_window(agg, in->start);
+		rec->first = in->first;
+		rec->readings = 0;
+		rec->max_gap = 0;
+		for (c = 0 ; c < AGGREGATE_CHANNELS ; c++) {
+			*RECORD_STAT(rec, c) = *RECORD_CSTAT(in, c);
+			agg->sum[c] = 0;
+		}
+		agg->open = 1;
+	}
+
+	gap = in->max_gap;
+	if (agg->last_time && in->first - agg->last_time > gap)
+		gap = in->first - agg->last_time;
+	if (gap > rec->max_gap)
+		rec->max_gap = gap;
+
+	for (c = 0 ; c < AGGREGATE_CHANNELS ; c++) {
+		s = RECORD_CSTAT(in, c);
+		stat = RECORD_STAT(rec, c);
+		if (s->min < stat->min)
+			stat->min = s->min;
+		if (s->max > stat->max)
+			stat->max = s->max;
+		agg->sum[c] += s->mean * in->readings;
+	}
+
+	if (!agg->has_ref) {
+		for (t = 0 ; t <= MAX_TARIFFS ; t++) {
+			agg->E_in_ref[t] = in->E_in_end[t] - in->E_in[t];
+			agg->E_out_ref[t] = in->E_out_end[t] - in->E_out[t];
+		}
+		agg->ref_time = in->E_since;
+		agg->has_ref = 1;
+	}
+	memcpy(rec->E_in_end, in->E_in_end, sizeof(rec->E_in_end));
+	memcpy(rec->E_out_end, in->E_out_end, sizeof(rec->E_out_end));
+
+	rec->last = in->last;
+	rec->readings += in->readings;
+	agg->last_time = in->last;
+	agg->readings += in->readings;
+
+	return closed;
+}
+
+
+int dsmr_aggregate_add (dsmr_aggregate *agg, const struct dsmr_data_struct *data)
+{
+	// Add a reading, as a window that holds just this reading. Returns 1 if this closed a window,
+	// 0 if not, and -1 if the reading was dropped.
+
+	dsmr_aggregate_record in;
+	const double *value;
+	int c;
+
+	memset(&in, 0, sizeof(in));
+	in.start = in.end = in.first = in.last = in.E_since = data->timestamp;
+	in.readings = 1;
+
+	for (c = 0 ; c < AGGREGATE_CHANNELS ; c++) {
+		value = DATA_CHANNEL(data, c);
+		RECORD_STAT(&in, c)->min = RECORD_STAT(&in, c)->max = RECORD_STAT(&in, c)->mean = *value;
+	}
+	memcpy(in.E_in_end, data->E_in, sizeof(in.E_in_end));
+	memcpy(in.E_out_end, data->E_out, sizeof(in.E_out_end));
+
+	return dsmr_aggregate_add_record(agg, &in);
+}
+
+
+int dsmr_aggregate_flush (dsmr_aggregate *agg)
+{
+	// Close the open window at the end of the input, even though it may be incomplete. Returns 1 if a window was closed.
+
+	if (!agg->open) {
+		return 0;
+	}
+
+	dsmr_aggregate_close(agg);
+	return 1;
+}
+
+
+size_t dsmr_aggregate_format (const dsmr_aggregate_record *rec, char *buf, size_t bufsize)
+{
+	// Format a record as a single line: window start and end, number of readings and the longest gap,
+	// the energy counter changes, then min/mean/max of every channel. Returns the line length, or 0
+	// if it doesn't fit in the buffer.
+
+	const dsmr_aggregate_stat *stat;
+	size_t len;
+	int n, c, t;
+
+	n = snprintf(buf, bufsize, "start=%lu end=%lu readings=%lu max_gap=%lu",
+			(unsigned long)(rec->start), (unsigned long)(rec->end), (unsigned long)(rec->readings), (unsigned long)(rec->max_gap));
+	if (n < 0 || n >= bufsize)
+		return 0;
+	len = n;
+
+	for (t = 1 ; t <= MAX_TARIFFS ; t++) {
+		n = snprintf(buf + len, bufsize - len, " dE_in[%d]=%.10g dE_out[%d]=%.10g", t, rec->E_in[t], t, rec->E_out[t]);
+		if (n < 0 || len + n >= bufsize)
+			return 0;
+		len += n;
+	}
+
+	for (c = 0 ; c < AGGREGATE_CHANNELS ; c++) {
+		stat = RECORD_CSTAT(rec, c);
+		n = snprintf(buf + len, bufsize - len, " %s=%.10g/%.10g/%.10g", dsmr_aggregate_channels[c].name, stat->min, stat->mean, stat->max);
+		if (n < 0 || len + n >= bufsize)
+			return 0;
+		len += n;
+	}
+
+	if (len + 1 >= bufsize)
+		return 0;
+	buf[len++] = '\n';
+	buf[len] = '\0';
+
+	return len;
+}
@@ -0,0 +1,91 @@
+/*
+   File: dsmr-aggregate.h
+
+   	  Streaming aggregation of smart meter readings (struct dsmr_data_struct) into fixed windows,
+   	  for instance 1-minute, 15-minute or hourly records with the minimum, maximum and mean of
+   	  power, voltage and current, and the change of the energy counters.
+
+   	  Windows are aligned on the meter timestamps, not on the wall clock of the reader. Memory use
+   	  is constant: only the open window is kept, and a record is passed to a callback as soon as
+   	  a reading (or the end of the input) closes it. Records can be fed to another aggregator with
+   	  a longer period, so that 1 Hz readings only pass through the shortest window.
+*/
+
+#ifndef DSMR_AGGREGATE_H
+
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "logmsg.h"
+#include "dsmr-data.h"
+#include "p1-time.h"
+
+
+#define AGGREGATE_CHANNELS	(2 + 4 * MAX_PHASES)	// P_in_total, P_out_total, P_in[], P_out[], V[], I[]
+
+
+typedef struct dsmr_aggregate_stat_struct {
+	double min, max, mean;
+} dsmr_aggregate_stat;
+
+
+// Aggregated record of a window. Windows without readings are not emitted, gaps show up
+// as missing windows, as a small number of readings, and in max_gap.
+
+typedef struct dsmr_aggregate_record_struct {
+
+	uint32_t start, end;			// Window, from start up to (not including) end, as UNIX time
+	uint32_t first, last;			// Timestamps of the first and last reading in the window
+	uint32_t readings;				// Number of readings
+	uint32_t max_gap;				// Longest interval between readings, including the one before the first reading, in seconds
+
+	dsmr_aggregate_stat P_in_total, P_out_total,	// Statistics of the readings, the mean is not weighted by time
+						P_in[MAX_PHASES], P_out[MAX_PHASES],
+						V[MAX_PHASES], I[MAX_PHASES];
+
+	double E_in[MAX_TARIFFS + 1], E_out[MAX_TARIFFS + 1];			// Change of the energy counters
+	double E_in_end[MAX_TARIFFS + 1], E_out_end[MAX_TARIFFS + 1];	// Energy counters at the last reading
+	uint32_t E_since;				// Time of the counters the change is relative to: the last reading
+									// before the window, or the first reading if there is none
+
+} dsmr_aggregate_record;
+
+
+struct dsmr_aggregate_struct;
+typedef void (*dsmr_aggregate_callback) (struct dsmr_aggregate_struct *agg, const dsmr_aggregate_record *rec, void *userdata);
+
+
+typedef struct dsmr_aggregate_struct {
+
+	unsigned int period;			// Window length, in seconds
+	const char *meter_timezone;		// Meter timezone, used to align windows that don't divide an hour
+	struct meter_tz tz;
+
+	dsmr_aggregate_callback callback;	// Called for every closed window
+	void *userdata;
+
+	dsmr_aggregate_record rec;		// Open window
+	int open;						// Flag to indicate that a window is open
+	double sum[AGGREGATE_CHANNELS];	// Sums of the readings in the open window
+	uint32_t last_time;				// Time of the last reading, 0 if none
+
+	int has_ref;					// Flag to indicate that the reference counters are set
+	double E_in_ref[MAX_TARIFFS + 1], E_out_ref[MAX_TARIFFS + 1];	// Counters the change is relative to
+	uint32_t ref_time;
+
+	uint64_t readings;				// Number of readings aggregated
+	uint64_t windows;				// Number of records emitted
+	uint64_t dropped;				// Number of readings without timestamp, or not after the last reading
+	messagelogger *logger;
+
+} dsmr_aggregate;
+
+
+int dsmr_aggregate_init (dsmr_aggregate *agg, unsigned int period, dsmr_aggregate_callback callback, void *userdata);
+int dsmr_aggregate_add (dsmr_aggregate *agg, const struct dsmr_data_struct *data);
+int dsmr_aggregate_add_record (dsmr_aggregate *agg, const dsmr_aggregate_record *rec);
+int dsmr_aggregate_flush (dsmr_aggregate *agg);
+size_t dsmr_aggregate_format (const dsmr_aggregate_record *rec, char *buf, size_t bufsize);
+
+#define DSMR_AGGREGATE_H	1
+#endif
@@ -0,0 +1,166 @@
+// Compact data structure to hold smart meter data, as an alternative to
+// struct dsmr_data_struct. Units are stored as small interned IDs instead
+// of strings, text messages are left out, and a bitmask tells which fields
+// were present in the last telegram. Fields that are used for every reading
+// are grouped at the start of the structure, so that they share cache lines.
+
+#ifndef DSMR_COMPACT_H
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "dsmr-data.h"
+
+
+// Interned units
+
+#define UNIT_NONE		0
+#define UNIT_KWH		1
+#define UNIT_KW			2
+#define UNIT_V			3
+#define UNIT_A			4
+#define UNIT_M3			5
+#define UNIT_S			6
+#define UNIT_GJ			7
+#define UNIT_WH			8
+#define UNIT_W			9
+#define UNIT_OTHER		15		// Unit not in the list above
+
+static inline uint8_t dsmr_unit_intern (const char *unit)
+{
+	// Return the ID of a unit string
+
+	if (unit == NULL || unit[0] == '\0')
+		return UNIT_NONE;
+
+	switch (unit[0]) {
+		case 'k':
+			if (unit[1] == 'W')
+				return unit[2] == '\0' ? UNIT_KW : (unit[2] == 'h' && unit[3] == '\0') ? UNIT_KWH : UNIT_OTHER;
+			break;
+		case 'W':
+			return unit[1] == '\0' ? UNIT_W : (unit[1] == 'h' && unit[2] == '\0') ? UNIT_WH : UNIT_OTHER;
+		case 'V':
+			return unit[1] == '\0' ? UNIT_V : UNIT_OTHER;
+		case 'A':
+			return unit[1] == '\0' ? UNIT_A : UNIT_OTHER;
+		case 'm':
+			return (unit[1] == '3' && unit[2] == '\0') ? UNIT_M3 : UNIT_OTHER;
+		case 's':
+			return unit[1] == '\0' ? UNIT_S : UNIT_OTHER;
+		case 'G':
+			return (unit[1] == 'J' && unit[2] == '\0') ? UNIT_GJ : UNIT_OTHER;
+	}
+
+	return UNIT_OTHER;
+}
+
+static inline const char *dsmr_unit_name (uint8_t id)
+{
+	// Return the unit string of an interned unit
+
+	switch (id) {
+		case UNIT_NONE:		return "";
+		case UNIT_KWH:		return "kWh";
+		case UNIT_KW:		return "kW";
+		case UNIT_V:		return "V";
+		case UNIT_A:		return "A";
+		case UNIT_M3:		return "m3";
+		case UNIT_S:		return "s";
+		case UNIT_GJ:		return "GJ";
+		case UNIT_WH:		return "Wh";
+		case UNIT_W:		return "W";
+	}
+
+	return "?";
+}
+
+
+// Presence bits, set for every field found in the last telegram
+
+#define HAS_TIMESTAMP			(1ULL << 0)
+#define HAS_HEADER				(1ULL << 1)
+#define HAS_EQUIPMENT_ID		(1ULL << 2)
+#define HAS_P1_VERSION			(1ULL << 3)
+#define HAS_TARIFF				(1ULL << 4)
+#define HAS_SWITCHPOS			(1ULL << 5)
+#define HAS_E_IN(tariff)		(1ULL << (6 + (tariff)))		// Tariffs 0 to MAX_TARIFFS
+#define HAS_E_OUT(tariff)		(1ULL << (9 + (tariff)))
+#define HAS_P_IN_TOTAL			(1ULL << 12)
+#define HAS_P_OUT_TOTAL			(1ULL << 13)
+#define HAS_P_THRESHOLD			(1ULL << 14)
+#define HAS_I(phase)			(1ULL << (15 + (phase)))		// Phases 0 to MAX_PHASES - 1
+#define HAS_V(phase)			(1ULL << (18 + (phase)))
+#define HAS_P_IN(phase)			(1ULL << (21 + (phase)))
+#define HAS_P_OUT(phase)		(1ULL << (24 + (phase)))
+#define HAS_POWER_FAILURES		(1ULL << 27)
+#define HAS_POWER_FAILURES_LONG	(1ULL << 28)
+#define HAS_V_SAGS(phase)		(1ULL << (29 + (phase)))
+#define HAS_V_SWELLS(phase)		(1ULL << (32 + (phase)))
+#define HAS_PFAIL_EVENTS		(1ULL << 35)
+#define HAS_TEXTMSG				(1ULL << 36)
+#define HAS_TEXTMSG_CODES		(1ULL << 37)
+#define HAS_DEV_TYPE(dev)		(1ULL << (38 + (dev)))		// Devices 0 to MAX_DEVS - 1
+#define HAS_DEV_ID(dev)			(1ULL << (42 + (dev)))
+#define HAS_DEV_VALVE(dev)		(1ULL << (46 + (dev)))
+#define HAS_DEV_COUNTER(dev)	(1ULL << (50 + (dev)))
+
+#if MAX_TARIFFS > 2 || MAX_PHASES > 3 || MAX_DEVS > 4
+#error "Presence bits in dsmr-compact.h must be updated for the array sizes in dsmr-data.h"
+#endif
+
+
+struct dsmr_compact_struct {
+
+	// Fields used for every reading
+
+	uint64_t	present;			// Presence bits (HAS_*), fields without a bit set are not valid
+	uint32_t	timestamp;
+	uint8_t		tariff;
+	int8_t		switchpos;
+	int8_t		P1_version_major, P1_version_minor;
+
+	double		P_in_total, P_out_total,
+				E_in[MAX_TARIFFS + 1],
+				E_out[MAX_TARIFFS + 1];
+
+	// Per-phase values
+
+	double		I[MAX_PHASES],
+				V[MAX_PHASES],
+				P_in[MAX_PHASES], P_out[MAX_PHASES];
+	double		P_threshold;
+
+	// Units, as interned IDs (UNIT_*)
+
+	uint8_t		unit_E_in[MAX_TARIFFS + 1], unit_E_out[MAX_TARIFFS + 1],
+				unit_P_in_total, unit_P_out_total, unit_P_threshold,
+				unit_I[MAX_PHASES], unit_V[MAX_PHASES],
+				unit_P_in[MAX_PHASES], unit_P_out[MAX_PHASES],
+				unit_dev_counter[MAX_DEVS];
+
+	// M-bus devices
+
+	uint8_t		dev_type[MAX_DEVS];
+	int8_t		dev_valve[MAX_DEVS];
+	uint32_t	dev_counter_timestamp[MAX_DEVS];
+	double		dev_counter[MAX_DEVS];
+
+	// Power quality
+
+	uint32_t	power_failures, power_failures_long,
+				V_sags[MAX_PHASES], V_swells[MAX_PHASES];
+
+	uint8_t		pfail_events;
+	uint8_t		unit_pfail_event_duration[MAX_EVENTS];
+	uint32_t	pfail_event_end_time[MAX_EVENTS];
+	uint32_t	pfail_event_duration[MAX_EVENTS];
+
+	// Identification, rarely used
+
+	char		equipment_id[LEN_EQUIPMENT_ID];
+	char		dev_id[MAX_DEVS][LEN_EQUIPMENT_ID];
+};
+
+#define DSMR_COMPACT_H	1
+#endif
@@ -0,0 +1,191 @@
+/*
+   File: dsmr-delta.c
+
+   	  Change detection between consecutive smart meter readings, see dsmr-delta.h.
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#include "logmsg.h"
+
+#include "dsmr-delta.h"
+
+
+int dsmr_delta_init (dsmr_delta *dd, unsigned int keyframe_interval)
+{
+	// Set up change detection, without deadbands. The first reading is always a keyframe.
+
+	const char *name;
+	int col;
+
+	if (dd == NULL) {
+		return -1;
+	}
+
+	memset(dd, 0, sizeof(dsmr_delta));
+	dd->logger = &logger;
+	dd->keyframe_interval = keyframe_interval;
+
+	dd->classes = calloc(dsmr_store_ncolumns, sizeof(uint8_t));
+	dd->changed = calloc(dsmr_store_ncolumns, sizeof(uint8_t));
+	if (dd->classes == NULL || dd->changed == NULL) {
+		logmsg_to(dd->logger, LL_ERROR, "Could not allocate change detection buffers\n");
+		dsmr_delta_free(dd);
+		return -2;
+	}
+
+	for (col = 0 ; col < dsmr_store_ncolumns ; col++) {
+		name = dsmr_store_columns[col].name;
+		if (dsmr_store_columns[col].type != STORE_DOUBLE)
+			continue;
+		if (!strncmp(name, "P_in", 4) || !strncmp(name, "P_out", 5))
+			dd->classes[col] = DELTA_POWER;
+		else if (!strncmp(name, "V[", 2))
+			dd->classes[col] = DELTA_VOLTAGE;
+		else if (!strncmp(name, "I[", 2))
+			dd->classes[col] = DELTA_CURRENT;
+	}
+
+	return 0;
+}
+
+
+void dsmr_delta_set_deadband (dsmr_delta *dd, double power, double voltage, double current)
+{
+	// Set the smallest change of power (kW), voltage (V) and current (A) that is emitted
+
+	dd->deadband[DELTA_POWER] = power;
+	dd->deadband[DELTA_VOLTAGE] = voltage;
+	dd->deadband[DELTA_CURRENT] = current;
+}
+
+
+int dsmr_delta_update (dsmr_delta *dd, const struct dsmr_data_struct *data)
+{
+	// Compare a reading with the last emitted values, and flag the columns to be emitted in dd->changed.
+	// Returns the number of columns emitted. The timestamp is emitted with every reading.
+
+	const dsmr_store_column *col;
+	const uint8_t *new = (const uint8_t *)data;
+	uint8_t *last = (uint8_t *)&(dd->last);
+	double a, b, deadband;
+	int c, changed;
+
+	dd->keyframe = (dd->readings == 0 || (dd->keyframe_interval && dd->since_keyframe >= dd->keyframe_interval));
+	if (dd->keyframe)
+		dd->since_keyframe = 0;
+	dd->nchanged = 0;
+
+	for (c = 0 ; c < dsmr_store_ncolumns ; c++) {
+		col = dsmr_store_columns + c;
+
+		if (dd->keyframe || col->offset == offsetof(struct dsmr_data_struct, timestamp)) {
+			changed = 1;
+		} else if (col->type == STORE_STRING) {
+			changed = strncmp((const char *)new + col->offset, (const char *)last + col->offset, col->size) != 0;
+		} else if (col->type == STORE_DOUBLE && (deadband = dd->deadband[dd->classes[c]]) > 0) {
+			memcpy(&a, new + col->offset, sizeof(double));
+			memcpy(&b, last + col->offset, sizeof(double));
+			changed = !(fabs(a - b) < deadband);		// Also true if either value is not a number
+		} else {
+			changed = memcmp(new + col->offset, last + col->offset, col->size) != 0;
+		}
+
+		dd->changed[c] = changed;
+		if (changed) {
+			memcpy(last + col->offset, new + col->offset, col->size);
+			dd->nchanged++;
+		}
+	}
+
+	dd->since_keyframe++;
+	dd->readings++;
+	dd->fields += dd->nchanged;
+
+	return dd->nchanged;
+}
+
+
+size_t dsmr_delta_format (const dsmr_delta *dd, const struct dsmr_data_struct *data, char *buf, size_t bufsize)
+{
+	// Format the columns emitted for a reading as a single line: 'K' for a keyframe or 'D' for a delta,
+	// followed by name=value pairs. Strings are quoted, with escapes for quotes, backslashes and
+	// non-printable characters. Returns the line length, or 0 if it doesn't fit in the buffer.
+
+	const dsmr_store_column *col;
+	const uint8_t *field;
+	size_t len = 0, i;
+	int64_t value;
+	double d;
+	int c, n;
+
+	if (bufsize < 3)
+		return 0;
+
+	buf[len++] = dd->keyframe ? 'K' : 'D';
+
+	for (c = 0 ; c < dsmr_store_ncolumns ; c++) {
+		if (!dd->changed[c])
+			continue;
+
+		col = dsmr_store_columns + c;
+		field = (const uint8_t *)data + col->offset;
+
+		switch (col->type) {
+			case STORE_U32:
+				value = *(const uint32_t *)field;
+				break;
+			case STORE_U8:
+				value = *(const uint8_t *)field;
+				break;
+			case STORE_I8:
+				value = *(const int8_t *)field;
+				break;
+			default:
+				value = 0;
+		}
+
+		if (col->type == STORE_DOUBLE) {
+			memcpy(&d, field, sizeof(double));
+			n = snprintf(buf + len, bufsize - len, " %s=%.10g", col->name, d);
+		} else if (col->type == STORE_STRING) {
+			n = snprintf(buf + len, bufsize - len, " %s=\"", col->name);
+			for (i = 0 ; n >= 0 && len + n < bufsize && i < col->size && field[i] ; i++) {
+				if (field[i] == '"' || field[i] == '\\')
+					n += snprintf(buf + len + n, bufsize - len - n, "\\%c", field[i]);
+				else if (field[i] < 0x20 || field[i] >= 0x7f)
+					n += snprintf(buf + len + n, bufsize - len - n, "\\x%02x", field[i]);
+				else
+					n += snprintf(buf + len + n, bufsize - len - n, "%c", field[i]);
+			}
+			if (n >= 0 && len + n < bufsize)
+				n += snprintf(buf + len + n, bufsize - len - n, "\"");
+		} else {
+			n = snprintf(buf + len, bufsize - len, " %s=%lld", col->name, (long long)value);
+		}
+
+		if (n < 0 || len + n >= bufsize - 1)
+			return 0;
+		len += n;
+	}
+
+	buf[len++] = '\n';
+	buf[len] = '\0';
+
+	return len;
+}
+
+
+void dsmr_delta_free (dsmr_delta *dd)
+{
+	if (dd == NULL) {
+		return;
+	}
+
+	free(dd->classes);
+	free(dd->changed);
+	dd->classes = dd->changed = NULL;
+}
@@ -0,0 +1,59 @@
+/*
+   File: dsmr-delta.h
+
+   	  Change detection between consecutive smart meter readings (struct dsmr_data_struct).
+
+   	  Every reading is compared field by field (using the column table of dsmr-store.h) with
+   	  the last value emitted for that field. Only fields that changed are emitted, except in
+   	  periodic keyframes, which hold all fields. Power, voltage and current can be given a
+   	  deadband: smaller changes are not emitted, but add up until they exceed the deadband.
+*/
+
+#ifndef DSMR_DELTA_H
+
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "logmsg.h"
+#include "dsmr-data.h"
+#include "dsmr-store.h"
+
+
+#define DELTA_KEYFRAME		360		// Default number of readings between keyframes (6 minutes at 1 Hz)
+
+// Deadband classes of columns
+
+#define DELTA_EXACT		0		// Every change is emitted
+#define DELTA_POWER		1		// Power (P_in_total, P_out_total, P_in[], P_out[]), in kW
+#define DELTA_VOLTAGE	2		// Voltage (V[]), in V
+#define DELTA_CURRENT	3		// Current (I[]), in A
+#define DELTA_CLASSES	4
+
+
+typedef struct dsmr_delta_struct {
+
+	double deadband[DELTA_CLASSES];	// Smallest change emitted, per class (0 for DELTA_EXACT)
+	unsigned int keyframe_interval;	// Number of readings between keyframes, 0 for a keyframe at the start only
+
+	struct dsmr_data_struct last;	// Last emitted value of every field
+	uint8_t *classes;				// Deadband class of every column
+	uint8_t *changed;				// Flag for every column, set if the column is emitted for the current reading
+	int nchanged;					// Number of columns emitted for the current reading
+	int keyframe;					// Flag to indicate that the current reading is a keyframe
+	unsigned int since_keyframe;	// Number of readings since the last keyframe
+
+	uint64_t readings;				// Number of readings compared
+	uint64_t fields;				// Number of fields emitted
+	messagelogger *logger;
+
+} dsmr_delta;
+
+
+int dsmr_delta_init (dsmr_delta *dd, unsigned int keyframe_interval);
+void dsmr_delta_set_deadband (dsmr_delta *dd, double power, double voltage, double current);
+int dsmr_delta_update (dsmr_delta *dd, const struct dsmr_data_struct *data);
+size_t dsmr_delta_format (const dsmr_delta *dd, const struct dsmr_data_struct *data, char *buf, size_t bufsize);
+void dsmr_delta_free (dsmr_delta *dd);
+
+#define DSMR_DELTA_H	1
+#endif
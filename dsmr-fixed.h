@@ -0,0 +1,72 @@
+// Fixed point data structure to hold the fractional values of smart meter data
+// (energy, power, voltage, current and M-bus counters) as exact scaled 64-bit integers,
+// as an alternative to the doubles of struct dsmr_data_struct. Every quantity has a
+// common scale (number of decimals), so that for instance all energy counters are
+// in Wh and all voltages in mV, regardless of the number of decimals the meter sends.
+
+#ifndef DSMR_FIXED_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "dsmr-data.h"
+
+
+// Quantities, and their base units. Energy and power in W or Wh are converted to kW and kWh.
+
+#define FIXED_ENERGY		0		// E_in, E_out, in kWh
+#define FIXED_POWER			1		// P_in_total, P_out_total, P_threshold, P_in, P_out, in kW
+#define FIXED_VOLTAGE		2		// V, in V
+#define FIXED_CURRENT		3		// I, in A
+#define FIXED_COUNTER		4		// dev_counter, in the unit of the device (m3, GJ)
+#define FIXED_QUANTITIES	5
+
+#define FIXED_SCALE_DEFAULT	3		// Default scale of every quantity: Wh, W, mV, mA, dm3 (or MJ)
+
+struct dsmr_fixed_struct {
+
+	int64_t		E_in[MAX_TARIFFS + 1], E_out[MAX_TARIFFS + 1];		// FIXED_ENERGY
+	int64_t		P_in_total, P_out_total, P_threshold,				// FIXED_POWER
+				P_in[MAX_PHASES], P_out[MAX_PHASES];
+	int64_t		V[MAX_PHASES];										// FIXED_VOLTAGE
+	int64_t		I[MAX_PHASES];										// FIXED_CURRENT
+	int64_t		dev_counter[MAX_DEVS];								// FIXED_COUNTER
+};
+
+
+static inline void dsmr_fixed_to_double (const int64_t *restrict values, double *restrict out, size_t n, int scale)
+{
+	// Convert a batch of scaled integers to doubles in the base unit. The iterations are independent,
+	// so that the compiler can vectorise the loop (gcc -O3, or -O2 -ftree-vectorize). Values below 2^53
+	// convert exactly, and the division by an exact power of ten rounds correctly, so the result is
+	// the same as the double the parser calculates from the mantissa and divider.
+
+	double divider = 1;
+	size_t i;
+
+	while (scale-- > 0)
+		divider *= 10;
+
+	for (i = 0 ; i < n ; i++)
+		out[i] = (double)values[i] / divider;
+}
+
+
+static inline void dsmr_fixed_to_data (const struct dsmr_fixed_struct *fixed, const int *scales, struct dsmr_data_struct *data)
+{
+	// Fill the doubles of a full data structure from the fixed point structure, with the scales of every quantity
+
+	dsmr_fixed_to_double(fixed->E_in, data->E_in, MAX_TARIFFS + 1, scales[FIXED_ENERGY]);
+	dsmr_fixed_to_double(fixed->E_out, data->E_out, MAX_TARIFFS + 1, scales[FIXED_ENERGY]);
+	dsmr_fixed_to_double(&(fixed->P_in_total), &(data->P_in_total), 1, scales[FIXED_POWER]);
+	dsmr_fixed_to_double(&(fixed->P_out_total), &(data->P_out_total), 1, scales[FIXED_POWER]);
+	dsmr_fixed_to_double(&(fixed->P_threshold), &(data->P_threshold), 1, scales[FIXED_POWER]);
+	dsmr_fixed_to_double(fixed->P_in, data->P_in, MAX_PHASES, scales[FIXED_POWER]);
+	dsmr_fixed_to_double(fixed->P_out, data->P_out, MAX_PHASES, scales[FIXED_POWER]);
+	dsmr_fixed_to_double(fixed->V, data->V, MAX_PHASES, scales[FIXED_VOLTAGE]);
+	dsmr_fixed_to_double(fixed->I, data->I, MAX_PHASES, scales[FIXED_CURRENT]);
+	dsmr_fixed_to_double(fixed->dev_counter, data->dev_counter, MAX_DEVS, scales[FIXED_COUNTER]);
+}
+
+#define DSMR_FIXED_H	1
+#endif
@@ -0,0 +1,348 @@
+/*
+   File: dsmr-log.c
+
+   	  Append-only, memory-mapped log of smart meter readings, see dsmr-log.h.
+*/
+
+#define _GNU_SOURCE 1
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "logmsg.h"
+#include "crc16.h"
+
+#include "dsmr-log.h"
+
+
+#define LOG_RECORD(log, i)	((const dsmr_log_record *)((log)->map + sizeof(dsmr_log_header)) + (i))
+
+
+static int dsmr_log_valid (const dsmr_log_record *rec)
+{
+	// Check the trailer and CRC of a record, to detect records that were only partly written
+
+	return rec->magic == LOG_RECORD_MAGIC && rec->crc == crc16((const uint8_t *)rec, offsetof(dsmr_log_record, crc));
+}
+
+
+static int dsmr_log_map (dsmr_log *log, size_t size)
+{
+	// Make sure that the first size bytes of the file are mapped. The mapping is doubled as the
+	// log grows, pages beyond the end of the file are reserved but never accessed.
+
+	size_t mapsize = log->mapsize ? log->mapsize : LOG_MAPSIZE;
+	void *map;
+
+	if (log->map && size <= log->mapsize) {
+		return 0;
+	}
+
+	while (mapsize < size)
+		mapsize *= 2;
+
+	map = mmap(NULL, mapsize, PROT_READ, MAP_SHARED, log->fd, 0);
+	if (map == MAP_FAILED) {
+		logmsg_to(log->logger, LL_ERROR, "Could not map reading log into memory: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (log->map)
+		munmap((void *)log->map, log->mapsize);
+	log->map = map;
+	log->mapsize = mapsize;
+
+	return 0;
+}
+
+
+static int dsmr_log_add_index (dsmr_log *log, size_t i)
+{
+	// Add record i to the sparse index, if it starts a new stride
+
+	uint32_t *index;
+
+	if (i % LOG_INDEX_STRIDE)
+		return 0;
+
+	if (log->nindex >= log->maxindex) {
+		index = realloc(log->index, (log->maxindex ? log->maxindex * 2 : 1024) * sizeof(uint32_t));
+		if (index == NULL) {
+			logmsg_to(log->logger, LL_ERROR, "Could not allocate reading log index\n");
+			return -1;
+		}
+		log->index = index;
+		log->maxindex = log->maxindex ? log->maxindex * 2 : 1024;
+	}
+
+	log->index[log->nindex++] = LOG_RECORD(log, i)->data.timestamp;
+	return 0;
+}
+
+
+int dsmr_log_open (dsmr_log *log, const char *filename, int writable)
+{
+	// Open a reading log, or create it if it is opened for writing and doesn't exist yet.
+	// Only one process at a time can open a log for writing. Incomplete records at the end of
+	// the log are removed when it is opened for writing, and ignored when it is opened for reading.
+
+	dsmr_log_header header;
+	struct stat st;
+	size_t count, i;
+
+	if (log == NULL || filename == NULL) {
+		return -1;
+	}
+
+	memset(log, 0, sizeof(dsmr_log));
+	log->logger = &logger;
+	log->writable = writable;
+
+	log->fd = open(filename, writable ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC), 0644);
+	if (log->fd < 0) {
+		logmsg_to(log->logger, LL_ERROR, "Could not open reading log %s: %s\n", filename, strerror(errno));
+		return -2;
+	}
+
+	if (writable && flock(log->fd, LOCK_EX | LOCK_NB) < 0) {
+		logmsg_to(log->logger, LL_ERROR, "Reading log %s is already opened for writing by another process\n", filename);
+		dsmr_log_close(log);
+		return -3;
+	}
+
+	if (fstat(log->fd, &st) < 0) {
+		logmsg_to(log->logger, LL_ERROR, "Could not determine size of reading log %s: %s\n", filename, strerror(errno));
+		dsmr_log_close(log);
+		return -4;
+	}
+
+	if (st.st_size == 0 && writable) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+		header.byte_order = LOG_BYTE_ORDER;
+		header.header_size = sizeof(dsmr_log_header);
+		header.record_size = sizeof(dsmr_log_record);
+		header.data_size = sizeof(struct dsmr_compact_struct);
+		if (pwrite(log->fd, &header, sizeof(header), 0) != sizeof(header) || fsync(log->fd) < 0) {
+			logmsg_to(log->logger, LL_ERROR, "Could not write header of reading log %s: %s\n", filename, strerror(errno));
+			dsmr_log_close(log);
+			return -5;
+		}
+		st.st_size = sizeof(header);
+	}
+
+	if (st.st_size < (off_t)sizeof(header) || pread(log->fd, &header, sizeof(header), 0) != sizeof(header)
+			|| memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) || header.byte_order != LOG_BYTE_ORDER
+			|| header.header_size != sizeof(dsmr_log_header) || header.record_size != sizeof(dsmr_log_record)
+			|| header.data_size != sizeof(struct dsmr_compact_struct)) {
+		logmsg_to(log->logger, LL_ERROR, "%s is not a reading log, or it was written with another byte order or data layout\n", filename);
+		dsmr_log_close(log);
+		return -6;
+	}
+
+	count = (st.st_size - sizeof(dsmr_log_header)) / sizeof(dsmr_log_record);
+	if (dsmr_log_map(log, sizeof(dsmr_log_header) + count * sizeof(dsmr_log_record)) < 0) {
+		dsmr_log_close(log);
+		return -7;
+	}
+
+	// Drop incomplete records at the end, a crash or power failure may have left one behind
+
+	while (count > 0 && !dsmr_log_valid(LOG_RECORD(log, count - 1)))
+		count--;
+
+	if (writable && sizeof(dsmr_log_header) + count * sizeof(dsmr_log_record) < (size_t)(st.st_size)) {
+		log->truncated = st.st_size - sizeof(dsmr_log_header) - count * sizeof(dsmr_log_record);
+		logmsg_to(log->logger, LL_NORMAL, "Removing %lu bytes of incomplete records from the end of reading log %s\n", (unsigned long)(log->truncated), filename);
+		if (ftruncate(log->fd, sizeof(dsmr_log_header) + count * sizeof(dsmr_log_record)) < 0) {
+			logmsg_to(log->logger, LL_ERROR, "Could not truncate reading log %s: %s\n", filename, strerror(errno));
+			dsmr_log_close(log);
+			return -8;
+		}
+	}
+
+	for (i = 0 ; i < count ; i += LOG_INDEX_STRIDE) {
+		if (dsmr_log_add_index(log, i) < 0) {
+			dsmr_log_close(log);
+			return -9;
+		}
+	}
+	log->count = count;
+	log->last_time = count ? LOG_RECORD(log, count - 1)->data.timestamp : 0;
+
+	return 0;
+}
+
+
+int dsmr_log_append (dsmr_log *log, const struct dsmr_compact_struct *reading)
+{
+	// Append a reading. Its timestamp must be later than that of the last reading, so that
+	// the log stays in timestamp order. Returns 0 on success, or a negative value on error.
+
+	dsmr_log_record rec;
+	off_t offset;
+
+	if (log == NULL || !log->writable) {
+		return -1;
+	}
+
+	if (reading->timestamp == 0 || reading->timestamp <= log->last_time) {
+		logmsg_to(log->logger, LL_VERBOSE, "Reading at %lu not appended, not after the last reading at %lu\n", (unsigned long)(reading->timestamp), (unsigned long)(log->last_time));
+		return -2;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	memcpy(&(rec.data), reading, sizeof(rec.data));
+	rec.magic = LOG_RECORD_MAGIC;
+	rec.crc = crc16((const uint8_t *)&rec, offsetof(dsmr_log_record, crc));
+
+	offset = sizeof(dsmr_log_header) + log->count * sizeof(dsmr_log_record);
+	if (pwrite(log->fd, &rec, sizeof(rec), offset) != sizeof(rec)) {
+		logmsg_to(log->logger, LL_ERROR, "Could not append to reading log: %s\n", strerror(errno));
+		if (ftruncate(log->fd, offset) < 0)
+			logmsg_to(log->logger, LL_ERROR, "Could not remove incomplete record from reading log: %s\n", strerror(errno));
+		return -3;
+	}
+
+	if (log->sync && fdatasync(log->fd) < 0) {
+		logmsg_to(log->logger, LL_ERROR, "Could not flush reading log to disk: %s\n", strerror(errno));
+		return -4;
+	}
+
+	if (dsmr_log_map(log, offset + sizeof(rec)) < 0 || dsmr_log_add_index(log, log->count) < 0) {
+		return -5;
+	}
+
+	log->count++;
+	log->last_time = reading->timestamp;
+
+	return 0;
+}
+
+
+size_t dsmr_log_refresh (dsmr_log *log)
+{
+	// Pick up the records appended by the writer since the log was opened or last refreshed.
+	// A record that is still being written fails its CRC check, and is picked up by a later refresh.
+	// Returns the number of records.
+
+	const dsmr_log_record *rec;
+	struct stat st;
+	size_t count;
+
+	if (log == NULL || log->writable || fstat(log->fd, &st) < 0) {
+		return log ? log->count : 0;
+	}
+
+	count = (st.st_size - sizeof(dsmr_log_header)) / sizeof(dsmr_log_record);
+	if (count <= log->count || dsmr_log_map(log, sizeof(dsmr_log_header) + count * sizeof(dsmr_log_record)) < 0) {
+		return log->count;
+	}
+
+	while (log->count < count) {
+		rec = LOG_RECORD(log, log->count);
+		if (!dsmr_log_valid(rec) || rec->data.timestamp <= log->last_time || dsmr_log_add_index(log, log->count) < 0)
+			break;
+		log->last_time = rec->data.timestamp;
+		log->count++;
+	}
+
+	return log->count;
+}
+
+
+const struct dsmr_compact_struct *dsmr_log_get (const dsmr_log *log, size_t i)
+{
+	// Return reading i, or NULL if there is no such reading. The pointer is valid until the next append or refresh.
+
+	if (i >= log->count) {
+		return NULL;
+	}
+
+	return &(LOG_RECORD(log, i)->data);
+}
+
+
+size_t dsmr_log_find (const dsmr_log *log, uint32_t time)
+{
+	// Find the first reading with a timestamp at or after the given time, or return the number of
+	// readings if there is none. The index narrows the search to a single stride of records.
+
+	size_t lo = 0, hi = log->nindex, mid;
+
+	// Last index entry before the given time
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (log->index[mid] < time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0) {
+		return 0;
+	}
+
+	// Search the records of that entry's stride
+
+	hi = lo * LOG_INDEX_STRIDE;
+	lo = (lo - 1) * LOG_INDEX_STRIDE;
+	if (hi > log->count)
+		hi = log->count;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (LOG_RECORD(log, mid)->data.timestamp < time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+size_t dsmr_log_range (const dsmr_log *log, uint32_t from, uint32_t to, size_t *first)
+{
+	// Find the readings from time from up to (not including) time to. Returns the number of
+	// readings, and sets first to the index of the first one.
+
+	size_t start = dsmr_log_find(log, from);
+	size_t end = (to > from) ? dsmr_log_find(log, to) : start;
+
+	if (first)
+		*first = start;
+
+	return end - start;
+}
+
+
+void dsmr_log_close (dsmr_log *log)
+{
+	if (log == NULL) {
+		return;
+	}
+
+	if (log->map) {
+		munmap((void *)log->map, log->mapsize);
+		log->map = NULL;
+	}
+
+	free(log->index);
+	log->index = NULL;
+	log->nindex = log->maxindex = 0;
+
+	if (log->fd >= 0) {
+		close(log->fd);		// Also releases the lock of a writer
+		log->fd = -1;
+	}
+}
@@ -0,0 +1,80 @@
+/*
+   File: dsmr-log.h
+
+   	  Append-only log of smart meter readings, stored as fixed-size records (struct dsmr_compact_struct
+   	  with a CRC) in timestamp order, and memory-mapped for reading. A sparse index of every
+   	  LOG_INDEX_STRIDE-th timestamp is kept in memory, so that time ranges are found in O(log n)
+   	  while touching only a few pages of the file.
+
+   	  Appends are crash-safe: a record that was only partly written fails its CRC check, and is
+   	  truncated when the log is opened for writing again. A single process appends (this is enforced
+   	  with a lock), while any number of readers map the same file and pick up new records with
+   	  dsmr_log_refresh(). Records are stored in native byte order, so log files are only portable
+   	  between machines with the same byte order and structure layout.
+*/
+
+#ifndef DSMR_LOG_H
+
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "logmsg.h"
+#include "dsmr-data.h"
+#include "dsmr-compact.h"
+
+
+#define LOG_MAGIC			"DSMRLOG1"	// File header magic
+#define LOG_BYTE_ORDER		0x01020304	// Stored in the file header, to detect files written with another byte order
+#define LOG_RECORD_MAGIC	0x31504c44	// Trailer of every record ("DLP1" in little-endian order)
+#define LOG_INDEX_STRIDE	256			// Number of records per index entry
+#define LOG_MAPSIZE			(16 * 1024 * 1024)	// Initial size of the mapping, doubled as the log grows
+
+
+typedef struct dsmr_log_header_struct {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t header_size;		// Offset of the first record
+	uint32_t record_size;		// sizeof(dsmr_log_record)
+	uint32_t data_size;			// sizeof(struct dsmr_compact_struct), to detect changes of the layout
+	uint8_t reserved[40];
+} dsmr_log_header;
+
+typedef struct dsmr_log_record_struct {
+	struct dsmr_compact_struct data;
+	uint32_t magic;				// LOG_RECORD_MAGIC
+	uint16_t crc;				// CRC16 of the data and magic
+	uint16_t reserved;
+} dsmr_log_record;
+
+
+typedef struct dsmr_log_struct {
+
+	int fd;
+	int writable;				// Flag to indicate that the log was opened for appending
+	int sync;					// Flag to flush every record to disk before dsmr_log_append() returns
+
+	const uint8_t *map;			// Memory-mapped file, may extend beyond the end of the file
+	size_t mapsize;
+
+	size_t count;				// Number of valid records
+	uint32_t last_time;			// Timestamp of the last record, 0 if none
+	size_t truncated;			// Number of bytes of incomplete records removed when opening the log
+
+	uint32_t *index;			// Timestamp of every LOG_INDEX_STRIDE-th record
+	size_t nindex, maxindex;
+
+	messagelogger *logger;
+
+} dsmr_log;
+
+
+int dsmr_log_open (dsmr_log *log, const char *filename, int writable);
+int dsmr_log_append (dsmr_log *log, const struct dsmr_compact_struct *reading);
+size_t dsmr_log_refresh (dsmr_log *log);
+const struct dsmr_compact_struct *dsmr_log_get (const dsmr_log *log, size_t i);
+size_t dsmr_log_find (const dsmr_log *log, uint32_t time);
+size_t dsmr_log_range (const dsmr_log *log, uint32_t from, uint32_t to, size_t *first);
+void dsmr_log_close (dsmr_log *log);
+
+#define DSMR_LOG_H	1
+#endif
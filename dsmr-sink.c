@@ -0,0 +1,568 @@
+/*
+   File: dsmr-sink.c
+
+   	  Buffered output sinks for smart meter readings, see dsmr-sink.h.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+
+#include "logmsg.h"
+
+#include "dsmr-sink.h"
+
+
+static const char sink_hex[] = "0123456789abcdef";
+
+
+int dsmr_sink_attach (dsmr_sink *sink, int format, int fd)
+{
+	// Set up a sink that writes to an open file descriptor (a file, pipe or socket), with the default columns
+
+	if (sink == NULL || fd < 0 || format < SINK_CSV || format > SINK_INFLUX) {
+		return -1;
+	}
+
+	memset(sink, 0, sizeof(dsmr_sink));
+	sink->logger = &logger;
+	sink->fd = fd;
+	sink->format = format;
+	sink->decimals = SINK_DECIMALS;
+	sink->measurement = SINK_MEASUREMENT;
+	sink->flush_bytes = SINK_FLUSH_BYTES;
+	sink->flush_ms = SINK_FLUSH_MS;
+
+	sink->buffer = malloc(SINK_CHUNKS * SINK_CHUNKSIZE);
+	sink->columns = calloc(dsmr_store_ncolumns, sizeof(uint8_t));
+	if (sink->buffer == NULL || sink->columns == NULL) {
+		logmsg_to(sink->logger, LL_ERROR, "Could not allocate output buffers\n");
+		dsmr_sink_close(sink);
+		return -2;
+	}
+
+	for (sink->chunk = 0 ; sink->chunk < SINK_CHUNKS ; sink->chunk++) {
+		sink->iov[sink->chunk].iov_base = sink->buffer + sink->chunk * SINK_CHUNKSIZE;
+		sink->iov[sink->chunk].iov_len = 0;
+	}
+	sink->chunk = 0;
+
+	return dsmr_sink_set_columns(sink, SINK_COLUMNS);
+}
+
+
+int dsmr_sink_open (dsmr_sink *sink, int format, const char *dest)
+{
+	// Set up a sink that writes to standard output ("-"), a Unix stream socket ("unix:<path>"),
+	// or a file or named pipe, which is appended to
+
+	struct sockaddr_un addr;
+	int fd;
+
+	if (sink == NULL || dest == NULL) {
+		return -1;
+	}
+
+	if (!strcmp(dest, "-")) {
+		return dsmr_sink_attach(sink, format, STDOUT_FILENO);
+	}
+
+	if (!strncmp(dest, "unix:", 5)) {
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(dest + 5) >= sizeof(addr.sun_path)) {
+			logmsg(LL_ERROR, "Socket path %s is too long\n", dest + 5);
+			return -3;
+		}
+		strcpy(addr.sun_path, dest + 5);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	} else {
+		fd = open(dest, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	}
+
+	if (fd < 0) {
+		logmsg(LL_ERROR, "Could not open output %s: %s\n", dest, strerror(errno));
+		return -3;
+	}
+
+	if (dsmr_sink_attach(sink, format, fd) < 0) {
+		close(fd);
+		return -4;
+	}
+	sink->close_fd = 1;
+
+	return 0;
+}
+
+
+int dsmr_sink_set_columns (dsmr_sink *sink, const char *names)
+{
+	// Select the columns to write, as a comma-separated list of column names (see dsmr-store.c),
+	// or "all". Columns are written in the order of the column table. Returns the number of
+	// columns selected, or -1 if a name is unknown.
+
+	char name[64];
+	const char *end;
+	int col, n = 0;
+
+	memset(sink->columns, 0, dsmr_store_ncolumns);
+
+	if (!strcmp(names, "all")) {
+		memset(sink->columns, 1, dsmr_store_ncolumns);
+		return dsmr_store_ncolumns;
+	}
+
+	while (*names) {
+		end = strchr(names, ',');
+		if (end == NULL)
+			end = names + strlen(names);
+		if (end - names >= sizeof(name) || end == names) {
+			logmsg_to(sink->logger, LL_ERROR, "Invalid column list\n");
+			return -1;
+		}
+		memcpy(name, names, end - names);
+		name[end - names] = '\0';
+
+		col = dsmr_store_column_lookup(name);
+		if (col < 0) {
+			logmsg_to(sink->logger, LL_ERROR, "Unknown column %s\n", name);
+			return -1;
+		}
+		sink->columns[col] = 1;
+		n++;
+
+		names = *end ? end + 1 : end;
+	}
+
+	return n;
+}
+
+
+// Formatting helpers. Every helper returns the position after the output, or NULL if it
+// doesn't fit (or if p is already NULL), so that calls can be chained without checks.
+
+static char *sink_put (char *p, const char *end, const char *s, size_t len)
+{
+	if (p == NULL || end - p < (ptrdiff_t)len)
+		return NULL;
+
+	memcpy(p, s, len);
+	return p + len;
+}
+
+static char *sink_put_char (char *p, const char *end, char c)
+{
+	if (p == NULL || p >= end)
+		return NULL;
+
+	*p++ = c;
+	return p;
+}
+
+static char *sink_put_uint (char *p, const char *end, uint64_t value, int mindigits)
+{
+	char digits[24];
+	int n = 0;
+
+	do {
+		digits[sizeof(digits) - ++n] = '0' + value % 10;
+		value /= 10;
+	} while (value || n < mindigits);
+
+	return sink_put(p, end, digits + sizeof(digits) - n, n);
+}
+
+static char *sink_put_int (char *p, const char *end, int64_t value)
+{
+	if (value < 0) {
+		p = sink_put_char(p, end, '-');
+		return sink_put_uint(p, end, -(uint64_t)value, 1);
+	}
+
+	return sink_put_uint(p, end, value, 1);
+}
+
+static const double sink_pow10[] = { 1, 10, 100, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+
+static char *sink_put_fixed (char *p, const char *end, double value, int decimals)
+{
+	// Write a value rounded to the given number of decimals, without trailing zeros.
+	// Values that don't fit in a 64-bit integer at that scale are written with printf.
+
+	uint64_t scale, scaled;
+	double rounded;
+	char tmp[32];
+	int n;
+
+	if (decimals < 0 || decimals > 9)
+		decimals = (decimals < 0) ? 0 : 9;
+	scale = sink_pow10[decimals];
+	rounded = round(fabs(value) * scale);
+
+	if (!(rounded < 9e18)) {
+		n = snprintf(tmp, sizeof(tmp), "%.17g", value);
+		return sink_put(p, end, tmp, n);
+	}
+
+	scaled = rounded;
+	while (decimals > 0 && scaled % 10 == 0) {
+		scaled /= 10;
+		scale /= 10;
+		decimals--;
+	}
+
+	if (value < 0 && scaled)
+		p = sink_put_char(p, end, '-');
+	p = sink_put_uint(p, end, scaled / scale, 1);
+	if (decimals > 0) {
+		p = sink_put_char(p, end, '.');
+		p = sink_put_uint(p, end, scaled % scale, decimals);
+	}
+
+	return p;
+}
+
+static char *sink_put_string (char *p, const char *end, const char *s, size_t maxlen, int format)
+{
+	// Write a string value, quoted and escaped for the output format
+
+	size_t i;
+	unsigned char c;
+
+	p = sink_put_char(p, end, '"');
+
+	for (i = 0 ; i < maxlen && s[i] && p ; i++) {
+		c = s[i];
+		if (c == '"') {
+			p = sink_put(p, end, format == SINK_CSV ? "\"\"" : "\\\"", 2);
+		} else if (c == '\\' && format != SINK_CSV) {
+			p = sink_put(p, end, "\\\\", 2);
+		} else if ((c < 0x20 || c >= 0x80) && format == SINK_JSON) {
+			// Control characters, and bytes that aren't ASCII (and may not be valid UTF-8), are
+			// escaped as the Latin-1 characters with those codes
+			p = sink_put(p, end, "\\u00", 4);
+			p = sink_put_char(p, end, sink_hex[c >> 4]);
+			p = sink_put_char(p, end, sink_hex[c & 0xf]);
+		} else if ((c == '\n' || c == '\r') && format == SINK_INFLUX) {
+			p = sink_put_char(p, end, ' ');		// Line breaks can't be escaped in line protocol
+		} else {
+			p = sink_put_char(p, end, c);
+		}
+	}
+
+	return sink_put_char(p, end, '"');
+}
+
+static char *sink_put_tag (char *p, const char *end, const char *s, size_t maxlen)
+{
+	// Write an InfluxDB measurement name or tag value, with commas, equal signs and spaces escaped
+
+	size_t i;
+
+	for (i = 0 ; i < maxlen && s[i] && p ; i++) {
+		if (s[i] == ',' || s[i] == '=' || s[i] == ' ')
+			p = sink_put_char(p, end, '\\');
+		p = sink_put_char(p, end, (s[i] == '\n' || s[i] == '\r') ? ' ' : s[i]);
+	}
+
+	return p;
+}
+
+
+static size_t sink_format_header (const dsmr_sink *sink, char *buf, size_t bufsize)
+{
+	// Format the CSV header line, with the names of the selected columns
+
+	char *p = buf, *end = buf + bufsize;
+	int col, n = 0;
+
+	for (col = 0 ; col < dsmr_store_ncolumns ; col++) {
+		if (!sink->columns[col])
+			continue;
+		if (n++)
+			p = sink_put_char(p, end, ',');
+		p = sink_put(p, end, dsmr_store_columns[col].name, strlen(dsmr_store_columns[col].name));
+	}
+	p = sink_put_char(p, end, '\n');
+
+	return p ? p - buf : 0;
+}
+
+
+ssize_t dsmr_sink_format (const dsmr_sink *sink, const struct dsmr_data_struct *data, char *buf, size_t bufsize)
+{
+	// Format a reading as a single line in the output format of the sink. Returns the line length,
+	// 0 if it doesn't fit in the buffer, or -1 for InfluxDB if no field has a value (a line without
+	// fields is invalid in line protocol, so the reading can't be written at all).
+
+	const dsmr_store_column *column;
+	const uint8_t *field;
+	char *p = buf, *end = buf + bufsize;
+	int col, n = 0, isint;
+	int64_t value;
+	double d;
+
+	if (sink->format == SINK_JSON) {
+		p = sink_put_char(p, end, '{');
+	} else if (sink->format == SINK_INFLUX) {
+		p = sink_put_tag(p, end, sink->measurement, strlen(sink->measurement));
+		if (data->equipment_id[0]) {
+			p = sink_put(p, end, ",equipment_id=", 14);
+			p = sink_put_tag(p, end, data->equipment_id, LEN_EQUIPMENT_ID);
+		}
+		p = sink_put_char(p, end, ' ');
+	}
+
+	for (col = 0 ; col < dsmr_store_ncolumns && p ; col++) {
+		if (!sink->columns[col])
+			continue;
+
+		column = dsmr_store_columns + col;
+		field = (const uint8_t *)data + column->offset;
+
+		if (sink->format == SINK_INFLUX) {
+			if (column->offset == offsetof(struct dsmr_data_struct, timestamp) || column->offset == offsetof(struct dsmr_data_struct, equipment_id))
+				continue;		// Used as line timestamp and tag
+			if (column->type == STORE_DOUBLE) {
+				memcpy(&d, field, sizeof(double));
+				if (!isfinite(d))
+					continue;	// Line protocol has no representation for these
+			}
+		}
+
+		// Separator and name
+
+		if (sink->format == SINK_CSV) {
+			if (n)
+				p = sink_put_char(p, end, ',');
+		} else if (sink->format == SINK_JSON) {
+			if (n)
+				p = sink_put_char(p, end, ',');
+			p = sink_put_char(p, end, '"');
+			p = sink_put(p, end, column->name, strlen(column->name));
+			p = sink_put(p, end, "\":", 2);
+		} else {
+			if (n)
+				p = sink_put_char(p, end, ',');
+			p = sink_put(p, end, column->name, strlen(column->name));
+			p = sink_put_char(p, end, '=');
+		}
+		n++;
+
+		// Value
+
+		isint = 1;
+		switch (column->type) {
+			case STORE_U32:
+				value = *(const uint32_t *)field;
+				break;
+			case STORE_U8:
+				value = *(const uint8_t *)field;
+				break;
+			case STORE_I8:
+				value = *(const int8_t *)field;
+				break;
+			default:
+				value = 0;
+				isint = 0;
+		}
+
+		if (isint) {
+			p = sink_put_int(p, end, value);
+			if (sink->format == SINK_INFLUX)
+				p = sink_put_char(p, end, 'i');
+		} else if (column->type == STORE_DOUBLE) {
+			memcpy(&d, field, sizeof(double));
+			if (isfinite(d))
+				p = sink_put_fixed(p, end, d, sink->decimals);
+			else if (sink->format == SINK_JSON)
+				p = sink_put(p, end, "null", 4);
+		} else {
+			p = sink_put_string(p, end, (const char *)field, column->size, sink->format);
+		}
+	}
+
+	if (sink->format == SINK_JSON) {
+		p = sink_put_char(p, end, '}');
+	} else if (sink->format == SINK_INFLUX) {
+		if (n == 0)
+			return -1;
+		p = sink_put_char(p, end, ' ');
+		p = sink_put_uint(p, end, data->timestamp, 1);
+		p = sink_put(p, end, "000000000", 9);	// Nanoseconds, the default precision
+	}
+	p = sink_put_char(p, end, '\n');
+
+	return p ? p - buf : 0;
+}
+
+
+static int sink_append (dsmr_sink *sink, const struct dsmr_data_struct *data)
+{
+	// Format a reading (or the CSV header, if data is NULL) into the buffer, moving on to the next chunk
+	// if it doesn't fit in the current one. Returns the number of bytes added, 0 if the reading has
+	// no values to write, or a negative value on error.
+
+	struct iovec *iov;
+	ssize_t len;
+
+	for (;;) {
+		iov = sink->iov + sink->chunk;
+		len = data ? dsmr_sink_format(sink, data, (char *)(iov->iov_base) + iov->iov_len, SINK_CHUNKSIZE - iov->iov_len)
+				: (ssize_t)sink_format_header(sink, (char *)(iov->iov_base) + iov->iov_len, SINK_CHUNKSIZE - iov->iov_len);
+		if (len > 0)
+			break;
+		if (len < 0) {
+			logmsg_to(sink->logger, LL_VERBOSE, "Reading at %lu has no values, skipped\n", (unsigned long)(data->timestamp));
+			return 0;
+		}
+		if (iov->iov_len == 0) {
+			if (data)
+				logmsg_to(sink->logger, LL_ERROR, "Reading at %lu does not fit in an output chunk\n", (unsigned long)(data->timestamp));
+			return -1;
+		}
+		if (sink->chunk + 1 < SINK_CHUNKS) {
+			sink->chunk++;
+		} else if (dsmr_sink_flush(sink) < 0) {
+			return -2;
+		}
+	}
+
+	if (sink->buffered == 0)
+		clock_gettime(CLOCK_MONOTONIC, &(sink->oldest));
+	iov->iov_len += len;
+	sink->buffered += len;
+
+	return len;
+}
+
+
+int dsmr_sink_write (dsmr_sink *sink, const struct dsmr_data_struct *data)
+{
+	// Buffer a reading, and write the buffer if enough data is buffered, or if the oldest reading
+	// has been buffered long enough. Returns 1 if data was written, 0 if not, or a negative value on error.
+
+	int len;
+
+	if (sink->format == SINK_CSV && !sink->header) {
+		if (sink_append(sink, NULL) < 0)
+			return -1;
+		sink->header = 1;
+	}
+
+	len = sink_append(sink, data);
+	if (len < 0) {
+		return -1;
+	} else if (len == 0) {
+		return 0;
+	}
+	sink->readings++;
+
+	if (sink->buffered >= sink->flush_bytes) {
+		return dsmr_sink_flush(sink) < 0 ? -2 : 1;
+	}
+
+	return dsmr_sink_tick(sink);
+}
+
+
+int dsmr_sink_tick (dsmr_sink *sink)
+{
+	// Write the buffer if the oldest reading has been buffered for at least the flush interval.
+	// Call this periodically if readings may stop coming in. Returns 1 if data was written, 0 if not.
+
+	struct timespec now;
+	long long ms;
+
+	if (sink->buffered == 0) {
+		return 0;
+	}
+
+	if (sink->flush_ms) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ms = (now.tv_sec - sink->oldest.tv_sec) * 1000LL + (now.tv_nsec - sink->oldest.tv_nsec) / 1000000;
+		if (ms < sink->flush_ms)
+			return 0;
+	}
+
+	return dsmr_sink_flush(sink) < 0 ? -1 : 1;
+}
+
+
+int dsmr_sink_flush (dsmr_sink *sink)
+{
+	// Write all buffered data with writev(), continuing after partial writes. On errors the buffered
+	// data is discarded. Returns 0 on success, or -1 on error.
+
+	struct iovec *iov = sink->iov;
+	int n = sink->chunk + 1, i = 0, result = 0;
+	ssize_t written;
+
+	while (i < n && sink->buffered) {
+		written = writev(sink->fd, iov + i, n - i);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			logmsg_to(sink->logger, LL_ERROR, "Could not write output: %s\n", strerror(errno));
+			result = -1;
+			break;
+		}
+		sink->writes++;
+		sink->bytes += written;
+		sink->buffered -= written;
+		while (i < n && written >= (ssize_t)(iov[i].iov_len)) {
+			written -= iov[i].iov_len;
+			iov[i++].iov_len = 0;
+		}
+		if (i < n) {
+			iov[i].iov_base = (char *)(iov[i].iov_base) + written;
+			iov[i].iov_len -= written;
+		}
+	}
+
+	for (i = 0 ; i < SINK_CHUNKS ; i++) {
+		iov[i].iov_base = sink->buffer + i * SINK_CHUNKSIZE;
+		iov[i].iov_len = 0;
+	}
+	sink->chunk = 0;
+	sink->buffered = 0;
+
+	return result;
+}
+
+
+void dsmr_sink_close (dsmr_sink *sink)
+{
+	// Write any buffered data, and close the output if it was opened by dsmr_sink_open()
+
+	if (sink == NULL) {
+		return;
+	}
+
+	if (sink->buffer && sink->buffered)
+		dsmr_sink_flush(sink);
+
+	free(sink->buffer);
+	free(sink->columns);
+	sink->buffer = NULL;
+	sink->columns = NULL;
+
+	if (sink->close_fd && sink->fd >= 0)
+		close(sink->fd);
+	sink->fd = -1;
+}
@@ -0,0 +1,83 @@
+/*
+   File: dsmr-sink.h
+
+   	  Output sinks for smart meter readings (struct dsmr_data_struct): CSV, JSON lines and
+   	  InfluxDB line protocol, written to a file, pipe or Unix socket.
+
+   	  Readings are formatted without printf and without allocations, directly into a set of
+   	  fixed-size chunks, using the column table of dsmr-store.h. The chunks are written with a
+   	  single writev() once enough data is buffered, or once the oldest buffered reading is older
+   	  than the flush interval.
+*/
+
+#ifndef DSMR_SINK_H
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "logmsg.h"
+#include "dsmr-data.h"
+#include "dsmr-store.h"
+
+
+// Output formats
+
+#define SINK_CSV		1		// Header line with column names, then one line per reading
+#define SINK_JSON		2		// One JSON object per line
+#define SINK_INFLUX		3		// InfluxDB line protocol, with the equipment ID as tag
+
+#define SINK_CHUNKSIZE		16384			// Size of a buffer chunk, every formatted reading must fit in one
+#define SINK_CHUNKS			16				// Number of chunks, and the maximum number of buffers per writev()
+#define SINK_FLUSH_BYTES	(64 * 1024)		// Default amount of buffered data that triggers a write
+#define SINK_FLUSH_MS		1000			// Default maximum time a reading is buffered, in milliseconds
+#define SINK_DECIMALS		3				// Default number of decimals of fractional values
+#define SINK_MEASUREMENT	"p1"			// Default InfluxDB measurement name
+
+// Columns written by default
+
+#define SINK_COLUMNS	"timestamp,tariff,E_in[1],E_in[2],E_out[1],E_out[2],P_in_total,P_out_total," \
+						"I[0],I[1],I[2],V[0],V[1],V[2],P_in[0],P_in[1],P_in[2],P_out[0],P_out[1],P_out[2]," \
+						"dev_counter[0],dev_counter_timestamp[0]"
+
+
+typedef struct dsmr_sink_struct {
+
+	int fd;							// Output file descriptor
+	int close_fd;					// Flag to indicate that the descriptor is closed with the sink
+	int format;						// SINK_CSV, SINK_JSON or SINK_INFLUX
+	int decimals;					// Number of decimals of fractional values, trailing zeros are left out
+	const char *measurement;		// InfluxDB measurement name
+	uint8_t *columns;				// Flag for every column of dsmr_store_columns, set if the column is written
+	int header;						// Flag to indicate that the CSV header has been buffered
+
+	char *buffer;					// SINK_CHUNKS chunks of SINK_CHUNKSIZE bytes
+	struct iovec iov[SINK_CHUNKS];	// Buffered data of every chunk
+	int chunk;						// Chunk being filled
+	size_t buffered;				// Number of bytes buffered
+	struct timespec oldest;			// Time at which the oldest buffered reading was added
+
+	size_t flush_bytes;				// Write once this many bytes are buffered
+	unsigned int flush_ms;			// Write once the oldest reading has been buffered this long, 0 to write every reading
+
+	uint64_t readings;				// Number of readings formatted
+	uint64_t bytes;					// Number of bytes written
+	uint64_t writes;				// Number of calls to writev()
+	messagelogger *logger;
+
+} dsmr_sink;
+
+
+int dsmr_sink_open (dsmr_sink *sink, int format, const char *dest);
+int dsmr_sink_attach (dsmr_sink *sink, int format, int fd);
+int dsmr_sink_set_columns (dsmr_sink *sink, const char *names);
+ssize_t dsmr_sink_format (const dsmr_sink *sink, const struct dsmr_data_struct *data, char *buf, size_t bufsize);
+int dsmr_sink_write (dsmr_sink *sink, const struct dsmr_data_struct *data);
+int dsmr_sink_tick (dsmr_sink *sink);
+int dsmr_sink_flush (dsmr_sink *sink);
+void dsmr_sink_close (dsmr_sink *sink);
+
+#define DSMR_SINK_H	1
+#endif
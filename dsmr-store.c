@@ -0,0 +1,1186 @@
+/*
+   File: dsmr-store.c
+
+   	  Compact columnar storage for series of smart meter readings, see dsmr-store.h.
+   	  All multi-byte integers in the file are stored little-endian.
+*/
+
+#define _GNU_SOURCE 1
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "logmsg.h"
+
+#include "dsmr-store.h"
+
+
+// Column table, one column per (array element of a) field of struct dsmr_data_struct
+
+#if MAX_TARIFFS != 2 || MAX_PHASES != 3 || MAX_DEVS != 4 || MAX_EVENTS != 10
+#error "Column table in dsmr-store.c must be updated for the array sizes in dsmr-data.h"
+#endif
+
+#define COL(name, field, type, enc) \
+	{ name, type, enc, sizeof(((struct dsmr_data_struct *)0)->field), offsetof(struct dsmr_data_struct, field) }
+#define COL3(field, type, enc) \
+	COL(#field "[0]", field[0], type, enc), COL(#field "[1]", field[1], type, enc), COL(#field "[2]", field[2], type, enc)
+#define COL4(field, type, enc) \
+	COL3(field, type, enc), COL(#field "[3]", field[3], type, enc)
+#define COL10(field, type, enc) \
+	COL4(field, type, enc), COL(#field "[4]", field[4], type, enc), COL(#field "[5]", field[5], type, enc), \
+	COL(#field "[6]", field[6], type, enc), COL(#field "[7]", field[7], type, enc), \
+	COL(#field "[8]", field[8], type, enc), COL(#field "[9]", field[9], type, enc)
+
+const dsmr_store_column dsmr_store_columns[] = {
+
+	COL("timestamp", timestamp, STORE_U32, STORE_DOD),
+
+	COL("header", header, STORE_STRING, 0),
+	COL("equipment_id", equipment_id, STORE_STRING, 0),
+	COL("P1_version_major", P1_version_major, STORE_I8, STORE_DELTA),
+	COL("P1_version_minor", P1_version_minor, STORE_I8, STORE_DELTA),
+	COL("tariff", tariff, STORE_U8, STORE_DELTA),
+	COL("switchpos", switchpos, STORE_I8, STORE_DELTA),
+
+	COL3(E_in, STORE_DOUBLE, STORE_DELTA),
+	COL3(E_out, STORE_DOUBLE, STORE_DELTA),
+	COL("P_in_total", P_in_total, STORE_DOUBLE, STORE_DELTA),
+	COL("P_out_total", P_out_total, STORE_DOUBLE, STORE_DELTA),
+	COL("P_threshold", P_threshold, STORE_DOUBLE, STORE_DELTA),
+	COL3(I, STORE_DOUBLE, STORE_DELTA),
+	COL3(V, STORE_DOUBLE, STORE_DELTA),
+	COL3(P_in, STORE_DOUBLE, STORE_DELTA),
+	COL3(P_out, STORE_DOUBLE, STORE_DELTA),
+
+	COL3(unit_E_in, STORE_STRING, 0),
+	COL3(unit_E_out, STORE_STRING, 0),
+	COL("unit_P_in_total", unit_P_in_total, STORE_STRING, 0),
+	COL("unit_P_out_total", unit_P_out_total, STORE_STRING, 0),
+	COL("unit_P_threshold", unit_P_threshold, STORE_STRING, 0),
+	COL3(unit_I, STORE_STRING, 0),
+	COL3(unit_V, STORE_STRING, 0),
+	COL3(unit_P_in, STORE_STRING, 0),
+	COL3(unit_P_out, STORE_STRING, 0),
+
+	COL("power_failures", power_failures, STORE_U32, STORE_DELTA),
+	COL("power_failures_long", power_failures_long, STORE_U32, STORE_DELTA),
+	COL3(V_sags, STORE_U32, STORE_DELTA),
+	COL3(V_swells, STORE_U32, STORE_DELTA),
+
+	COL("textmsg", textmsg, STORE_STRING, 0),
+	COL("textmsg_codes", textmsg_codes, STORE_STRING, 0),
+
+	COL4(dev_type, STORE_U8, STORE_DELTA),
+	COL4(dev_valve, STORE_I8, STORE_DELTA),
+	COL4(dev_counter, STORE_DOUBLE, STORE_DELTA),
+	COL4(dev_counter_timestamp, STORE_U32, STORE_DOD),
+	COL4(unit_dev_counter, STORE_STRING, 0),
+	COL4(dev_id, STORE_STRING, 0),
+
+	COL("pfail_events", pfail_events, STORE_U8, STORE_DELTA),
+	COL10(pfail_event_end_time, STORE_U32, STORE_DELTA),
+	COL10(pfail_event_duration, STORE_U32, STORE_DELTA),
+	COL10(unit_pfail_event_duration, STORE_STRING, 0),
+};
+
+const int dsmr_store_ncolumns = sizeof(dsmr_store_columns) / sizeof(dsmr_store_column);
+
+
+int dsmr_store_column_lookup (const char *name)
+{
+	// Return the index of a column, or -1 if there's no column with that name
+
+	int col;
+
+	for (col = 0 ; col < dsmr_store_ncolumns ; col++) {
+		if (!strcmp(dsmr_store_columns[col].name, name)) {
+			return col;
+		}
+	}
+
+	return -1;
+}
+
+
+// Encoding helpers
+
+static inline uint64_t zigzag (int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag (uint64_t u)
+{
+	return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+static inline int bit_width (uint64_t bits)
+{
+	return bits ? 64 - __builtin_clzll(bits) : 0;
+}
+
+static void put_u32 (uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_u32 (const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static const uint8_t *get_varint (const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+	// Decode a LEB128 varint, returns NULL if the data is truncated
+
+	int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			return p;
+		}
+		shift += 7;
+	}
+
+	return NULL;
+}
+
+
+// Bit reader, values are packed LSB-first
+
+typedef struct {
+	const uint8_t *p, *end;
+	uint64_t acc;
+	int nbits;
+} bitreader;
+
+static inline uint64_t get_bits (bitreader *br, int width)
+{
+	// Read a value of up to 32 bits, missing data reads as zeroes
+
+	uint64_t v;
+
+	while (br->nbits < width) {
+		br->acc |= (uint64_t)(br->p < br->end ? *br->p++ : 0) << br->nbits;
+		br->nbits += 8;
+	}
+	v = br->acc & ((1ULL << width) - 1);
+	br->acc >>= width;
+	br->nbits -= width;
+
+	return v;
+}
+
+static inline uint64_t get_value (bitreader *br, int width)
+{
+	if (width <= 32) {
+		return get_bits(br, width);
+	}
+	return get_bits(br, 32) | (get_bits(br, width - 32) << 32);
+}
+
+
+static const uint8_t *get_packed (const uint8_t *p, const uint8_t *end, size_t n, uint64_t *values)
+{
+	// Decode n values encoded by put_packed(), returns NULL if the data is invalid
+
+	bitreader br;
+	size_t group, i, len;
+	int width;
+
+	for (group = 0 ; group < n ; group += STORE_GROUP) {
+		if (p >= end || (width = *p++) > 64) {
+			return NULL;
+		}
+		len = (n - group > STORE_GROUP) ? STORE_GROUP : n - group;
+		if ((len * width + 7) / 8 > (size_t)(end - p)) {
+			return NULL;
+		}
+		br.p = p;
+		br.end = end;
+		br.acc = 0;
+		br.nbits = 0;
+		for (i = 0 ; i < len ; i++) {
+			values[group + i] = width ? get_value(&br, width) : 0;
+		}
+		p += (len * width + 7) / 8;
+	}
+
+	return p;
+}
+
+static const uint8_t *get_rle (const uint8_t *p, const uint8_t *end, size_t n, uint64_t *values)
+{
+	// Decode n values encoded by put_rle(), returns NULL if the data is invalid
+
+	uint64_t v, run;
+	size_t i = 0;
+
+	while (i < n) {
+		if ((p = get_varint(p, end, &v)) == NULL || (p = get_varint(p, end, &run)) == NULL || run >= n - i) {
+			return NULL;
+		}
+		for (run++ ; run > 0 ; run--) {
+			values[i++] = v;
+		}
+	}
+
+	return p;
+}
+
+
+// Writer
+
+static int writer_reserve (dsmr_store_writer *sw, size_t len)
+{
+	// Make sure the encoding buffer has room for another len bytes
+
+	uint8_t *buf;
+	size_t bufsize;
+
+	if (sw->buflen + len <= sw->bufsize) {
+		return 0;
+	}
+
+	bufsize = sw->bufsize ? sw->bufsize : 65536;
+	while (bufsize < sw->buflen + len) {
+		bufsize *= 2;
+	}
+
+	buf = realloc(sw->buf, bufsize);
+	if (buf == NULL) {
+		logmsg_to(sw->logger, LL_ERROR, "Could not allocate %lu byte encoding buffer\n", (unsigned long)bufsize);
+		return -1;
+	}
+	sw->buf = buf;
+	sw->bufsize = bufsize;
+
+	return 0;
+}
+
+static void put_varint (dsmr_store_writer *sw, uint64_t v)
+{
+	// Append a LEB128 varint, space must be reserved by the caller (max. 10 bytes)
+
+	while (v >= 0x80) {
+		sw->buf[sw->buflen++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	sw->buf[sw->buflen++] = v;
+}
+
+static size_t packed_size (const uint64_t *values, size_t n)
+{
+	// Size of n values when encoded by put_packed()
+
+	uint64_t bits;
+	size_t group, i, size = 0;
+
+	for (group = 0 ; group < n ; group += STORE_GROUP) {
+		bits = 0;
+		for (i = group ; i < n && i < group + STORE_GROUP ; i++) {
+			bits |= values[i];
+		}
+		size += 1 + ((i - group) * bit_width(bits) + 7) / 8;
+	}
+
+	return size;
+}
+
+static int put_packed (dsmr_store_writer *sw, const uint64_t *values, size_t n)
+{
+	// Append n values, bit-packed in groups of STORE_GROUP values. Every group starts
+	// with a byte holding the bit width of its largest value, so outliers only
+	// affect the width of a single group.
+
+	uint64_t bits, acc, v;
+	size_t group, i, end;
+	int width, nbits, w, chunk;
+
+	if (writer_reserve(sw, packed_size(values, n)) < 0) {
+		return -1;
+	}
+
+	for (group = 0 ; group < n ; group += STORE_GROUP) {
+		end = (n - group > STORE_GROUP) ? group + STORE_GROUP : n;
+		bits = 0;
+		for (i = group ; i < end ; i++) {
+			bits |= values[i];
+		}
+		width = bit_width(bits);
+		sw->buf[sw->buflen++] = width;
+
+		if (width == 0) {
+			continue;
+		}
+
+		acc = 0;
+		nbits = 0;
+		for (i = group ; i < end ; i++) {
+			v = values[i];
+			for (w = width ; w > 0 ; ) {
+				// Add at most 32 bits at a time, so that the accumulator can't overflow
+				chunk = w > 32 ? 32 : w;
+				acc |= (v & ((1ULL << chunk) - 1)) << nbits;
+				v >>= chunk;
+				w -= chunk;
+				nbits += chunk;
+				while (nbits >= 8) {
+					sw->buf[sw->buflen++] = acc;
+					acc >>= 8;
+					nbits -= 8;
+				}
+			}
+		}
+		if (nbits) {
+			sw->buf[sw->buflen++] = acc;
+		}
+	}
+
+	return 0;
+}
+
+static inline size_t varint_size (uint64_t v)
+{
+	size_t size = 1;
+
+	while (v >= 0x80) {
+		v >>= 7;
+		size++;
+	}
+
+	return size;
+}
+
+static size_t rle_size (const uint64_t *values, size_t n)
+{
+	// Size of n values when encoded by put_rle()
+
+	size_t i, run, size = 0;
+
+	for (i = 0 ; i < n ; i += run) {
+		for (run = 1 ; i + run < n && values[i + run] == values[i] ; run++);
+		size += varint_size(values[i]) + varint_size(run - 1);
+	}
+
+	return size;
+}
+
+static int put_rle (dsmr_store_writer *sw, const uint64_t *values, size_t n)
+{
+	// Append n values as (value, run length - 1) pairs of varints
+
+	size_t i, run;
+
+	if (writer_reserve(sw, rle_size(values, n)) < 0) {
+		return -1;
+	}
+
+	for (i = 0 ; i < n ; i += run) {
+		for (run = 1 ; i + run < n && values[i + run] == values[i] ; run++);
+		put_varint(sw, values[i]);
+		put_varint(sw, run - 1);
+	}
+
+	return 0;
+}
+
+static int double_is_scalable (const uint64_t *values, size_t n)
+{
+	// Check whether all doubles in a column can be stored exactly as integers in units of 1/STORE_SCALE
+
+	double d, back;
+	long long s;
+	size_t i;
+
+	for (i = 0 ; i < n ; i++) {
+		memcpy(&d, values + i, sizeof(double));
+		if (!(fabs(d) < 1e15)) {
+			return 0;
+		}
+		s = llround(d * STORE_SCALE);
+		back = (double)s / STORE_SCALE;
+		if (memcmp(&back, &d, sizeof(double))) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int encode_numeric (dsmr_store_writer *sw, int col)
+{
+	// Encode a numeric column as first value(s) followed by zigzag deltas or delta-of-deltas, 
+	// which are either bit-packed or run-length encoded, whichever is smaller.
+	// The value slots are converted in place, they're not needed after the block is written.
+
+	const dsmr_store_column *c = dsmr_store_columns + col;
+	uint64_t *values = sw->values + col * sw->blockrows;
+	size_t n = sw->rows, i, first;
+	uint64_t prev, prevdelta, delta;
+	double d;
+	int rle;
+
+	if (c->type == STORE_DOUBLE) {
+		if (!double_is_scalable(values, n)) {
+			if (writer_reserve(sw, 1 + n * 8) < 0) {
+				return -1;
+			}
+			sw->buf[sw->buflen++] = STORE_ENC_RAW;
+			for (i = 0 ; i < n ; i++) {
+				put_u32(sw->buf + sw->buflen, values[i]);
+				put_u32(sw->buf + sw->buflen + 4, values[i] >> 32);
+				sw->buflen += 8;
+			}
+			return 0;
+		}
+		for (i = 0 ; i < n ; i++) {
+			memcpy(&d, values + i, sizeof(double));
+			values[i] = (uint64_t)llround(d * STORE_SCALE);
+		}
+	}
+
+	// Replace values by (zigzag) differences, working backwards through the column
+
+	if (c->encoding == STORE_DOD && n >= 2) {
+		prevdelta = values[1] - values[0];
+		for (i = n - 1 ; i >= 2 ; i--) {
+			delta = values[i] - values[i - 1];
+			values[i] = zigzag(delta - (values[i - 1] - values[i - 2]));
+		}
+		values[1] = zigzag(prevdelta);
+		first = 2;
+	} else {
+		prev = values[0];
+		for (i = 1 ; i < n ; i++) {
+			delta = values[i] - prev;
+			prev = values[i];
+			values[i] = zigzag(delta);
+		}
+		first = 1;
+	}
+
+	if (writer_reserve(sw, 21) < 0) {
+		return -1;
+	}
+	rle = (n > first && rle_size(values + first, n - first) < packed_size(values + first, n - first));
+	sw->buf[sw->buflen++] = rle ? STORE_ENC_RLE : STORE_ENC_PACKED;
+	put_varint(sw, zigzag(values[0]));
+	if (first == 2) {
+		put_varint(sw, values[1]);
+	}
+
+	if (rle) {
+		return put_rle(sw, values + first, n - first);
+	}
+	return put_packed(sw, values + first, n - first);
+}
+
+static int encode_strings (dsmr_store_writer *sw, int col)
+{
+	// Encode a string column as its dictionary, followed by the bit-packed dictionary indices
+
+	dsmr_store_dict *dict = sw->dicts + col;
+	size_t i, len;
+
+	if (writer_reserve(sw, 11) < 0) {
+		return -1;
+	}
+	sw->buf[sw->buflen++] = STORE_ENC_DICT;
+	put_varint(sw, dict->nstrings);
+
+	for (i = 0 ; i < dict->nstrings ; i++) {
+		len = strlen(dict->strings[i]);
+		if (writer_reserve(sw, len + 10) < 0) {
+			return -1;
+		}
+		put_varint(sw, len);
+		memcpy(sw->buf + sw->buflen, dict->strings[i], len);
+		sw->buflen += len;
+	}
+
+	return put_packed(sw, sw->values + col * sw->blockrows, sw->rows);
+}
+
+static void dict_clear (dsmr_store_dict *dict)
+{
+	size_t i;
+
+	for (i = 0 ; i < dict->nstrings ; i++) {
+		free(dict->strings[i]);
+	}
+	dict->nstrings = 0;
+	dict->last = 0;
+}
+
+static long dict_index (dsmr_store_dict *dict, const char *str, size_t len)
+{
+	// Return the index of a string in a dictionary, adding it if needed
+
+	char **strings;
+	size_t i;
+
+	if (dict->last < dict->nstrings && !strncmp(dict->strings[dict->last], str, len) && dict->strings[dict->last][len] == '\0') {
+		return dict->last;
+	}
+
+	for (i = 0 ; i < dict->nstrings ; i++) {
+		if (!strncmp(dict->strings[i], str, len) && dict->strings[i][len] == '\0') {
+			dict->last = i;
+			return i;
+		}
+	}
+
+	if (dict->nstrings >= dict->maxstrings) {
+		strings = realloc(dict->strings, (dict->maxstrings ? dict->maxstrings * 2 : 4) * sizeof(char *));
+		if (strings == NULL) {
+			return -1;
+		}
+		dict->strings = strings;
+		dict->maxstrings = dict->maxstrings ? dict->maxstrings * 2 : 4;
+	}
+
+	dict->strings[dict->nstrings] = strndup(str, len);
+	if (dict->strings[dict->nstrings] == NULL) {
+		return -1;
+	}
+	dict->last = dict->nstrings;
+
+	return dict->nstrings++;
+}
+
+
+int dsmr_store_writer_open (dsmr_store_writer *sw, char *outfile, size_t blockrows)
+{
+	uint8_t header[10];
+
+	if (sw == NULL) {
+		return -1;
+	}
+
+	memset(sw, 0, sizeof(dsmr_store_writer));
+	sw->logger = &logger;
+	sw->blockrows = blockrows ? blockrows : STORE_BLOCKROWS;
+
+	sw->values = malloc(sw->blockrows * dsmr_store_ncolumns * sizeof(uint64_t));
+	sw->dicts = calloc(dsmr_store_ncolumns, sizeof(dsmr_store_dict));
+	sw->lengths = malloc(dsmr_store_ncolumns * sizeof(uint32_t));
+	if (sw->values == NULL || sw->dicts == NULL || sw->lengths == NULL) {
+		logmsg_to(sw->logger, LL_ERROR, "Could not allocate column buffers\n");
+		dsmr_store_writer_close(sw);
+		return -2;
+	}
+
+	sw->file = fopen(outfile, "wb");
+	if (sw->file == NULL) {
+		logmsg_to(sw->logger, LL_ERROR, "Could not open %s: %s\n", outfile, strerror(errno));
+		dsmr_store_writer_close(sw);
+		return -3;
+	}
+
+	memcpy(header, STORE_MAGIC, 8);
+	header[8] = dsmr_store_ncolumns;
+	header[9] = dsmr_store_ncolumns >> 8;
+	if (fwrite(header, 1, sizeof(header), sw->file) != sizeof(header)) {
+		logmsg_to(sw->logger, LL_ERROR, "Could not write to %s: %s\n", outfile, strerror(errno));
+		dsmr_store_writer_close(sw);
+		return -4;
+	}
+	sw->bytes = sizeof(header);
+
+	return 0;
+}
+
+
+int dsmr_store_append (dsmr_store_writer *sw, const struct dsmr_data_struct *data)
+{
+	// Add a reading to the current block, and write the block when it is full
+
+	const dsmr_store_column *c;
+	const uint8_t *field;
+	uint64_t *slot;
+	uint32_t u32;
+	long idx;
+	int col;
+
+	if (sw == NULL || sw->file == NULL) {
+		return -1;
+	}
+
+	for (col = 0 ; col < dsmr_store_ncolumns ; col++) {
+		c = dsmr_store_columns + col;
+		field = (const uint8_t *)data + c->offset;
+		slot = sw->values + col * sw->blockrows + sw->rows;
+		switch (c->type) {
+			case STORE_U32:
+				memcpy(&u32, field, sizeof(uint32_t));
+				*slot = u32;
+				break;
+			case STORE_U8:
+				*slot = *field;
+				break;
+			case STORE_I8:
+				*slot = (uint64_t)(int64_t)*(const int8_t *)field;
+				break;
+			case STORE_DOUBLE:
+				memcpy(slot, field, sizeof(double));
+				break;
+			case STORE_STRING:
+				idx = dict_index(sw->dicts + col, (const char *)field, strnlen((const char *)field, c->size));
+				if (idx < 0) {
+					logmsg_to(sw->logger, LL_ERROR, "Could not add string to dictionary of column %s\n", c->name);
+					return -2;
+				}
+				*slot = idx;
+				break;
+		}
+	}
+
+	sw->rows++;
+	sw->readings++;
+
+	if (sw->rows >= sw->blockrows) {
+		return dsmr_store_flush(sw);
+	}
+
+	return 0;
+}
+
+
+int dsmr_store_flush (dsmr_store_writer *sw)
+{
+	// Encode and write the current block
+
+	uint8_t header[8];
+	size_t start, col, i;
+	int result;
+
+	if (sw == NULL || sw->file == NULL) {
+		return -1;
+	}
+
+	if (sw->rows == 0) {
+		return 0;
+	}
+
+	sw->buflen = 0;
+	for (col = 0 ; col < dsmr_store_ncolumns ; col++) {
+		start = sw->buflen;
+		if (dsmr_store_columns[col].type == STORE_STRING) {
+			result = encode_strings(sw, col);
+			dict_clear(sw->dicts + col);
+		} else {
+			result = encode_numeric(sw, col);
+		}
+		if (result < 0) {
+			return -2;
+		}
+		sw->lengths[col] = sw->buflen - start;
+	}
+
+	memcpy(header, STORE_BLOCK_MAGIC, 4);
+	put_u32(header + 4, sw->rows);
+	if (fwrite(header, 1, sizeof(header), sw->file) != sizeof(header)) {
+		goto write_error;
+	}
+	for (col = 0 ; col < dsmr_store_ncolumns ; col++) {
+		put_u32(header, sw->lengths[col]);
+		if (fwrite(header, 1, 4, sw->file) != 4) {
+			goto write_error;
+		}
+	}
+	if (fwrite(sw->buf, 1, sw->buflen, sw->file) != sw->buflen) {
+		goto write_error;
+	}
+
+	sw->bytes += sizeof(header) + dsmr_store_ncolumns * 4 + sw->buflen;
+	logmsg_to(sw->logger, LL_VERBOSE, "Wrote block of %lu rows, %lu bytes\n", (unsigned long)sw->rows, (unsigned long)sw->buflen);
+	sw->rows = 0;
+
+	return 0;
+
+write_error:
+	logmsg_to(sw->logger, LL_ERROR, "Could not write block: %s\n", strerror(errno));
+	for (i = 0 ; i < dsmr_store_ncolumns ; i++) {
+		dict_clear(sw->dicts + i);
+	}
+	sw->rows = 0;
+	return -3;
+}
+
+
+int dsmr_store_writer_close (dsmr_store_writer *sw)
+{
+	// Write the last (partial) block and release all resources
+
+	int result = 0, col;
+
+	if (sw == NULL) {
+		return -1;
+	}
+
+	if (sw->file) {
+		if (dsmr_store_flush(sw) < 0) {
+			result = -2;
+		}
+		if (fclose(sw->file)) {
+			result = -3;
+		}
+		sw->file = NULL;
+	}
+
+	if (sw->dicts) {
+		for (col = 0 ; col < dsmr_store_ncolumns ; col++) {
+			dict_clear(sw->dicts + col);
+			free(sw->dicts[col].strings);
+		}
+		free(sw->dicts);
+		sw->dicts = NULL;
+	}
+
+	free(sw->values);
+	free(sw->lengths);
+	free(sw->buf);
+	sw->values = NULL;
+	sw->lengths = NULL;
+	sw->buf = NULL;
+	sw->bufsize = sw->buflen = 0;
+
+	return result;
+}
+
+
+// Reader
+
+int dsmr_store_reader_open (dsmr_store_reader *sr, char *infile)
+{
+	uint8_t header[10];
+	int ncolumns;
+
+	if (sr == NULL) {
+		return -1;
+	}
+
+	memset(sr, 0, sizeof(dsmr_store_reader));
+	sr->logger = &logger;
+
+	sr->lengths = malloc(dsmr_store_ncolumns * sizeof(uint32_t));
+	sr->offsets = malloc(dsmr_store_ncolumns * sizeof(int64_t));
+	if (sr->lengths == NULL || sr->offsets == NULL) {
+		logmsg_to(sr->logger, LL_ERROR, "Could not allocate column directory\n");
+		dsmr_store_reader_close(sr);
+		return -2;
+	}
+
+	sr->file = fopen(infile, "rb");
+	if (sr->file == NULL) {
+		logmsg_to(sr->logger, LL_ERROR, "Could not open %s: %s\n", infile, strerror(errno));
+		dsmr_store_reader_close(sr);
+		return -3;
+	}
+
+	if (fread(header, 1, sizeof(header), sr->file) != sizeof(header) || memcmp(header, STORE_MAGIC, 8)) {
+		logmsg_to(sr->logger, LL_ERROR, "%s is not a DSMR column store\n", infile);
+		dsmr_store_reader_close(sr);
+		return -4;
+	}
+
+	ncolumns = header[8] | (header[9] << 8);
+	if (ncolumns != dsmr_store_ncolumns) {
+		logmsg_to(sr->logger, LL_ERROR, "%s has %d columns, expected %d\n", infile, ncolumns, dsmr_store_ncolumns);
+		dsmr_store_reader_close(sr);
+		return -5;
+	}
+
+	sr->next_block = sizeof(header);
+
+	return 0;
+}
+
+
+ssize_t dsmr_store_next_block (dsmr_store_reader *sr)
+{
+	// Read the header and column directory of the next block.
+	// Returns the number of rows in the block, 0 at the end of the file, or a negative value on errors.
+
+	uint8_t header[8];
+	int64_t offset = 0;
+	int col;
+
+	if (sr == NULL || sr->file == NULL) {
+		return -1;
+	}
+
+	if (fseeko(sr->file, sr->next_block, SEEK_SET) < 0) {
+		return -2;
+	}
+
+	if (fread(header, 1, sizeof(header), sr->file) != sizeof(header)) {
+		sr->rows = 0;
+		return 0;
+	}
+
+	if (memcmp(header, STORE_BLOCK_MAGIC, 4)) {
+		logmsg_to(sr->logger, LL_ERROR, "Invalid block header at offset %lld\n", (long long)sr->next_block);
+		return -3;
+	}
+	sr->rows = get_u32(header + 4);
+
+	for (col = 0 ; col < dsmr_store_ncolumns ; col++) {
+		if (fread(header, 1, 4, sr->file) != 4) {
+			logmsg_to(sr->logger, LL_ERROR, "Truncated block directory at offset %lld\n", (long long)sr->next_block);
+			return -4;
+		}
+		sr->lengths[col] = get_u32(header);
+		sr->offsets[col] = offset;
+		offset += sr->lengths[col];
+	}
+
+	sr->block_data = sr->next_block + sizeof(header) + dsmr_store_ncolumns * 4;
+	sr->next_block = sr->block_data + offset;
+
+	if (sr->rows > sr->maxrows) {
+		free(sr->ints);
+		free(sr->doubles);
+		free(sr->rowstrings);
+		sr->ints = malloc(sr->rows * sizeof(int64_t));
+		sr->doubles = malloc(sr->rows * sizeof(double));
+		sr->rowstrings = malloc(sr->rows * sizeof(char *));
+		if (sr->ints == NULL || sr->doubles == NULL || sr->rowstrings == NULL) {
+			logmsg_to(sr->logger, LL_ERROR, "Could not allocate buffers for %lu rows\n", (unsigned long)sr->rows);
+			sr->maxrows = 0;
+			return -5;
+		}
+		sr->maxrows = sr->rows;
+	}
+
+	return sr->rows;
+}
+
+
+static const uint8_t *load_column (dsmr_store_reader *sr, int col)
+{
+	// Read the encoded data of a single column of the current block
+
+	uint8_t *buf;
+
+	if (sr->lengths[col] > sr->bufsize) {
+		buf = realloc(sr->buf, sr->lengths[col]);
+		if (buf == NULL) {
+			logmsg_to(sr->logger, LL_ERROR, "Could not allocate %lu byte column buffer\n", (unsigned long)sr->lengths[col]);
+			return NULL;
+		}
+		sr->buf = buf;
+		sr->bufsize = sr->lengths[col];
+	}
+
+	if (fseeko(sr->file, sr->block_data + sr->offsets[col], SEEK_SET) < 0 ||
+		fread(sr->buf, 1, sr->lengths[col], sr->file) != sr->lengths[col]) {
+		logmsg_to(sr->logger, LL_ERROR, "Could not read column %s\n", dsmr_store_columns[col].name);
+		return NULL;
+	}
+
+	return sr->buf;
+}
+
+
+static int decode_numeric (dsmr_store_reader *sr, int col)
+{
+	// Decode a numeric column into sr->ints (packed or run-length encoded) or sr->doubles (raw). 
+	// Returns the column encoding.
+
+	const dsmr_store_column *c = dsmr_store_columns + col;
+	const uint8_t *p, *end;
+	uint64_t v, delta = 0, *diffs = (uint64_t *)sr->ints;
+	size_t i, first;
+	int enc;
+
+	if (sr->rows == 0) {
+		return STORE_ENC_PACKED;
+	}
+
+	p = load_column(sr, col);
+	if (p == NULL || sr->lengths[col] < 1) {
+		return -1;
+	}
+	end = p + sr->lengths[col];
+	enc = *p++;
+
+	if (enc == STORE_ENC_RAW) {
+		if (sr->lengths[col] < 1 + sr->rows * 8) {
+			return -2;
+		}
+		for (i = 0 ; i < sr->rows ; i++, p += 8) {
+			v = get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+			memcpy(sr->doubles + i, &v, sizeof(double));
+		}
+		return STORE_ENC_RAW;
+	}
+
+	if ((enc != STORE_ENC_PACKED && enc != STORE_ENC_RLE) || (p = get_varint(p, end, &v)) == NULL) {
+		return -3;
+	}
+	sr->ints[0] = unzigzag(v);
+	first = 1;
+
+	if (c->encoding == STORE_DOD && sr->rows >= 2) {
+		if ((p = get_varint(p, end, &v)) == NULL) {
+			return -3;
+		}
+		delta = unzigzag(v);
+		sr->ints[1] = (uint64_t)sr->ints[0] + delta;
+		first = 2;
+	}
+
+	if (first >= sr->rows) {
+		return STORE_ENC_PACKED;
+	}
+
+	// Decode the (zigzag) differences in place, then add them up
+
+	if (enc == STORE_ENC_RLE)
+		p = get_rle(p, end, sr->rows - first, diffs + first);
+	else
+		p = get_packed(p, end, sr->rows - first, diffs + first);
+	if (p == NULL) {
+		return -4;
+	}
+
+	for (i = first ; i < sr->rows ; i++) {
+		// Unsigned arithmetic, the encoder's differences wrap around in the same way
+		if (c->encoding == STORE_DOD) {
+			delta += (uint64_t)unzigzag(diffs[i]);
+			sr->ints[i] = (uint64_t)sr->ints[i - 1] + delta;
+		} else {
+			sr->ints[i] = (uint64_t)sr->ints[i - 1] + (uint64_t)unzigzag(diffs[i]);
+		}
+	}
+
+	return STORE_ENC_PACKED;
+}
+
+
+static int decode_strings (dsmr_store_reader *sr, int col)
+{
+	// Decode a string column, sets sr->rowstrings to the dictionary entry of every row
+
+	const uint8_t *p, *end, *q;
+	uint64_t nstrings, len, v;
+	size_t i, total = 0;
+	char *strbuf;
+
+	if (sr->rows == 0) {
+		return STORE_ENC_DICT;
+	}
+
+	p = load_column(sr, col);
+	if (p == NULL || sr->lengths[col] < 1 || *p++ != STORE_ENC_DICT) {
+		return -1;
+	}
+	end = p + sr->lengths[col] - 1;
+
+	if ((p = get_varint(p, end, &nstrings)) == NULL || nstrings == 0 || nstrings > sr->lengths[col]) {
+		return -2;
+	}
+
+	// First pass to determine the size of the dictionary, then copy the strings
+
+	for (q = p, i = 0 ; i < nstrings ; i++) {
+		if ((q = get_varint(q, end, &len)) == NULL || len > (uint64_t)(end - q)) {
+			return -2;
+		}
+		q += len;
+		total += len + 1;
+	}
+
+	if (total > sr->strbufsize) {
+		strbuf = realloc(sr->strbuf, total);
+		if (strbuf == NULL) {
+			return -3;
+		}
+		sr->strbuf = strbuf;
+		sr->strbufsize = total;
+	}
+	if (nstrings > sr->maxstrings) {
+		free(sr->strings);
+		sr->strings = malloc(nstrings * sizeof(char *));
+		if (sr->strings == NULL) {
+			sr->maxstrings = 0;
+			return -3;
+		}
+		sr->maxstrings = nstrings;
+	}
+
+	strbuf = sr->strbuf;
+	for (i = 0 ; i < nstrings ; i++) {
+		p = get_varint(p, end, &len);
+		memcpy(strbuf, p, len);
+		strbuf[len] = '\0';
+		sr->strings[i] = strbuf;
+		strbuf += len + 1;
+		p += len;
+	}
+
+	if (get_packed(p, end, sr->rows, (uint64_t *)sr->ints) == NULL) {
+		return -4;
+	}
+
+	for (i = 0 ; i < sr->rows ; i++) {
+		v = sr->ints[i];
+		sr->rowstrings[i] = (v < nstrings) ? sr->strings[v] : "";
+	}
+
+	return STORE_ENC_DICT;
+}
+
+
+ssize_t dsmr_store_read_values (dsmr_store_reader *sr, int col, const double **values)
+{
+	// Decode a single numeric column of the current block. Sets *values to an array with
+	// a value for every row, valid until the next read. Returns the number of rows.
+
+	const dsmr_store_column *c;
+	int enc;
+	size_t i;
+
+	if (sr == NULL || col < 0 || col >= dsmr_store_ncolumns || dsmr_store_columns[col].type == STORE_STRING) {
+		return -1;
+	}
+	c = dsmr_store_columns + col;
+
+	enc = decode_numeric(sr, col);
+	if (enc < 0) {
+		logmsg_to(sr->logger, LL_ERROR, "Could not decode column %s\n", c->name);
+		return -2;
+	}
+
+	if (enc == STORE_ENC_PACKED) {
+		for (i = 0 ; i < sr->rows ; i++) {
+			if (c->type == STORE_DOUBLE)
+				sr->doubles[i] = (double)sr->ints[i] / STORE_SCALE;
+			else if (c->type == STORE_U32)
+				sr->doubles[i] = (uint32_t)sr->ints[i];
+			else
+				sr->doubles[i] = sr->ints[i];
+		}
+	}
+
+	*values = sr->doubles;
+
+	return sr->rows;
+}
+
+
+ssize_t dsmr_store_read_strings (dsmr_store_reader *sr, int col, const char ***values)
+{
+	// Decode a single string column of the current block. Sets *values to an array with
+	// a string for every row, valid until the next read. Returns the number of rows.
+
+	if (sr == NULL || col < 0 || col >= dsmr_store_ncolumns || dsmr_store_columns[col].type != STORE_STRING) {
+		return -1;
+	}
+
+	if (decode_strings(sr, col) < 0) {
+		logmsg_to(sr->logger, LL_ERROR, "Could not decode column %s\n", dsmr_store_columns[col].name);
+		return -2;
+	}
+
+	*values = sr->rowstrings;
+
+	return sr->rows;
+}
+
+
+ssize_t dsmr_store_read_rows (dsmr_store_reader *sr, struct dsmr_data_struct *rows)
+{
+	// Decode all columns of the current block into an array of sr->rows readings
+
+	const dsmr_store_column *c;
+	uint8_t *field;
+	uint32_t u32;
+	double d;
+	size_t i, len;
+	int col, enc;
+
+	if (sr == NULL || rows == NULL) {
+		return -1;
+	}
+
+	memset(rows, 0, sr->rows * sizeof(struct dsmr_data_struct));
+
+	for (col = 0 ; col < dsmr_store_ncolumns ; col++) {
+		c = dsmr_store_columns + col;
+
+		if (c->type == STORE_STRING) {
+			if (decode_strings(sr, col) < 0) {
+				logmsg_to(sr->logger, LL_ERROR, "Could not decode column %s\n", c->name);
+				return -2;
+			}
+			for (i = 0 ; i < sr->rows ; i++) {
+				field = (uint8_t *)(rows + i) + c->offset;
+				len = strlen(sr->rowstrings[i]);
+				memcpy(field, sr->rowstrings[i], len < c->size ? len : c->size);
+			}
+			continue;
+		}
+
+		enc = decode_numeric(sr, col);
+		if (enc < 0) {
+			logmsg_to(sr->logger, LL_ERROR, "Could not decode column %s\n", c->name);
+			return -2;
+		}
+
+		for (i = 0 ; i < sr->rows ; i++) {
+			field = (uint8_t *)(rows + i) + c->offset;
+			switch (c->type) {
+				case STORE_U32:
+					u32 = sr->ints[i];
+					memcpy(field, &u32, sizeof(uint32_t));
+					break;
+				case STORE_U8:
+				case STORE_I8:
+					*field = sr->ints[i];
+					break;
+				case STORE_DOUBLE:
+					d = (enc == STORE_ENC_RAW) ? sr->doubles[i] : (double)sr->ints[i] / STORE_SCALE;
+					memcpy(field, &d, sizeof(double));
+					break;
+			}
+		}
+	}
+
+	return sr->rows;
+}
+
+
+void dsmr_store_reader_close (dsmr_store_reader *sr)
+{
+	if (sr == NULL) {
+		return;
+	}
+
+	if (sr->file) {
+		fclose(sr->file);
+		sr->file = NULL;
+	}
+
+	free(sr->lengths);
+	free(sr->offsets);
+	free(sr->buf);
+	free(sr->ints);
+	free(sr->doubles);
+	free(sr->strbuf);
+	free(sr->strings);
+	free(sr->rowstrings);
+	memset(sr, 0, sizeof(dsmr_store_reader));
+}
@@ -0,0 +1,132 @@
+/*
+   File: dsmr-store.h
+
+   	  Compact columnar storage for series of smart meter readings (struct dsmr_data_struct).
+
+   	  Readings are stored in blocks of up to STORE_BLOCKROWS rows. Within a block, every field
+   	  is stored as a separate column: numeric fields as bit-packed or run-length encoded deltas
+   	  (or delta-of-deltas, for timestamps) and strings as a dictionary with bit-packed indices. Every block starts
+   	  with a directory of column lengths, so a reader only needs to read the columns it uses.
+*/
+
+#ifndef DSMR_STORE_H
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include "logmsg.h"
+#include "dsmr-data.h"
+
+
+#define STORE_MAGIC			"DSMRCOL1"	// File header, followed by the number of columns (16 bits)
+#define STORE_BLOCK_MAGIC	"P1BK"		// Block header, followed by the number of rows and column lengths (32 bits each)
+#define STORE_BLOCKROWS		4096		// Default number of rows per block
+#define STORE_SCALE			1000		// Doubles are stored as integers in units of 1/STORE_SCALE, if exact
+#define STORE_GROUP			128			// Number of values per bit width in bit-packed columns
+
+// Field types
+
+#define STORE_U32		1
+#define STORE_U8		2
+#define STORE_I8		3
+#define STORE_DOUBLE	4
+#define STORE_STRING	5
+
+// Numeric encodings
+
+#define STORE_DELTA		1	// Differences between successive values
+#define STORE_DOD		2	// Differences between successive differences, for regularly spaced timestamps
+
+// Column encodings, the first byte of an encoded column
+
+#define STORE_ENC_PACKED	1	// First value(s) as varint, then bit-packed (zigzag) deltas
+#define STORE_ENC_RAW		2	// Doubles that cannot be scaled exactly, 8 bytes per row
+#define STORE_ENC_DICT		3	// Dictionary of strings, then bit-packed indices
+#define STORE_ENC_RLE		4	// First value(s) as varint, then (zigzag) deltas as (value, run length - 1) varint pairs
+
+
+typedef struct dsmr_store_column_struct {
+
+	const char *name;		// Column name, e.g. "E_in[1]"
+	uint8_t type;			// Field type (STORE_U32, STORE_U8, STORE_I8, STORE_DOUBLE or STORE_STRING)
+	uint8_t encoding;		// Numeric encoding (STORE_DELTA or STORE_DOD)
+	size_t size;			// Field size in bytes
+	size_t offset;			// Field offset in struct dsmr_data_struct
+
+} dsmr_store_column;
+
+extern const dsmr_store_column dsmr_store_columns[];
+extern const int dsmr_store_ncolumns;
+
+
+// String dictionary of a column, rebuilt for every block
+
+typedef struct dsmr_store_dict_struct {
+
+	char **strings;
+	size_t nstrings, maxstrings;
+	size_t last;			// Index of the last string found, checked first
+
+} dsmr_store_dict;
+
+
+typedef struct dsmr_store_writer_struct {
+
+	FILE *file;
+	size_t blockrows;		// Maximum number of rows per block
+	size_t rows;			// Number of rows in the current block
+	uint64_t *values;		// Column values of the current block, column-major (double bits, integers or dictionary indices)
+	dsmr_store_dict *dicts;	// Dictionaries of the string columns
+	uint8_t *buf;			// Encoding buffer
+	size_t buflen, bufsize;
+	uint32_t *lengths;		// Encoded column lengths
+
+	uint64_t readings;		// Number of readings written
+	uint64_t bytes;			// Number of bytes written
+	messagelogger *logger;
+
+} dsmr_store_writer;
+
+
+typedef struct dsmr_store_reader_struct {
+
+	FILE *file;
+	int64_t next_block;		// File offset of the next block
+	int64_t block_data;		// File offset of the column data of the current block
+	size_t rows;			// Number of rows in the current block
+	uint32_t *lengths;		// Encoded column lengths in the current block
+	int64_t *offsets;			// Column offsets relative to block_data
+
+	uint8_t *buf;			// Column data buffer
+	size_t bufsize;
+	int64_t *ints;			// Decoded integer values
+	double *doubles;		// Decoded values as doubles
+	size_t maxrows;
+	char *strbuf;			// Decoded dictionary strings (zero-terminated)
+	size_t strbufsize;
+	const char **strings;	// Dictionary entries
+	size_t maxstrings;
+	const char **rowstrings;	// Dictionary entry of every row
+
+	messagelogger *logger;
+
+} dsmr_store_reader;
+
+
+int dsmr_store_column_lookup (const char *name);
+
+int dsmr_store_writer_open (dsmr_store_writer *sw, char *outfile, size_t blockrows);
+int dsmr_store_append (dsmr_store_writer *sw, const struct dsmr_data_struct *data);
+int dsmr_store_flush (dsmr_store_writer *sw);
+int dsmr_store_writer_close (dsmr_store_writer *sw);
+
+int dsmr_store_reader_open (dsmr_store_reader *sr, char *infile);
+ssize_t dsmr_store_next_block (dsmr_store_reader *sr);
+ssize_t dsmr_store_read_values (dsmr_store_reader *sr, int col, const double **values);
+ssize_t dsmr_store_read_strings (dsmr_store_reader *sr, int col, const char ***values);
+ssize_t dsmr_store_read_rows (dsmr_store_reader *sr, struct dsmr_data_struct *rows);
+void dsmr_store_reader_close (dsmr_store_reader *sr);
+
+#define DSMR_STORE_H	1
+#endif
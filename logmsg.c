@@ -0,0 +1,267 @@
+/*
+   File: logmsg.c
+
+   	  Functions and data used for writing messages to a logfile.
+*/
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "logmsg.h"
+
+
+// Default logger, messages are discarded until init_msglogger() is called
+
+messagelogger logger = { NULL, NULL, LL_NORMAL, NULL };
+
+
+// Ring buffer used for asynchronous logging. This is a bounded multi-producer queue in which
+// every slot has a sequence number: producers claim a position by advancing the head,
+// fill the slot, and then publish it by updating its sequence number. The single consumer
+// (the background thread) releases slots in the same way. When the ring is empty, the
+// consumer sets the sleeping flag and waits on a condition variable, and a producer only
+// takes the lock (to wake it up) if it finds that flag set after publishing a message.
+
+struct logmsg_slot {
+	atomic_size_t seq;
+	int level;
+	char text[LOGMSG_SLOTSIZE];
+};
+
+struct logmsg_ring {
+	struct logmsg_slot *slots;
+	size_t mask;				// Number of slots - 1 (the number of slots is a power of two)
+	atomic_size_t head;			// Next position to be claimed by a producer
+	size_t tail;				// Next position to be written by the background thread
+	atomic_size_t dropped;		// Number of messages dropped because the ring was full
+	atomic_int running;
+	atomic_int sleeping;		// Set while the background thread waits for messages
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	pthread_t thread;
+	FILE *logfile;
+};
+
+
+static int logmsg_ring_flush (struct logmsg_ring *ring)
+{
+	// Write all published messages, returns the number of messages written
+
+	struct logmsg_slot *slot;
+	size_t dropped;
+	int count = 0;
+
+	for (;;) {
+		slot = ring->slots + (ring->tail & ring->mask);
+		if (atomic_load_explicit(&(slot->seq), memory_order_acquire) != ring->tail + 1) {
+			break;
+		}
+
+		if (slot->level == LL_WARNING)
+			fputs("WARNING: ", ring->logfile);
+		else if (slot->level == LL_ERROR)
+			fputs("ERROR: ", ring->logfile);
+		else if (slot->level == LL_FATAL)
+			fputs("FATAL ERROR: ", ring->logfile);
+		fputs(slot->text, ring->logfile);
+
+		atomic_store_explicit(&(slot->seq), ring->tail + ring->mask + 1, memory_order_release);
+		ring->tail++;
+		count++;
+	}
+
+	dropped = atomic_exchange(&(ring->dropped), 0);
+	if (dropped) {
+		fprintf(ring->logfile, "WARNING: %lu log messages dropped\n", (unsigned long)dropped);
+	}
+
+	if (count || dropped) {
+		fflush(ring->logfile);
+	}
+
+	return count;
+}
+
+
+static void logmsg_ring_wait (struct logmsg_ring *ring)
+{
+	// Wait until a message is published or the ring is stopped. The sleeping flag is set
+	// before checking the next slot, and producers check the flag after publishing, so
+	// either this thread sees the new message or the producer sees the flag.
+
+	pthread_mutex_lock(&(ring->lock));
+	atomic_store(&(ring->sleeping), 1);
+	if (atomic_load(&(ring->running)) && atomic_load(&(ring->slots[ring->tail & ring->mask].seq)) != ring->tail + 1) {
+		pthread_cond_wait(&(ring->wakeup), &(ring->lock));
+	}
+	atomic_store(&(ring->sleeping), 0);
+	pthread_mutex_unlock(&(ring->lock));
+}
+
+
+static void logmsg_ring_wake (struct logmsg_ring *ring)
+{
+	// Wake up the background thread, if it's waiting
+
+	if (atomic_load(&(ring->sleeping))) {
+		pthread_mutex_lock(&(ring->lock));
+		pthread_cond_signal(&(ring->wakeup));
+		pthread_mutex_unlock(&(ring->lock));
+	}
+}
+
+
+static void *logmsg_thread (void *arg)
+{
+	// Background thread: write messages, and wait whenever the ring is empty
+
+	struct logmsg_ring *ring = arg;
+
+	while (atomic_load(&(ring->running))) {
+		if (logmsg_ring_flush(ring) == 0) {
+			logmsg_ring_wait(ring);
+		}
+	}
+
+	logmsg_ring_flush(ring);
+
+	return NULL;
+}
+
+
+int logmsg_start_async (messagelogger *lg, size_t slots)
+{
+	// Switch a logger to asynchronous mode, with a ring buffer of (at least) the given number of slots
+
+	struct logmsg_ring *ring;
+	size_t i, n = 1;
+
+	if (lg == NULL || lg->ring != NULL || lg->logfile == NULL) {
+		return -1;
+	}
+
+	if (slots == 0) {
+		slots = LOGMSG_SLOTS;
+	}
+	while (n < slots) {
+		n <<= 1;
+	}
+
+	ring = calloc(1, sizeof(struct logmsg_ring));
+	if (ring == NULL) {
+		return -2;
+	}
+	ring->slots = calloc(n, sizeof(struct logmsg_slot));
+	if (ring->slots == NULL) {
+		free(ring);
+		return -2;
+	}
+
+	ring->mask = n - 1;
+	for (i = 0 ; i < n ; i++) {
+		atomic_init(&(ring->slots[i].seq), i);
+	}
+	atomic_init(&(ring->head), 0);
+	atomic_init(&(ring->dropped), 0);
+	atomic_init(&(ring->running), 1);
+	atomic_init(&(ring->sleeping), 0);
+	pthread_mutex_init(&(ring->lock), NULL);
+	pthread_cond_init(&(ring->wakeup), NULL);
+	ring->tail = 0;
+	ring->logfile = lg->logfile;
+
+	if (pthread_create(&(ring->thread), NULL, logmsg_thread, ring)) {
+		pthread_cond_destroy(&(ring->wakeup));
+		pthread_mutex_destroy(&(ring->lock));
+		free(ring->slots);
+		free(ring);
+		return -3;
+	}
+
+	lg->ring = ring;
+
+	return 0;
+}
+
+
+void logmsg_stop_async (messagelogger *lg)
+{
+	// Write all pending messages and switch the logger back to synchronous mode.
+	// No other threads should log to this logger while it is being stopped.
+
+	struct logmsg_ring *ring;
+
+	if (lg == NULL || lg->ring == NULL) {
+		return;
+	}
+
+	ring = lg->ring;
+	lg->ring = NULL;
+
+	atomic_store(&(ring->running), 0);
+	pthread_mutex_lock(&(ring->lock));
+	pthread_cond_signal(&(ring->wakeup));
+	pthread_mutex_unlock(&(ring->lock));
+	pthread_join(ring->thread, NULL);
+
+	pthread_cond_destroy(&(ring->wakeup));
+	pthread_mutex_destroy(&(ring->lock));
+	free(ring->slots);
+	free(ring);
+}
+
+
+void logmsg_async (messagelogger *lg, int level, const char *format, ...)
+{
+	// Format a message into the next free slot of the ring buffer. The message is formatted
+	// here, rather than in the background thread, because arguments (e.g. strings in parser
+	// buffers) are only valid during the call.
+
+	struct logmsg_ring *ring = lg->ring;
+	struct logmsg_slot *slot;
+	size_t pos, seq;
+	va_list ap;
+
+	pos = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+	for (;;) {
+		slot = ring->slots + (pos & ring->mask);
+		seq = atomic_load_explicit(&(slot->seq), memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak_explicit(&(ring->head), &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if ((ssize_t)(seq - pos) < 0) {
+			// Ring is full, don't wait for the background thread. Warnings and errors
+			// are written directly instead, other messages are dropped.
+			if (level <= LL_WARNING) {
+				flockfile(ring->logfile);
+				fputs(level == LL_WARNING ? "WARNING: " : level == LL_ERROR ? "ERROR: " : "FATAL ERROR: ", ring->logfile);
+				va_start(ap, format);
+				vfprintf(ring->logfile, format, ap);
+				va_end(ap);
+				fflush(ring->logfile);
+				funlockfile(ring->logfile);
+			} else {
+				atomic_fetch_add_explicit(&(ring->dropped), 1, memory_order_relaxed);
+			}
+			return;
+		} else {
+			pos = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+		}
+	}
+
+	slot->level = level;
+	va_start(ap, format);
+	if (vsnprintf(slot->text, LOGMSG_SLOTSIZE, format, ap) >= LOGMSG_SLOTSIZE) {
+		strcpy(slot->text + LOGMSG_SLOTSIZE - 5, "...\n");	// Mark truncated messages
+	}
+	va_end(ap);
+
+	atomic_store(&(slot->seq), pos + 1);		// Sequentially consistent, see logmsg_ring_wait()
+	logmsg_ring_wake(ring);
+}
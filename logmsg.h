@@ -6,6 +6,7 @@
    	  (c)2013-2015, Levien van Zon (levien@zonnetjes.net)
 */
 
+#ifndef LOGMSG_H
 
 #include <stdio.h>
 
@@ -19,34 +20,76 @@
 #define LL_VERBOSE		5
 #define LL_DEBUG		6
 
+// Messages above this level are removed at compile time, e.g. compile with -DLOGMSG_LEVEL=LL_NORMAL
+// to drop all verbose and debug messages (including their arguments) from release builds
+
+#ifndef LOGMSG_LEVEL
+#define LOGMSG_LEVEL	LL_DEBUG
+#endif
+
+#define LOGMSG_SLOTS		1024	// Default number of messages in the ring buffer of an asynchronous logger
+#define LOGMSG_SLOTSIZE		256		// Maximum length of a message in the ring buffer, longer messages are truncated
+
+struct logmsg_ring;
+
 typedef struct msglogger_struct {
 	
 	char *logfile_name;
 	FILE *logfile;
 	int loglevel;
+	struct logmsg_ring *ring;	// Ring buffer for asynchronous logging, NULL to write messages directly
 	
 } messagelogger;
 
-messagelogger logger;
+// Default logger, used by applications and by library objects that haven't been given a logger of their own
+
+extern messagelogger logger;
+
+static inline void init_msglogger_struct(messagelogger *lg) {
+		lg->logfile_name = NULL;
+		lg->logfile = stdout;
+		lg->loglevel = LL_NORMAL;
+		lg->ring = NULL;
+}
 
 static inline void init_msglogger() {
-		logger.logfile_name = NULL;
-		logger.logfile = stdout;
-		logger.loglevel = LL_NORMAL;
+		init_msglogger_struct(&logger);
 }
 
 
-#define logmsg(level, format, args...) { \
-	if (level <= logger.loglevel && logger.logfile) { \
-		if (level == LL_WARNING) \
-			fprintf(logger.logfile, "WARNING: "); \
-		else if (level == LL_ERROR) \
-			fprintf(logger.logfile, "ERROR: "); \
-		else if (level == LL_FATAL) \
-			fprintf(logger.logfile, "FATAL ERROR: "); \
-		fprintf(logger.logfile, format, ##args); \
-		fflush(logger.logfile); \
+// Asynchronous logging: messages are formatted by the caller into a lock-free ring buffer, 
+// and written to the logfile by a background thread. Messages are dropped (and counted) 
+// when the ring buffer is full, so logging never blocks the caller on I/O.
+
+int logmsg_start_async (messagelogger *lg, size_t slots);
+void logmsg_stop_async (messagelogger *lg);
+void logmsg_async (messagelogger *lg, int level, const char *format, ...) __attribute__ ((format (printf, 3, 4)));
+
+
+// Write a message to a specific logger. Synchronous messages are written with the file locked, 
+// so that messages from different threads don't get mixed up.
+
+#define logmsg_to(lg, level, format, args...) { \
+	messagelogger *_logger = (lg); \
+	if (level <= LOGMSG_LEVEL && _logger && level <= _logger->loglevel) { \
+		if (_logger->ring) { \
+			logmsg_async(_logger, level, format, ##args); \
+		} else if (_logger->logfile) { \
+			flockfile(_logger->logfile); \
+			if (level == LL_WARNING) \
+				fprintf(_logger->logfile, "WARNING: "); \
+			else if (level == LL_ERROR) \
+				fprintf(_logger->logfile, "ERROR: "); \
+			else if (level == LL_FATAL) \
+				fprintf(_logger->logfile, "FATAL ERROR: "); \
+			fprintf(_logger->logfile, format, ##args); \
+			fflush(_logger->logfile); \
+			funlockfile(_logger->logfile); \
+		} \
 	} \
 }
 
+#define logmsg(level, format, args...) logmsg_to(&logger, level, format, ##args)
 
+#define LOGMSG_H	1
+#endif
@@ -1,6 +1,15 @@
-#!/bin/bash
-
 ragel -s p1-parser.rl
-gcc -Wall -Os -g -o p1-test p1-parser.c p1-lib.c p1-test.c crc16.c
-gcc -Wall -Os -g -o d0-test p1-parser.c p1-lib.c p1-test-d0.c crc16.c
-
+gcc -Wall -Os -g -pthread -o p1-test p1-parser.c p1-obis.c p1-time.c p1-lib.c p1-dump.c p1-stats.c p1-baud.c p1-test.c crc16.c logmsg.c
+gcc -Wall -Os -g -pthread -o d0-test p1-parser.c p1-obis.c p1-time.c p1-lib.c p1-dump.c p1-stats.c p1-baud.c p1-test-d0.c crc16.c logmsg.c
+gcc -Wall -Os -g -o crc16-bench crc16-bench.c crc16.c
+gcc -Wall -Os -g -pthread -o p1-test-multi p1-parser.c p1-obis.c p1-time.c p1-lib.c p1-dump.c p1-stats.c p1-baud.c p1-mux.c p1-test-multi.c crc16.c logmsg.c
+gcc -Wall -Os -g -pthread -o p1-test-threads p1-parser.c p1-obis.c p1-time.c p1-lib.c p1-dump.c p1-stats.c p1-baud.c p1-test-threads.c crc16.c logmsg.c
+gcc -Wall -Os -g -pthread -o p1-test-stream p1-parser.c p1-obis.c p1-time.c p1-lib.c p1-dump.c p1-stats.c p1-baud.c p1-test-stream.c crc16.c logmsg.c
+gcc -Wall -Os -g -pthread -o p1-test-obis p1-parser.c p1-obis.c p1-time.c p1-lib.c p1-dump.c p1-stats.c p1-baud.c p1-test-obis.c crc16.c logmsg.c
+gcc -Wall -O2 -g -pthread -o p1-replay p1-parser.c p1-obis.c p1-time.c p1-lib.c p1-dump.c p1-stats.c p1-baud.c p1-archive.c p1-replay.c crc16.c logmsg.c
+gcc -Wall -O2 -g -pthread -o p1-store p1-parser.c p1-obis.c p1-time.c p1-lib.c p1-dump.c p1-stats.c p1-baud.c p1-archive.c dsmr-store.c p1-store.c crc16.c logmsg.c -lm
+gcc -Wall -O2 -g -pthread -o p1-bench p1-parser.c p1-obis.c p1-time.c p1-lib.c p1-dump.c p1-stats.c p1-baud.c p1-gen.c dsmr-store.c dsmr-sink.c p1-bench.c crc16.c logmsg.c -lm
+gcc -Wall -O2 -g -pthread -o p1-sim p1-parser.c p1-obis.c p1-time.c p1-lib.c p1-dump.c p1-stats.c p1-baud.c p1-gen.c p1-sim.c crc16.c logmsg.c -lm
+gcc -Wall -O2 -g -pthread -o p1-delta p1-parser.c p1-obis.c p1-time.c p1-lib.c p1-dump.c p1-stats.c p1-baud.c p1-archive.c dsmr-store.c dsmr-delta.c p1-delta.c crc16.c logmsg.c -lm
+gcc -Wall -O2 -g -pthread -o p1-aggregate p1-parser.c p1-obis.c p1-time.c p1-lib.c p1-dump.c p1-stats.c p1-baud.c p1-archive.c dsmr-aggregate.c p1-aggregate.c crc16.c logmsg.c -lm
+gcc -Wall -O2 -g -pthread -o p1-log p1-parser.c p1-obis.c p1-time.c p1-lib.c p1-dump.c p1-stats.c p1-baud.c dsmr-log.c p1-log.c crc16.c logmsg.c
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "logmsg.h"
+
+#include "p1-archive.h"
+#include "dsmr-aggregate.h"
+
+
+// Replay a telegram capture, and aggregate the readings into windows of one minute,
+// 15 minutes and one hour (or other periods). Readings only pass through the shortest
+// window, every longer window is fed with the records of the one before it.
+
+
+#define AGGREGATE_LEVELS	8
+#define AGGREGATE_LINELEN	4096
+
+
+typedef struct aggregate_level_struct {
+	dsmr_aggregate agg;
+	struct aggregate_level_struct *next;	// Aggregator fed with the records of this one, NULL if none
+	FILE *out;
+} aggregate_level;
+
+
+void window_closed (dsmr_aggregate *agg, const dsmr_aggregate_record *rec, void *userdata)
+{
+	aggregate_level *level = userdata;
+	char line[AGGREGATE_LINELEN];
+	size_t len;
+
+	if (level->out) {
+		len = dsmr_aggregate_format(rec, line, sizeof(line));
+		fprintf(level->out, "%u ", agg->period);
+		fwrite(line, 1, len, level->out);
+	}
+
+	if (level->next)
+		dsmr_aggregate_add_record(&(level->next->agg), rec);
+}
+
+
+void telegram_aggregate (const telegram_archive_record *rec, void *userdata)
+{
+	aggregate_level *levels = userdata;
+
+	if (rec->result < 0)
+		return;		// Skip telegrams with CRC errors
+
+	dsmr_aggregate_add(&(levels[0].agg), &(rec->data));
+}
+
+
+int main (int argc, char **argv)
+{
+
+	init_msglogger();
+	logger.loglevel = LL_NORMAL;
+
+	telegram_archive archive;
+	aggregate_level levels[AGGREGATE_LEVELS];
+	unsigned int periods[AGGREGATE_LEVELS] = { 60, 900, 3600 };
+	int nlevels = 3, l;
+	FILE *out = NULL;
+
+	if (argc < 2) {
+		logmsg(LL_NORMAL, "Usage: %s <capture file> [<output file or -> [<period in seconds> ...]]\n", argv[0]);
+		exit(1);
+	}
+
+	if (argc >= 3)
+		out = strcmp(argv[2], "-") ? fopen(argv[2], "w") : stdout;
+	if (argc >= 3 && out == NULL) {
+		logmsg(LL_ERROR, "Could not open output file %s\n", argv[2]);
+		exit(2);
+	}
+
+	if (argc >= 4) {
+		for (nlevels = 0 ; nlevels < AGGREGATE_LEVELS && nlevels + 3 < argc ; nlevels++) {
+			periods[nlevels] = atoi(argv[nlevels + 3]);
+			if (nlevels && (periods[nlevels] <= periods[nlevels - 1] || periods[nlevels] % periods[nlevels - 1])) {
+				logmsg(LL_ERROR, "Every period must be a multiple of the one before it\n");
+				exit(3);
+			}
+		}
+	}
+
+	for (l = 0 ; l < nlevels ; l++) {
+		if (dsmr_aggregate_init(&(levels[l].agg), periods[l], window_closed, levels + l) < 0) {
+			logmsg(LL_ERROR, "Invalid period %u\n", periods[l]);
+			exit(3);
+		}
+		levels[l].next = (l + 1 < nlevels) ? levels + l + 1 : NULL;
+		levels[l].out = out;
+	}
+
+	if (telegram_archive_open(&archive, argv[1], 0) < 0) {
+		exit(4);
+	}
+
+	telegram_archive_replay(&archive, 0, telegram_aggregate, levels);
+
+	for (l = 0 ; l < nlevels ; l++) {
+		dsmr_aggregate_flush(&(levels[l].agg));
+	}
+
+	for (l = 0 ; l < nlevels ; l++) {
+		logmsg(LL_NORMAL, "%u s windows: %lu readings, %lu records, %lu readings dropped\n", periods[l],
+			(unsigned long)(levels[l].agg.readings), (unsigned long)(levels[l].agg.windows), (unsigned long)(levels[l].agg.dropped));
+	}
+
+	telegram_archive_close(&archive);
+	if (out && out != stdout)
+		fclose(out);
+
+	return 0;
+}
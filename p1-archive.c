@@ -0,0 +1,336 @@
+/*
+   File: p1-archive.c
+
+   	  Replay of large P1 telegram captures, using a memory-mapped file and a pool of worker threads.
+   	  Chunk boundaries are placed at the start of a telegram ('/' after "\r\n"), so every telegram
+   	  falls within a single chunk. Workers parse whole chunks into record arrays, which are handed
+   	  to the callback in order by the thread that runs the replay.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "logmsg.h"
+
+#include "p1-archive.h"
+
+
+static size_t telegram_boundary (const uint8_t *data, size_t size, size_t offset)
+{
+	// Find the first telegram start ('/' at the start of a line) at or after offset
+
+	const uint8_t *p;
+
+	while (offset < size) {
+		p = memchr(data + offset, '/', size - offset);
+		if (p == NULL) {
+			return size;
+		}
+		offset = p - data;
+		if (offset == 0 || (offset >= 2 && data[offset - 2] == '\r' && data[offset - 1] == '\n')) {
+			return offset;
+		}
+		offset++;
+	}
+
+	return size;
+}
+
+
+int telegram_archive_open (telegram_archive *ta, char *infile, size_t chunksize)
+{
+	// Map a telegram capture into memory and split it into chunks of about chunksize bytes
+
+	struct stat st;
+	size_t chunk, offset, end;
+	void *data;
+
+	if (ta == NULL) {
+		return -1;
+	}
+
+	memset(ta, 0, sizeof(telegram_archive));
+	ta->fd = -1;
+	ta->logger = &logger;
+
+	if (chunksize == 0) {
+		chunksize = ARCHIVE_CHUNKSIZE;
+	}
+
+	ta->fd = open(infile, O_RDONLY | O_CLOEXEC);
+	if (ta->fd < 0) {
+		logmsg_to(ta->logger, LL_ERROR, "Could not open %s: %s\n", infile, strerror(errno));
+		return -2;
+	}
+
+	if (fstat(ta->fd, &st) < 0 || st.st_size == 0) {
+		logmsg_to(ta->logger, LL_ERROR, "Could not determine size of %s, or file is empty\n", infile);
+		close(ta->fd);
+		ta->fd = -1;
+		return -3;
+	}
+	ta->size = st.st_size;
+
+	data = mmap(NULL, ta->size, PROT_READ, MAP_PRIVATE, ta->fd, 0);
+	if (data == MAP_FAILED) {
+		logmsg_to(ta->logger, LL_ERROR, "Could not map %s into memory: %s\n", infile, strerror(errno));
+		close(ta->fd);
+		ta->fd = -1;
+		return -4;
+	}
+	ta->data = data;
+	madvise(data, ta->size, MADV_SEQUENTIAL);	// Chunks are parsed roughly in order
+
+	// Split the capture at telegram starts. Chunks are never smaller than chunksize
+	// (except for the last one), so there are at most size / chunksize + 1 of them.
+
+	ta->chunks = calloc(ta->size / chunksize + 1, sizeof(telegram_archive_chunk));
+	if (ta->chunks == NULL) {
+		logmsg_to(ta->logger, LL_ERROR, "Could not allocate chunk array\n");
+		telegram_archive_close(ta);
+		return -5;
+	}
+
+	offset = 0;
+	for (chunk = 0 ; offset < ta->size ; chunk++) {
+		end = (ta->size - offset > chunksize) ? telegram_boundary(ta->data, ta->size, offset + chunksize) : ta->size;
+		ta->chunks[chunk].start = offset;
+		ta->chunks[chunk].end = end;
+		offset = end;
+	}
+	ta->nchunks = chunk;
+
+	logmsg_to(ta->logger, LL_VERBOSE, "Mapped %lu bytes from %s, split into %lu chunks\n",
+		(unsigned long)ta->size, infile, (unsigned long)ta->nchunks);
+
+	return 0;
+}
+
+
+static int archive_add_record (telegram_archive *ta, telegram_archive_chunk *chunk, telegram_parser *obj, int result)
+{
+	// Copy the result of parsing a telegram to the record array of a chunk
+
+	telegram_archive_record *rec;
+	size_t maxrecords;
+
+	if (chunk->nrecords >= chunk->maxrecords) {
+		maxrecords = chunk->maxrecords ? chunk->maxrecords * 2 : 64;
+		rec = realloc(chunk->records, maxrecords * sizeof(telegram_archive_record));
+		if (rec == NULL) {
+			logmsg_to(ta->logger, LL_ERROR, "Could not allocate %lu records\n", (unsigned long)maxrecords);
+			return -1;
+		}
+		chunk->records = rec;
+		chunk->maxrecords = maxrecords;
+	}
+
+	rec = chunk->records + chunk->nrecords++;
+	rec->telegram = obj->telegram;
+	rec->offset = obj->telegram - ta->data;
+	rec->len = obj->len;
+	rec->status = obj->status;
+	rec->result = result;
+	memcpy(&(rec->data), obj->data, sizeof(struct dsmr_data_struct));
+
+	return 0;
+}
+
+
+static void archive_parse_chunk (telegram_archive *ta, telegram_archive_chunk *chunk, telegram_parser *obj)
+{
+	// Find and parse all telegrams in a chunk
+
+	int result;
+
+	telegram_framer_attach(&(obj->framer), ta->data + chunk->start, chunk->end - chunk->start);
+
+	while ((obj->len = telegram_framer_next(&(obj->framer), &(obj->telegram)))) {
+		memset(obj->data, 0, sizeof(struct dsmr_data_struct));
+		result = telegram_parser_parse(obj);
+		if (archive_add_record(ta, chunk, obj, result) < 0) {
+			break;
+		}
+	}
+
+	chunk->failed = obj->framer.failed;
+	if (obj->framer.telegram) {
+		chunk->failed += obj->framer.end - obj->framer.start;	// Incomplete telegram at the end of the capture
+	}
+}
+
+
+static void *archive_worker (void *arg)
+{
+	// Worker thread: take the next chunk, as long as it is within the window of chunks
+	// that may be parsed ahead of delivery, and parse it
+
+	telegram_archive *ta = arg;
+	telegram_parser obj;
+	size_t chunk;
+
+	memset(&obj, 0, sizeof(telegram_parser));
+	obj.fd = -1;
+	obj.mode = 'P';
+	obj.logger = ta->logger;
+	obj.framer.logger = ta->logger;
+	parser_init(&(obj.parser));
+	parser_set_logger(&(obj.parser), ta->logger);
+	obj.parser.meter_timezone = ta->meter_timezone;
+	obj.data = &(obj.parser.data);
+
+	for (;;) {
+		pthread_mutex_lock(&(ta->lock));
+		while (ta->next_chunk < ta->nchunks && ta->next_chunk >= ta->next_record + ta->window) {
+			pthread_cond_wait(&(ta->cond), &(ta->lock));
+		}
+		chunk = ta->next_chunk;
+		if (chunk < ta->nchunks) {
+			ta->next_chunk++;
+		}
+		pthread_mutex_unlock(&(ta->lock));
+
+		if (chunk >= ta->nchunks) {
+			break;
+		}
+
+		archive_parse_chunk(ta, ta->chunks + chunk, &obj);
+
+		pthread_mutex_lock(&(ta->lock));
+		ta->chunks[chunk].done = 1;
+		pthread_cond_broadcast(&(ta->cond));
+		pthread_mutex_unlock(&(ta->lock));
+	}
+
+	return NULL;
+}
+
+
+int telegram_archive_replay (telegram_archive *ta, int nthreads, telegram_archive_callback callback, void *userdata)
+{
+	// Parse all telegrams in the capture using nthreads workers (the number of online CPUs if zero),
+	// and deliver the records to the callback in order. Returns the number of telegrams.
+
+	pthread_t threads[ARCHIVE_MAXTHREADS];
+	telegram_archive_chunk *chunk;
+	size_t rec;
+	int thread, started = 0;
+
+	if (ta == NULL || ta->data == NULL) {
+		return -1;
+	}
+
+	if (nthreads <= 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (nthreads <= 0) {
+		nthreads = 1;
+	}
+	if (nthreads > ARCHIVE_MAXTHREADS) {
+		nthreads = ARCHIVE_MAXTHREADS;
+	}
+
+	ta->next_chunk = 0;
+	ta->next_record = 0;
+	ta->window = 4 * nthreads;		// Limits the memory used by records waiting for delivery
+	ta->telegrams = ta->errors = ta->failed = 0;
+	for (rec = 0 ; rec < ta->nchunks ; rec++) {
+		ta->chunks[rec].done = 0;
+	}
+	pthread_mutex_init(&(ta->lock), NULL);
+	pthread_cond_init(&(ta->cond), NULL);
+
+	for (thread = 0 ; thread < nthreads ; thread++) {
+		if (pthread_create(&(threads[thread]), NULL, archive_worker, ta)) {
+			logmsg_to(ta->logger, LL_ERROR, "Could not create worker thread %d\n", thread);
+			break;
+		}
+		started++;
+	}
+
+	if (started == 0) {
+		pthread_cond_destroy(&(ta->cond));
+		pthread_mutex_destroy(&(ta->lock));
+		return -2;
+	}
+
+	logmsg_to(ta->logger, LL_VERBOSE, "Replaying %lu chunks with %d worker threads\n", (unsigned long)ta->nchunks, started);
+
+	// Deliver the records of each chunk as soon as it and all chunks before it have been parsed
+
+	while (ta->next_record < ta->nchunks) {
+		chunk = ta->chunks + ta->next_record;
+
+		pthread_mutex_lock(&(ta->lock));
+		while (!chunk->done) {
+			pthread_cond_wait(&(ta->cond), &(ta->lock));
+		}
+		pthread_mutex_unlock(&(ta->lock));
+
+		for (rec = 0 ; rec < chunk->nrecords ; rec++) {
+			if (chunk->records[rec].result < 0 || chunk->records[rec].status != 1) {
+				ta->errors++;
+			}
+			if (callback) {
+				callback(chunk->records + rec, userdata);
+			}
+		}
+		ta->telegrams += chunk->nrecords;
+		ta->failed += chunk->failed;
+
+		free(chunk->records);
+		chunk->records = NULL;
+		chunk->nrecords = chunk->maxrecords = 0;
+
+		pthread_mutex_lock(&(ta->lock));
+		ta->next_record++;
+		pthread_cond_broadcast(&(ta->cond));
+		pthread_mutex_unlock(&(ta->lock));
+	}
+
+	for (thread = 0 ; thread < started ; thread++) {
+		pthread_join(threads[thread], NULL);
+	}
+
+	pthread_cond_destroy(&(ta->cond));
+	pthread_mutex_destroy(&(ta->lock));
+
+	return ta->telegrams;
+}
+
+
+void telegram_archive_close (telegram_archive *ta)
+{
+	size_t chunk;
+
+	if (ta == NULL) {
+		return;
+	}
+
+	if (ta->chunks) {
+		for (chunk = 0 ; chunk < ta->nchunks ; chunk++) {
+			free(ta->chunks[chunk].records);
+		}
+		free(ta->chunks);
+		ta->chunks = NULL;
+	}
+	ta->nchunks = 0;
+
+	if (ta->data) {
+		munmap((void *)ta->data, ta->size);
+		ta->data = NULL;
+	}
+
+	if (ta->fd >= 0) {
+		close(ta->fd);
+		ta->fd = -1;
+	}
+}
@@ -0,0 +1,81 @@
+/*
+   File: p1-archive.h
+
+   	  Replay of large P1 telegram captures: the capture is memory-mapped, split into chunks
+   	  at telegram boundaries and parsed by a pool of worker threads. Results are delivered
+   	  to a callback in the order of the telegrams in the capture.
+*/
+
+#ifndef P1_ARCHIVE_H
+
+#include <pthread.h>
+
+#include "p1-lib.h"
+
+
+#define ARCHIVE_CHUNKSIZE	(256 * 1024)	// Default chunk size, in bytes
+#define ARCHIVE_MAXTHREADS	256
+
+
+// Result of parsing a single telegram. Every record holds only the data found in its own
+// telegram, so results don't depend on how the capture was split into chunks.
+
+typedef struct telegram_archive_record_struct {
+
+	const uint8_t *telegram;	// Telegram, points into the memory-mapped capture
+	size_t offset;				// Offset of the telegram in the capture
+	size_t len;					// Telegram length
+	int status;					// Ragel parser status
+	int result;					// Return value of telegram_parser_parse()
+	struct dsmr_data_struct data;	// Parsed smart meter data
+
+} telegram_archive_record;
+
+
+// Callback used to deliver records, called from the thread running telegram_archive_replay()
+
+typedef void (*telegram_archive_callback) (const telegram_archive_record *rec, void *userdata);
+
+
+typedef struct telegram_archive_chunk_struct {
+
+	size_t start, end;				// Chunk boundaries, as offsets in the capture
+	telegram_archive_record *records;	// Records of the telegrams in this chunk, once parsed
+	size_t nrecords, maxrecords;	// Number of records used and allocated
+	size_t failed;					// Number of bytes in the chunk that were not part of a telegram
+	int done;						// Flag to indicate that the chunk has been parsed
+
+} telegram_archive_chunk;
+
+
+typedef struct telegram_archive_struct {
+
+	int fd;							// Capture file descriptor
+	const uint8_t *data;			// Memory-mapped capture
+	size_t size;					// Capture size, in bytes
+
+	size_t nchunks;					// Number of chunks
+	telegram_archive_chunk *chunks;	// Chunk array
+
+	size_t next_chunk;				// Next chunk to be handed to a worker
+	size_t next_record;				// Next chunk to be delivered to the callback
+	size_t window;					// Maximum number of chunks parsed ahead of delivery
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	char *meter_timezone;			// Meter timezone passed to the parsers (NULL for the default)
+	messagelogger *logger;			// Logger used by the archive and its workers
+
+	size_t telegrams;				// Number of telegrams delivered
+	size_t errors;					// Number of telegrams with parse or CRC errors
+	size_t failed;					// Number of bytes that were not part of a telegram
+
+} telegram_archive;
+
+
+int telegram_archive_open (telegram_archive *ta, char *infile, size_t chunksize);
+int telegram_archive_replay (telegram_archive *ta, int nthreads, telegram_archive_callback callback, void *userdata);
+void telegram_archive_close (telegram_archive *ta);
+
+#define P1_ARCHIVE_H	1
+#endif
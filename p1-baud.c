@@ -0,0 +1,240 @@
+/*
+   File: p1-baud.c
+
+   	  Baud rate detection and per-device rate cache for P1 ports, see p1-baud.h.
+*/
+
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "logmsg.h"
+
+#include "p1-baud.h"
+
+
+// Rates remembered per device, shared by all parser objects (which may be used from different threads)
+
+static struct {
+	char device[BAUD_DEVLEN];
+	speed_t speed;
+} baud_table[BAUD_DEVICES];
+
+static int baud_entries = 0, baud_next = 0;
+static char *baud_cache = NULL;
+static pthread_mutex_t baud_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void telegram_baud_init (telegram_baud_detect *det, const char *device)
+{
+	memset(det, 0, sizeof(telegram_baud_detect));
+	det->logger = &logger;
+	if (device)
+		strncpy(det->device, device, BAUD_DEVLEN - 1);
+}
+
+
+void telegram_baud_reset (telegram_baud_detect *det)
+{
+	// Start a new sample, e.g. after a telegram was found or the rate was switched
+
+	det->bytes = det->valid = det->nul = det->lines = det->since_line = 0;
+	det->last = 0;
+}
+
+
+int telegram_baud_classify (telegram_baud_detect *det, const unsigned char *data, size_t len, speed_t speed)
+{
+	// Classify a block of data received at the given rate. Returns BAUD_WRONG as soon as the data
+	// looks like it's received at the wrong rate, BAUD_GOOD once it looks like telegram text,
+	// and BAUD_UNKNOWN if more data is needed to tell.
+
+	unsigned char c;
+	size_t i;
+
+	for (i = 0 ; i < len ; i++) {
+		c = data[i];
+
+		if (c == 0) {
+			det->nul++;
+		} else if (c & 0x80) {
+			// At 9600 baud, the high bit is the parity bit of a 7E1 character (even parity,
+			// so every valid byte has an even number of bits set). At 115200 baud it's never set.
+			if (speed == B9600 && !(__builtin_popcount(c) & 1))
+				c &= 0x7f;
+		}
+
+		if ((c >= 0x20 && c <= 0x7e) || c == '\r' || c == '\n')
+			det->valid++;
+
+		if (det->last == '\r' && c == '\n') {
+			det->lines++;
+			det->since_line = 0;
+		} else {
+			det->since_line++;
+		}
+
+		det->last = c;
+		det->bytes++;
+	}
+
+	if (det->since_line >= BAUD_MAXLINE) {
+		return BAUD_WRONG;
+	}
+
+	if (det->bytes >= BAUD_MINSAMPLE && det->valid * 100 < det->bytes * BAUD_MINVALID) {
+		return BAUD_WRONG;
+	}
+
+	if (det->bytes < BAUD_SAMPLE) {
+		return BAUD_UNKNOWN;
+	}
+
+	if (det->valid * 100 < det->bytes * BAUD_VALID || det->nul * 8 > det->bytes) {
+		return BAUD_WRONG;
+	}
+
+	return det->lines ? BAUD_GOOD : BAUD_UNKNOWN;
+}
+
+
+static int baud_rate (speed_t speed)
+{
+	return (speed == B9600) ? 9600 : (speed == B115200) ? 115200 : 0;
+}
+
+
+static speed_t baud_speed (int rate)
+{
+	return (rate == 9600) ? B9600 : (rate == 115200) ? B115200 : 0;
+}
+
+
+static void baud_store (const char *device, speed_t speed)
+{
+	// Add or update a device in the table, the caller holds the lock
+
+	int i;
+
+	for (i = 0 ; i < baud_entries ; i++) {
+		if (!strcmp(baud_table[i].device, device)) {
+			baud_table[i].speed = speed;
+			return;
+		}
+	}
+
+	// Replace the oldest entry once the table is full
+
+	i = (baud_entries < BAUD_DEVICES) ? baud_entries++ : baud_next++ % BAUD_DEVICES;
+	strncpy(baud_table[i].device, device, BAUD_DEVLEN - 1);
+	baud_table[i].device[BAUD_DEVLEN - 1] = '\0';
+	baud_table[i].speed = speed;
+}
+
+
+int telegram_baud_set_cache (const char *filename, messagelogger *lg)
+{
+	// Keep remembered rates in a file, with a line "<device> <rate>" for every device, and load
+	// the rates already stored in it. Errors reading the file are logged to lg, later errors updating
+	// it to the logger of the detector. Returns the number of devices loaded, or a negative value on error.
+
+	char device[BAUD_DEVLEN];
+	int rate, count = 0;
+	FILE *f;
+
+	pthread_mutex_lock(&baud_lock);
+
+	free(baud_cache);
+	baud_cache = filename ? strdup(filename) : NULL;
+
+	if (filename && (f = fopen(filename, "r")) != NULL) {
+		while (fscanf(f, "%127s %d", device, &rate) == 2) {
+			if (baud_speed(rate)) {
+				baud_store(device, baud_speed(rate));
+				count++;
+			}
+		}
+		fclose(f);
+	} else if (filename && errno != ENOENT) {
+		logmsg_to(lg, LL_WARNING, "Could not read baud rate cache %s: %s\n", filename, strerror(errno));
+	}
+
+	pthread_mutex_unlock(&baud_lock);
+
+	return (filename && baud_cache == NULL) ? -1 : count;
+}
+
+
+speed_t telegram_baud_lookup (const char *device)
+{
+	// Return the last rate at which a device produced valid telegrams, or 0 if unknown
+
+	speed_t speed = 0;
+	int i;
+
+	if (device == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&baud_lock);
+	for (i = 0 ; i < baud_entries ; i++) {
+		if (!strcmp(baud_table[i].device, device)) {
+			speed = baud_table[i].speed;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&baud_lock);
+
+	return speed;
+}
+
+
+void telegram_baud_remember (telegram_baud_detect *det, speed_t speed)
+{
+	// Remember the rate at which a device produced a valid telegram. This is called for every
+	// telegram, but the table and cache file are only updated when the rate changes.
+
+	char tmpname[PATH_MAX];
+	FILE *f = NULL;
+	int fd, i;
+
+	if (speed == det->remembered || !det->device[0] || !baud_rate(speed)) {
+		return;
+	}
+	det->remembered = speed;
+
+	pthread_mutex_lock(&baud_lock);
+
+	baud_store(det->device, speed);
+
+	if (baud_cache) {
+		// Write to a unique temporary file, as other programs may be using the same cache
+
+		snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", baud_cache);
+		fd = mkstemp(tmpname);
+		if (fd >= 0 && (fchmod(fd, 0644) < 0 || (f = fdopen(fd, "w")) == NULL)) {
+			close(fd);
+			remove(tmpname);
+			fd = -1;
+		}
+		if (fd >= 0) {
+			for (i = 0 ; i < baud_entries ; i++)
+				fprintf(f, "%s %d\n", baud_table[i].device, baud_rate(baud_table[i].speed));
+			if (fclose(f) != 0 || rename(tmpname, baud_cache) < 0) {
+				logmsg_to(det->logger, LL_WARNING, "Could not update baud rate cache %s: %s\n", baud_cache, strerror(errno));
+				remove(tmpname);
+			}
+		} else {
+			logmsg_to(det->logger, LL_WARNING, "Could not update baud rate cache %s: %s\n", baud_cache, strerror(errno));
+		}
+	}
+
+	pthread_mutex_unlock(&baud_lock);
+
+	logmsg_to(det->logger, LL_VERBOSE, "%s sends telegrams at %d baud\n", det->device, baud_rate(speed));
+}
@@ -0,0 +1,64 @@
+/*
+   File: p1-baud.h
+
+   	  Baud rate detection for P1 ports. DSMR 4 and later meters send at 115200 baud (8N1), older
+   	  meters at 9600 baud (7E1). Rather than waiting for a read to time out without a telegram,
+   	  the bytes received at the current rate are classified as they come in: at the wrong rate, most
+   	  bytes are NULs (framing errors), have the high bit set without valid 7E1 parity, or are control
+   	  characters, and no "\r\n" line ends show up. The rate is switched as soon as a sample looks wrong,
+   	  which is usually within a single telegram.
+
+   	  The last rate at which a device produced valid telegrams is remembered, in memory and (if
+   	  set up with telegram_baud_set_cache()) in a cache file, so that reconnected devices and
+   	  restarted programs start at the right rate.
+*/
+
+#ifndef P1_BAUD_H
+
+#include <stdlib.h>
+#include <termios.h>
+
+#include "logmsg.h"
+
+
+#define BAUD_SAMPLE		128		// Number of bytes classified before deciding that the rate is wrong
+#define BAUD_VALID		85		// Minimum percentage of plausible bytes at the right rate
+#define BAUD_MINSAMPLE	32		// Number of bytes after which clearly invalid data (below BAUD_MINVALID) is rejected
+#define BAUD_MINVALID	50		// At 9600 baud, a 115200 baud telegram yields fewer than BAUD_SAMPLE bytes
+#define BAUD_MAXLINE	2200	// Maximum number of bytes without a line end at the right rate (long text messages)
+#define BAUD_DEVICES	64		// Number of devices of which the rate is remembered
+#define BAUD_DEVLEN		128		// Maximum device name length
+
+// Results of telegram_baud_classify()
+
+#define BAUD_UNKNOWN	0		// Not enough data yet
+#define BAUD_GOOD		1		// Data looks like telegram text
+#define BAUD_WRONG		-1		// Data looks like it's received at the wrong rate
+
+
+typedef struct telegram_baud_detect_struct {
+
+	size_t bytes;				// Number of bytes classified since the last reset
+	size_t valid;				// Number of bytes that are printable 7-bit characters, CR or LF
+	size_t nul;					// Number of NUL bytes, framing errors are received as NUL
+	size_t lines;				// Number of "\r\n" sequences
+	size_t since_line;			// Number of bytes since the last line end
+	unsigned char last;			// Last byte classified
+	int switched;				// Number of rate switches by the detector since the flag was last cleared
+	speed_t remembered;			// Rate last stored in the rate cache, 0 if none
+	char device[BAUD_DEVLEN];	// Device name, used as cache key
+	messagelogger *logger;		// Logger of the parser object using this detector
+
+} telegram_baud_detect;
+
+
+void telegram_baud_init (telegram_baud_detect *det, const char *device);
+void telegram_baud_reset (telegram_baud_detect *det);
+int telegram_baud_classify (telegram_baud_detect *det, const unsigned char *data, size_t len, speed_t speed);
+
+int telegram_baud_set_cache (const char *filename, messagelogger *lg);
+speed_t telegram_baud_lookup (const char *device);
+void telegram_baud_remember (telegram_baud_detect *det, speed_t speed);
+
+#define P1_BAUD_H	1
+#endif
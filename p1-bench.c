@@ -0,0 +1,524 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "logmsg.h"
+
+#include "p1-lib.h"
+#include "p1-gen.h"
+#include "dsmr-sink.h"
+
+
+// Benchmark the stages of telegram processing on synthetic telegrams of every supported
+// DSMR version, and report the time per telegram and the throughput of each stage.
+
+#define BENCH_TIME		0.5				// Minimum run time of every benchmark, in seconds
+#define BENCH_START		1490400000		// Start time of generated telegrams (around the start of summer time in 2017)
+#define BENCH_FRAMEBUF	65536			// Size of the framing buffer used for reading
+#define BENCH_READINGS	1000			// Number of parsed readings used for the output benchmarks
+
+static const int bench_versions[] = { GEN_DSMR22, GEN_DSMR30, GEN_DSMR40, GEN_DSMR50 };
+
+volatile unsigned long bench_sink;		// Keeps results from being optimised away
+
+
+typedef struct {
+	const uint8_t **telegrams;		// Telegrams, as found by the framer
+	size_t *lengths;
+	size_t count;
+	size_t bytes;
+	long long *timestamps;			// TST fields of every telegram timestamp (7 per telegram)
+	int64_t *times;					// UNIX time of every telegram
+	size_t ntimes;
+	struct dsmr_data_struct *readings;	// Parsed data of the first telegrams
+	size_t nreadings;
+} bench_data;
+
+
+static double bench_seconds (const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+static void bench_report (int version, const char *name, double telegrams, double bytes, double seconds)
+{
+	if (telegrams <= 0 || seconds <= 0) {
+		logmsg(LL_NORMAL, "DSMR %d.%d  %-16s no telegrams\n", version / 10, version % 10, name);
+		return;
+	}
+
+	logmsg(LL_NORMAL, "DSMR %d.%d  %-16s %10.0f ns/telegram %10.1f MB/s\n", version / 10, version % 10, name,
+		seconds * 1e9 / telegrams, bytes / seconds / 1e6);
+}
+
+
+static void bench_read_telegram (int version, int fd)
+{
+	// Read telegrams from a file one byte at a time, as read_telegram() does
+
+	uint8_t buf[BUFSIZE_TELEGRAM];
+	struct timespec start;
+	double seconds = 0, telegrams = 0, bytes = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (seconds < BENCH_TIME) {
+		lseek(fd, 0, SEEK_SET);
+		while (read_telegram(fd, buf, BUFSIZE_TELEGRAM, 0) > 0) {
+			telegrams++;
+			if (((unsigned long)telegrams & 63) == 0 && bench_seconds(&start) >= BENCH_TIME)
+				break;
+		}
+		bytes += lseek(fd, 0, SEEK_CUR);
+		seconds = bench_seconds(&start);
+	}
+
+	bench_report(version, "read_telegram", telegrams, bytes, seconds);
+}
+
+
+static void bench_framer_read (int version, int fd)
+{
+	// Read telegrams from a file with the buffered framer, as telegram_parser_read() does
+
+	telegram_framer framer;
+	const uint8_t *telegram;
+	struct timespec start;
+	double seconds = 0, telegrams = 0, bytes = 0;
+
+	if (telegram_framer_init(&framer, BENCH_FRAMEBUF) < 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (seconds < BENCH_TIME) {
+		lseek(fd, 0, SEEK_SET);
+		telegram_framer_reset(&framer);
+		while (telegram_framer_read(&framer, fd, &telegram, 0) > 0) {
+			bench_sink += framer.crc;
+			telegrams++;
+		}
+		bytes += lseek(fd, 0, SEEK_CUR);
+		seconds = bench_seconds(&start);
+	}
+
+	telegram_framer_free(&framer);
+	bench_report(version, "telegram_framer", telegrams, bytes, seconds);
+}
+
+
+static void bench_parser_execute (int version, const bench_data *bd)
+{
+	struct parser parser;
+	struct timespec start;
+	double seconds = 0, telegrams = 0, bytes = 0;
+	size_t i;
+
+	parser_init(&parser);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (seconds < BENCH_TIME) {
+		for (i = 0 ; i < bd->count ; i++) {
+			parser_reset(&parser);
+			parser_execute(&parser, (const char *)(bd->telegrams[i]), bd->lengths[i], 1);
+			bench_sink += parser_finish(&parser);
+		}
+		telegrams += bd->count;
+		bytes += bd->bytes;
+		seconds = bench_seconds(&start);
+	}
+
+	bench_report(version, "parser_execute", telegrams, bytes, seconds);
+}
+
+
+typedef struct {
+	uint32_t timestamp;
+	long long E_in[2], P_in, gas;		// Mantissas, enough for a benchmark
+} bench_fields;
+
+
+static void bench_field (struct parser *fsm, const parser_field *field, void *userdata)
+{
+	// Take the five fields a typical application needs, and ignore the rest
+
+	bench_fields *bf = userdata;
+
+	switch (field->code) {
+		case OBIS_CODE(0, 0, 1, 0, 0):
+			bf->timestamp = field->value;
+			break;
+		case OBIS_CODE(1, 0, 1, 8, 1):
+		case OBIS_CODE(1, 0, 1, 8, 2):
+			bf->E_in[field->index - 1] = field->value;
+			break;
+		case OBIS_CODE(1, 0, 1, 7, 0):
+			bf->P_in = field->value;
+			break;
+		case OBIS_CODE(0, 1, 24, 2, 1):
+		case OBIS_CODE(7, 0, 23, 1, 0):
+			bf->gas = field->value;
+			break;
+	}
+}
+
+
+static void bench_parser_fields (int version, const bench_data *bd)
+{
+	// Parse with a field callback only, without filling the data structures
+
+	struct parser parser;
+	bench_fields bf;
+	struct timespec start;
+	double seconds = 0, telegrams = 0, bytes = 0;
+	size_t i;
+
+	parser_init(&parser);
+	parser.output = 0;
+	parser_set_field_callback(&parser, bench_field, &bf);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (seconds < BENCH_TIME) {
+		for (i = 0 ; i < bd->count ; i++) {
+			parser_reset(&parser);
+			parser_execute(&parser, (const char *)(bd->telegrams[i]), bd->lengths[i], 1);
+			bench_sink += parser_finish(&parser) + bf.P_in;
+		}
+		telegrams += bd->count;
+		bytes += bd->bytes;
+		seconds = bench_seconds(&start);
+	}
+
+	bench_report(version, "parser_fields", telegrams, bytes, seconds);
+}
+
+
+static void bench_parser_fixed (int version, const bench_data *bd)
+{
+	// Parse into the fixed point structure only, after checking that its values convert
+	// back to exactly the doubles of the full data structure
+
+	struct parser parser;
+	struct dsmr_data_struct converted;
+	struct timespec start;
+	double seconds = 0, telegrams = 0, bytes = 0;
+	size_t i, errors = 0;
+
+	parser_init(&parser);
+	parser.output = PARSER_OUTPUT_DATA | PARSER_OUTPUT_FIXED;
+
+	for (i = 0 ; i < bd->count ; i++) {
+		parser_reset(&parser);
+		parser_execute(&parser, (const char *)(bd->telegrams[i]), bd->lengths[i], 1);
+		parser_finish(&parser);
+		dsmr_fixed_to_data(&(parser.fixed), parser.fixed_scale, &converted);
+		if (memcmp(converted.E_in, parser.data.E_in, sizeof(converted.E_in)) || converted.P_in_total != parser.data.P_in_total
+				|| memcmp(converted.V, parser.data.V, sizeof(converted.V)) || converted.dev_counter[0] != parser.data.dev_counter[0])
+			errors++;
+	}
+	if (errors)
+		logmsg(LL_ERROR, "parser_fixed: %lu of %lu telegrams differ from the full data structure\n", (unsigned long)errors, (unsigned long)bd->count);
+
+	parser.output = PARSER_OUTPUT_FIXED;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (seconds < BENCH_TIME) {
+		for (i = 0 ; i < bd->count ; i++) {
+			parser_reset(&parser);
+			parser_execute(&parser, (const char *)(bd->telegrams[i]), bd->lengths[i], 1);
+			bench_sink += parser_finish(&parser) + parser.fixed.P_in_total;
+		}
+		telegrams += bd->count;
+		bytes += bd->bytes;
+		seconds = bench_seconds(&start);
+	}
+
+	bench_report(version, "parser_fixed", telegrams, bytes, seconds);
+}
+
+
+static void bench_crc_telegram (int version, const bench_data *bd)
+{
+	struct timespec start;
+	double seconds = 0, telegrams = 0, bytes = 0;
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (seconds < BENCH_TIME) {
+		for (i = 0 ; i < bd->count ; i++) {
+			bench_sink += crc_telegram(bd->telegrams[i], bd->lengths[i]);
+		}
+		telegrams += bd->count;
+		bytes += bd->bytes;
+		seconds = bench_seconds(&start);
+	}
+
+	bench_report(version, "crc_telegram", telegrams, bytes, seconds);
+}
+
+
+static void bench_tst_to_time (int version, const bench_data *bd)
+{
+	// Convert one timestamp per telegram, throughput is given for the 13-byte TST strings
+
+	struct parser parser;
+	struct timespec start;
+	double seconds = 0, telegrams = 0;
+	size_t i, errors = 0;
+
+	parser_init(&parser);
+
+	for (i = 0 ; i < bd->ntimes ; i++) {
+		memcpy(parser.arg, bd->timestamps + i * 7, 7 * sizeof(long long));
+		if (TST_to_time(&parser, 0) != bd->times[i])
+			errors++;
+	}
+	if (errors)
+		logmsg(LL_ERROR, "TST_to_time: %lu of %lu timestamps converted incorrectly\n", (unsigned long)errors, (unsigned long)bd->ntimes);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (seconds < BENCH_TIME) {
+		for (i = 0 ; i < bd->ntimes ; i++) {
+			memcpy(parser.arg, bd->timestamps + i * 7, 7 * sizeof(long long));
+			bench_sink += TST_to_time(&parser, 0);
+		}
+		telegrams += bd->ntimes;
+		seconds = bench_seconds(&start);
+	}
+
+	bench_report(version, "TST_to_time", telegrams, telegrams * 13, seconds);
+}
+
+
+static void bench_sink_write (int version, const bench_data *bd, int format, const char *name)
+{
+	// Format readings and write them to /dev/null through a buffered sink.
+	// Throughput is given for the output, times per reading.
+
+	dsmr_sink sink;
+	struct timespec start;
+	double seconds = 0, telegrams = 0;
+	size_t i;
+	int fd = open("/dev/null", O_WRONLY);
+
+	if (dsmr_sink_attach(&sink, format, fd) < 0) {
+		close(fd);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (seconds < BENCH_TIME) {
+		for (i = 0 ; i < bd->nreadings ; i++) {
+			dsmr_sink_write(&sink, bd->readings + i);
+		}
+		telegrams += bd->nreadings;
+		seconds = bench_seconds(&start);
+	}
+	dsmr_sink_flush(&sink);
+
+	bench_report(version, name, telegrams, sink.bytes, seconds);
+	dsmr_sink_close(&sink);
+	close(fd);
+}
+
+
+static void bench_sink_printf (int version, const bench_data *bd)
+{
+	// Baseline for the sinks: the same CSV columns formatted with snprintf(), and one write() per reading
+
+	dsmr_sink sink;
+	const dsmr_store_column *col;
+	const uint8_t *field;
+	struct timespec start;
+	double seconds = 0, telegrams = 0, bytes = 0, d;
+	char line[SINK_CHUNKSIZE];
+	size_t i, len;
+	int c, fd = open("/dev/null", O_WRONLY);
+
+	if (dsmr_sink_attach(&sink, SINK_CSV, fd) < 0) {
+		close(fd);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (seconds < BENCH_TIME) {
+		for (i = 0 ; i < bd->nreadings ; i++) {
+			len = 0;
+			for (c = 0 ; c < dsmr_store_ncolumns ; c++) {
+				if (!sink.columns[c])
+					continue;
+				col = dsmr_store_columns + c;
+				field = (const uint8_t *)(bd->readings + i) + col->offset;
+				if (col->type == STORE_DOUBLE) {
+					memcpy(&d, field, sizeof(double));
+					len += snprintf(line + len, sizeof(line) - len, len ? ",%.3f" : "%.3f", d);
+				} else if (col->type == STORE_U32) {
+					len += snprintf(line + len, sizeof(line) - len, len ? ",%lu" : "%lu", (unsigned long)*(const uint32_t *)field);
+				} else if (col->type == STORE_U8) {
+					len += snprintf(line + len, sizeof(line) - len, len ? ",%u" : "%u", *field);
+				}
+			}
+			line[len++] = '\n';
+			if (write(fd, line, len) == len)
+				bytes += len;
+		}
+		telegrams += bd->nreadings;
+		seconds = bench_seconds(&start);
+	}
+
+	bench_report(version, "printf_csv", telegrams, bytes, seconds);
+	dsmr_sink_close(&sink);
+	close(fd);
+}
+
+
+static void bench_timestamps (telegram_generator *gen, bench_data *bd, size_t n)
+{
+	// Split the timestamps of the generated telegrams into TST fields, as the parser does
+
+	struct tm tm;
+	time_t local;
+	long offset;
+	size_t i;
+
+	for (i = 0 ; i < n ; i++) {
+		bd->times[i] = BENCH_START + (int64_t)i * gen->interval;
+		offset = meter_tz_offset(&(gen->tz), METER_TIMEZONE, bd->times[i]);
+		local = bd->times[i] + offset;
+		gmtime_r(&local, &tm);
+		bd->timestamps[i * 7] = tm.tm_year % 100;
+		bd->timestamps[i * 7 + 1] = tm.tm_mon + 1;
+		bd->timestamps[i * 7 + 2] = tm.tm_mday;
+		bd->timestamps[i * 7 + 3] = tm.tm_hour;
+		bd->timestamps[i * 7 + 4] = tm.tm_min;
+		bd->timestamps[i * 7 + 5] = tm.tm_sec;
+		bd->timestamps[i * 7 + 6] = (offset != gen->tz.std_offset) ? 'S' : 'W';
+	}
+	bd->ntimes = n;
+}
+
+
+int main (int argc, char **argv)
+{
+
+	init_msglogger();
+	logger.loglevel = LL_NORMAL;
+
+	size_t n = 10000, i, len, streamlen, crcerrors;
+	double error_rate = 0;
+	uint32_t seed = 1;
+	uint8_t *stream;
+	char tmpname[] = "/tmp/p1-bench-XXXXXX";
+	telegram_generator gen;
+	telegram_framer framer;
+	struct parser parser;
+	bench_data bd;
+	int v, version, fd, parse_errors;
+
+	if (argc >= 2 && argv[1][0] == '-') {
+		logmsg(LL_NORMAL, "Usage: %s [<telegrams per version> [<error rate> [<random seed>]]]\n", argv[0]);
+		exit(1);
+	}
+
+	if (argc >= 2)
+		n = atol(argv[1]);
+	if (argc >= 3)
+		error_rate = atof(argv[2]);
+	if (argc >= 4)
+		seed = atol(argv[3]);
+	if (n == 0)
+		n = 1;
+
+	stream = malloc(n * GEN_MAXLEN);
+	bd.telegrams = malloc(n * 2 * sizeof(uint8_t *));
+	bd.lengths = malloc(n * 2 * sizeof(size_t));
+	bd.timestamps = malloc(n * 7 * sizeof(long long));
+	bd.times = malloc(n * sizeof(int64_t));
+	bd.readings = malloc(BENCH_READINGS * sizeof(struct dsmr_data_struct));
+	if (stream == NULL || bd.telegrams == NULL || bd.lengths == NULL || bd.timestamps == NULL || bd.times == NULL || bd.readings == NULL) {
+		logmsg(LL_ERROR, "Could not allocate memory for %lu telegrams\n", (unsigned long)n);
+		exit(2);
+	}
+
+	parser_init(&parser);
+
+	for (v = 0 ; v < sizeof(bench_versions) / sizeof(bench_versions[0]) ; v++) {
+
+		version = bench_versions[v];
+
+		// Generate a stream of telegrams, and locate them with the framer as a reader would
+
+		telegram_generator_init(&gen, version, BENCH_START, seed);
+		gen.error_rate = error_rate;
+		streamlen = 0;
+		for (i = 0 ; i < n ; i++) {
+			streamlen += telegram_generator_next(&gen, stream + streamlen, GEN_MAXLEN);
+		}
+
+		telegram_framer_attach(&framer, stream, streamlen);
+		framer.logger = &logger;
+		bd.count = bd.bytes = bd.nreadings = 0;
+		crcerrors = 0;
+		parse_errors = 0;
+		while (bd.count < n * 2 && (len = telegram_framer_next(&framer, bd.telegrams + bd.count)) > 0) {
+			if (framer.crc && framer.crc != strtoul((const char *)(bd.telegrams[bd.count] + len - 6), NULL, 16))
+				crcerrors++;
+			parser_reset(&parser);
+			parser_execute(&parser, (const char *)(bd.telegrams[bd.count]), len, 1);
+			parser_finish(&parser);
+			if (parser.parse_errors)
+				parse_errors++;
+			else if (bd.nreadings < BENCH_READINGS)
+				bd.readings[bd.nreadings++] = parser.data;
+			bd.lengths[bd.count++] = len;
+			bd.bytes += len;
+		}
+
+		logmsg(LL_NORMAL, "DSMR %d.%d: %lu telegrams, %lu bytes, damaged: %lu byte, %lu truncated, %lu garbage, %lu CRC\n",
+			version / 10, version % 10, (unsigned long)n, (unsigned long)streamlen,
+			(unsigned long)gen.errors[GEN_ERR_BYTE], (unsigned long)gen.errors[GEN_ERR_TRUNCATE],
+			(unsigned long)gen.errors[GEN_ERR_GARBAGE], (unsigned long)gen.errors[GEN_ERR_CRC]);
+		logmsg(LL_NORMAL, "DSMR %d.%d: %lu telegrams found, %lu bytes skipped, %lu CRC errors, %d with parse errors\n",
+			version / 10, version % 10, (unsigned long)bd.count, (unsigned long)framer.failed, (unsigned long)crcerrors, parse_errors);
+
+		bench_timestamps(&gen, &bd, n);
+
+		// Write the stream to a temporary file, for the benchmarks that read from a file
+
+		fd = mkstemp(tmpname);
+		if (fd < 0 || write(fd, stream, streamlen) != (ssize_t)streamlen) {
+			logmsg(LL_ERROR, "Could not write temporary file %s\n", tmpname);
+			exit(3);
+		}
+		unlink(tmpname);
+		strcpy(tmpname, "/tmp/p1-bench-XXXXXX");
+
+		bench_read_telegram(version, fd);
+		bench_framer_read(version, fd);
+		bench_parser_execute(version, &bd);
+		bench_parser_fields(version, &bd);
+		bench_parser_fixed(version, &bd);
+		bench_crc_telegram(version, &bd);
+		bench_tst_to_time(version, &bd);
+		bench_sink_printf(version, &bd);
+		bench_sink_write(version, &bd, SINK_CSV, "sink_csv");
+		bench_sink_write(version, &bd, SINK_JSON, "sink_json");
+		bench_sink_write(version, &bd, SINK_INFLUX, "sink_influx");
+
+		close(fd);
+	}
+
+	free(stream);
+	free(bd.telegrams);
+	free(bd.lengths);
+	free(bd.timestamps);
+	free(bd.times);
+	free(bd.readings);
+
+	return 0;
+}
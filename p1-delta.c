@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "logmsg.h"
+
+#include "p1-archive.h"
+#include "dsmr-delta.h"
+
+
+// Replay a telegram capture, and emit only the fields that changed between readings,
+// with a keyframe of all fields at regular intervals. Reports the reduction in output,
+// compared to emitting all fields for every reading.
+
+
+#define DELTA_LINELEN	(LEN_MESSAGE * 4 + 16384)	// Enough for a keyframe with an escaped text message
+
+
+typedef struct {
+	dsmr_delta delta, full;			// Change detection, and a reference that emits every field
+	FILE *out;
+	char *line;
+	uint64_t bytes, fullbytes;
+} delta_output;
+
+
+void telegram_delta (const telegram_archive_record *rec, void *userdata)
+{
+	delta_output *dout = userdata;
+	size_t len;
+
+	if (rec->result < 0)
+		return;		// Skip telegrams with CRC errors
+
+	dsmr_delta_update(&(dout->delta), &(rec->data));
+	len = dsmr_delta_format(&(dout->delta), &(rec->data), dout->line, DELTA_LINELEN);
+	dout->bytes += len;
+	if (dout->out && len)
+		fwrite(dout->line, 1, len, dout->out);
+
+	dsmr_delta_update(&(dout->full), &(rec->data));
+	dout->fullbytes += dsmr_delta_format(&(dout->full), &(rec->data), dout->line, DELTA_LINELEN);
+}
+
+
+int main (int argc, char **argv)
+{
+
+	init_msglogger();
+	logger.loglevel = LL_NORMAL;
+
+	telegram_archive archive;
+	delta_output dout;
+	unsigned int keyframe = DELTA_KEYFRAME;
+	double dP = 0, dV = 0, dI = 0;
+
+	if (argc < 2) {
+		logmsg(LL_NORMAL, "Usage: %s <capture file> [<output file or -> [<keyframe interval> [<deadband P in kW> [<deadband V> [<deadband I>]]]]]\n", argv[0]);
+		exit(1);
+	}
+
+	memset(&dout, 0, sizeof(dout));
+	if (argc >= 3)
+		dout.out = strcmp(argv[2], "-") ? fopen(argv[2], "w") : stdout;
+	if (argc >= 4)
+		keyframe = atoi(argv[3]);
+	if (argc >= 5)
+		dP = atof(argv[4]);
+	if (argc >= 6)
+		dV = atof(argv[5]);
+	if (argc >= 7)
+		dI = atof(argv[6]);
+
+	if (argc >= 3 && dout.out == NULL) {
+		logmsg(LL_ERROR, "Could not open output file %s\n", argv[2]);
+		exit(2);
+	}
+
+	dout.line = malloc(DELTA_LINELEN);
+	if (dout.line == NULL || dsmr_delta_init(&(dout.delta), keyframe) < 0 || dsmr_delta_init(&(dout.full), 1) < 0) {
+		exit(3);
+	}
+	dsmr_delta_set_deadband(&(dout.delta), dP, dV, dI);
+
+	if (telegram_archive_open(&archive, argv[1], 0) < 0) {
+		exit(4);
+	}
+
+	telegram_archive_replay(&archive, 0, telegram_delta, &dout);
+
+	logmsg(LL_NORMAL, "%lu readings, %lu of %lu fields emitted (%.1f per reading), %lu of %lu bytes (%.1fx less)\n",
+		(unsigned long)dout.delta.readings, (unsigned long)dout.delta.fields, (unsigned long)dout.full.fields,
+		dout.delta.readings ? (double)dout.delta.fields / dout.delta.readings : 0.0,
+		(unsigned long)dout.bytes, (unsigned long)dout.fullbytes, dout.bytes ? (double)dout.fullbytes / dout.bytes : 0.0);
+
+	telegram_archive_close(&archive);
+	dsmr_delta_free(&(dout.delta));
+	dsmr_delta_free(&(dout.full));
+	free(dout.line);
+	if (dout.out && dout.out != stdout)
+		fclose(dout.out);
+
+	return 0;
+}
@@ -0,0 +1,465 @@
+/*
+   File: p1-dump.c
+
+   	  Asynchronous, rate-limited and rotating capture of bad telegrams, see p1-dump.h.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "logmsg.h"
+
+#include "p1-dump.h"
+
+
+extern char **environ;
+
+
+// Ring buffer of telegrams waiting to be written. This is the same bounded multi-producer queue
+// as used for asynchronous logging (see logmsg.c): a producer claims a position by advancing the
+// head, fills the slot and publishes it by updating its sequence number, and wakes up the
+// background thread if it's waiting for telegrams.
+
+struct telegram_dump_slot {
+	atomic_size_t seq;
+	struct timespec arrival;	// Real time at which the telegram was dumped
+	int errors;
+	int crc;
+	unsigned long suppressed;	// Number of telegrams of this meter suppressed before this one
+	size_t len;					// Original telegram length
+	char meter_id[24];
+	uint8_t data[DUMP_SLOTSIZE];
+};
+
+struct telegram_dump_ring {
+	struct telegram_dump_slot slots[DUMP_SLOTS];
+	atomic_size_t head;			// Next position to be claimed by a producer
+	size_t tail;				// Next position to be written by the background thread
+	atomic_ulong dropped;		// Number of telegrams dropped because the ring was full
+	atomic_ulong suppressed;	// Number of telegrams suppressed by rate limits
+	unsigned long dumped;		// Number of telegrams written
+	atomic_int running;
+	atomic_int sleeping;		// Set while the background thread waits for telegrams
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	int initialized;			// Set once lock and wakeup are initialized
+	pthread_t thread;
+};
+
+
+static int telegram_dump_reopen (telegram_dump *dump, int truncate)
+{
+	struct stat st;
+
+	if (dump->fd >= 0) {
+		close(dump->fd);
+	}
+
+	dump->fd = open(dump->filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+	if (dump->fd < 0) {
+		logmsg_to(dump->logger, LL_ERROR, "Could not open output file %s: %s\n", dump->filename, strerror(errno));
+		return -1;
+	}
+
+	dump->size = (fstat(dump->fd, &st) == 0) ? st.st_size : 0;
+
+	return 0;
+}
+
+
+static void telegram_dump_reap (telegram_dump *dump, int options)
+{
+	// Collect the compressor of the last rotated file, if it has finished, and check its result
+
+	char name[PATH_MAX];
+	int status;
+	pid_t pid;
+
+	if (dump->compressor <= 0) {
+		return;
+	}
+
+	pid = waitpid(dump->compressor, &status, options);
+	if (pid == 0) {
+		return;		// Still running
+	}
+	dump->compressor = 0;
+
+	if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		snprintf(name, sizeof(name), "%s.1", dump->filename);
+		logmsg_to(dump->logger, LL_WARNING, "%s failed to compress %s, keeping it uncompressed\n", DUMP_COMPRESS, name);
+	}
+}
+
+
+static void telegram_dump_rotate (telegram_dump *dump)
+{
+	// Rename file.N-1 to file.N, ..., file to file.1, start compressing file.1 and open a new file
+
+	char from[PATH_MAX], to[PATH_MAX], *argv[4];
+	const char *suffix = dump->compress ? DUMP_COMPRESS_SUFFIX : "";
+	int i;
+
+	if (dump->keep <= 0) {
+		telegram_dump_reopen(dump, 1);
+		return;
+	}
+
+	// A rotated file may still be being compressed, and the compressor replaces it once done
+
+	telegram_dump_reap(dump, 0);
+
+	// If compressing a file failed (or the compressor couldn't be started), it's still there
+	// uncompressed, so shift those along as well rather than renaming the dump file onto them
+
+	for (i = dump->keep - 1 ; i >= 1 ; i--) {
+		snprintf(from, sizeof(from), "%s.%d%s", dump->filename, i, suffix);
+		snprintf(to, sizeof(to), "%s.%d%s", dump->filename, i + 1, suffix);
+		rename(from, to);		// Fails if there's no such file yet, which is fine
+		if (dump->compress) {
+			snprintf(from, sizeof(from), "%s.%d", dump->filename, i);
+			snprintf(to, sizeof(to), "%s.%d", dump->filename, i + 1);
+			rename(from, to);
+		}
+	}
+
+	snprintf(to, sizeof(to), "%s.1", dump->filename);
+	if (rename(dump->filename, to) < 0) {
+		logmsg_to(dump->logger, LL_ERROR, "Could not rotate %s: %s\n", dump->filename, strerror(errno));
+	} else if (dump->compress) {
+		argv[0] = DUMP_COMPRESS;
+		argv[1] = "-f";
+		argv[2] = to;
+		argv[3] = NULL;
+		if (posix_spawnp(&(dump->compressor), DUMP_COMPRESS, NULL, NULL, argv, environ)) {
+			logmsg_to(dump->logger, LL_WARNING, "Could not start %s to compress %s, keeping it uncompressed\n", DUMP_COMPRESS, to);
+			dump->compressor = 0;
+		}
+	}
+
+	telegram_dump_reopen(dump, 0);
+}
+
+
+static void telegram_dump_record (telegram_dump *dump, const struct telegram_dump_slot *slot)
+{
+	// Write a record header and telegram
+
+	static const char *crc_state[] = { "none", "ok", "mismatch" };
+	struct iovec iov[3];
+	char header[192];
+	size_t len = (slot->len < DUMP_SLOTSIZE) ? slot->len : DUMP_SLOTSIZE;
+	int n;
+
+	n = snprintf(header, sizeof(header), "# %lu.%03ld errors %d crc %s meter %s length %lu%s suppressed %lu\r\n",
+				(unsigned long)(slot->arrival.tv_sec), slot->arrival.tv_nsec / 1000000, slot->errors,
+				crc_state[slot->crc], slot->meter_id[0] ? slot->meter_id : "unknown", (unsigned long)(slot->len),
+				(slot->len > len) ? " truncated" : "", slot->suppressed);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = n;
+	iov[1].iov_base = (void *)(slot->data);
+	iov[1].iov_len = len;
+	iov[2].iov_base = "\r\n";		// Keep the next header on a line of its own, even after a partial telegram
+	iov[2].iov_len = (len >= 1 && slot->data[len - 1] == '\n') ? 0 : 2;
+
+	if (dump->max_size && dump->size > 0 && dump->size + (off_t)(n + len + 2) > dump->max_size) {
+		telegram_dump_rotate(dump);
+	}
+
+	if (dump->fd < 0 || writev(dump->fd, iov, 3) < 0) {
+		if (!dump->failed) {
+			logmsg_to(dump->logger, LL_ERROR, "Could not write telegram to %s: %s\n", dump->filename, dump->fd < 0 ? "not open" : strerror(errno));
+			dump->failed = 1;
+		}
+		return;
+	}
+
+	dump->size += n + len + iov[2].iov_len;
+	dump->ring->dumped++;
+}
+
+
+static int telegram_dump_flush (telegram_dump *dump)
+{
+	// Write all published telegrams, returns the number of telegrams written
+
+	struct telegram_dump_ring *ring = dump->ring;
+	struct telegram_dump_slot *slot;
+	unsigned long dropped;
+	int count = 0;
+
+	for (;;) {
+		slot = ring->slots + (ring->tail % DUMP_SLOTS);
+		if (atomic_load_explicit(&(slot->seq), memory_order_acquire) != ring->tail + 1) {
+			break;
+		}
+
+		telegram_dump_record(dump, slot);
+
+		atomic_store_explicit(&(slot->seq), ring->tail + DUMP_SLOTS, memory_order_release);
+		ring->tail++;
+		count++;
+	}
+
+	dropped = atomic_exchange(&(ring->dropped), 0);
+	if (dropped) {
+		logmsg_to(dump->logger, LL_WARNING, "%lu bad telegrams not written to %s, the dump buffer was full\n", dropped, dump->filename);
+	}
+
+	telegram_dump_reap(dump, WNOHANG);
+
+	return count;
+}
+
+
+static void telegram_dump_wait (telegram_dump *dump)
+{
+	// Wait until a telegram is published or the dump is closed, see logmsg_ring_wait().
+	// While a rotated file is being compressed, wake up every second to collect the compressor.
+
+	struct telegram_dump_ring *ring = dump->ring;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&(ring->lock));
+	atomic_store(&(ring->sleeping), 1);
+	if (atomic_load(&(ring->running)) && atomic_load(&(ring->slots[ring->tail % DUMP_SLOTS].seq)) != ring->tail + 1) {
+		if (dump->compressor > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += 1;
+			pthread_cond_timedwait(&(ring->wakeup), &(ring->lock), &deadline);
+		} else {
+			pthread_cond_wait(&(ring->wakeup), &(ring->lock));
+		}
+	}
+	atomic_store(&(ring->sleeping), 0);
+	pthread_mutex_unlock(&(ring->lock));
+}
+
+
+static void *telegram_dump_thread (void *arg)
+{
+	// Background thread: write telegrams, and wait whenever the ring is empty
+
+	telegram_dump *dump = arg;
+
+	while (atomic_load(&(dump->ring->running))) {
+		if (telegram_dump_flush(dump) == 0) {
+			telegram_dump_wait(dump);
+		}
+	}
+
+	telegram_dump_flush(dump);
+
+	return NULL;
+}
+
+
+int telegram_dump_open (telegram_dump *dump, const char *filename, off_t max_size, int keep, int compress)
+{
+	// Open (or create) a dump file and start its background thread. The file is rotated once
+	// it would exceed max_size bytes, and keep rotated files are kept (compressed, if compress is set).
+
+	pthread_condattr_t attr;
+	size_t i;
+
+	if (dump == NULL || filename == NULL) {
+		return -1;
+	}
+
+	memset(dump, 0, sizeof(telegram_dump));
+	dump->fd = -1;
+	dump->max_size = max_size;
+	dump->keep = keep;
+	dump->compress = compress;
+	dump->burst = DUMP_BURST;
+	dump->interval = DUMP_INTERVAL;
+	dump->logger = &logger;
+
+	dump->filename = strdup(filename);
+	dump->ring = calloc(1, sizeof(struct telegram_dump_ring));
+	if (dump->filename == NULL || dump->ring == NULL) {
+		logmsg_to(dump->logger, LL_ERROR, "Could not allocate dump buffer for %s\n", filename);
+		telegram_dump_close(dump);
+		return -2;
+	}
+
+	if (telegram_dump_reopen(dump, 0) < 0) {
+		telegram_dump_close(dump);
+		return -3;
+	}
+
+	for (i = 0 ; i < DUMP_SLOTS ; i++) {
+		atomic_init(&(dump->ring->slots[i].seq), i);
+	}
+	atomic_init(&(dump->ring->head), 0);
+	atomic_init(&(dump->ring->dropped), 0);
+	atomic_init(&(dump->ring->suppressed), 0);
+	atomic_init(&(dump->ring->running), 1);
+	atomic_init(&(dump->ring->sleeping), 0);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&(dump->ring->wakeup), &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&(dump->ring->lock), NULL);
+	dump->ring->initialized = 1;
+
+	if (pthread_create(&(dump->ring->thread), NULL, telegram_dump_thread, dump)) {
+		logmsg_to(dump->logger, LL_ERROR, "Could not start dump thread for %s\n", filename);
+		atomic_store(&(dump->ring->running), 0);
+		telegram_dump_close(dump);
+		return -4;
+	}
+
+	return 0;
+}
+
+
+static int telegram_dump_allow (const telegram_dump *dump, telegram_dump_limit *limit)
+{
+	// Token bucket: a meter can dump burst telegrams at once, and one more every interval seconds
+
+	struct timespec now;
+
+	if (limit == NULL || dump->interval == 0) {
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (limit->last.tv_sec == 0 && limit->last.tv_nsec == 0) {
+		limit->tokens = dump->burst;
+	} else {
+		limit->tokens += ((now.tv_sec - limit->last.tv_sec) + (now.tv_nsec - limit->last.tv_nsec) / 1e9) / dump->interval;
+		if (limit->tokens > dump->burst)
+			limit->tokens = dump->burst;
+	}
+	limit->last = now;
+
+	if (limit->tokens < 1) {
+		return 0;
+	}
+
+	limit->tokens -= 1;
+	return 1;
+}
+
+
+int telegram_dump_write (telegram_dump *dump, telegram_dump_limit *limit, const uint8_t *telegram, size_t len,
+							int errors, int crc, const char *meter_id)
+{
+	// Queue a telegram for writing, limit is the rate limit state of the meter (NULL for no limit).
+	// Never blocks: returns 0 if the telegram was queued, 1 if it was suppressed by the rate limit,
+	// or a negative value if it was dropped.
+
+	struct telegram_dump_ring *ring;
+	struct telegram_dump_slot *slot;
+	size_t pos, seq, i, n;
+
+	if (dump == NULL || dump->ring == NULL || telegram == NULL) {
+		return -1;
+	}
+	ring = dump->ring;
+
+	if (!telegram_dump_allow(dump, limit)) {
+		limit->suppressed++;
+		atomic_fetch_add_explicit(&(ring->suppressed), 1, memory_order_relaxed);
+		return 1;
+	}
+
+	pos = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+	for (;;) {
+		slot = ring->slots + (pos % DUMP_SLOTS);
+		seq = atomic_load_explicit(&(slot->seq), memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak_explicit(&(ring->head), &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if ((ssize_t)(seq - pos) < 0) {
+			atomic_fetch_add_explicit(&(ring->dropped), 1, memory_order_relaxed);
+			return -2;
+		} else {
+			pos = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &(slot->arrival));
+	slot->errors = errors;
+	slot->crc = (crc >= DUMP_CRC_NONE && crc <= DUMP_CRC_MISMATCH) ? crc : DUMP_CRC_NONE;
+	slot->suppressed = limit ? limit->suppressed : 0;
+	slot->len = len;
+	memcpy(slot->data, telegram, (len < DUMP_SLOTSIZE) ? len : DUMP_SLOTSIZE);
+
+	// The meter ID comes from a telegram with errors, only keep characters that are safe in the header
+
+	for (i = n = 0 ; meter_id && meter_id[i] && n < sizeof(slot->meter_id) - 1 ; i++) {
+		if (isalnum((unsigned char)(meter_id[i])))
+			slot->meter_id[n++] = meter_id[i];
+	}
+	slot->meter_id[n] = '\0';
+
+	if (limit)
+		limit->suppressed = 0;
+
+	atomic_store(&(slot->seq), pos + 1);		// Sequentially consistent, see telegram_dump_wait()
+	if (atomic_load(&(ring->sleeping))) {
+		pthread_mutex_lock(&(ring->lock));
+		pthread_cond_signal(&(ring->wakeup));
+		pthread_mutex_unlock(&(ring->lock));
+	}
+
+	return 0;
+}
+
+
+void telegram_dump_close (telegram_dump *dump)
+{
+	// Write all queued telegrams, wait for a running compression and close the dump file.
+	// No other threads should write to the dump while it is being closed.
+
+	if (dump == NULL) {
+		return;
+	}
+
+	if (dump->ring) {
+		if (atomic_load(&(dump->ring->running))) {
+			atomic_store(&(dump->ring->running), 0);
+			pthread_mutex_lock(&(dump->ring->lock));
+			pthread_cond_signal(&(dump->ring->wakeup));
+			pthread_mutex_unlock(&(dump->ring->lock));
+			pthread_join(dump->ring->thread, NULL);
+			logmsg_to(dump->logger, LL_VERBOSE, "%lu bad telegrams written to %s, %lu suppressed by rate limits\n",
+						dump->ring->dumped, dump->filename, (unsigned long)atomic_load(&(dump->ring->suppressed)));
+		}
+		if (dump->ring->initialized) {
+			pthread_cond_destroy(&(dump->ring->wakeup));
+			pthread_mutex_destroy(&(dump->ring->lock));
+		}
+		free(dump->ring);
+		dump->ring = NULL;
+	}
+
+	telegram_dump_reap(dump, 0);
+
+	if (dump->fd >= 0) {
+		close(dump->fd);
+		dump->fd = -1;
+	}
+
+	free(dump->filename);
+	dump->filename = NULL;
+}
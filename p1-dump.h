@@ -0,0 +1,82 @@
+/*
+   File: p1-dump.h
+
+   	  Capture of telegrams with parse errors or CRC mismatches, for later diagnosis.
+
+   	  Telegrams are copied by the reading thread into a lock-free ring buffer, and appended to the
+   	  dump file by a background thread, so a flapping serial line never blocks reading on disk I/O.
+   	  Every telegram is preceded by a header line starting with '#' (arrival time, number of parse
+   	  errors, CRC state, meter ID and length). The header contains no '/', so dump files can still be
+   	  fed to the parser, which skips the header lines as garbage between telegrams.
+
+   	  The dump file is rotated once it reaches a maximum size, and rotated files can be compressed
+   	  in the background. The number of telegrams dumped per meter is limited with a token bucket.
+*/
+
+#ifndef P1_DUMP_H
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "logmsg.h"
+
+
+#define DUMP_SLOTS			16					// Number of telegrams in the ring buffer
+#define DUMP_SLOTSIZE		4096				// Maximum telegram size, longer telegrams are truncated
+#define DUMP_MAXSIZE		(16 * 1024 * 1024)	// Default size at which the dump file is rotated
+#define DUMP_KEEP			4					// Default number of rotated files kept (file.1 ... file.N)
+#define DUMP_BURST			10					// Default number of telegrams a meter can dump in a burst
+#define DUMP_INTERVAL		60					// Default interval at which a meter can dump another telegram, in seconds
+#define DUMP_COMPRESS		"gzip"				// Program used to compress rotated files
+#define DUMP_COMPRESS_SUFFIX	".gz"
+
+// CRC state reported in the record header
+
+#define DUMP_CRC_NONE		0		// Telegram has no CRC (DSMR 2/3), or no CRC was found
+#define DUMP_CRC_OK			1
+#define DUMP_CRC_MISMATCH	2
+
+
+// Rate limit state, kept per meter (i.e. per parser object) by the caller
+
+typedef struct telegram_dump_limit_struct {
+
+	double tokens;				// Number of telegrams that can be dumped right now
+	struct timespec last;		// Monotonic time of the last update, 0 if never used
+	unsigned long suppressed;	// Number of telegrams suppressed since the last one dumped
+
+} telegram_dump_limit;
+
+
+struct telegram_dump_ring;
+
+typedef struct telegram_dump_struct {
+
+	char *filename;
+	int fd;						// Dump file, opened with O_APPEND
+	off_t size;					// Current size of the dump file
+	off_t max_size;				// Rotate once the file would exceed this size, 0 to never rotate
+	int keep;					// Number of rotated files, 0 to truncate the file instead
+	int compress;				// Flag to compress rotated files with DUMP_COMPRESS
+	pid_t compressor;			// Running compression process, 0 if none
+
+	unsigned int burst;			// Rate limit: number of telegrams per meter in a burst
+	unsigned int interval;		// Rate limit: seconds per telegram after a burst, 0 for no limit
+
+	struct telegram_dump_ring *ring;	// Ring buffer and background thread, also holds the statistics
+	int failed;					// Flag to indicate that a write error has been reported
+
+	messagelogger *logger;
+
+} telegram_dump;
+
+
+int telegram_dump_open (telegram_dump *dump, const char *filename, off_t max_size, int keep, int compress);
+int telegram_dump_write (telegram_dump *dump, telegram_dump_limit *limit, const uint8_t *telegram, size_t len,
+							int errors, int crc, const char *meter_id);
+void telegram_dump_close (telegram_dump *dump);
+
+#define P1_DUMP_H	1
+#endif
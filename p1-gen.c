@@ -0,0 +1,336 @@
+/*
+   File: p1-gen.c
+
+   	  Generator for synthetic P1 telegrams, used for benchmarks and tests.
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "crc16.h"
+#include "p1-parser.h"
+#include "p1-gen.h"
+
+
+static uint32_t gen_random (telegram_generator *gen)
+{
+	// Xorshift random number generator, so that telegram series can be reproduced from the seed
+
+	uint32_t x = gen->rng;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return gen->rng = x;
+}
+
+
+static double gen_uniform (telegram_generator *gen)
+{
+	// Random number in [0, 1)
+
+	return (gen_random(gen) >> 8) / 16777216.0;
+}
+
+
+void telegram_generator_init (telegram_generator *gen, int version, int64_t start, uint32_t seed)
+{
+	// Set up a generator for telegrams of a given DSMR version, starting at a given UNIX time
+
+	memset(gen, 0, sizeof(telegram_generator));
+
+	gen->version = version;
+	gen->interval = (version >= GEN_DSMR50) ? 1 : 10;
+	gen->time = start;
+	gen->rng = seed ? seed : 1;
+
+	gen->E_in[0] = 12345678;
+	gen->E_in[1] = 23456789;
+	gen->E_out[0] = 1234567;
+	gen->E_out[1] = 2345678;
+	gen->V[0] = gen->V[1] = gen->V[2] = 230;
+	gen->gas = 12785123;
+	gen->gas_time = start - start % 300;
+
+	meter_tz_init(&(gen->tz));
+	meter_tz_set(&(gen->tz), METER_TIMEZONE);
+}
+
+
+static void gen_update (telegram_generator *gen)
+{
+	// Advance the meter readings by one interval
+
+	struct tm tm;
+	time_t local;
+	double hour, solar, load, net;
+	int phase, tariff;
+
+	local = gen->time + meter_tz_offset(&(gen->tz), METER_TIMEZONE, gen->time);
+	gmtime_r(&local, &tm);
+	hour = tm.tm_hour + tm.tm_min / 60.0;
+	tariff = (tm.tm_wday > 0 && tm.tm_wday < 6 && tm.tm_hour >= 7 && tm.tm_hour < 23) ? 1 : 0;	// Low tariff at night and in weekends
+	gen->tariff = tariff + 1;
+
+	// Base load with noise and occasional appliances, solar panels produce during the day
+
+	load = 250 + 100 * gen_uniform(gen);
+	if (gen_uniform(gen) < 0.1)
+		load += 2000 * gen_uniform(gen);
+	solar = (hour > 7 && hour < 19) ? 2500 * sin((hour - 7) * M_PI / 12) * (0.7 + 0.3 * gen_uniform(gen)) : 0;
+	net = load - solar;
+
+	gen->P_in = net > 0 ? net : 0;
+	gen->P_out = net < 0 ? -net : 0;
+	gen->E_in[tariff] += gen->P_in * gen->interval / 3600;
+	gen->E_out[tariff] += gen->P_out * gen->interval / 3600;
+
+	for (phase = 0 ; phase < 3 ; phase++) {
+		gen->V[phase] += gen_uniform(gen) - 0.5 + (230 - gen->V[phase]) * 0.05;
+		gen->I[phase] = (phase == 0 ? net * 0.6 : net * 0.2) / gen->V[phase];
+	}
+
+	// Gas is used in bursts, the meter is read every 5 minutes (DSMR 5.0) or every hour
+
+	if (gen_uniform(gen) < 0.2)
+		gen->gas += 20 * gen_uniform(gen);
+	if (gen->time - gen->gas_time >= (gen->version >= GEN_DSMR50 ? 300 : 3600))
+		gen->gas_time = gen->time - gen->time % (gen->version >= GEN_DSMR50 ? 300 : 3600);
+
+	if (gen_uniform(gen) < 1e-4) {
+		gen->pfail++;
+		if (gen_uniform(gen) < 0.3)
+			gen->pfail_long++;
+	}
+}
+
+
+static char *gen_tst (telegram_generator *gen, char *str, int64_t time, int dstflag)
+{
+	// Format a timestamp in meter time as YYMMDDhhmmss, followed by S or W if dstflag is set
+
+	struct tm tm;
+	time_t local;
+	long offset;
+
+	offset = meter_tz_offset(&(gen->tz), METER_TIMEZONE, time);
+	local = time + offset;
+	gmtime_r(&local, &tm);
+
+	sprintf(str, "%02d%02d%02d%02d%02d%02d%s", tm.tm_year % 100, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+		dstflag ? (offset != gen->tz.std_offset ? "S" : "W") : "");
+
+	return str;
+}
+
+
+static void gen_printf (char **pos, char *end, const char *format, ...)
+{
+	// Append a formatted line to a telegram
+
+	va_list ap;
+	int len;
+
+	va_start(ap, format);
+	len = vsnprintf(*pos, end - *pos, format, ap);
+	va_end(ap);
+
+	if (len > 0)
+		*pos += (len < end - *pos) ? len : end - *pos - 1;
+}
+
+
+static size_t gen_telegram (telegram_generator *gen, char *buf, size_t bufsize)
+{
+	// Format a telegram from the current meter readings, returns the telegram length
+
+	char *pos = buf, *end = buf + bufsize, tst[16], tst2[16];
+	int version = gen->version, phase;
+	int width = version >= GEN_DSMR40 ? 10 : 9;		// Width of energy readings
+
+	gen_printf(&pos, end, "/ISk5\\2MT382-1000\r\n\r\n");
+	if (version >= GEN_DSMR40) {
+		gen_printf(&pos, end, "1-3:0.2.8(%d)\r\n", version);
+		gen_printf(&pos, end, "0-0:1.0.0(%s)\r\n", gen_tst(gen, tst, gen->time, 1));
+	}
+	gen_printf(&pos, end, "0-0:96.1.1(4B384547303034303436333935353037)\r\n");
+
+	gen_printf(&pos, end, "1-0:1.8.1(%0*.3f*kWh)\r\n", width, gen->E_in[0] / 1000);
+	gen_printf(&pos, end, "1-0:1.8.2(%0*.3f*kWh)\r\n", width, gen->E_in[1] / 1000);
+	gen_printf(&pos, end, "1-0:2.8.1(%0*.3f*kWh)\r\n", width, gen->E_out[0] / 1000);
+	gen_printf(&pos, end, "1-0:2.8.2(%0*.3f*kWh)\r\n", width, gen->E_out[1] / 1000);
+
+	gen_printf(&pos, end, "0-0:96.14.0(%04d)\r\n", gen->tariff);
+	if (version >= GEN_DSMR40) {
+		gen_printf(&pos, end, "1-0:1.7.0(%06.3f*kW)\r\n", gen->P_in / 1000);
+		gen_printf(&pos, end, "1-0:2.7.0(%06.3f*kW)\r\n", gen->P_out / 1000);
+	} else {
+		gen_printf(&pos, end, "1-0:1.7.0(%06.2f*kW)\r\n", gen->P_in / 1000);
+		gen_printf(&pos, end, "1-0:2.7.0(%06.2f*kW)\r\n", gen->P_out / 1000);
+	}
+
+	if (version == GEN_DSMR40)
+		gen_printf(&pos, end, "0-0:17.0.0(016.1*kW)\r\n");
+	else if (version < GEN_DSMR40)
+		gen_printf(&pos, end, version == GEN_DSMR22 ? "0-0:17.0.0(0999.00*kW)\r\n" : "0-0:17.0.0(016*A)\r\n");
+	if (version < GEN_DSMR50)
+		gen_printf(&pos, end, "0-0:96.3.10(1)\r\n");
+
+	if (version >= GEN_DSMR40) {
+		gen_printf(&pos, end, "0-0:96.7.21(%05u)\r\n", gen->pfail);
+		gen_printf(&pos, end, "0-0:96.7.9(%05u)\r\n", gen->pfail_long);
+		gen_printf(&pos, end, "1-0:99.97.0(2)(0-0:96.7.19)(%s)(0000000240*s)(%s)(0000000301*s)\r\n",
+			gen_tst(gen, tst, gen->time - 86400 * 3, 1), gen_tst(gen, tst2, gen->time - 86400 * 40, 1));
+		gen_printf(&pos, end, "1-0:32.32.0(00002)\r\n1-0:52.32.0(00001)\r\n1-0:72.32.0(00000)\r\n");
+		gen_printf(&pos, end, "1-0:32.36.0(00000)\r\n1-0:52.36.0(00003)\r\n1-0:72.36.0(00000)\r\n");
+	}
+
+	if (version == GEN_DSMR22) {
+		gen_printf(&pos, end, "0-0:96.13.1()\r\n0-0:96.13.0()\r\n");
+	} else {
+		if (version < GEN_DSMR50)
+			gen_printf(&pos, end, "0-0:96.13.1(3031203631203831)\r\n");
+		gen_printf(&pos, end, "0-0:96.13.0(303132333435363738393A3B3C3D3E3F303132333435363738393A3B3C3D3E3F)\r\n");
+	}
+
+	if (version >= GEN_DSMR50) {
+		for (phase = 0 ; phase < 3 ; phase++)
+			gen_printf(&pos, end, "1-0:%d2.7.0(%05.1f*V)\r\n", 3 + 2 * phase, gen->V[phase]);
+		for (phase = 0 ; phase < 3 ; phase++)
+			gen_printf(&pos, end, "1-0:%d1.7.0(%03d*A)\r\n", 3 + 2 * phase, (int)fabs(gen->I[phase]));
+		for (phase = 0 ; phase < 3 ; phase++)
+			gen_printf(&pos, end, "1-0:%d1.7.0(%06.3f*kW)\r\n", 2 + 2 * phase, gen->I[phase] > 0 ? gen->I[phase] * gen->V[phase] / 1000 : 0);
+		for (phase = 0 ; phase < 3 ; phase++)
+			gen_printf(&pos, end, "1-0:%d2.7.0(%06.3f*kW)\r\n", 2 + 2 * phase, gen->I[phase] < 0 ? -gen->I[phase] * gen->V[phase] / 1000 : 0);
+	}
+
+	// Gas meter
+
+	if (version == GEN_DSMR22) {
+		gen_printf(&pos, end, "7-0:0.0.0(3232323241424344313233343536373839)\r\n");
+		gen_printf(&pos, end, "7-0:23.1.0(%s)(%09.3f*m3)\r\n", gen_tst(gen, tst, gen->gas_time, 1), gen->gas / 1000);
+	} else if (version == GEN_DSMR30) {
+		gen_printf(&pos, end, "0-1:96.1.0(3232323241424344313233343536373839)\r\n");
+		gen_printf(&pos, end, "0-1:24.1.0(03)\r\n");
+		gen_printf(&pos, end, "0-1:24.3.0(%s)(00)(60)(1)(0-1:24.2.1)(m3)(%09.3f)\r\n", gen_tst(gen, tst, gen->gas_time, 0), gen->gas / 1000);
+		gen_printf(&pos, end, "0-1:24.4.0(1)\r\n");
+	} else {
+		gen_printf(&pos, end, version == GEN_DSMR40 ? "0-1:24.1.0(03)\r\n" : "0-1:24.1.0(003)\r\n");
+		gen_printf(&pos, end, "0-1:96.1.0(3232323241424344313233343536373839)\r\n");
+		gen_printf(&pos, end, "0-1:24.2.1(%s)(%09.3f*m3)\r\n", gen_tst(gen, tst, gen->gas_time, 1), gen->gas / 1000);
+		if (version == GEN_DSMR40)
+			gen_printf(&pos, end, "0-1:24.4.0(1)\r\n");
+	}
+
+	// Telegram end, with CRC from DSMR 4.0
+
+	if (version >= GEN_DSMR40) {
+		gen_printf(&pos, end, "!");
+		gen_printf(&pos, end, "%04X\r\n", (unsigned int)crc16((uint8_t *)buf, pos - buf));
+	} else {
+		gen_printf(&pos, end, "!\r\n");
+	}
+
+	return pos - buf;
+}
+
+
+int telegram_generator_damage (telegram_generator *gen, uint8_t *buf, size_t *length, size_t bufsize)
+{
+	// Damage a telegram (generated or not) with a probability of gen->error_rate, in one of several ways.
+	// Garbage is only inserted if the buffer has room for it. Updates the length and returns the type
+	// of damage, GEN_ERR_NONE if the telegram was left intact.
+
+	size_t len = *length, pos, n, i;
+	uint8_t byte;
+	int type, crc;
+
+	if (gen->error_rate <= 0 || len < 32 || gen_uniform(gen) >= gen->error_rate)
+		return GEN_ERR_NONE;
+
+	crc = (buf[len - 7] == '!');
+	do {
+		type = 1 + gen_random(gen) % (crc ? GEN_ERRORS - 1 : GEN_ERRORS - 2);
+	} while (type == GEN_ERR_GARBAGE && len + 64 > bufsize);
+
+	switch (type) {
+		case GEN_ERR_BYTE:
+			// Change a byte between the header and the telegram end, never into a telegram start or end
+			pos = 20 + gen_random(gen) % (len - 30);
+			if (buf[pos] >= '0' && buf[pos] <= '9')
+				buf[pos] = '0' + (buf[pos] - '0' + 1 + gen_random(gen) % 9) % 10;
+			else
+				buf[pos] = '#';
+			break;
+		case GEN_ERR_TRUNCATE:
+			len = 1 + gen_random(gen) % (len - 1);
+			break;
+		case GEN_ERR_GARBAGE:
+			n = 8 + gen_random(gen) % 56;
+			memmove(buf + n, buf, len);
+			for (i = 0 ; i < n ; i++) {
+				do {
+					byte = gen_random(gen);
+				} while (byte == '/' || byte == '!');
+				buf[i] = byte;
+			}
+			len += n;
+			break;
+		case GEN_ERR_CRC:
+			pos = len - 3;
+			buf[pos] = (buf[pos] == '0') ? '1' : '0';
+			break;
+	}
+
+	*length = len;
+	gen->errors[type]++;
+
+	return type;
+}
+
+
+size_t telegram_generator_next (telegram_generator *gen, uint8_t *buf, size_t bufsize)
+{
+	// Generate the next telegram, returns its length, or 0 if the buffer is smaller than GEN_MAXLEN
+
+	size_t len;
+
+	if (bufsize < GEN_MAXLEN)
+		return 0;
+
+	gen_update(gen);
+	len = gen_telegram(gen, (char *)buf, GEN_MAXLEN - 64);	// Leave room for garbage, if the telegram is damaged
+
+	gen->error = telegram_generator_damage(gen, buf, &len, bufsize);
+
+	gen->telegrams++;
+	gen->time += gen->interval;
+
+	return len;
+}
+
+
+size_t telegram_generator_fill (telegram_generator *gen, uint8_t *buf, size_t bufsize, size_t *count)
+{
+	// Fill a buffer with consecutive telegrams, returns the number of bytes used.
+	// The number of telegrams is stored in count, if not NULL.
+
+	size_t len = 0, n = 0, telegram;
+
+	while (bufsize - len >= GEN_MAXLEN) {
+		telegram = telegram_generator_next(gen, buf + len, bufsize - len);
+		if (telegram == 0)
+			break;
+		len += telegram;
+		n++;
+	}
+
+	if (count)
+		*count = n;
+
+	return len;
+}
@@ -0,0 +1,71 @@
+/*
+   File: p1-gen.h
+
+   	  Generator for synthetic P1 telegrams, used for benchmarks and tests.
+
+   	  Telegrams follow the layout of the DSMR 2.2, 3.0, 4.0 and 5.0 examples, with meter
+   	  readings that evolve over time like those of a real household. DSMR 4.0 and 5.0 telegrams
+   	  get a valid CRC. A configurable fraction of the telegrams can be damaged, to exercise
+   	  error handling and resynchronisation.
+*/
+
+#ifndef P1_GEN_H
+
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "p1-time.h"
+
+// DSMR versions that can be generated
+
+#define GEN_DSMR22		22		// DSMR 2.2, gas meter as legacy 7-0:23.1.0 object, no CRC
+#define GEN_DSMR30		30		// DSMR 3.0, gas meter as profile-generic 0-n:24.3.0 object, no CRC
+#define GEN_DSMR40		40		// DSMR 4.0, with power failure log and CRC
+#define GEN_DSMR50		50		// DSMR 5.0, with per-phase voltage, current and power
+
+// Types of damage done to a telegram
+
+#define GEN_ERR_NONE		0
+#define GEN_ERR_BYTE		1	// A single byte in the body of the telegram is changed
+#define GEN_ERR_TRUNCATE	2	// The telegram is cut off, the next telegram follows directly
+#define GEN_ERR_GARBAGE		3	// Line noise is inserted before the telegram
+#define GEN_ERR_CRC			4	// The CRC is wrong (no effect on telegrams without CRC)
+#define GEN_ERRORS			5
+
+// Maximum size of a generated telegram (including inserted garbage)
+
+#define GEN_MAXLEN		2048
+
+
+typedef struct telegram_generator_struct {
+
+	int version;			// DSMR version (GEN_DSMR*)
+	int interval;			// Seconds between telegrams
+	int64_t time;			// UNIX time of the next telegram
+	uint32_t rng;			// Random number generator state
+	double error_rate;		// Fraction of telegrams that is damaged (0 by default)
+
+	int tariff;				// Current tariff (1 or 2)
+	double E_in[2], E_out[2];	// Meter readings in Wh
+	double P_in, P_out;		// Power in W
+	double V[3], I[3];		// Voltage per phase
+	double gas;				// Gas meter reading in dm3
+	int64_t gas_time;		// Time of the last gas meter reading
+	unsigned int pfail, pfail_long;
+
+	struct meter_tz tz;		// Meter timezone, used to generate local timestamps
+
+	int error;				// Type of damage done to the last telegram (GEN_ERR_*)
+	uint64_t telegrams;		// Number of telegrams generated
+	uint64_t errors[GEN_ERRORS];	// Number of telegrams damaged, per type
+
+} telegram_generator;
+
+
+void telegram_generator_init (telegram_generator *gen, int version, int64_t start, uint32_t seed);
+size_t telegram_generator_next (telegram_generator *gen, uint8_t *buf, size_t bufsize);
+int telegram_generator_damage (telegram_generator *gen, uint8_t *buf, size_t *length, size_t bufsize);
+size_t telegram_generator_fill (telegram_generator *gen, uint8_t *buf, size_t bufsize, size_t *count);
+
+#define P1_GEN_H	1
+#endif
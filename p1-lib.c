@@ -10,6 +10,11 @@
 #include <string.h>
 #include <inttypes.h>
 #include <time.h>
+#include <poll.h>
+
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 #include "logmsg.h"
 
@@ -45,6 +50,8 @@ uint16_t crc_telegram (const uint8_t *data, unsigned int length)
 size_t read_telegram (int fd, uint8_t *buf, size_t bufsize, size_t maxfailbytes)
 {
 	// Try to read a full P1-telegram from a file-handle and store it in a buffer
+	// This reads one byte at a time, so no data beyond the telegram is consumed. 
+	// The telegram parser uses the buffered framer (telegram_framer_read) instead.
 	
 	int telegram = 0;
 	uint8_t byte;
@@ -108,12 +115,303 @@ size_t read_telegram (int fd, uint8_t *buf, size_t bufsize, size_t maxfailbytes)
 }
 
 
+int telegram_trailer_length (const uint8_t *data, size_t length)
+{
+	// Check the bytes following a telegram terminator ('!' at data[0]) and return the length
+	// of the telegram trailer, including the '!'. Returns 0 if more data is needed, and -1
+	// if the trailer is invalid.
+	
+	if (length < 3) {
+		return 0;
+	}
+	
+	if (data[1] == '\r') {
+		// Old-style telegram without CRC: "!\r\n"
+		return 3;
+	}
+	
+	if (length < 7) {
+		return 0;
+	}
+	
+	if (data[5] == '\r') {
+		// New style telegram with CRC: "!XXXX\r\n"
+		return 7;
+	}
+	
+	return -1;
+}
+
+
+static inline void telegram_framer_skip (telegram_framer *fr, size_t len)
+{
+	// Account for bytes skipped outside of valid telegrams
+	
+	fr->failed += len;
+	if (fr->stats)
+		stats_add(&(fr->stats->garbage_bytes), len);
+}
+
+
+int telegram_framer_init (telegram_framer *fr, size_t bufsize)
+{
+	if (fr == NULL) {
+		return -1;
+	}
+	
+	fr->start = fr->end = fr->scan = 0;
+	fr->telegram = 0;
+	fr->crcpos = 0;
+	fr->crc = 0;
+	fr->failed = 0;
+	fr->logger = &logger;
+	fr->stats = NULL;
+	fr->fill_time = fr->end_time = 0;
+	
+	fr->buffer = malloc(bufsize);
+	if (fr->buffer == NULL) {
+		fr->bufsize = 0;
+		logmsg_to(fr->logger, LL_ERROR, "Could not allocate %lu byte framing buffer\n", (unsigned long)bufsize);
+		return -2;
+	}
+	fr->bufsize = bufsize;
+	
+	return 0;
+}
+
+
+int telegram_framer_attach (telegram_framer *fr, const uint8_t *data, size_t len)
+{
+	// Set up a framer to find telegrams in a block of memory (e.g. a memory-mapped file),
+	// instead of in data read from a file-handle. The memory is not copied or modified, 
+	// and must not be released with telegram_framer_free().
+	
+	if (fr == NULL) {
+		return -1;
+	}
+	
+	fr->buffer = (uint8_t *)data;
+	fr->bufsize = len;
+	fr->start = fr->scan = 0;
+	fr->end = len;
+	fr->telegram = 0;
+	fr->crcpos = 0;
+	fr->crc = 0;
+	fr->failed = 0;
+	fr->stats = NULL;
+	fr->fill_time = fr->end_time = 0;
+	
+	return 0;
+}
+
+
+void telegram_framer_reset (telegram_framer *fr)
+{
+	// Discard buffered data and any partly framed telegram, e.g. after the input was rewound or the
+	// baud rate was changed. The count of skipped bytes is kept, as it covers the current read.
+	// A framer set up with telegram_framer_attach() is attached again instead.
+	
+	if (fr == NULL) {
+		return;
+	}
+	
+	fr->start = fr->end = fr->scan = 0;
+	fr->telegram = 0;
+	fr->crcpos = 0;
+	fr->crc = 0;
+}
+
+
+void telegram_framer_free (telegram_framer *fr)
+{
+	if (fr == NULL) {
+		return;
+	}
+	
+	if (fr->buffer) {
+		free(fr->buffer);
+		fr->buffer = NULL;
+	}
+	fr->bufsize = 0;
+	fr->start = fr->end = fr->scan = 0;
+	fr->telegram = 0;
+}
+
+
+ssize_t telegram_framer_fill (telegram_framer *fr, int fd)
+{
+	// Read as much data as is available (and fits) into the framing buffer
+	
+	ssize_t len;
+	
+	if (fr->start == fr->end) {
+		// Buffer is empty, start at the beginning
+		fr->start = fr->end = fr->scan = 0;
+	} else if (fr->end == fr->bufsize && fr->start > 0) {
+		// Move unconsumed data to the start of the buffer, to make room for more
+		memmove(fr->buffer, fr->buffer + fr->start, fr->end - fr->start);
+		fr->end -= fr->start;
+		fr->scan -= fr->start;
+		if (fr->telegram)
+			fr->crcpos -= fr->start;
+		fr->start = 0;
+	}
+	
+	if (fr->end >= fr->bufsize) {
+		return 0;
+	}
+	
+	len = read(fd, fr->buffer + fr->end, fr->bufsize - fr->end);
+	if (len > 0) {
+		fr->end += len;
+		if (fr->stats) {
+			fr->fill_time = stats_now();
+			stats_add(&(fr->stats->bytes_read), len);
+		}
+	} else if (len < 0 && fr->stats && errno != EAGAIN && errno != EINTR) {
+		stats_add(&(fr->stats->read_errors), 1);
+	}
+	
+	return len;
+}
+
+
+size_t telegram_framer_next (telegram_framer *fr, const uint8_t **telegram)
+{
+	// Try to find a full P1-telegram in the data that is currently in the framing buffer.
+	// Returns the telegram length and sets *telegram to point to it, or returns zero if no 
+	// full telegram is available yet. The telegram stays valid until the next call to a framer function.
+	
+	uint8_t *p;
+	size_t offset, len;
+	int trailer;
+	
+	for (;;) {
+		
+		if (!fr->telegram) {
+			// Look for the start of a telegram
+			p = memchr(fr->buffer + fr->start, '/', fr->end - fr->start);
+			if (p == NULL) {
+				telegram_framer_skip(fr, fr->end - fr->start);
+				fr->start = fr->end = fr->scan = 0;
+				return 0;
+			}
+			offset = p - fr->buffer;
+			logmsg_to(fr->logger, LL_VERBOSE, "Possible telegram found at offset %lu\n", (unsigned long)offset);
+			telegram_framer_skip(fr, offset - fr->start);
+			fr->start = offset;
+			fr->scan = offset + 1;
+			fr->telegram = 1;
+			fr->crcpos = offset;
+			fr->crc = 0;
+		}
+		
+		// Look for the end of the telegram, updating the CRC over the bytes scanned so far,
+		// so that it is ready as soon as the terminator is found
+		
+		p = memchr(fr->buffer + fr->scan, '!', fr->end - fr->scan);
+		if (p == NULL) {
+			fr->crc = crc16_update(fr->crc, fr->buffer + fr->crcpos, fr->end - fr->crcpos);
+			fr->crcpos = fr->end;
+			fr->scan = fr->end;
+			if (fr->end - fr->start >= fr->bufsize) {
+				// Buffer overflow before telegram end, restart search for telegrams
+				logmsg_to(fr->logger, LL_VERBOSE, "Buffer overflow before valid telegram end, restart scanning\n");
+				telegram_framer_skip(fr, fr->end - fr->start);
+				fr->start = fr->end = fr->scan = 0;
+				fr->telegram = 0;
+			}
+			return 0;
+		}
+		
+		offset = p - fr->buffer;
+		if (fr->crcpos <= offset) {
+			// Calculate CRC from start of telegram until '!' (inclusive)
+			fr->crc = crc16_update(fr->crc, fr->buffer + fr->crcpos, offset + 1 - fr->crcpos);
+			fr->crcpos = offset + 1;
+			fr->end_time = fr->fill_time;	// The terminator arrived with the last read
+		}
+		trailer = telegram_trailer_length(p, fr->end - offset);
+		
+		if (trailer == 0) {
+			// Possible end of telegram, but we need more data to check it
+			fr->scan = offset;
+			if (fr->end - fr->start >= fr->bufsize) {
+				logmsg_to(fr->logger, LL_VERBOSE, "Buffer overflow before valid telegram end, restart scanning\n");
+				telegram_framer_skip(fr, fr->end - fr->start);
+				fr->start = fr->end = fr->scan = 0;
+				fr->telegram = 0;
+			}
+			return 0;
+		}
+		
+		logmsg_to(fr->logger, LL_VERBOSE, "Possible telegram end at offset %lu\n", (unsigned long)(offset - fr->start + 1));
+		
+		if (trailer < 0) {
+			// We haven't found a valid telegram, try again after the terminator
+			logmsg_to(fr->logger, LL_VERBOSE, "Invalid telegram, restart scanning\n");
+			telegram_framer_skip(fr, offset + 1 - fr->start);
+			fr->start = offset + 1;
+			fr->scan = fr->start;
+			fr->telegram = 0;
+			continue;
+		}
+		
+		len = offset + trailer - fr->start;
+		if (trailer == 3) {
+			// Old-style telegrams do not contain a CRC, so there's no point in checking it
+			logmsg_to(fr->logger, LL_VERBOSE, "Old-style telegram with length %lu\n", (unsigned long)len);
+			fr->crc = 0;
+		} else {
+			logmsg_to(fr->logger, LL_VERBOSE, "New-style telegram with length %lu\n", (unsigned long)len);
+		}
+		
+		*telegram = fr->buffer + fr->start;
+		fr->start += len;
+		fr->scan = fr->start;
+		fr->telegram = 0;
+		
+		return len;
+	}
+}
+
+
+size_t telegram_framer_read (telegram_framer *fr, int fd, const uint8_t **telegram, size_t maxfailbytes)
+{
+	// Read from a file-handle until a full P1-telegram is available in the framing buffer
+	
+	ssize_t len;
+	size_t tlen;
+	
+	fr->failed = 0;
+	
+	do {
+		tlen = telegram_framer_next(fr, telegram);
+		if (tlen) {
+			return tlen;
+		}
+		if (maxfailbytes && fr->failed >= maxfailbytes) {
+			break;
+		}
+		len = telegram_framer_fill(fr, fd);
+		if (len < 0) {
+			logmsg_to(fr->logger, LL_ERROR, "reading telegram data: %s\n", strerror(errno));
+		}
+	} while (len > 0);
+	
+	// Return zero if we get a read error or time-out, or if we've read the maximum number of non-valid bytes
+	
+	return 0;
+}
+
+
 int telegram_parser_open (telegram_parser *obj, char *infile, size_t bufsize, int timeout, char *dumpfile)
 {
 	if (obj == NULL) {
 		return -1;
 	}
 	
+	obj->logger = &logger;
 	parser_init(&(obj->parser));	// Initialise Ragel state machine
 	
 	obj->data = &(obj->parser.data);
@@ -122,6 +420,21 @@ int telegram_parser_open (telegram_parser *obj, char *infile, size_t bufsize, in
 	obj->buffer = NULL;
 	obj->bufsize = 0;
 	obj->len = 0;
+	obj->telegram = NULL;
+	
+	obj->framer.buffer = NULL;
+	obj->framer.bufsize = 0;
+	
+	obj->callback = NULL;
+	obj->userdata = NULL;
+	obj->telegrams = 0;
+	obj->failed = 0;
+	
+	telegram_stats_init(&(obj->stats), infile);
+	telegram_baud_init(&(obj->baud), infile);
+	memset(&(obj->d0), 0, sizeof(telegram_d0_session));
+	memset(&(obj->lowlat), 0, sizeof(telegram_low_latency));
+	obj->lowlat.serial_flags = -1;
 	
 	obj->fd = -1;
 	obj->terminal = 0;
@@ -136,13 +449,13 @@ int telegram_parser_open (telegram_parser *obj, char *infile, size_t bufsize, in
 		obj->fd = open(infile, O_RDWR | O_NOCTTY);	// If we open a serial device, make sure it doesn't become the controlling TTY
 		
 		if (obj->fd < 0) {
-			logmsg(LL_ERROR, "Could not open input file/device %s: %s\n", infile, strerror(errno));
+			logmsg_to(obj->logger, LL_ERROR, "Could not open input file/device %s: %s\n", infile, strerror(errno));
 			return -2;
 		}
 		
 		if (tcgetattr(obj->fd, &(obj->oldtio)) == 0) {
 			
-			logmsg(LL_VERBOSE, "Input device seems to be a serial terminal\n");
+			logmsg_to(obj->logger, LL_VERBOSE, "Input device seems to be a serial terminal\n");
 			
 			obj->terminal = 1;					// If we can get terminal attributes, assume we're reading from a serial device
 			
@@ -155,20 +468,28 @@ int telegram_parser_open (telegram_parser *obj, char *infile, size_t bufsize, in
 			obj->newtio.c_cc[VTIME] = (timeout * 10);  		// Inter-character timer or timeout in 0.1s (0 = unused)
 			obj->newtio.c_cc[VMIN]  = 0;   					// Blocking read until 1 char received or timeout
 			
+			if (telegram_baud_lookup(infile) == B9600) {
+				logmsg_to(obj->logger, LL_VERBOSE, "Starting at 9600 baud, the last rate at which %s sent telegrams\n", infile);
+				cfsetspeed(&(obj->newtio), B9600);
+			}
+			
 			tcflush(obj->fd, TCIFLUSH);						// Flush any data still left in the input buffer, to avoid confusing the parsers
 			tcsetattr(obj->fd, TCSANOW, &(obj->newtio));	// Set new terminal attributes
 		}
 	}
 	
+	obj->dump = NULL;
+	obj->dump_owned = 0;
+	memset(&(obj->dump_limit), 0, sizeof(telegram_dump_limit));
+	
 	if (dumpfile) {
-		// TODO: use a file descriptor rather than a stdio pointer
-		obj->dumpfile = fopen(dumpfile, "a");
-		if (obj->dumpfile == NULL) {
-			logmsg(LL_ERROR, "Could not open output file %s\n", dumpfile);
+		obj->dump = malloc(sizeof(telegram_dump));
+		if (obj->dump == NULL || telegram_dump_open(obj->dump, dumpfile, DUMP_MAXSIZE, DUMP_KEEP, 0) < 0) {
+			free(obj->dump);
+			obj->dump = NULL;
 			return -3;
 		}
-	} else {
-		obj->dumpfile = NULL;
+		obj->dump_owned = 1;
 	}
 	
 	if (bufsize == 0) {
@@ -179,16 +500,49 @@ int telegram_parser_open (telegram_parser *obj, char *infile, size_t bufsize, in
 	if (obj->buffer) {
 		obj->bufsize = bufsize;
 	} else {
-		logmsg(LL_ERROR, "Could not allocate %lu byte telegram buffer\n", (unsigned long)bufsize);
+		logmsg_to(obj->logger, LL_ERROR, "Could not allocate %lu byte telegram buffer\n", (unsigned long)bufsize);
 		return -4;
 	}
 	
+	if (telegram_framer_init(&(obj->framer), bufsize) < 0) {
+		return -4;
+	}
+	obj->framer.logger = obj->logger;
+	obj->framer.stats = &(obj->stats);
+	
 	obj->mode = 'P';
 		
 	return 0;	
 }
 
 
+void telegram_parser_set_logger (telegram_parser *obj, messagelogger *lg)
+{
+	// Set the logger used by this parser object, its framer, baud rate detector and Ragel parser
+	
+	obj->logger = lg;
+	obj->framer.logger = lg;
+	obj->baud.logger = lg;
+	parser_set_logger(&(obj->parser), lg);
+}
+
+
+void telegram_parser_set_dump (telegram_parser *obj, telegram_dump *dump)
+{
+	// Write bad telegrams to a dump that may be shared with other parser objects (and threads),
+	// rather than to the dump file given to telegram_parser_open(). Rate limits apply per parser object.
+	
+	if (obj->dump && obj->dump_owned) {
+		telegram_dump_close(obj->dump);
+		free(obj->dump);
+	}
+	
+	obj->dump = dump;
+	obj->dump_owned = 0;
+	memset(&(obj->dump_limit), 0, sizeof(telegram_dump_limit));
+}
+
+
 void telegram_parser_close (telegram_parser *obj)
 {
 	if (obj == NULL) {
@@ -200,9 +554,15 @@ void telegram_parser_close (telegram_parser *obj)
 		obj->buffer = NULL;
 		obj->bufsize = 0;
 		obj->len = 0;
+		obj->telegram = NULL;
 	}
 	
+	telegram_framer_free(&(obj->framer));
+	
 	if (obj->fd > 0) {
+		if (obj->lowlat.enabled) {
+			telegram_parser_low_latency(obj, 0);			// Restore the driver flags
+		}
 		if (obj->terminal) {
 			tcsetattr(obj->fd, TCSANOW, &(obj->oldtio));	// Restore old port settings
 		}		
@@ -211,21 +571,282 @@ void telegram_parser_close (telegram_parser *obj)
 		obj->terminal = 0;
 	}
 	
-	if (obj->dumpfile) {
-		fclose(obj->dumpfile);
-		obj->dumpfile = NULL;
-	}
+	telegram_parser_set_dump(obj, NULL);
 }
 
 
-int telegram_parser_read (telegram_parser *obj)
+int telegram_parser_parse (telegram_parser *obj)
 {
+	// Parse the P1-telegram found by the framer (obj->telegram, obj->len bytes) and check its CRC
+	
 	uint16_t crc = 0;
+	uint64_t start, end;
+	int mismatch;
 	
 	if (obj == NULL) {
 		return -1;
 	}
 	
+	obj->parser.crc16 = 0;
+	
+	if (obj->len) {
+		start = stats_now();
+		parser_reset(&(obj->parser));
+		parser_execute(&(obj->parser), (const char *)(obj->telegram), obj->len, 1);
+		obj->status = parser_finish(&(obj->parser));	// 1 if final state reached, -1 on error, 0 if final state not reached
+		end = stats_now();
+		
+		stats_add(&(obj->stats.telegrams), 1);
+		stats_record(&(obj->stats.parse_time), end - start);
+		telegram_baud_reset(&(obj->baud));
+		if (obj->framer.end_time && obj->framer.end_time <= start) {
+			stats_record(&(obj->stats.latency), end - obj->framer.end_time);
+		}
+		if (obj->parser.parse_errors) {
+			stats_add(&(obj->stats.parse_errors), 1);
+		}
+		
+		if (obj->status == 1) {
+			crc = obj->framer.crc;	// Calculated by the framer while scanning for the end of the telegram
+			logmsg_to(obj->logger, LL_VERBOSE, "Parsing successful, data CRC 0x%x, telegram CRC 0x%x\n", crc, obj->parser.crc16);
+		} 
+		if (obj->parser.parse_errors) {
+			logmsg_to(obj->logger, LL_VERBOSE, "Parse errors: %d\n", obj->parser.parse_errors);
+		}
+	}
+	
+	// Telegrams with parse errors or a CRC mismatch are counted in obj->stats and written to the
+	// dump file, a CRC mismatch is also logged and returned as -4
+	
+	mismatch = (obj->parser.crc16 && obj->parser.crc16 != crc);
+	if (obj->dump && obj->len && (obj->parser.parse_errors || mismatch)) {
+		telegram_dump_write(obj->dump, &(obj->dump_limit), obj->telegram, obj->len, obj->parser.parse_errors,
+							mismatch ? DUMP_CRC_MISMATCH : obj->parser.crc16 ? DUMP_CRC_OK : DUMP_CRC_NONE, obj->data->equipment_id);
+	}
+	
+	if (mismatch) {
+		stats_add(&(obj->stats.crc_failures), 1);
+		logmsg_to(obj->logger, LL_ERROR, "data CRC 0x%x does not match telegram CRC 0x%x\n", crc, obj->parser.crc16);
+		return -4;
+	}
+	
+	if (obj->terminal && obj->mode == 'P' && obj->status == 1) {
+		telegram_baud_remember(&(obj->baud), cfgetispeed(&(obj->newtio)));
+	}
+	
+	return 0;
+}
+
+
+static void telegram_parser_stream_end (struct parser *fsm, void *userdata)
+{
+	// Called by the Ragel parser at the end of every telegram in streaming mode
+	
+	telegram_parser *obj = userdata;
+	int result = 0;
+	
+	obj->status = 1;
+	obj->len = fsm->telegram_len;
+	obj->telegram = NULL;		// The telegram isn't kept in a buffer in streaming mode
+	obj->telegrams++;
+	
+	stats_add(&(obj->stats.telegrams), 1);
+	if (obj->framer.fill_time) {
+		stats_record(&(obj->stats.latency), stats_now() - obj->framer.fill_time);	// Time of the read that delivered the end of the telegram
+	}
+	
+	if (fsm->parse_errors) {
+		stats_add(&(obj->stats.parse_errors), 1);
+		logmsg_to(obj->logger, LL_VERBOSE, "Parse errors: %d\n", fsm->parse_errors);
+	}
+	
+	if (fsm->crc16) {
+		if (fsm->telegram_state != PARSER_TELEGRAM_END) {
+			logmsg_to(obj->logger, LL_ERROR, "telegram without header, CRC 0x%x can't be checked\n", fsm->crc16);
+			result = -4;
+		} else if (fsm->crc16 != fsm->crc16_data) {
+			logmsg_to(obj->logger, LL_ERROR, "data CRC 0x%x does not match telegram CRC 0x%x\n", fsm->crc16_data, fsm->crc16);
+			result = -4;
+		} else {
+			logmsg_to(obj->logger, LL_VERBOSE, "Parsing successful, data CRC 0x%x, telegram CRC 0x%x\n", fsm->crc16_data, fsm->crc16);
+		}
+	}
+	
+	if (result < 0) {
+		stats_add(&(obj->stats.crc_failures), 1);
+	} else if (obj->terminal && obj->mode == 'P') {
+		telegram_baud_remember(&(obj->baud), cfgetispeed(&(obj->newtio)));
+	}
+	telegram_baud_reset(&(obj->baud));
+	
+	obj->callback(obj, result, obj->userdata);
+}
+
+
+void telegram_parser_set_callback (telegram_parser *obj, telegram_parser_callback callback, void *userdata)
+{
+	// Switch a parser object to streaming mode: input is fed to a single, persistent Ragel parser
+	// in chunks of any size, without framing or copying telegrams, and the callback is called at 
+	// the end of every telegram. Telegrams are not written to the dump file in this mode.
+	// Pass a NULL callback to switch back to telegram_parser_read().
+	
+	if (callback && obj->dump) {
+		logmsg_to(obj->logger, LL_WARNING, "Bad telegrams are not written to the dump file in streaming mode\n");
+	}
+	
+	obj->callback = callback;
+	obj->userdata = userdata;
+	parser_set_callback(&(obj->parser), callback ? telegram_parser_stream_end : NULL, obj);
+	parser_reset(&(obj->parser));
+	obj->failed = 0;
+}
+
+
+int telegram_parser_feed (telegram_parser *obj, const uint8_t *data, size_t len)
+{
+	// Feed a chunk of input to a parser in streaming mode, the chunk may end anywhere in a telegram
+	
+	uint64_t telegrams;
+	
+	if (obj == NULL || obj->callback == NULL) {
+		return -1;
+	}
+	
+	telegrams = obj->telegrams;
+	parser_execute(&(obj->parser), (const char *)data, len, 0);
+	
+	if (obj->telegrams == telegrams) {
+		obj->failed += len;
+	} else {
+		obj->failed = 0;
+	}
+	
+	return 0;
+}
+
+
+int telegram_parser_low_latency (telegram_parser *obj, int enable)
+{
+	// Switch a P1 serial device to low-latency mode, or back. The driver is asked to pass on data as
+	// soon as it comes in (ASYNC_LOW_LATENCY, which e.g. makes FTDI USB adapters use a 1 ms latency
+	// timer rather than 16 ms), and reads no longer block in the kernel under the VTIME timer, but
+	// wait in ppoll() with deadlines derived from the expected telegram length (see telegram_parser_wait()).
+	// Returns 0 on success, 1 if the driver does not support low latency (reads still use ppoll()),
+	// or a negative value on error.
+	
+	int flags, result = 0;
+	
+	if (obj == NULL || obj->fd <= 0) {
+		return -1;
+	}
+	
+	if (!obj->terminal || obj->mode != 'P') {
+		return -2;		// Files don't need it, and D0 readouts rely on blocking reads
+	}
+	
+	if (enable == obj->lowlat.enabled) {
+		return 0;
+	}
+	
+#ifdef ASYNC_LOW_LATENCY
+	struct serial_struct serial;
+	
+	if (ioctl(obj->fd, TIOCGSERIAL, &serial) < 0) {
+		logmsg_to(obj->logger, LL_VERBOSE, "Could not get serial driver flags: %s\n", strerror(errno));
+		result = 1;
+	} else if (enable) {
+		obj->lowlat.serial_flags = serial.flags;
+		serial.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl(obj->fd, TIOCSSERIAL, &serial) < 0) {
+			logmsg_to(obj->logger, LL_VERBOSE, "Could not set low latency in serial driver: %s\n", strerror(errno));
+			obj->lowlat.serial_flags = -1;
+			result = 1;
+		}
+	} else if (obj->lowlat.serial_flags >= 0) {
+		serial.flags = obj->lowlat.serial_flags;
+		ioctl(obj->fd, TIOCSSERIAL, &serial);
+		obj->lowlat.serial_flags = -1;
+	}
+#else
+	result = 1;
+#endif
+	
+	flags = fcntl(obj->fd, F_GETFL);
+	if (flags < 0 || fcntl(obj->fd, F_SETFL, enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK)) < 0) {
+		logmsg_to(obj->logger, LL_ERROR, "Could not change blocking mode: %s\n", strerror(errno));
+		return -3;
+	}
+	
+	obj->newtio.c_cc[VTIME] = enable ? 0 : obj->timeout * 10;
+	obj->newtio.c_cc[VMIN] = enable ? 1 : 0;
+	tcsetattr(obj->fd, TCSANOW, &(obj->newtio));
+	
+	obj->lowlat.enabled = enable;
+	
+	return result;
+}
+
+
+static int telegram_parser_wait (telegram_parser *obj, size_t remaining, uint64_t timeout)
+{
+	// Wait for data in low-latency mode, until the rest of a telegram (remaining bytes, 0 if no telegram
+	// is coming in) should have arrived at the current baud rate, or until the monotonic time-out (in ns).
+	// VMIN is set to the number of bytes remaining, so that the driver wakes us once for all of them
+	// (poll() honours VMIN when VTIME is 0), rather than for every USB packet or FIFO interrupt.
+	// Returns 1 if data may be available, 0 on time-out, or -1 on error.
+	
+	struct pollfd pfd;
+	struct timespec ts;
+	uint64_t now, deadline = timeout, chartime;
+	cc_t vmin;
+	int result;
+	
+	now = stats_now();
+	if (now >= timeout) {
+		return 0;
+	}
+	
+	vmin = (remaining == 0) ? 1 : (remaining > 255) ? 255 : remaining;	// VMIN is a byte
+	
+	if (vmin != obj->newtio.c_cc[VMIN]) {
+		obj->newtio.c_cc[VMIN] = vmin;
+		tcsetattr(obj->fd, TCSANOW, &(obj->newtio));
+	}
+	
+	if (remaining) {
+		chartime = (cfgetispeed(&(obj->newtio)) == B9600) ? 1041667 : 86806;	// 10 bits per character, in ns
+		if (now + vmin * chartime + LOW_LATENCY_SLACK * 1000000ULL < deadline)
+			deadline = now + vmin * chartime + LOW_LATENCY_SLACK * 1000000ULL;
+	}
+	
+	pfd.fd = obj->fd;
+	pfd.events = POLLIN;
+	ts.tv_sec = (deadline - now) / 1000000000ULL;
+	ts.tv_nsec = (deadline - now) % 1000000000ULL;
+	
+	result = ppoll(&pfd, 1, &ts, NULL);
+	if (result < 0 && errno != EINTR) {
+		logmsg_to(obj->logger, LL_ERROR, "waiting for telegram data: %s\n", strerror(errno));
+		return -1;
+	}
+	
+	return (result == 0 && deadline == timeout) ? 0 : 1;
+}
+
+
+ssize_t telegram_parser_stream_read (telegram_parser *obj)
+{
+	// Read the data that is available from the input and feed it to the parser (in streaming mode).
+	// Returns the number of bytes read, 0 on time-out or end of input, or a negative value on error.
+	
+	uint64_t timeout, telegrams;
+	size_t pending, remaining;
+	ssize_t len;
+	
+	if (obj == NULL || obj->callback == NULL) {
+		return -1;
+	}
+	
 	if (obj->buffer == NULL || obj->bufsize == 0) {
 		return -2;
 	}
@@ -234,51 +855,198 @@ int telegram_parser_read (telegram_parser *obj)
 		return -3;
 	}
 	
-	obj->parser.crc16 = 0;
+	// In low-latency mode, wait only when nothing is available: the driver may return fewer bytes
+	// than are available when VMIN is set above 64. The bytes fed since the last telegram are the
+	// part of the next one read so far, unless we've been waiting for them in vain already.
+	
+	timeout = stats_now() + obj->timeout * 1000000000ULL;
+	remaining = 0;
+	for (;;) {
+		len = read(obj->fd, obj->buffer, obj->bufsize);
+		if (len >= 0 || !obj->lowlat.enabled || errno != EAGAIN) {
+			break;
+		}
+		if (remaining || obj->failed == 0) {
+			remaining = 0;
+		} else {
+			remaining = (obj->lowlat.expected > obj->failed) ? obj->lowlat.expected - obj->failed : 1;
+		}
+		len = telegram_parser_wait(obj, remaining, timeout);
+		if (len <= 0) {
+			break;
+		}
+	}
+	
+	if (len < 0) {
+		stats_add(&(obj->stats.read_errors), 1);
+		logmsg_to(obj->logger, LL_ERROR, "reading telegram data: %s\n", strerror(errno));
+		return -4;
+	}
 	
-	obj->len = read_telegram(obj->fd, obj->buffer, obj->bufsize, obj->bufsize);
+	if (len > 0) {
+		obj->framer.fill_time = stats_now();
+		stats_add(&(obj->stats.bytes_read), len);
+		pending = obj->failed;
+		telegrams = obj->telegrams;
+		telegram_parser_feed(obj, obj->buffer, len);
+		if (obj->telegrams != telegrams) {
+			obj->lowlat.expected = pending + len;	// About the telegram length, unless the chunk holds more than its tail
+		}
+	} else if (obj->terminal) {
+		stats_add(&(obj->stats.timeouts), 1);
+	}
+	
+	// If no telegrams come in, or the data looks like it's received at the wrong rate,
+	// try a different baud rate, as telegram_parser_read() does
+	
+	if (obj->terminal && obj->mode == 'P' && (len == 0 || obj->failed > obj->bufsize
+			|| telegram_baud_classify(&(obj->baud), obj->buffer, len, cfgetispeed(&(obj->newtio))) == BAUD_WRONG)) {
+		telegram_parser_toggle_baudrate(obj);
+		parser_reset(&(obj->parser));
+		obj->failed = 0;
+	}
+	
+	return len;
+}
 
-	if (obj->len) {
-		parser_init(&(obj->parser));
-		parser_execute(&(obj->parser), (const char *)(obj->buffer), obj->len, 1);
-		obj->status = parser_finish(&(obj->parser));	// 1 if final state reached, -1 on error, 0 if final state not reached
-		if (obj->status == 1) {
-			crc = crc_telegram(obj->buffer, obj->len);
-			// TODO: actually report CRC error
-			logmsg(LL_VERBOSE, "Parsing successful, data CRC 0x%x, telegram CRC 0x%x\n", crc, obj->parser.crc16);
-		} 
-		if (obj->parser.parse_errors) {
-			logmsg(LL_VERBOSE, "Parse errors: %d\n", obj->parser.parse_errors);
-			if (obj->dumpfile) {
-				fwrite(obj->buffer, 1, obj->len, obj->dumpfile);
-				fflush(obj->dumpfile);
+
+void telegram_parser_toggle_baudrate (telegram_parser *obj)
+{
+	// Try a different baud rate, maybe we have an old DSMR meter that runs at 9600 baud
+	
+	speed_t baudrate = cfgetispeed(&(obj->newtio));
+	
+	stats_add(&(obj->stats.baud_switches), 1);
+	telegram_baud_reset(&(obj->baud));
+	
+	if (baudrate == B115200)
+		cfsetispeed(&(obj->newtio), B9600);	
+	else
+		cfsetispeed(&(obj->newtio), B115200);
+	
+	tcflush(obj->fd, TCIFLUSH);				// Flush any data still left in the input buffer, to avoid confusing the parsers
+	tcsetattr(obj->fd, TCSANOW, &(obj->newtio));	// Set new terminal attributes
+	
+	telegram_framer_reset(&(obj->framer));		// Discard buffered data received at the old baud rate
+}
+
+
+int telegram_parser_detect (telegram_parser *obj, const uint8_t *data, size_t len)
+{
+	// Classify data just read from a P1 serial device, and switch the baud rate right away if it
+	// looks like it's received at the wrong rate. Returns 1 if the rate was switched, 0 otherwise.
+	
+	if (!obj->terminal || obj->mode != 'P' || len == 0) {
+		return 0;
+	}
+	
+	if (telegram_baud_classify(&(obj->baud), data, len, cfgetispeed(&(obj->newtio))) != BAUD_WRONG) {
+		return 0;
+	}
+	
+	logmsg_to(obj->logger, LL_VERBOSE, "Data received at %s baud looks invalid, switching baud rate\n",
+				cfgetispeed(&(obj->newtio)) == B9600 ? "9600" : "115200");
+	telegram_parser_toggle_baudrate(obj);
+	obj->baud.switched++;
+	
+	return 1;
+}
+
+
+static size_t telegram_parser_frame (telegram_parser *obj)
+{
+	// Read from a P1 serial device until a full telegram is available, as telegram_framer_read()
+	// does, but check the data as it comes in, so that the baud rate is switched as soon as
+	// the data looks wrong, rather than after a time-out or a full buffer of garbage
+	
+	telegram_framer *fr = &(obj->framer);
+	uint64_t timeout = stats_now() + obj->timeout * 1000000000ULL;
+	ssize_t len;
+	size_t tlen, remaining = 0;
+	
+	fr->failed = 0;
+	
+	do {
+		tlen = telegram_framer_next(fr, &(obj->telegram));
+		if (tlen) {
+			obj->lowlat.expected = tlen;
+			return tlen;
+		}
+		if (fr->failed >= fr->bufsize) {
+			break;
+		}
+		len = telegram_framer_fill(fr, obj->fd);
+		if (len < 0 && obj->lowlat.enabled && errno == EAGAIN) {
+			
+			// Nothing (more) to read in low-latency mode. Wait for the rest of the telegram coming in,
+			// or for any data if there's no telegram or its bytes didn't arrive when expected. The
+			// reads continue until nothing is left, as the driver may return fewer bytes than are
+			// available when VMIN is set above 64. As with the VTIME timer, we time out when no data
+			// comes in for obj->timeout seconds.
+			
+			if (!fr->telegram || remaining) {
+				remaining = 0;
+			} else if (fr->scan < fr->end) {
+				remaining = 1;		// The terminator was found, only (part of) the CRC is missing
+			} else if (obj->lowlat.expected > fr->end - fr->start) {
+				remaining = obj->lowlat.expected - (fr->end - fr->start);
+			} else {
+				remaining = 1;		// Longer than the last telegram
 			}
+			len = telegram_parser_wait(obj, remaining, timeout);
+			
+		} else if (len < 0) {
+			logmsg_to(fr->logger, LL_ERROR, "reading telegram data: %s\n", strerror(errno));
+		} else if (len > 0) {
+			remaining = 0;
+			timeout = fr->fill_time + obj->timeout * 1000000000ULL;
+			telegram_parser_detect(obj, fr->buffer + fr->end - len, len);
 		}
+	} while (len > 0);
+	
+	return 0;
+}
+
+
+int telegram_parser_read (telegram_parser *obj)
+{
+	int result = 0;
+	
+	if (obj == NULL) {
+		return -1;
 	}
 	
-	if (obj->terminal && obj->len == 0 && obj->mode == 'P') {
-		
-		// Try a different baud rate, maybe we have an old DSMR meter that runs at 9600 baud
-		
-		speed_t baudrate = cfgetispeed(&(obj->newtio));
-		
-		if (baudrate == B115200)
-			cfsetispeed(&(obj->newtio), B9600);	
-		else
-			cfsetispeed(&(obj->newtio), B115200);
-		
-		tcflush(obj->fd, TCIFLUSH);				// Flush any data still left in the input buffer, to avoid confusing the parsers
-		tcsetattr(obj->fd, TCSANOW, &(obj->newtio));	// Set new terminal attributes
+	if (obj->framer.buffer == NULL || obj->framer.bufsize == 0) {
+		return -2;
+	}
+	
+	if (obj->fd <= 0) {
+		return -3;
+	}
+	
+	obj->parser.crc16 = 0;
+	
+	obj->baud.switched = 0;
+	
+	if (obj->terminal && obj->mode == 'P') {
+		obj->len = telegram_parser_frame(obj);
+	} else {
+		obj->len = telegram_framer_read(&(obj->framer), obj->fd, &(obj->telegram), obj->framer.bufsize);
 	}
 
-	// TODO: report more errors
+	if (obj->len) {
+		result = telegram_parser_parse(obj);
+	} else if (obj->terminal && obj->framer.failed < obj->framer.bufsize) {
+		stats_add(&(obj->stats.timeouts), 1);		// No full buffer of garbage either, so the read timed out
+	}
 	
-	if (obj->parser.crc16 && obj->parser.crc16 != crc) {
-		logmsg(LL_ERROR, "data CRC 0x%x does not match telegram CRC 0x%x\n", crc, obj->parser.crc16);
-		return -4;
+	// Fall back to switching after a time-out, e.g. if the meter sends nothing at all at this rate
+	
+	if (obj->terminal && obj->len == 0 && obj->mode == 'P' && !obj->baud.switched) {
+		telegram_parser_toggle_baudrate(obj);
 	}
 	
-	return 0;
+	return result;
 }	
 
 
@@ -304,13 +1072,151 @@ int telegram_parser_open_d0 (telegram_parser *obj, char *infile, size_t bufsize,
 }
 
 
+static long telegram_parser_d0_signon (telegram_parser *obj, int wakeup)
+{
+	// Send an optional wake-up sequence and the sign-on sequence at 300 baud, and read the meter
+	// identification string into the telegram buffer. Returns the offset of its last byte, or a
+	// negative value on error (-5 if the meter didn't respond).
+	
+	int count;
+	char zero = 0;
+	unsigned long idx = 0;
+	ssize_t len;
+	uint64_t signon;
+	unsigned int reaction, elapsed;
+	char id[D0_IDLEN];
+	
+	logmsg_to(obj->logger, LL_VERBOSE, "Setting baud rate to 300 baud\n");
+	cfsetspeed(&(obj->newtio), B300);			// Update speed in termio-structure
+	tcsetattr(obj->fd, TCSANOW, &(obj->newtio));	// Set new terminal attributes
+			
+	if (wakeup) {
+		logmsg_to(obj->logger, LL_VERBOSE, "Sending wake-up sequence\n");
+		for (count = 0 ; count < 65 ; count++) {
+			if (write(obj->fd, &zero, 1) < 0) {
+				logmsg_to(obj->logger, LL_WARNING, "Unable to send wake-up sequence: %s\n", strerror(errno));
+				break;
+			}
+		}
+		
+		tcdrain(obj->fd);	// Make sure the data in the output buffer is sent
+		usleep(D0_WAKEUP_DELAY * 1000UL);
+		obj->d0.wakeups++;
+	}
+	
+	tcflush(obj->fd, TCIFLUSH);	// Flush any unread data that may still be in the input buffer
+	
+	char signonseq[] = "/?!\r\n";
+	logmsg_to(obj->logger, LL_VERBOSE, "Sending sign-on sequence: %s\n", signonseq);
+	if (write(obj->fd, signonseq, strlen(signonseq)) < strlen(signonseq)) {
+		logmsg_to(obj->logger, LL_WARNING, "Unable to send sign-on sequence.\n");
+		return -3;
+	}
+	tcdrain(obj->fd);	// Make sure the data in the output buffer is sent
+	signon = stats_now();
+	
+	// Try to read first character of meter identification string ('/'). In session mode, don't wait
+	// much longer than the maximum reaction time, so that we can retry with a wake-up sequence.
+	
+	if (obj->d0.session) {
+		obj->newtio.c_cc[VTIME] = D0_REACTION_TIMEOUT / 100;
+		tcsetattr(obj->fd, TCSANOW, &(obj->newtio));
+	}
+	
+	len = read(obj->fd, obj->buffer, 1);
+	
+	if (obj->d0.session) {
+		obj->newtio.c_cc[VTIME] = obj->timeout * 10;
+		tcsetattr(obj->fd, TCSANOW, &(obj->newtio));
+	}
+	
+	if (len < 0) {
+		logmsg_to(obj->logger, LL_ERROR, "reading meter ID string: %s\n", strerror(errno));
+		return -4;
+		
+	} else if (len == 0 || obj->buffer[0] != '/') {
+		logmsg_to(obj->logger, LL_ERROR, "Did not receive a valid meter ID string.\n");
+		return -5;
+		
+	}
+	
+	elapsed = (stats_now() - signon) / 1000000;
+	reaction = (elapsed > 1000 * 10 / 300) ? elapsed - 1000 * 10 / 300 : 0;	// Minus the time taken by the '/' itself (10 bits at 300 baud)
+	
+	// Try to read full meter identification string
+	
+	do {
+		idx += 1;
+		len = read(obj->fd, obj->buffer + idx, 1);
+	} while (idx < obj->bufsize && len == 1 && obj->buffer[idx] != '\n');
+	
+	if (idx < obj->bufsize - 1) {
+		obj->buffer[idx + 1] = '\0';
+		logmsg_to(obj->logger, LL_VERBOSE, "Meter ID string received, %lu bytes, reaction time %u ms: %s\n", idx, reaction, obj->buffer);
+	}
+	
+	// The reaction time of the meter (at least 200 ms according to IEC 62056-21) is also the time
+	// it waits before sending data after the baud rate switch, so keep a smoothed measurement per meter
+	
+	if (idx >= 6 && idx < obj->bufsize && obj->buffer[idx] == '\n' && obj->buffer[idx - 1] == '\r') {
+		len = (idx - 2 < D0_IDLEN) ? idx - 2 : D0_IDLEN - 1;	// Without '/' and line end
+		memcpy(id, obj->buffer + 1, len);
+		id[len] = '\0';
+		if (strcmp(id, obj->d0.id)) {
+			if (obj->d0.id[0])
+				logmsg_to(obj->logger, LL_NORMAL, "Another meter is connected, measuring its timing again\n");
+			strcpy(obj->d0.id, id);
+			obj->d0.reaction_ms = 0;
+			obj->d0.adaptive = 1;
+		}
+		obj->d0.reaction_ms = obj->d0.reaction_ms ? (3 * obj->d0.reaction_ms + reaction) / 4 : reaction;
+	}
+	
+	return idx;
+}
+
+
+static unsigned int telegram_parser_d0_switch_delay (const telegram_parser *obj)
+{
+	// Time to wait between acknowledging the identification and switching to the new baud rate,
+	// in ms. The meter switches as soon as it has received the acknowledgement, and starts sending
+	// after its reaction time, so in session mode we switch halfway that time.
+	
+	unsigned int delay = obj->d0.reaction_ms / 2;
+	
+	if (!obj->d0.session || !obj->d0.adaptive || obj->d0.reaction_ms == 0) {
+		return D0_SWITCH_DELAY;
+	}
+	
+	return (delay < D0_SWITCH_MIN) ? D0_SWITCH_MIN : (delay > D0_SWITCH_DELAY) ? D0_SWITCH_DELAY : delay;
+}
+
+
+void telegram_parser_d0_session (telegram_parser *obj, int enable)
+{
+	// Enable or disable session mode for repeated readouts of a D0 meter: the wake-up sequence is
+	// only sent if the meter wasn't read recently (or doesn't respond without it), and the delay
+	// before switching baud rates is derived from the measured reaction time of the meter
+	
+	memset(&(obj->d0), 0, sizeof(telegram_d0_session));
+	obj->d0.session = enable;
+	obj->d0.adaptive = 1;
+	obj->d0.awake_ms = D0_AWAKE;
+}
+
+
 int telegram_parser_read_d0 (telegram_parser *obj, int wakeup) 
 {
 	
-	// Attempt to request data from an optical IEC 62056-21 "D0" interface and parse it
+	// Attempt to request data from an optical IEC 62056-21 "D0" interface and parse it.
+	// The wake-up sequence is sent if wakeup is set (in session mode: only if needed).
+	// Returns 0 if a telegram was parsed, 1 if the BCC didn't match (after retransmissions),
+	// or a negative value if no telegram was received.
 	
 	ssize_t len;
 	unsigned long idx = 0;
+	long result;
+	int awake;
 	
 	if (obj == NULL) {
 		return -1;
@@ -322,63 +1228,28 @@ int telegram_parser_read_d0 (telegram_parser *obj, int wakeup)
 	
 	if (obj->terminal && obj->mode != 'P') {
 	
-		// We need to send a wake-up and sign-on sequence in order to receive a telegram
+		// We need to send a sign-on sequence (and possibly a wake-up sequence) in order to receive a telegram.
+		// In session mode, the wake-up sequence is skipped if the meter was read recently, and only
+		// sent if the meter doesn't respond without it.
 		
-		int count;
-		char zero = 0;
-		
-		logmsg(LL_VERBOSE, "Setting baud rate to 300 baud\n");
-		cfsetspeed(&(obj->newtio), B300);			// Update speed in termio-structure
-		tcsetattr(obj->fd, TCSANOW, &(obj->newtio));	// Set new terminal attributes
-				
-		if (wakeup) {
-			logmsg(LL_VERBOSE, "Sending wake-up sequence\n");
-			for (count = 0 ; count < 65 ; count++) {
-				if (write(obj->fd, &zero, 1) < 0) {
-					logmsg(LL_WARNING, "Unable to send wake-up sequence: %s\n", strerror(errno));
-					break;
-				}
+		if (obj->d0.session) {
+			awake = obj->d0.last_active && stats_now() - obj->d0.last_active < obj->d0.awake_ms * 1000000ULL;
+			result = telegram_parser_d0_signon(obj, wakeup && !awake);
+			if (result == -5 && wakeup && awake) {
+				logmsg_to(obj->logger, LL_VERBOSE, "No response from meter, retrying with wake-up sequence\n");
+				result = telegram_parser_d0_signon(obj, 1);
 			}
-			
-			tcdrain(obj->fd);	// Make sure the data in the output buffer is sent
-			usleep(2700000UL);	// Wait 2.7 seconds
-		}
-		
-		tcflush(obj->fd, TCIFLUSH);	// Flush any unread data that may still be in the input buffer
-		
-		char signonseq[] = "/?!\r\n";
-		logmsg(LL_VERBOSE, "Sending sign-on sequence: %s\n", signonseq);
-		if (write(obj->fd, signonseq, strlen(signonseq)) < strlen(signonseq)) {
-			logmsg(LL_WARNING, "Unable to send sign-on sequence.\n");
-			return -3;
-		}
-		tcdrain(obj->fd);	// Make sure the data in the output buffer is sent
-		
-		// Try to read first character of meter identification string ('/')
-		
-		len = read(obj->fd, obj->buffer, 1);
-		
-		if (len < 0) {
-			logmsg(LL_ERROR, "reading meter ID string: %s\n", strerror(errno));
-			return -4;
-			
-		} else if (len == 0 || obj->buffer[0] != '/') {
-			logmsg(LL_ERROR, "Did not receive a valid meter ID string.\n");
-			return -5;
-			
+			if (result < 0) {
+				obj->d0.last_active = 0;
+			}
+		} else {
+			result = telegram_parser_d0_signon(obj, wakeup);
 		}
 		
-		// Try to read full meter identification string
-		
-		do {
-			idx += 1;
-			len = read(obj->fd, obj->buffer + idx, 1);
-		} while (idx < obj->bufsize && len == 1 && obj->buffer[idx] != '\n');
-		
-		if (idx < obj->bufsize - 1) {
-			obj->buffer[idx + 1] = '\0';
-			logmsg(LL_VERBOSE, "Meter ID string received, %lu bytes: %s\n", idx, obj->buffer);
+		if (result < 0) {
+			return result;
 		}
+		idx = result;
 		
 		obj->mode = 0;
 		speed_t baudrate = B300;
@@ -394,37 +1265,37 @@ int telegram_parser_read_d0 (telegram_parser *obj, int wakeup)
 				obj->mode = 'B';
 			case '1':
 				baudrate = B600;
-				logmsg(LL_VERBOSE, "Upgrading to 600 baud\n");
+				logmsg_to(obj->logger, LL_VERBOSE, "Upgrading to 600 baud\n");
 				break;
 			case 'C':
 				obj->mode = 'B';
 			case '2':
 				baudrate = B1200;
-				logmsg(LL_VERBOSE, "Upgrading to 1200 baud\n");
+				logmsg_to(obj->logger, LL_VERBOSE, "Upgrading to 1200 baud\n");
 				break;
 			case 'D':
 				obj->mode = 'B';
 			case '3':
 				baudrate = B2400;
-				logmsg(LL_VERBOSE, "Upgrading to 2400 baud\n");
+				logmsg_to(obj->logger, LL_VERBOSE, "Upgrading to 2400 baud\n");
 				break;
 			case 'E':
 				obj->mode = 'B';
 			case '4':
 				baudrate = B4800;
-				logmsg(LL_VERBOSE, "Upgrading to 4800 baud\n");
+				logmsg_to(obj->logger, LL_VERBOSE, "Upgrading to 4800 baud\n");
 				break;
 			case 'F':
 				obj->mode = 'B';
 			case '5':
 				baudrate = B9600;
-				logmsg(LL_VERBOSE, "Upgrading to 9600 baud\n");
+				logmsg_to(obj->logger, LL_VERBOSE, "Upgrading to 9600 baud\n");
 				break;
 			case 'G':
 				obj->mode = 'B';
 			case '6':
 				baudrate = B19200;
-				logmsg(LL_VERBOSE, "Upgrading to 19200 baud\n");
+				logmsg_to(obj->logger, LL_VERBOSE, "Upgrading to 19200 baud\n");
 				break;
 			default:
 				if (obj->buffer[4] >= 0x20 && obj->buffer[4] != '/' && obj->buffer[4] != '!' && obj->buffer[4] <= 0x7e) {
@@ -443,7 +1314,7 @@ int telegram_parser_read_d0 (telegram_parser *obj, int wakeup)
 				if (obj->buffer[5] == '\\') {
 					obj->mode = 'E';
 					if (obj->buffer[6] == '2') {
-						logmsg(LL_ERROR, "This parser does not support the IEC 62056-21 binary HDLC protocol.\n");
+						logmsg_to(obj->logger, LL_ERROR, "This parser does not support the IEC 62056-21 binary HDLC protocol.\n");
 						return -8;
 					}
 				} else {
@@ -452,19 +1323,19 @@ int telegram_parser_read_d0 (telegram_parser *obj, int wakeup)
 				
 				// Send ACK sequence
 				char ackseq[6] = {0x06, '0', obj->buffer[4], '0', '\r', '\n'};	// The third character in the ACK message is the baud rate ID
-				logmsg(LL_VERBOSE, "Sending ACK: \\x06 0 %c 0 \\r \\n\n", obj->buffer[4]);
+				logmsg_to(obj->logger, LL_VERBOSE, "Sending ACK: \\x06 0 %c 0 \\r \\n\n", obj->buffer[4]);
 				write(obj->fd, ackseq, 6);
 				tcdrain(obj->fd);
 			}
 			
-			logmsg(LL_VERBOSE, "Meter detected or assumed to use mode %c\n", obj->mode);
+			logmsg_to(obj->logger, LL_VERBOSE, "Meter detected or assumed to use mode %c\n", obj->mode);
 
 			if (obj->mode != 'A') {
 				
 				// Change baud rate
 				
-				usleep(300000UL);	// Wait 300 ms
-				logmsg(LL_VERBOSE, "Setting baud rate\n");
+				usleep(telegram_parser_d0_switch_delay(obj) * 1000UL);
+				logmsg_to(obj->logger, LL_VERBOSE, "Setting baud rate\n");
 				cfsetspeed(&(obj->newtio), baudrate);			// Update speed in termio-structure
 				tcsetattr(obj->fd, TCSANOW, &(obj->newtio));	// Set new terminal attributes
 			}
@@ -475,7 +1346,7 @@ int telegram_parser_read_d0 (telegram_parser *obj, int wakeup)
 				obj->buffer[idx + 1] = '\0';
 			else
 				obj->buffer[idx] = '\0';		
-			logmsg(LL_ERROR, "Invalid meter ID string: %s", obj->buffer);
+			logmsg_to(obj->logger, LL_ERROR, "Invalid meter ID string: %s", obj->buffer);
 			return -6;
 		}	
 	}
@@ -483,103 +1354,173 @@ int telegram_parser_read_d0 (telegram_parser *obj, int wakeup)
 	idx += 1;
 	
 	if (idx >= obj->bufsize - 1) {
-		logmsg(LL_ERROR, "Buffer too small to hold telegram\n");
+		logmsg_to(obj->logger, LL_ERROR, "Buffer too small to hold telegram\n");
 		return -7;
 	}
 	
-	// Attempt to read telegram data
+	// Attempt to read telegram data. The BCC is calculated as the bytes come in, and if it doesn't
+	// match (or the data block is incomplete), a NAK asks the meter to send the data again (in mode C or E).
 	
-	int telegram = 0;
-	unsigned long lrc_start = 0, lrc_end = 0;
+	unsigned long data_start = idx;
+	int telegram, stx, etx, lrc_error, attempt = 0;
+	uint8_t lrc_value, lrc_check;
+	uint64_t end_time, start;
 	
-	do {
-		// Read next byte
-		len = read(obj->fd, obj->buffer + idx, 1);
-		if (len < 0) {
-			logmsg(LL_ERROR, "reading telegram data: %s\n", strerror(errno));
-		} else if (len == 0) {
-			logmsg(LL_WARNING, "read() returned no bytes when reading telegram data\n");
-		} else {
-			if (obj->buffer[idx] == 0x02) {
-				logmsg(LL_VERBOSE, "STX found at offset %lu\n", (unsigned long)idx);
-				lrc_start = idx;	// LRC calculation starts after STX
-				idx--;				// We don't store STX, so overwrite it with the next byte
-			} else if (obj->buffer[idx] == '!') {
-				logmsg(LL_VERBOSE, "Telegram terminator found at offset %lu\n", (unsigned long)idx);
-				telegram = 1;
-			} else if (obj->buffer[idx] == 0x03) {
-				logmsg(LL_VERBOSE, "ETX found at offset %lu\n", (unsigned long)idx);
-				lrc_end = idx;	// LRC calculation ends at ETX (included)
-				break;
-			} else if ((obj->buffer[idx] < 0x20 || obj->buffer[idx] > 0x7e) && obj->buffer[idx] != '\n' && obj->buffer[idx] != '\r') {
-				logmsg(LL_WARNING, "Non-printable byte (0x%02x) in telegram at index %lu\n", (int)(obj->buffer[idx]), idx);
-			}
-			idx++;
-		}
+	for (;;) {
 		
-	} while (len > 0 && idx < obj->bufsize);
-	
-	uint8_t lrc_value = 0;
-	int lrc_error = 0;
-	uint8_t lrc_check = 0xff;
-	
-	if (!telegram) {
-		logmsg(LL_WARNING, "No full telegram found, received %lu bytes of data\n", idx);
-		// TODO: in mode C or E we could send a NAK and request a resend
-	} else {
-		if (lrc_start && lrc_end) {
-			// Try to read the BCC block check byte
-			len = read(obj->fd, &lrc_value, 1);
-			if (len <= 0) {
-				logmsg(LL_WARNING, "Unable to read BCC block check character\n");
+		idx = data_start;
+		telegram = stx = etx = lrc_error = 0;
+		lrc_check = 0;
+		end_time = 0;
+		
+		do {
+			// Read next byte
+			len = read(obj->fd, obj->buffer + idx, 1);
+			if (len < 0) {
+				stats_add(&(obj->stats.read_errors), 1);
+				logmsg_to(obj->logger, LL_ERROR, "reading telegram data: %s\n", strerror(errno));
+			} else if (len == 0) {
+				stats_add(&(obj->stats.timeouts), 1);
+				logmsg_to(obj->logger, LL_WARNING, "read() returned no bytes when reading telegram data\n");
 			} else {
-				unsigned long lrc_idx;
-				for (lrc_idx = lrc_start ; lrc_idx <= lrc_end ; lrc_idx++) {
-					lrc_check ^= obj->buffer[lrc_idx];	// XOR LRC value with next byte
+				stats_add(&(obj->stats.bytes_read), 1);
+				if (stx) {
+					lrc_check ^= obj->buffer[idx];	// BCC covers the bytes after STX, up to and including ETX
 				}
-				lrc_check ^= 0xff;
+				if (obj->buffer[idx] == 0x02) {
+					logmsg_to(obj->logger, LL_VERBOSE, "STX found at offset %lu\n", (unsigned long)idx);
+					stx = 1;
+					lrc_check = 0;
+					idx--;				// We don't store STX, so overwrite it with the next byte
+				} else if (obj->buffer[idx] == '!') {
+					logmsg_to(obj->logger, LL_VERBOSE, "Telegram terminator found at offset %lu\n", (unsigned long)idx);
+					telegram = 1;
+					end_time = stats_now();
+				} else if (obj->buffer[idx] == 0x03) {
+					logmsg_to(obj->logger, LL_VERBOSE, "ETX found at offset %lu\n", (unsigned long)idx);
+					etx = 1;
+					break;
+				} else if ((obj->buffer[idx] < 0x20 || obj->buffer[idx] > 0x7e) && obj->buffer[idx] != '\n' && obj->buffer[idx] != '\r') {
+					logmsg_to(obj->logger, LL_WARNING, "Non-printable byte (0x%02x) in telegram at index %lu\n", (int)(obj->buffer[idx]), idx);
+				}
+				idx++;
 			}
-			logmsg(LL_VERBOSE, "BCC received is %u, LRC calculated is %u\n", (unsigned int)lrc_value, (unsigned int)lrc_check);
 			
-			if (lrc_value != lrc_check) {
-				logmsg(LL_WARNING, "BCC/LRC check failed, data may be invalid\n");
+		} while (len > 0 && idx < obj->bufsize);
+		
+		obj->len = idx;
+		
+		if (stx) {
+			if (!etx) {
+				logmsg_to(obj->logger, LL_WARNING, "Data block incomplete, received %lu bytes without ETX\n", idx - data_start);
 				lrc_error = 1;
+			} else if (read(obj->fd, &lrc_value, 1) <= 0) {
+				logmsg_to(obj->logger, LL_WARNING, "Unable to read BCC block check character\n");
+				lrc_error = 1;
+			} else {
+				logmsg_to(obj->logger, LL_VERBOSE, "BCC received is %u, LRC calculated is %u\n", (unsigned int)lrc_value, (unsigned int)lrc_check);
+				if (lrc_value != lrc_check) {
+					logmsg_to(obj->logger, LL_WARNING, "BCC/LRC check failed\n");
+					stats_add(&(obj->stats.crc_failures), 1);
+					lrc_error = 1;
+				}
 			}
+		} else if (telegram) {
+			logmsg_to(obj->logger, LL_WARNING, "No STX found, telegram can't be checked\n");
+		}
+		
+		if (!lrc_error) {
+			break;
+		}
+		
+		if (obj->dump && obj->len) {
+			telegram_dump_write(obj->dump, &(obj->dump_limit), obj->buffer, obj->len, 0, DUMP_CRC_MISMATCH, obj->data->equipment_id);
+		}
+		
+		if (!obj->terminal || (obj->mode != 'C' && obj->mode != 'E') || attempt++ >= D0_RETRIES) {
+			break;
+		}
+		
+		// Ask for a retransmission, the meter sends the whole data block again
+		
+		logmsg_to(obj->logger, LL_VERBOSE, "Sending NAK, retransmission %d of %d\n", attempt, D0_RETRIES);
+		const char nak = 0x15;
+		tcflush(obj->fd, TCIFLUSH);
+		write(obj->fd, &nak, 1);
+		tcdrain(obj->fd);
+		obj->d0.retransmissions++;
+	}
+	
+	// Acknowledge a valid data block and sign off
+	
+	if (obj->terminal && obj->mode != 'P' && (stx || telegram)) {
+		const char signoffseq[6] = {0x06, 0x01, 'B', '0', 0x03, 'q'};	// 0x06 is ACK, the other bytes are part of a break sequence (complete sign off)
+		if (lrc_error) {
+			logmsg_to(obj->logger, LL_VERBOSE, "Signing off\n");
+			write(obj->fd, signoffseq + 1, 5);
 		} else {
-			logmsg(LL_WARNING, "LRC block range invalid: %lu - %lu\n", lrc_start, lrc_end);
+			logmsg_to(obj->logger, LL_VERBOSE, "Sending ACK and signing off\n");
+			write(obj->fd, signoffseq, 6);
 		}
+		tcdrain(obj->fd);
 	}
 	
-	// If a full telegram is received, we should send an ACK and sign off
+	// Only parse a complete telegram that passed the BCC check, partial or corrupted data would
+	// only produce parse errors (it's written to the dump file above)
 	
-	if (telegram && obj->terminal && obj->mode != 'P') {
+	if (!telegram || lrc_error) {
+		if (!telegram && !lrc_error) {
+			logmsg_to(obj->logger, LL_WARNING, "No full telegram found, received %lu bytes of data\n", idx);
+		}
+		obj->status = 0;
+	} else {
+		obj->telegram = obj->buffer;
+		start = stats_now();
+		parser_reset(&(obj->parser));
+		parser_execute(&(obj->parser), (const char *)(obj->buffer), obj->len, 1);
+		obj->status = parser_finish(&(obj->parser));	// 1 if final state reached, -1 on error, 0 if final state not reached
 		
-		// TODO: send NAK if LRC is incorrect
+		stats_add(&(obj->stats.telegrams), 1);
+		stats_record(&(obj->stats.parse_time), stats_now() - start);
+		if (end_time) {
+			stats_record(&(obj->stats.latency), stats_now() - end_time);
+		}
 		
-		logmsg(LL_VERBOSE, "Sending ACK and signing off\n");
-		const char signoffseq[6] = {0x06, 0x01, 'B', '0', 0x03, 'q'};	// 0x06 is ACK, the other bytes are part of a break sequence (complete sign off)
-		write(obj->fd, signoffseq, 6);
-		tcdrain(obj->fd);
+		if (obj->parser.parse_errors) {
+			stats_add(&(obj->stats.parse_errors), 1);
+			logmsg_to(obj->logger, LL_VERBOSE, "Parse errors: %d\n", obj->parser.parse_errors);
+			if (obj->dump && obj->len) {
+				telegram_dump_write(obj->dump, &(obj->dump_limit), obj->buffer, obj->len, obj->parser.parse_errors,
+									stx ? DUMP_CRC_OK : DUMP_CRC_NONE, obj->data->equipment_id);
+			}
+		}
+		
+		if (! obj->data->timestamp) {
+			// Set current time, if no timestamp is reported by the meter
+			obj->data->timestamp = time(NULL);
+		}
 	}
 	
-	// We'll try parsing the telegram (even if we receive only a partial one)
+	// In session mode, a successful readout means the meter is awake, and a readout without any
+	// data may mean that our measured delays don't work for this meter
 	
-	obj->len = idx;
-	parser_init(&(obj->parser));
-	parser_execute(&(obj->parser), (const char *)(obj->buffer), obj->len, 1);
-	obj->status = parser_finish(&(obj->parser));	// 1 if final state reached, -1 on error, 0 if final state not reached
-	if (obj->parser.parse_errors) {
-		logmsg(LL_VERBOSE, "Parse errors: %d\n", obj->parser.parse_errors);
-		if (obj->dumpfile) {
-			fwrite(obj->buffer, 1, obj->len, obj->dumpfile);
-			fflush(obj->dumpfile);
+	if (obj->d0.session && obj->terminal) {
+		if (telegram && !lrc_error) {
+			obj->d0.last_active = stats_now();
+			obj->d0.readouts++;
+		} else {
+			obj->d0.last_active = 0;
+			if (!stx && !telegram && obj->mode != 'A' && telegram_parser_d0_switch_delay(obj) < D0_SWITCH_DELAY) {
+				logmsg_to(obj->logger, LL_WARNING, "Readout failed with a baud rate switch after %u ms, using %u ms for this meter from now on\n",
+							telegram_parser_d0_switch_delay(obj), D0_SWITCH_DELAY);
+				obj->d0.adaptive = 0;
+			}
 		}
 	}
 	
-	if (! obj->data->timestamp) {
-		// Set current time, if no timestamp is reported by the meter
-		obj->data->timestamp = time(NULL);
+	if (lrc_error) {
+		return 1;
 	}
 	
-	return lrc_error;
+	return telegram ? 0 : -9;
 }
@@ -1,11 +1,19 @@
+#ifndef P1_LIB_H
+
 #include <stdlib.h>
+#include <sys/types.h>
 #include <termios.h>
 
+#include "logmsg.h"
 #include "p1-parser.h"
 #include "dsmr-data.h"
+#include "p1-dump.h"
+#include "p1-stats.h"
+#include "p1-baud.h"
 
 uint16_t crc_telegram (const uint8_t *data, unsigned int length);
 size_t read_telegram (int fd, uint8_t *buf, size_t bufsize, size_t maxfailbytes);
+int telegram_trailer_length (const uint8_t *data, size_t length);
 
 
 // Default size of the buffer used to read and store telegrams, determines maximum telegram size
@@ -17,11 +25,94 @@ size_t read_telegram (int fd, uint8_t *buf, size_t bufsize, size_t maxfailbytes)
 #define READ_TIMEOUT 15
 
 
+// Buffered telegram framer: input is read in large blocks, telegrams are located with memchr()
+// and returned as slices of the framing buffer. Data following a telegram is kept for the next call.
+
+typedef struct telegram_framer_struct {
+	
+	uint8_t *buffer;		// Framing buffer
+	size_t bufsize;			// Framing buffer size, determines maximum telegram size
+	size_t start;			// Offset of first unconsumed byte (start of telegram, if telegram flag is set)
+	size_t end;				// Offset after last byte read
+	size_t scan;			// Offset from which to continue scanning for the end of a telegram
+	int telegram;			// Flag to indicate that a telegram start ('/') was found at offset start
+	size_t crcpos;			// Offset up to which the CRC of the current telegram has been calculated
+	uint16_t crc;			// CRC16 of the current telegram up to crcpos, or of the last telegram found (0 if it has no CRC)
+	size_t failed;			// Number of bytes skipped since the last call to telegram_framer_read()
+	messagelogger *logger;	// Logger used for framing messages
+	telegram_stats *stats;	// Statistics updated by the framer, NULL if none
+	uint64_t fill_time;		// Monotonic time of the last read, in ns (only kept if stats is set)
+	uint64_t end_time;		// Monotonic time at which the terminator of the current or last telegram was read
+	
+} telegram_framer;
+
+
+int telegram_framer_init (telegram_framer *fr, size_t bufsize);
+int telegram_framer_attach (telegram_framer *fr, const uint8_t *data, size_t len);
+void telegram_framer_reset (telegram_framer *fr);
+void telegram_framer_free (telegram_framer *fr);
+ssize_t telegram_framer_fill (telegram_framer *fr, int fd);
+size_t telegram_framer_next (telegram_framer *fr, const uint8_t **telegram);
+size_t telegram_framer_read (telegram_framer *fr, int fd, const uint8_t **telegram, size_t maxfailbytes);
+
+
+// Low-latency reading from P1 serial devices, see telegram_parser_low_latency()
+
+#define LOW_LATENCY_SLACK	2		// Time allowed on top of the transmission time of the bytes expected, in ms
+
+typedef struct telegram_low_latency_struct {
+	
+	int enabled;			// Flag to indicate low-latency mode (non-blocking reads, waiting in ppoll())
+	int serial_flags;		// Driver flags before ASYNC_LOW_LATENCY was set, -1 if they weren't changed
+	size_t expected;		// Length of the last telegram, the next one is expected to be about as long
+	
+} telegram_low_latency;
+
+
+// IEC 62056-21 (D0) timing, in ms
+
+#define D0_WAKEUP_DELAY		2700	// Wait after the wake-up sequence
+#define D0_SWITCH_DELAY		300		// Default wait between acknowledging the identification and switching baud rate
+#define D0_SWITCH_MIN		20		// Minimum wait before switching baud rate in session mode
+#define D0_REACTION_TIMEOUT	2000	// Time to wait for a reaction to the sign-on in session mode (IEC: at most 1500 ms)
+#define D0_AWAKE			10000	// Time after a readout during which the meter is assumed to be awake
+#define D0_IDLEN			32		// Maximum length of the identification string that is remembered
+#define D0_RETRIES			3		// Maximum number of retransmissions requested (with a NAK) for a data block with a bad BCC
+
+
+// State kept between readouts of a D0 meter in session mode
+
+typedef struct telegram_d0_session_struct {
+	
+	int session;				// Flag to indicate session mode, see telegram_parser_d0_session()
+	int adaptive;				// Flag to use the measured reaction time, cleared if a readout fails with it
+	unsigned int awake_ms;		// Time after a readout during which no wake-up sequence is sent
+	unsigned int reaction_ms;	// Smoothed time between the sign-on and the identification, 0 if not measured
+	uint64_t last_active;		// Monotonic time of the last successful readout (in ns), 0 if none
+	char id[D0_IDLEN];			// Identification string, to detect that another meter is connected
+	unsigned long readouts;		// Number of successful readouts
+	unsigned long wakeups;		// Number of wake-up sequences sent
+	unsigned long retransmissions;	// Number of retransmissions requested
+	
+} telegram_d0_session;
+
+
+// Callback used in streaming mode, called at the end of every telegram. The result is 0, or -4 if
+// the CRC does not match. The parsed data (obj->data) is valid until the callback returns.
+// The bytes of a telegram aren't kept in streaming mode, so telegrams with parse errors or a CRC
+// mismatch are counted in obj->stats, but not written to the dump file (obj->dump).
+
+struct telegram_parser_struct;
+typedef void (*telegram_parser_callback) (struct telegram_parser_struct *obj, int result, void *userdata);
+
+
 typedef struct telegram_parser_struct {
 	
 	int fd;					// Input file descriptor
 	int timeout;			// Time-out for reading serial data, in seconds
-	FILE *dumpfile;			// File descriptor used to write telegrams with parsing errors
+	telegram_dump *dump;	// Dump file for telegrams with parse errors or CRC mismatches, NULL if none
+	int dump_owned;			// Flag to indicate that the dump was opened by (and is closed with) this object
+	telegram_dump_limit dump_limit;	// Rate limit state of this meter
 	int terminal;			// Flag to indicate whether input is a terminal or a file
 	struct termios 	oldtio, 
 					newtio;	// Terminal settings
@@ -34,15 +125,43 @@ typedef struct telegram_parser_struct {
 	size_t bufsize;			// Telegram buffer size
 	size_t len;				// Telegram length
 	uint8_t *buffer;		// Telegram buffer pointer
+	const uint8_t *telegram;	// Last telegram read, points into the framing buffer (P1) or telegram buffer (D0)
+	
+	telegram_framer framer;	// Buffered framer used to read P1 telegrams
 	
 	char mode;				// Meter mode (A, B, C, D, E for IEC, or P for DSMR P1)
+	telegram_baud_detect baud;	// Baud rate detection state (P1 serial devices)
+	telegram_d0_session d0;		// Session state of D0 meters
+	telegram_low_latency lowlat;	// Low-latency mode state (P1 serial devices)
+	
+	messagelogger *logger;	// Logger used by this parser object (the default logger, unless set otherwise)
+	
+	telegram_parser_callback callback;	// Called for every telegram in streaming mode, NULL otherwise
+	void *userdata;
+	uint64_t telegrams;		// Number of telegrams completed in streaming mode
+	size_t failed;			// Number of bytes fed since the last telegram in streaming mode
+	
+	telegram_stats stats;	// Counters and latency histograms of this meter
 	
 } telegram_parser;
 
 
 int telegram_parser_open (telegram_parser *obj, char *infile, size_t bufsize, int timeout, char *dumpfile);
 void telegram_parser_close (telegram_parser *obj);
+void telegram_parser_set_logger (telegram_parser *obj, messagelogger *lg);
+void telegram_parser_set_dump (telegram_parser *obj, telegram_dump *dump);
 int telegram_parser_read (telegram_parser *obj);
+int telegram_parser_parse (telegram_parser *obj);
+void telegram_parser_set_callback (telegram_parser *obj, telegram_parser_callback callback, void *userdata);
+int telegram_parser_feed (telegram_parser *obj, const uint8_t *data, size_t len);
+ssize_t telegram_parser_stream_read (telegram_parser *obj);
+void telegram_parser_toggle_baudrate (telegram_parser *obj);
+int telegram_parser_detect (telegram_parser *obj, const uint8_t *data, size_t len);
+int telegram_parser_low_latency (telegram_parser *obj, int enable);
 
 int telegram_parser_open_d0 (telegram_parser *obj, char *infile, size_t bufsize, int timeout, char *dumpfile);
 int telegram_parser_read_d0 (telegram_parser *obj, int wakeup);
+void telegram_parser_d0_session (telegram_parser *obj, int enable);
+
+#define P1_LIB_H	1
+#endif
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logmsg.h"
+
+#include "p1-lib.h"
+#include "dsmr-log.h"
+
+
+// Append parsed readings from a P1 device or telegram file to a reading log, or query a
+// time range of a log, while another process may be appending to it.
+
+
+void print_reading (const struct dsmr_compact_struct *r)
+{
+	logmsg(LL_NORMAL, "%lu E_in %.3f %.3f E_out %.3f %.3f P_in %.3f P_out %.3f gas %.3f\n",
+		(unsigned long)(r->timestamp), r->E_in[1], r->E_in[2], r->E_out[1], r->E_out[2],
+		r->P_in_total, r->P_out_total, r->dev_counter[0]);
+}
+
+
+int main (int argc, char **argv)
+{
+
+	init_msglogger();
+	logger.loglevel = LL_NORMAL;
+
+	dsmr_log log;
+	telegram_parser parser;
+	const struct dsmr_compact_struct *r;
+	size_t first, n, i, appended = 0, skipped = 0;
+	uint32_t from, to;
+	int result;
+
+	if (argc < 3 || (!strcmp(argv[2], "append") && argc < 4) || (!strcmp(argv[2], "range") && argc < 5)
+			|| (!strcmp(argv[2], "at") && argc < 4)) {
+		logmsg(LL_NORMAL, "Usage: %s <log file> append <input file or device> [<sync>]\n", argv[0]);
+		logmsg(LL_NORMAL, "       %s <log file> range <from> <to>    (UNIX time)\n", argv[0]);
+		logmsg(LL_NORMAL, "       %s <log file> at <time>            (last reading at or before time)\n", argv[0]);
+		logmsg(LL_NORMAL, "       %s <log file> follow\n", argv[0]);
+		exit(1);
+	}
+
+	if (!strcmp(argv[2], "append")) {
+
+		if (dsmr_log_open(&log, argv[1], 1) < 0) {
+			exit(2);
+		}
+		log.sync = (argc >= 5);
+
+		if (telegram_parser_open(&parser, argv[3], 0, 0, NULL) < 0) {
+			exit(3);
+		}
+		parser.parser.output = PARSER_OUTPUT_COMPACT;
+
+		for (;;) {
+			result = telegram_parser_read(&parser);
+			if (parser.len == 0 && !parser.terminal)
+				break;
+			if (parser.len == 0)
+				continue;
+			if (result < 0 || parser.parser.parse_errors || !(parser.parser.compact.present & HAS_TIMESTAMP)
+					|| dsmr_log_append(&log, &(parser.parser.compact)) < 0)
+				skipped++;
+			else
+				appended++;
+		}
+
+		logmsg(LL_NORMAL, "%lu readings appended, %lu skipped, %lu in log\n", (unsigned long)appended, (unsigned long)skipped, (unsigned long)(log.count));
+		telegram_parser_close(&parser);
+
+	} else {
+
+		if (dsmr_log_open(&log, argv[1], 0) < 0) {
+			exit(2);
+		}
+
+		if (!strcmp(argv[2], "range")) {
+			from = strtoul(argv[3], NULL, 10);
+			to = strtoul(argv[4], NULL, 10);
+			n = dsmr_log_range(&log, from, to, &first);
+			for (i = first ; i < first + n ; i++)
+				print_reading(dsmr_log_get(&log, i));
+			logmsg(LL_NORMAL, "%lu of %lu readings in range\n", (unsigned long)n, (unsigned long)(log.count));
+		} else if (!strcmp(argv[2], "at")) {
+			i = dsmr_log_find(&log, strtoul(argv[3], NULL, 10) + 1);
+			if (i > 0)
+				print_reading(dsmr_log_get(&log, i - 1));
+			else
+				logmsg(LL_NORMAL, "No reading at or before %s\n", argv[3]);
+		} else if (!strcmp(argv[2], "follow")) {
+			for (i = log.count ; ; sleep(1)) {
+				dsmr_log_refresh(&log);
+				for ( ; (r = dsmr_log_get(&log, i)) != NULL ; i++)
+					print_reading(r);
+			}
+		} else {
+			logmsg(LL_ERROR, "Unknown command %s\n", argv[2]);
+			exit(1);
+		}
+	}
+
+	dsmr_log_close(&log);
+
+	return 0;
+}
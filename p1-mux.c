@@ -0,0 +1,340 @@
+/*
+   File: p1-mux.c
+
+   	  Read telegrams from many P1 serial devices in a single thread, using epoll.
+   	  Each port has its own telegram parser, framing buffer, baud rate probing and dump file.
+   	  The statistics of all ports can be written to a file periodically.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "logmsg.h"
+
+#include "p1-mux.h"
+
+
+static time_t monotonic_seconds (void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+
+int telegram_mux_init (telegram_mux *mux, int maxports, telegram_mux_callback callback, void *userdata)
+{
+	if (mux == NULL || maxports <= 0) {
+		return -1;
+	}
+	
+	mux->nports = 0;
+	mux->maxports = 0;
+	mux->callback = callback;
+	mux->userdata = userdata;
+	mux->stats_file = NULL;
+	mux->stats_interval = 0;
+	mux->stats = NULL;
+	
+	mux->ports = calloc(maxports, sizeof(telegram_mux_port));
+	if (mux->ports == NULL) {
+		logmsg(LL_ERROR, "Could not allocate %d ports\n", maxports);
+		return -2;
+	}
+	mux->maxports = maxports;
+	
+	mux->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (mux->epfd < 0) {
+		logmsg(LL_ERROR, "Could not create epoll instance: %s\n", strerror(errno));
+		free(mux->ports);
+		mux->ports = NULL;
+		mux->maxports = 0;
+		return -3;
+	}
+	
+	return 0;
+}
+
+
+int telegram_mux_add (telegram_mux *mux, char *infile, size_t bufsize, int timeout, char *dumpfile)
+{
+	// Open a P1 device and add it to the multiplexer, returns the port number
+	
+	struct epoll_event ev;
+	telegram_mux_port *port;
+	int result;
+	
+	if (mux == NULL || mux->ports == NULL) {
+		return -1;
+	}
+	
+	if (mux->nports >= mux->maxports) {
+		logmsg(LL_ERROR, "Cannot add %s, maximum number of ports (%d) reached\n", infile, mux->maxports);
+		return -5;
+	}
+	
+	port = mux->ports + mux->nports;
+	
+	result = telegram_parser_open(&(port->parser), infile, bufsize, timeout, dumpfile);
+	if (result < 0) {
+		telegram_parser_close(&(port->parser));
+		return result;
+	}
+	
+	// The event loop never blocks in read(), so make the device non-blocking
+	
+	fcntl(port->parser.fd, F_SETFL, fcntl(port->parser.fd, F_GETFL) | O_NONBLOCK);
+	
+	ev.events = EPOLLIN;
+	ev.data.u32 = mux->nports;
+	
+	if (epoll_ctl(mux->epfd, EPOLL_CTL_ADD, port->parser.fd, &ev) < 0) {
+		logmsg(LL_ERROR, "Could not add %s to epoll set: %s\n", infile, strerror(errno));
+		telegram_parser_close(&(port->parser));
+		return -6;
+	}
+	
+	port->active = 1;
+	port->last_telegram = monotonic_seconds();
+	port->failed = 0;
+	
+	logmsg(LL_VERBOSE, "Added %s as port %d\n", infile, mux->nports);
+	
+	return mux->nports++;
+}
+
+
+static void telegram_mux_remove (telegram_mux *mux, int idx)
+{
+	telegram_mux_port *port = mux->ports + idx;
+	
+	if (port->active) {
+		epoll_ctl(mux->epfd, EPOLL_CTL_DEL, port->parser.fd, NULL);
+		port->active = 0;
+	}
+}
+
+
+static int telegram_mux_read_port (telegram_mux *mux, int idx, time_t now)
+{
+	// Read available data from a port and deliver all complete telegrams, returns the number of telegrams
+	
+	telegram_mux_port *port = mux->ports + idx;
+	telegram_parser *obj = &(port->parser);
+	ssize_t len;
+	int result, count = 0;
+	
+	obj->framer.failed = 0;
+	
+	len = telegram_framer_fill(&(obj->framer), obj->fd);
+	
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EINTR) {
+			return 0;
+		}
+		logmsg(LL_ERROR, "Port %d: read error: %s\n", idx, strerror(errno));
+		telegram_mux_remove(mux, idx);
+		return 0;
+	} else if (len == 0) {
+		logmsg(LL_ERROR, "Port %d: end of input\n", idx);
+		telegram_mux_remove(mux, idx);
+		return 0;
+	}
+	
+	if (telegram_parser_detect(obj, obj->framer.buffer + obj->framer.end - len, len)) {
+		// Data looked like it was received at the wrong baud rate, and the rate was switched
+		port->last_telegram = now;
+		port->failed = 0;
+		return 0;
+	}
+	
+	while ((obj->len = telegram_framer_next(&(obj->framer), &(obj->telegram))) > 0) {
+		result = telegram_parser_parse(obj);
+		port->last_telegram = now;
+		port->failed = 0;
+		count++;
+		if (mux->callback) {
+			mux->callback(obj, idx, result, mux->userdata);
+		}
+	}
+	
+	port->failed += obj->framer.failed;
+	
+	return count;
+}
+
+
+static void telegram_mux_probe (telegram_mux *mux, time_t now)
+{
+	// Switch baud rates on ports that haven't produced a valid telegram within their time-out,
+	// or that have produced a full buffer of garbage
+	
+	int idx;
+	
+	for (idx = 0 ; idx < mux->nports ; idx++) {
+		telegram_mux_port *port = mux->ports + idx;
+		telegram_parser *obj = &(port->parser);
+		
+		if (!port->active || !obj->terminal || obj->mode != 'P') {
+			continue;
+		}
+		
+		if (now - port->last_telegram >= obj->timeout || port->failed >= obj->framer.bufsize) {
+			logmsg(LL_VERBOSE, "Port %d: no valid telegram received, switching baud rate\n", idx);
+			if (port->failed < obj->framer.bufsize)
+				stats_add(&(obj->stats.timeouts), 1);
+			telegram_parser_toggle_baudrate(obj);
+			port->last_telegram = now;
+			port->failed = 0;
+		}
+	}
+}
+
+
+int telegram_mux_set_stats_file (telegram_mux *mux, const char *filename, int interval)
+{
+	// Write the statistics of all ports to a file (in the Prometheus text format) every interval seconds
+	
+	if (mux == NULL || mux->ports == NULL || filename == NULL || interval <= 0) {
+		return -1;
+	}
+	
+	free(mux->stats_file);
+	mux->stats_file = strdup(filename);
+	if (mux->stats == NULL)
+		mux->stats = calloc(mux->maxports, sizeof(telegram_stats *));
+	if (mux->stats_file == NULL || mux->stats == NULL) {
+		logmsg(LL_ERROR, "Could not allocate statistics of %d ports\n", mux->maxports);
+		return -2;
+	}
+	
+	mux->stats_interval = interval;
+	mux->stats_next = monotonic_seconds();
+	
+	return 0;
+}
+
+
+static void telegram_mux_write_stats (telegram_mux *mux, time_t now)
+{
+	int idx;
+	
+	if (mux->stats_file == NULL || now < mux->stats_next) {
+		return;
+	}
+	
+	for (idx = 0 ; idx < mux->nports ; idx++) {
+		mux->stats[idx] = &(mux->ports[idx].parser.stats);
+	}
+	telegram_stats_write_file(mux->stats_file, mux->stats, mux->nports);
+	
+	mux->stats_next = now + mux->stats_interval;
+}
+
+
+int telegram_mux_run (telegram_mux *mux, int timeout_ms)
+{
+	// Wait for data on any of the ports for at most timeout_ms milliseconds (or indefinitely 
+	// if timeout_ms is negative), and deliver telegrams through the callback.
+	// Returns the number of telegrams delivered, or a negative value on error.
+	
+	struct epoll_event events[64];
+	int nevents, ev, idx, wait_ms, count = 0;
+	time_t now, deadline;
+	
+	if (mux == NULL || mux->epfd < 0) {
+		return -1;
+	}
+	
+	// Wake up in time for the first baud rate probe deadline
+	
+	now = monotonic_seconds();
+	wait_ms = timeout_ms;
+	
+	for (idx = 0 ; idx < mux->nports ; idx++) {
+		telegram_mux_port *port = mux->ports + idx;
+		if (port->active && port->parser.terminal && port->parser.mode == 'P') {
+			deadline = port->last_telegram + port->parser.timeout;
+			int ms = (deadline > now) ? (deadline - now) * 1000 : 0;
+			if (wait_ms < 0 || ms < wait_ms)
+				wait_ms = ms;
+		}
+	}
+	
+	if (mux->stats_file) {
+		int ms = (mux->stats_next > now) ? (mux->stats_next - now) * 1000 : 0;
+		if (wait_ms < 0 || ms < wait_ms)
+			wait_ms = ms;
+	}
+	
+	nevents = epoll_wait(mux->epfd, events, sizeof(events) / sizeof(events[0]), wait_ms);
+	
+	if (nevents < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		logmsg(LL_ERROR, "epoll_wait: %s\n", strerror(errno));
+		return -2;
+	}
+	
+	now = monotonic_seconds();
+	
+	for (ev = 0 ; ev < nevents ; ev++) {
+		idx = events[ev].data.u32;
+		if (idx >= mux->nports || !mux->ports[idx].active) {
+			continue;
+		}
+		if (events[ev].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+			count += telegram_mux_read_port(mux, idx, now);
+		}
+	}
+	
+	telegram_mux_probe(mux, now);
+	telegram_mux_write_stats(mux, now);
+	
+	return count;
+}
+
+
+void telegram_mux_close (telegram_mux *mux)
+{
+	int idx;
+	
+	if (mux == NULL) {
+		return;
+	}
+	
+	if (mux->stats_file) {
+		mux->stats_next = 0;
+		telegram_mux_write_stats(mux, 0);		// Leave the final statistics behind
+	}
+	free(mux->stats_file);
+	free(mux->stats);
+	mux->stats_file = NULL;
+	mux->stats = NULL;
+	
+	for (idx = 0 ; idx < mux->nports ; idx++) {
+		telegram_mux_remove(mux, idx);
+		telegram_parser_close(&(mux->ports[idx].parser));
+	}
+	
+	if (mux->ports) {
+		free(mux->ports);
+		mux->ports = NULL;
+	}
+	mux->nports = mux->maxports = 0;
+	
+	if (mux->epfd >= 0) {
+		close(mux->epfd);
+		mux->epfd = -1;
+	}
+}
@@ -0,0 +1,52 @@
+/*
+   File: p1-mux.h
+
+   	  Read telegrams from many P1 serial devices in a single thread, using epoll.
+*/
+
+#ifndef P1_MUX_H
+
+#include "p1-lib.h"
+
+
+// Callback used to deliver parsed telegrams. The result is the return value of telegram_parser_parse(),
+// the telegram (obj->telegram, obj->len) and the parsed data (obj->data) are valid until the callback returns.
+
+typedef void (*telegram_mux_callback) (telegram_parser *obj, int port, int result, void *userdata);
+
+
+typedef struct telegram_mux_port_struct {
+	
+	telegram_parser parser;		// Parser state, framing buffer and dump file of this port
+	int active;					// Flag to indicate that the port is registered with epoll
+	time_t last_telegram;		// Monotonic time of the last telegram (or baud rate switch), in seconds
+	size_t failed;				// Number of bytes skipped since the last telegram (or baud rate switch)
+	
+} telegram_mux_port;
+
+
+typedef struct telegram_mux_struct {
+	
+	int epfd;					// epoll file descriptor
+	int nports, maxports;		// Number of ports in use and allocated
+	telegram_mux_port *ports;	// Port array, allocated once so parser pointers stay valid
+	
+	telegram_mux_callback callback;
+	void *userdata;
+	
+	char *stats_file;			// Statistics file rewritten every stats_interval seconds, NULL if none
+	int stats_interval;
+	time_t stats_next;			// Monotonic time at which the statistics file is next written
+	telegram_stats **stats;		// Statistics of every port, as passed to telegram_stats_write_file()
+	
+} telegram_mux;
+
+
+int telegram_mux_init (telegram_mux *mux, int maxports, telegram_mux_callback callback, void *userdata);
+int telegram_mux_add (telegram_mux *mux, char *infile, size_t bufsize, int timeout, char *dumpfile);
+int telegram_mux_set_stats_file (telegram_mux *mux, const char *filename, int interval);
+int telegram_mux_run (telegram_mux *mux, int timeout_ms);
+void telegram_mux_close (telegram_mux *mux);
+
+#define P1_MUX_H	1
+#endif
@@ -0,0 +1,76 @@
+/*
+   File: p1-obis-table.h
+
+   	  Perfect hash of the known OBIS codes in p1-obis.c, generated by p1-obis.c with MAKEOBISH defined
+*/
+
+#define OBIS_HASH_ENTRIES		89
+#define OBIS_HASH_MULTIPLIER	0x9bb024aec20eab0bULL
+#define OBIS_HASH_EMPTY			255
+
+static const uint8_t obis_hash_index[1024] = {
+	  3, 255, 255, 255,  86,  66, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	 32, 255,  88, 255, 255, 255, 255, 255, 255, 255,  36, 255, 255, 255,  80, 255,
+	  7, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  22, 255,
+	  0, 255, 255, 255, 255,   2, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255,  11, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  26,
+	255, 255, 255, 255, 255, 255,  71, 255, 255, 255, 255, 255,  52, 255, 255, 255,
+	255, 255, 255, 255,  27, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255,  48, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255,   1, 255, 255, 255, 255,  87, 255, 255, 255, 255, 255,  55, 255, 255,
+	255, 255, 255,  35, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255,  51,  46, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  60, 255,
+	255, 255, 255,  17, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255,  76, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255,  25, 255, 255, 255, 255, 255, 255,  63,
+	255, 255, 255, 255,  58, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255,   6, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255,  64, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255,  10, 255, 255,  30, 255, 255, 255,
+	255, 255,  40, 255, 255, 255, 255, 255, 255,  65, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  21,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255,  24, 255, 255, 255, 255, 255, 255, 255, 255, 255,  68, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  15, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  70, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255,  83, 255, 255, 255, 255, 255, 255, 255,  20, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  39, 255, 255, 255,
+	255, 255, 255, 255, 255,  43, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255,  54, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255,  13, 255, 255, 255, 255, 255,  50,  45, 255, 255, 255, 255,  73, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	  5, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255,   9, 255, 255,  62, 255, 255, 255, 255,  57, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255,  38, 255, 255, 255, 255, 255, 255, 255, 255,  42, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255,  14, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  79, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  23, 255,
+	 67, 255, 255, 255,  75,  84, 255, 255, 255, 255, 255, 255, 255,  31, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  18, 255,
+	255, 255, 255, 255, 255, 255, 255, 255,  41, 255, 255, 255,  81, 255, 255, 255,
+	 69, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  34, 255,
+	255, 255, 255, 255, 255, 255, 255, 255,   4, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255,  72, 255, 255, 255, 255, 255,  53, 255,   8, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  49,  44, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  12, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255,  85, 255, 255, 255, 255, 255, 255, 255, 255,
+	255,  29, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  47, 255,
+	255,  19, 255, 255, 255, 255, 255, 255, 255,  61, 255, 255, 255, 255,  56, 255,
+	255,  78, 255, 255, 255, 255, 255,  33, 255, 255, 255, 255, 255, 255, 255, 255,
+	 37, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  16, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  59,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  74, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  82,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255,  77,  28, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255
+};
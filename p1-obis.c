@@ -0,0 +1,633 @@
+/*
+   File: p1-obis.c
+
+   	  Registry of OBIS codes, see p1-obis.h.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "logmsg.h"
+
+#include "p1-parser.h"
+
+
+// Known OBIS codes. After changing this table, regenerate p1-obis-table.h (see the end of this file).
+
+#define OBIS_HASH_BITS	10		// Size of the perfect hash index, 2^OBIS_HASH_BITS
+
+#define OBIS_GRAMMAR(a, b, c, d, e, name)	{ OBIS_CODE(a, b, c, d, e), name, OBIS_SLOT_GRAMMAR, 0, 0 }
+#define OBIS_KNOWN(a, b, c, d, e, name)		{ OBIS_CODE(a, b, c, d, e), name, OBIS_SLOT_NONE, 0, 0 }
+
+// Codes of M-bus devices, for channels 1 to MAX_DEVS
+#define OBIS_MBUS(c, d, e, name, slot) \
+	{ OBIS_CODE(0, 1, c, d, e), name "[0]", slot, 0, 0 }, { OBIS_CODE(0, 2, c, d, e), name "[1]", slot, 1, 0 }, \
+	{ OBIS_CODE(0, 3, c, d, e), name "[2]", slot, 2, 0 }, { OBIS_CODE(0, 4, c, d, e), name "[3]", slot, 3, 0 }
+
+static const obis_entry obis_entries[] = {
+
+	// DSMR codes, handled by the grammar
+
+	OBIS_GRAMMAR(1, 3, 0, 2, 8, "P1_version"),
+	OBIS_GRAMMAR(0, 0, 1, 0, 0, "timestamp"),
+	OBIS_GRAMMAR(0, 0, 96, 1, 1, "equipment_id"),
+	OBIS_GRAMMAR(0, 0, 0, 0, 0, "equipment_id"), OBIS_GRAMMAR(1, 0, 0, 0, 0, "equipment_id"),	// IEC 62056-21 equipment ID, any medium
+	OBIS_GRAMMAR(2, 0, 0, 0, 0, "equipment_id"), OBIS_GRAMMAR(3, 0, 0, 0, 0, "equipment_id"),
+	OBIS_GRAMMAR(4, 0, 0, 0, 0, "equipment_id"), OBIS_GRAMMAR(5, 0, 0, 0, 0, "equipment_id"),
+	OBIS_GRAMMAR(6, 0, 0, 0, 0, "equipment_id"), OBIS_GRAMMAR(7, 0, 0, 0, 0, "dev_id[0]"),
+	OBIS_GRAMMAR(8, 0, 0, 0, 0, "equipment_id"), OBIS_GRAMMAR(9, 0, 0, 0, 0, "equipment_id"),
+	OBIS_GRAMMAR(1, 0, 1, 8, OBIS_ANY, "E_in"),
+	OBIS_GRAMMAR(1, 0, 2, 8, OBIS_ANY, "E_out"),
+	OBIS_GRAMMAR(0, 0, 96, 14, 0, "tariff"),
+	OBIS_GRAMMAR(0, 0, 96, 3, 10, "switchpos"),
+	OBIS_GRAMMAR(0, 0, 24, 4, 0, "switchpos"),
+	OBIS_GRAMMAR(1, 0, 1, 7, 0, "P_in_total"),
+	OBIS_GRAMMAR(1, 0, 2, 7, 0, "P_out_total"),
+	OBIS_GRAMMAR(0, 0, 17, 0, 0, "P_threshold"),
+	OBIS_GRAMMAR(0, 0, 96, 7, 21, "power_failures"),
+	OBIS_GRAMMAR(0, 0, 96, 7, 9, "power_failures_long"),
+	OBIS_GRAMMAR(1, 0, 99, 97, 0, "pfail_events"),
+	OBIS_GRAMMAR(1, 0, 32, 32, 0, "V_sags[0]"), OBIS_GRAMMAR(1, 0, 52, 32, 0, "V_sags[1]"), OBIS_GRAMMAR(1, 0, 72, 32, 0, "V_sags[2]"),
+	OBIS_GRAMMAR(1, 0, 32, 36, 0, "V_swells[0]"), OBIS_GRAMMAR(1, 0, 52, 36, 0, "V_swells[1]"), OBIS_GRAMMAR(1, 0, 72, 36, 0, "V_swells[2]"),
+	OBIS_GRAMMAR(0, 0, 96, 13, 1, "textmsg_codes"),
+	OBIS_GRAMMAR(0, 0, 96, 13, 0, "textmsg"),
+	OBIS_GRAMMAR(1, 0, 31, 7, 0, "I[0]"), OBIS_GRAMMAR(1, 0, 51, 7, 0, "I[1]"), OBIS_GRAMMAR(1, 0, 71, 7, 0, "I[2]"),
+	OBIS_GRAMMAR(1, 0, 32, 7, 0, "V[0]"), OBIS_GRAMMAR(1, 0, 52, 7, 0, "V[1]"), OBIS_GRAMMAR(1, 0, 72, 7, 0, "V[2]"),
+	OBIS_GRAMMAR(1, 0, 21, 7, 0, "P_in[0]"), OBIS_GRAMMAR(1, 0, 41, 7, 0, "P_in[1]"), OBIS_GRAMMAR(1, 0, 61, 7, 0, "P_in[2]"),
+	OBIS_GRAMMAR(1, 0, 22, 7, 0, "P_out[0]"), OBIS_GRAMMAR(1, 0, 42, 7, 0, "P_out[1]"), OBIS_GRAMMAR(1, 0, 62, 7, 0, "P_out[2]"),
+	OBIS_MBUS(24, 1, 0, "dev_type", OBIS_SLOT_GRAMMAR),
+	OBIS_MBUS(96, 1, 0, "dev_id", OBIS_SLOT_GRAMMAR),
+	OBIS_MBUS(24, 2, 1, "dev_counter", OBIS_SLOT_GRAMMAR),
+	OBIS_MBUS(24, 4, 0, "dev_valve", OBIS_SLOT_GRAMMAR),
+	OBIS_MBUS(24, 3, 0, "dev_counter", OBIS_SLOT_GRAMMAR),		// DSMR 3.x profile generic dataset
+	OBIS_GRAMMAR(7, 0, 23, 1, 0, "dev_counter[0]"),
+
+	// Belgian (e-MUCS) M-bus devices: counter with capture time, and ID
+
+	OBIS_MBUS(24, 2, 3, "dev_counter", OBIS_SLOT_DEV_COUNTER),
+	OBIS_MBUS(96, 1, 1, "dev_id", OBIS_SLOT_DEV_ID),
+
+	// Slave devices of older meters (DSMR 2.x and IEC 62056-21)
+
+	{ OBIS_CODE(7, 0, 24, 4, 0), "dev_valve[0]", OBIS_SLOT_DEV_VALVE, 0, 3 },		// Gas
+	{ OBIS_CODE(5, 0, 1, 0, 0), "dev_counter[1]", OBIS_SLOT_DEV_COUNTER, 1, 4 },	// Heat
+	{ OBIS_CODE(6, 0, 1, 0, 0), "dev_counter[2]", OBIS_SLOT_DEV_COUNTER, 2, 10 },	// Cold
+	{ OBIS_CODE(8, 0, 1, 0, 0), "dev_counter[3]", OBIS_SLOT_DEV_COUNTER, 3, 7 },	// Water
+	OBIS_KNOWN(7, 0, 23, 2, 0, "Temperature-compensated gas volume"),
+
+	// Known extensions, not stored
+
+	OBIS_KNOWN(0, 0, 96, 1, 4, "Belgian P1 version"),
+	OBIS_KNOWN(1, 0, 1, 4, 0, "Average demand, current quarter-hour"),
+	OBIS_KNOWN(1, 0, 1, 6, 0, "Maximum demand, current month"),
+	OBIS_KNOWN(0, 0, 98, 1, 0, "Maximum demand, last 13 months"),
+	OBIS_KNOWN(1, 0, 31, 4, 0, "Current limit"),
+	OBIS_KNOWN(0, 0, 96, 3, 1, "Breaker state"),
+	OBIS_KNOWN(1, 0, 3, 8, 0, "Reactive energy in"),
+	OBIS_KNOWN(1, 0, 4, 8, 0, "Reactive energy out"),
+	OBIS_KNOWN(1, 0, 3, 7, 0, "Reactive power in"),
+	OBIS_KNOWN(1, 0, 4, 7, 0, "Reactive power out"),
+	OBIS_KNOWN(0, 0, 42, 0, 0, "Logical device name"),
+};
+
+#define OBIS_NENTRIES	(sizeof(obis_entries) / sizeof(obis_entries[0]))
+
+
+static inline unsigned int obis_hash (uint64_t code, uint64_t multiplier)
+{
+	return (unsigned int)((code * multiplier) >> (64 - OBIS_HASH_BITS));
+}
+
+
+uint64_t obis_code_parse (const char *str)
+{
+	// Parse an OBIS code of the form A-B:C.D.E, with an optional billing period (*F), which is ignored
+
+	static const char separators[OBIS_FIELDS] = "-:..";
+	unsigned int field[OBIS_FIELDS];
+	int f, digits;
+
+	for (f = 0 ; f < OBIS_FIELDS ; f++) {
+		field[f] = 0;
+		for (digits = 0 ; isdigit((unsigned char)*str) ; str++, digits++) {
+			field[f] = field[f] * 10 + (*str - '0');
+			if (field[f] > 255)
+				return OBIS_CODE_NONE;
+		}
+		if (digits == 0)
+			return OBIS_CODE_NONE;
+		if (f < OBIS_FIELDS - 1 && *str++ != separators[f])
+			return OBIS_CODE_NONE;
+	}
+
+	if (*str != '\0' && *str != '*')
+		return OBIS_CODE_NONE;
+
+	return OBIS_CODE(field[0], field[1], field[2], field[3], field[4]);
+}
+
+
+#ifndef MAKEOBISH
+
+#include "p1-obis-table.h"
+
+// Fails to compile if the table of known codes was changed without regenerating p1-obis-table.h
+
+typedef char obis_table_check[(OBIS_HASH_ENTRIES == OBIS_NENTRIES) ? 1 : -1];
+
+
+const obis_entry *obis_lookup (uint64_t code)
+{
+	// Look up a known code in the perfect hash: a single probe, and a second one for codes that match any value group E
+
+	const obis_entry *entry;
+	unsigned int idx;
+
+	idx = obis_hash_index[obis_hash(code, OBIS_HASH_MULTIPLIER)];
+	if (idx != OBIS_HASH_EMPTY && (entry = obis_entries + idx)->code == code)
+		return entry;
+
+	code |= OBIS_ANY;
+	idx = obis_hash_index[obis_hash(code, OBIS_HASH_MULTIPLIER)];
+	if (idx != OBIS_HASH_EMPTY && (entry = obis_entries + idx)->code == code)
+		return entry;
+
+	return NULL;
+}
+
+
+uint64_t obis_line_code (const struct parser *fsm)
+{
+	// Get the code of the current line, as collected by the generic rule of the grammar.
+	// The code is complete as soon as the first value starts, so this can also be used by other rules.
+
+	int f;
+
+	if (fsm->obis_nfield != OBIS_FIELDS - 1)
+		return OBIS_CODE_NONE;
+	for (f = 0 ; f < OBIS_FIELDS ; f++) {
+		if (fsm->obis_field[f] > 255)
+			return OBIS_CODE_NONE;
+	}
+
+	return OBIS_CODE(fsm->obis_field[0], fsm->obis_field[1], fsm->obis_field[2], fsm->obis_field[3], fsm->obis_field[4]);
+}
+
+
+static int obis_parse_number (const char *str, obis_value *v)
+{
+	// Parse a fixed point value with an optional unit (value*unit, or value unit), like the grammar does.
+	// Returns 0 on success, -1 if the string doesn't start with a number.
+
+	long long mantissa = 0;
+	int negative = 0, decimals = -1, digits = 0;
+
+	if (*str == '-' || *str == '+')
+		negative = (*str++ == '-');
+
+	for ( ; isdigit((unsigned char)*str) || (*str == '.' && decimals < 0) ; str++) {
+		if (*str == '.') {
+			decimals = 0;
+		} else if (digits++ < MAX_DIVIDER_EXP) {
+			mantissa = mantissa * 10 + (*str - '0');
+			if (decimals >= 0)
+				decimals++;
+		}
+	}
+
+	if (digits == 0 || (*str != '\0' && *str != '*' && *str != ' '))
+		return -1;
+
+	v->mantissa = negative ? -mantissa : mantissa;
+	v->scale = decimals > 0 ? decimals : 0;
+	v->value = (double)(v->mantissa) / (double)parser_pow10[v->scale];
+	v->unit = *str ? str + 1 : str;
+
+	return 0;
+}
+
+
+static int obis_parse_timestamp (struct parser *fsm, const char *str, uint32_t *timestamp)
+{
+	// Parse a timestamp, YYMMDDhhmmss followed by an optional DST flag (S or W), as in TST_to_time()
+
+	int f, field[6];
+
+	for (f = 0 ; f < 6 ; f++, str += 2) {
+		if (!isdigit((unsigned char)str[0]) || !isdigit((unsigned char)str[1]))
+			return -1;
+		field[f] = (str[0] - '0') * 10 + (str[1] - '0');
+	}
+	if (*str != '\0' && *str != 'S' && *str != 'W')
+		return -1;
+
+	if (!fsm->meter_timezone)
+		fsm->meter_timezone = METER_TIMEZONE;
+
+	*timestamp = meter_tz_to_time(&(fsm->tz), fsm->meter_timezone, field[0] + 2000, field[1], field[2], field[3], field[4], field[5], *str);
+
+	return 0;
+}
+
+
+static void obis_parse_value (struct parser *fsm, uint64_t code, int type, size_t maxlen, obis_value *v)
+{
+	// Split the values of the current line, and parse them as the given type. String values are
+	// truncated to maxlen bytes (at most sizeof(v->string) - 1).
+
+	const char *str;
+	size_t len;
+	int g;
+
+	v->code = code;
+	v->type = type;
+	v->ngroups = fsm->obis_ngroups;
+	for (g = 0 ; g < v->ngroups ; g++)
+		v->group[g] = fsm->obis_buffer + fsm->obis_group[g];
+	v->value = 0;
+	v->mantissa = 0;
+	v->scale = 0;
+	v->unit = "";
+	v->timestamp = 0;
+	v->string[0] = '\0';
+	v->valid = 1;
+
+	str = v->ngroups ? v->group[v->ngroups - 1] : "";
+	if (maxlen > sizeof(v->string) - 1)
+		maxlen = sizeof(v->string) - 1;
+
+	switch (type) {
+		case OBIS_TYPE_TIMESTAMPED:
+			if (v->ngroups < 2 || obis_parse_timestamp(fsm, v->group[0], &(v->timestamp)) < 0) {
+				v->valid = 0;
+				break;
+			}
+			// Fall through, the value is in the last group
+		case OBIS_TYPE_NUMBER:
+			if (obis_parse_number(str, v) < 0)
+				v->valid = 0;
+			break;
+		case OBIS_TYPE_STRING:
+			str = v->ngroups ? v->group[0] : "";
+			len = strnlen(str, maxlen);
+			memcpy(v->string, str, len);
+			v->string[len] = '\0';
+			break;
+		case OBIS_TYPE_HEXSTRING:
+			str = v->ngroups ? v->group[0] : "";
+			for (len = 0 ; isxdigit((unsigned char)str[0]) && isxdigit((unsigned char)str[1]) ; str += 2) {
+				if (len < maxlen)
+					v->string[len++] = (isdigit((unsigned char)str[0]) ? str[0] - '0' : (toupper((unsigned char)str[0]) - 'A' + 10)) << 4 |
+									   (isdigit((unsigned char)str[1]) ? str[1] - '0' : (toupper((unsigned char)str[1]) - 'A' + 10));
+			}
+			v->string[len] = '\0';
+			if (*str)
+				v->valid = 0;
+			break;
+	}
+}
+
+
+static int obis_store (struct parser *fsm, const obis_entry *entry, obis_value *v)
+{
+	// Store the value of a known code in its field of the data structures.
+	// Returns 1 if the value was stored, 0 if the code isn't stored, -1 if the value is invalid.
+
+	unsigned int dev = entry->dev;
+	size_t len;
+
+	switch (entry->slot) {
+		case OBIS_SLOT_DEV_COUNTER:
+			obis_parse_value(fsm, entry->code, v->ngroups >= 2 ? OBIS_TYPE_TIMESTAMPED : OBIS_TYPE_NUMBER, 0, v);
+			if (!v->valid)
+				break;
+			if (v->type == OBIS_TYPE_NUMBER)
+				v->timestamp = fsm->data.timestamp;
+			logmsg_to(fsm->logger, LL_VERBOSE, "Device %u counter at %lu: %f %s\n", dev + 1, (unsigned long)(v->timestamp), v->value, v->unit);
+			fsm->data.dev_counter[dev] = v->value;
+			fsm->data.dev_counter_timestamp[dev] = v->timestamp;
+			if (fsm->output & PARSER_OUTPUT_DATA)
+				strncpy((char *)(fsm->data.unit_dev_counter[dev]), v->unit, LEN_UNIT + 1);
+			if (fsm->output & PARSER_OUTPUT_COMPACT) {
+				fsm->compact.dev_counter[dev] = v->value;
+				fsm->compact.dev_counter_timestamp[dev] = v->timestamp;
+				fsm->compact.unit_dev_counter[dev] = dsmr_unit_intern(v->unit);
+				fsm->compact.present |= HAS_DEV_COUNTER(dev);
+			}
+			if (fsm->output & PARSER_OUTPUT_FIXED)
+				parser_fixed_value(fsm, FIXED_COUNTER, v->mantissa, parser_pow10[v->scale], v->unit, &(fsm->fixed.dev_counter[dev]));
+			break;
+		case OBIS_SLOT_DEV_ID:
+			obis_parse_value(fsm, entry->code, OBIS_TYPE_HEXSTRING, LEN_EQUIPMENT_ID - 1, v);
+			if (!v->valid)
+				break;
+			logmsg_to(fsm->logger, LL_VERBOSE, "Device %u ID: %s\n", dev + 1, v->string);
+			len = strnlen(v->string, LEN_EQUIPMENT_ID - 1);
+			if (fsm->output & PARSER_OUTPUT_DATA) {
+				memcpy(fsm->data.dev_id[dev], v->string, len);
+				fsm->data.dev_id[dev][len] = '\0';
+			}
+			if (fsm->output & PARSER_OUTPUT_COMPACT) {
+				memcpy(fsm->compact.dev_id[dev], v->string, len);
+				fsm->compact.dev_id[dev][len] = '\0';
+				fsm->compact.present |= HAS_DEV_ID(dev);
+			}
+			break;
+		case OBIS_SLOT_DEV_VALVE:
+			obis_parse_value(fsm, entry->code, OBIS_TYPE_NUMBER, 0, v);
+			if (!v->valid)
+				break;
+			logmsg_to(fsm->logger, LL_VERBOSE, "Device %u valve position: %d\n", dev + 1, (int)(v->value));
+			fsm->data.dev_valve[dev] = v->value;
+			if (fsm->output & PARSER_OUTPUT_COMPACT) {
+				fsm->compact.dev_valve[dev] = v->value;
+				fsm->compact.present |= HAS_DEV_VALVE(dev);
+			}
+			break;
+		default:
+			return 0;
+	}
+
+	if (!v->valid) {
+		logmsg_to(fsm->logger, LL_VERBOSE, "Invalid value for %s: %s\n", entry->name, v->ngroups ? v->group[v->ngroups - 1] : "");
+		fsm->parse_errors++;
+		return -1;
+	}
+
+	if (entry->dev_type) {
+		fsm->data.dev_type[dev] = entry->dev_type;
+		if (fsm->output & PARSER_OUTPUT_COMPACT) {
+			fsm->compact.dev_type[dev] = entry->dev_type;
+			fsm->compact.present |= HAS_DEV_TYPE(dev);
+		}
+	}
+
+	return 1;
+}
+
+
+static void obis_emit (struct parser *fsm, uint64_t code, const obis_entry *entry, const obis_value *v)
+{
+	// Pass the value of a line without a rule of its own to the field callback: typed if it was
+	// stored in a field (see obis_store()), otherwise as the raw values of the line
+
+	parser_field field;
+
+	memset(&field, 0, sizeof(field));
+	field.code = code;
+
+	if (entry && entry->slot == OBIS_SLOT_DEV_COUNTER) {
+		field.type = PARSER_FIELD_NUMBER;
+		field.index = entry->dev;
+		field.value = v->mantissa;
+		field.scale = v->scale;
+		field.timestamp = v->timestamp;
+		field.unit = v->unit;
+		field.unitlen = strlen(v->unit);
+	} else if (entry && entry->slot == OBIS_SLOT_DEV_ID) {
+		field.type = PARSER_FIELD_STRING;
+		field.index = entry->dev;
+		field.str = v->string;
+		field.len = strlen(v->string);
+	} else if (entry && entry->slot == OBIS_SLOT_DEV_VALVE) {
+		field.type = PARSER_FIELD_INTEGER;
+		field.index = entry->dev;
+		field.value = v->mantissa;
+	} else {
+		field.type = PARSER_FIELD_RAW;
+		field.value = fsm->obis_ngroups;
+		field.str = fsm->obis_buffer;
+		field.len = fsm->obis_buflen;
+	}
+
+	fsm->field_callback(fsm, &field, fsm->field_userdata);
+}
+
+
+void obis_line_start (struct parser *fsm)
+{
+	// Look up the code of a line collected by the generic rule of the grammar, as soon as its first
+	// value starts. Most lines of a telegram have a rule of their own and no registered handler:
+	// their values aren't collected and they aren't dispatched, the only thing left to do is to
+	// count the line as a parse error if its rule didn't match (obis_check in p1-parser.rl).
+
+	uint64_t code = obis_line_code(fsm);
+
+	fsm->obis_entry = NULL;
+	fsm->obis_reg = NULL;
+	if (code != OBIS_CODE_NONE) {
+		fsm->obis_entry = obis_lookup(code);
+		if (fsm->obis_registry)
+			fsm->obis_reg = obis_registry_lookup(fsm->obis_registry, code);
+	}
+
+	if (fsm->obis_entry && fsm->obis_entry->slot == OBIS_SLOT_GRAMMAR) {
+		fsm->obis_pending = 1;
+		fsm->obis_skip = (fsm->obis_reg == NULL);
+	}
+}
+
+
+void obis_dispatch (struct parser *fsm)
+{
+	// Handle a line collected by the generic rule of the grammar, at the end of the line.
+	// Lines with codes that have a rule of their own are matched by both, and are skipped here,
+	// unless a handler was registered for the code. If the rule of the code didn't match the line
+	// (e.g. because of a corrupted value), the line is counted as a parse error when it ends
+	// (obis_check in p1-parser.rl). Other lines are passed to the field callback.
+
+	const obis_entry *entry = fsm->obis_entry;
+	const obis_registration *reg = fsm->obis_reg;
+	obis_value v;
+	uint64_t code;
+	int stored = 0;
+
+	if (fsm->obis_skip)
+		return;
+
+	code = obis_line_code(fsm);
+
+	if (entry == NULL && reg == NULL) {
+		logmsg_to(fsm->logger, LL_VERBOSE, "Unknown OBIS code %u-%u:%u.%u.%u\n",
+				fsm->obis_field[0], fsm->obis_field[1], fsm->obis_field[2], fsm->obis_field[3], fsm->obis_field[4]);
+	}
+
+	if (entry) {
+		v.ngroups = fsm->obis_ngroups;
+		stored = obis_store(fsm, entry, &v);
+	}
+
+	if (fsm->field_callback && (entry == NULL || entry->slot != OBIS_SLOT_GRAMMAR))
+		obis_emit(fsm, code, stored > 0 ? entry : NULL, &v);
+
+	if (reg) {
+		obis_parse_value(fsm, code, reg->type, sizeof(v.string) - 1, &v);
+		reg->handler(fsm, &v, reg->userdata);
+	}
+}
+
+
+int obis_registry_init (obis_registry *reg)
+{
+	// Set up an empty registry. Codes are registered before the registry is passed to parsers,
+	// after that it is only read, and can be shared by parsers in different threads.
+
+	size_t i;
+
+	if (reg == NULL) {
+		return -1;
+	}
+
+	reg->logger = &logger;
+	reg->count = 0;
+	reg->size = 16;
+	reg->entries = malloc(reg->size * sizeof(obis_registration));
+	if (reg->entries == NULL) {
+		logmsg_to(reg->logger, LL_ERROR, "Could not allocate OBIS registry\n");
+		return -2;
+	}
+	for (i = 0 ; i < reg->size ; i++)
+		reg->entries[i].code = OBIS_CODE_NONE;
+
+	return 0;
+}
+
+
+static obis_registration *obis_registry_slot (obis_registration *entries, size_t size, uint64_t code)
+{
+	// Find the entry of a code, or the empty entry where it belongs (linear probing)
+
+	size_t i = (size_t)((code * 0x9e3779b97f4a7c15ULL) >> 32) & (size - 1);
+
+	while (entries[i].code != code && entries[i].code != OBIS_CODE_NONE)
+		i = (i + 1) & (size - 1);
+
+	return entries + i;
+}
+
+
+int obis_register (obis_registry *reg, const char *code, int type, obis_handler handler, void *userdata)
+{
+	// Register a handler for an OBIS code (A-B:C.D.E), called for every line with this code,
+	// with the values parsed as the given type (OBIS_TYPE_*). A handler registered for a code
+	// that is already handled by the grammar or stored in a field is called after that.
+
+	obis_registration *entries, *entry;
+	uint64_t packed = obis_code_parse(code);
+	size_t i, size;
+
+	if (packed == OBIS_CODE_NONE || handler == NULL) {
+		logmsg_to(reg->logger, LL_ERROR, "Invalid OBIS code or handler: %s\n", code);
+		return -1;
+	}
+
+	if ((reg->count + 1) * 2 > reg->size) {
+		// Keep the table at most half full
+		size = reg->size * 2;
+		entries = malloc(size * sizeof(obis_registration));
+		if (entries == NULL) {
+			logmsg_to(reg->logger, LL_ERROR, "Could not grow OBIS registry to %lu entries\n", (unsigned long)size);
+			return -2;
+		}
+		for (i = 0 ; i < size ; i++)
+			entries[i].code = OBIS_CODE_NONE;
+		for (i = 0 ; i < reg->size ; i++) {
+			if (reg->entries[i].code != OBIS_CODE_NONE)
+				*obis_registry_slot(entries, size, reg->entries[i].code) = reg->entries[i];
+		}
+		free(reg->entries);
+		reg->entries = entries;
+		reg->size = size;
+	}
+
+	entry = obis_registry_slot(reg->entries, reg->size, packed);
+	if (entry->code == OBIS_CODE_NONE)
+		reg->count++;
+	entry->code = packed;
+	entry->type = type;
+	entry->handler = handler;
+	entry->userdata = userdata;
+
+	logmsg_to(reg->logger, LL_VERBOSE, "Registered OBIS code %s (%s)\n", code, obis_lookup(packed) ? obis_lookup(packed)->name : "unknown");
+
+	return 0;
+}
+
+
+const obis_registration *obis_registry_lookup (const obis_registry *reg, uint64_t code)
+{
+	const obis_registration *entry;
+
+	if (reg->count == 0)
+		return NULL;
+
+	entry = obis_registry_slot(reg->entries, reg->size, code);
+
+	return (entry->code == code) ? entry : NULL;
+}
+
+
+void obis_registry_free (obis_registry *reg)
+{
+	if (reg == NULL) {
+		return;
+	}
+
+	free(reg->entries);
+	reg->entries = NULL;
+	reg->size = reg->count = 0;
+}
+
+#else
+
+// Generate p1-obis-table.h: gcc -DMAKEOBISH -o p1-obis-maketable p1-obis.c && ./p1-obis-maketable > p1-obis-table.h
+// Searches for a multiplier that hashes every known code to a different index.
+
+int main (void)
+{
+	uint8_t index[1 << OBIS_HASH_BITS];
+	uint64_t multiplier, state = 0x2545f4914f6cdd1dULL;
+	unsigned int n, h, tries;
+
+	if (OBIS_NENTRIES >= 255) {
+		fprintf(stderr, "Too many known OBIS codes: %u\n", (unsigned int)OBIS_NENTRIES);
+		return 1;
+	}
+
+	for (tries = 1 ; tries < 1000000 ; tries++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		multiplier = state | 1;
+
+		memset(index, 255, sizeof(index));
+		for (n = 0 ; n < OBIS_NENTRIES ; n++) {
+			h = obis_hash(obis_entries[n].code, multiplier);
+			if (index[h] != 255)
+				break;
+			index[h] = n;
+		}
+		if (n == OBIS_NENTRIES)
+			break;
+	}
+
+	if (n != OBIS_NENTRIES) {
+		fprintf(stderr, "No perfect hash found\n");
+		return 1;
+	}
+
+	printf("/*\n   File: p1-obis-table.h\n\n   \t  Perfect hash of the known OBIS codes in p1-obis.c, generated by p1-obis.c with MAKEOBISH defined\n*/\n\n");
+	printf("#define OBIS_HASH_ENTRIES\t\t%u\n", (unsigned int)OBIS_NENTRIES);
+	printf("#define OBIS_HASH_MULTIPLIER\t0x%016llxULL\n", (unsigned long long)multiplier);
+	printf("#define OBIS_HASH_EMPTY\t\t\t255\n\n");
+	printf("static const uint8_t obis_hash_index[%u] = {\n", 1 << OBIS_HASH_BITS);
+	for (n = 0 ; n < (1 << OBIS_HASH_BITS) ; n++) {
+		printf("%s%3u%s", (n % 16 == 0) ? "\t" : "", index[n], (n == (1 << OBIS_HASH_BITS) - 1) ? "\n" : ((n % 16 == 15) ? ",\n" : ", "));
+	}
+	printf("};\n");
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,114 @@
+/*
+   File: p1-obis.h
+
+   	  Registry of OBIS codes, used to handle telegram lines that don't have a rule of their own
+   	  in the Ragel grammar (p1-parser.rl).
+
+   	  Any line of the form A-B:C.D.E(value)(value)... is collected by a generic rule, and its code
+   	  is looked up in a perfect hash of known codes (generated by p1-obis.c with MAKEOBISH defined).
+   	  Known codes are either handled by the grammar, mapped directly to a field of struct dsmr_data_struct,
+   	  or known but not stored. Extra codes (for instance Belgian or Luxembourg extensions, or additional
+   	  M-bus channels) can be registered at runtime, with a handler that receives the typed value.
+*/
+
+#ifndef P1_OBIS_H
+
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "logmsg.h"
+
+
+#define OBIS_FIELDS		5		// Value groups A to E of an OBIS code
+#define OBIS_MAXGROUPS	24		// Maximum number of values (between parentheses) per line
+#define OBIS_BUFLEN		1024	// Buffer for the values of a line
+
+#define OBIS_ANY		255		// Value group that matches any value (only supported for group E in the table of known codes)
+
+// OBIS codes are packed into an integer, one byte per value group
+
+#define OBIS_CODE(a, b, c, d, e)	(((uint64_t)(a) << 32) | ((uint64_t)(b) << 24) | ((uint64_t)(c) << 16) | ((uint64_t)(d) << 8) | (uint64_t)(e))
+#define OBIS_CODE_NONE				(~(uint64_t)0)		// Not a valid code, for instance because a value group is > 255
+
+#define OBIS_A(code)	((unsigned int)((code) >> 32) & 0xff)
+#define OBIS_B(code)	((unsigned int)((code) >> 24) & 0xff)
+#define OBIS_C(code)	((unsigned int)((code) >> 16) & 0xff)
+#define OBIS_D(code)	((unsigned int)((code) >> 8) & 0xff)
+#define OBIS_E(code)	((unsigned int)(code) & 0xff)
+
+// How the value of a known code is stored
+
+#define OBIS_SLOT_NONE			0	// Known, but not stored
+#define OBIS_SLOT_GRAMMAR		1	// Handled by a rule of the grammar
+#define OBIS_SLOT_DEV_COUNTER	2	// Counter of an M-bus device: ([TST])(value*unit)
+#define OBIS_SLOT_DEV_ID		3	// Equipment ID of an M-bus device, as hex string
+#define OBIS_SLOT_DEV_VALVE		4	// Valve position of an M-bus device: (integer)
+
+// Value types of registered codes
+
+#define OBIS_TYPE_RAW			0	// Values are only passed as strings
+#define OBIS_TYPE_NUMBER		1	// (value*unit)
+#define OBIS_TYPE_TIMESTAMPED	2	// (TST)(value*unit)
+#define OBIS_TYPE_STRING		3	// (string)
+#define OBIS_TYPE_HEXSTRING		4	// (hex string), decoded
+
+
+// Known OBIS code
+
+typedef struct obis_entry_struct {
+	uint64_t	code;
+	const char	*name;			// Field name (as used in dsmr-store.h), or description if not stored
+	uint8_t		slot;			// OBIS_SLOT_*
+	uint8_t		dev;			// M-bus device index, for the OBIS_SLOT_DEV_* slots
+	uint8_t		dev_type;		// M-bus device type to set along with the value, 0 if none
+} obis_entry;
+
+// Value of a line, as passed to handlers
+
+typedef struct obis_value_struct {
+	uint64_t	code;
+	int			type;						// OBIS_TYPE_* the value was parsed as
+	int			ngroups;					// Number of values between parentheses
+	const char	*group[OBIS_MAXGROUPS];		// Raw values, without parentheses
+
+	double		value;						// Numeric value (OBIS_TYPE_NUMBER, OBIS_TYPE_TIMESTAMPED)
+	long long	mantissa;					// Numeric value as integer mantissa and number of decimals
+	int			scale;
+	const char	*unit;						// Unit, "" if absent
+	uint32_t	timestamp;					// Timestamp (OBIS_TYPE_TIMESTAMPED), 0 otherwise
+	char		string[OBIS_BUFLEN / 2 + 1];	// String value (OBIS_TYPE_STRING, OBIS_TYPE_HEXSTRING)
+	int			valid;						// Set if the value could be parsed as the given type
+} obis_value;
+
+struct parser;
+typedef void (*obis_handler) (struct parser *fsm, const obis_value *value, void *userdata);
+
+// Registry of extra codes and their handlers
+
+typedef struct obis_registration_struct {
+	uint64_t		code;
+	int				type;
+	obis_handler	handler;
+	void			*userdata;
+} obis_registration;
+
+typedef struct obis_registry_struct {
+	obis_registration	*entries;	// Open addressing hash table, OBIS_CODE_NONE for empty entries
+	size_t				size, count;
+	messagelogger		*logger;
+} obis_registry;
+
+
+uint64_t obis_code_parse (const char *str);
+const obis_entry *obis_lookup (uint64_t code);
+uint64_t obis_line_code (const struct parser *fsm);
+void obis_line_start (struct parser *fsm);
+void obis_dispatch (struct parser *fsm);
+
+int obis_registry_init (obis_registry *reg);
+int obis_register (obis_registry *reg, const char *code, int type, obis_handler handler, void *userdata);
+const obis_registration *obis_registry_lookup (const obis_registry *reg, uint64_t code);
+void obis_registry_free (obis_registry *reg);
+
+#define P1_OBIS_H	1
+#endif
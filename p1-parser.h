@@ -10,14 +10,32 @@
 
 #include <inttypes.h>
 
+#include "logmsg.h"
+
 // Data structure to hold meter data
 
 #include "dsmr-data.h"
+#include "dsmr-compact.h"
+#include "dsmr-fixed.h"
+
+// Timezone context used to convert meter timestamps
+
+#include "p1-time.h"
+
+// Registry of OBIS codes, used for lines that don't have a rule of their own in the grammar
+
+#include "p1-obis.h"
 
 // Default meter timezone is CET (The Netherlands and most of mainland Western Europe)
 
 #define METER_TIMEZONE	"CET-1CEST,M3.5.0/2,M10.5.0/3"
 
+// Parser output flags: fill the full data structure, the compact one, the fixed point one, or any combination
+
+#define PARSER_OUTPUT_DATA		1
+#define PARSER_OUTPUT_COMPACT	2
+#define PARSER_OUTPUT_FIXED		4
+
 // Parser buffer used to store strings
 
 #define PARSER_BUFLEN 4096
@@ -26,6 +44,43 @@
 
 #define PARSER_MAXARGS 12
 
+// Callback used in streaming mode, called at the end of every telegram
+
+struct parser;
+typedef void (*parser_telegram_callback) (struct parser *fsm, void *userdata);
+
+// Field callback, called for every value as soon as it is parsed. Strings are passed as views into
+// the capture buffer of the parser, which are only valid during the callback. Together with the
+// output flags (setting fsm->output to 0 skips copying strings into the data structures), this
+// allows applications to take just the fields they need, without copying the rest.
+
+#define PARSER_FIELD_NUMBER		1	// Fixed point value: mantissa * 10^-scale, with unit
+#define PARSER_FIELD_INTEGER	2	// Integer value, with unit if the meter gives one
+#define PARSER_FIELD_TIME		3	// Timestamp, as UNIX time
+#define PARSER_FIELD_STRING		4	// String, hex strings are decoded
+#define PARSER_FIELD_RAW		5	// Values of a line without a rule of its own, each terminated by '\0'
+
+typedef struct parser_field_struct {
+	uint64_t	code;			// OBIS code (see p1-obis.h), OBIS_CODE_NONE for the telegram header
+	int			index;			// Tariff, phase, M-bus device or power failure event, 0 if not applicable
+	int			type;			// PARSER_FIELD_*
+	long long	value;			// Mantissa, integer value or UNIX time
+	int			scale;			// Number of decimals of fixed point values, 0 otherwise
+	uint32_t	timestamp;		// Time at which the value was captured, if the meter gives it, 0 otherwise
+	const char	*str;			// String value (view, not always terminated)
+	size_t		len;
+	const char	*unit;			// Unit (view, not always terminated), NULL if absent
+	size_t		unitlen;
+} parser_field;
+
+typedef void (*parser_field_callback) (struct parser *fsm, const parser_field *field, void *userdata);
+
+// Telegram states, tracked to calculate the CRC of telegrams that are split over several chunks of input
+
+#define PARSER_TELEGRAM_NONE	0	// Outside a telegram, or in a telegram without header
+#define PARSER_TELEGRAM_DATA	1	// After the start of a telegram ('/'), the CRC is being calculated
+#define PARSER_TELEGRAM_END		2	// After the end of a telegram ('!'), the CRC is complete
+
 // Data structure used by the Ragel parser
 
 struct parser
@@ -51,15 +106,52 @@ struct parser
 	// Variables specific to the P1-parser
 	
 	uint16_t	crc16;
-	char		*meter_timezone;
+	char		*meter_timezone;		// Meter timezone as POSIX TZ string, METER_TIMEZONE if NULL
+	struct meter_tz	tz;					// Parsed meter timezone and conversion cache
+	
+	messagelogger	*logger;			// Logger used by the parser (the default logger, unless set otherwise)
 	int			parse_errors, pfaileventcount;
 
 	unsigned int devcount, timeseries_period_minutes;
 	uint32_t timeseries_time;
 	
-	// Data structure to hold meter data
+	// Telegram boundaries, tracked across calls to parser_execute(). The CRC and length are only
+	// calculated in streaming mode (if telegram_callback is set), the framer handles them otherwise.
+	
+	int			telegram_state;			// PARSER_TELEGRAM_*
+	const char	*crcstart;				// Start of the data that has not yet been added to the CRC and length
+	uint16_t	crc16_data;				// CRC16 calculated over the telegram, valid in state PARSER_TELEGRAM_END
+	size_t		telegram_len;			// Length of the current (or last) telegram
+	
+	parser_telegram_callback	telegram_callback;	// Called at the end of every telegram, if not NULL
+	void		*userdata;
+	
+	parser_field_callback	field_callback;		// Called for every value, if not NULL
+	void		*field_userdata;
+	
+	// Generic OBIS lines, collected apart from the capture stacks, since other rules use those on the same line
+	
+	const obis_registry	*obis_registry;		// Handlers for extra OBIS codes, NULL if none
+	unsigned int	obis_field[OBIS_FIELDS];	// Value groups A to E of the code of the current line
+	int			obis_nfield;
+	char		obis_buffer[OBIS_BUFLEN + OBIS_MAXGROUPS];	// Values of the current line, each terminated by '\0'
+	int			obis_buflen;
+	int			obis_ngroups;
+	int			obis_group[OBIS_MAXGROUPS];	// Offsets of the values in obis_buffer
+	const obis_entry	*obis_entry;		// Known code and handler of the current line, set by obis_line_start()
+	const obis_registration	*obis_reg;
+	int			obis_skip;					// Set if the values of the line don't have to be collected
+	int			obis_pending;				// Set by obis_line_start() if the code of the line has a rule of its own
+	int			obis_matched;				// Set if a rule of the grammar matched the line
+	
+	// Data structures to hold meter data
 	
-	struct dsmr_data_struct	data;
+	int		output;							// Output flags (PARSER_OUTPUT_*), PARSER_OUTPUT_DATA by default
+	struct dsmr_data_struct	data;			// Full data structure. Integer fields are always filled in, doubles
+											// only if the full or the compact structure is in use.
+	struct dsmr_compact_struct	compact;	// Compact data structure, presence bits are reset for every telegram
+	struct dsmr_fixed_struct	fixed;		// Fixed point values, as integers, reset for every telegram
+	int		fixed_scale[FIXED_QUANTITIES];	// Number of decimals of every quantity, FIXED_SCALE_DEFAULT by default
 };
 
 
@@ -67,14 +159,19 @@ struct parser
 
 # define MAX_DIVIDER_EXP 18
 
-static const long long pow10[MAX_DIVIDER_EXP + 1] = {
-        1, 10, 100, 1000, 10000, 100000L, 1000000L, 10000000L, 100000000L, 1000000000L,
-        10000000000LL, 100000000000LL, 1000000000000LL, 10000000000000LL, 100000000000000LL, 
-        1000000000000000LL, 10000000000000000LL, 100000000000000000LL, 1000000000000000000LL};
+extern const long long parser_pow10[MAX_DIVIDER_EXP + 1];
 
 
 // Function prototypes
 
 void parser_init( struct parser *fsm );
+void parser_reset( struct parser *fsm );
+void parser_set_logger( struct parser *fsm, messagelogger *lg );
+void parser_set_callback( struct parser *fsm, parser_telegram_callback callback, void *userdata );
+void parser_set_field_callback( struct parser *fsm, parser_field_callback callback, void *userdata );
+void parser_set_obis_registry( struct parser *fsm, const obis_registry *reg );
+int parser_set_fixed_scale( struct parser *fsm, int quantity, int decimals );
+int parser_fixed_value( struct parser *fsm, int quantity, long long mantissa, long long divider, const char *unit, int64_t *value );
 void parser_execute(struct parser *fsm, const char *data, int len, int eofflag);
 int parser_finish(struct parser *fsm);
+long long int TST_to_time (struct parser *fsm, int arg_idx);
@@ -16,49 +16,109 @@
 #include <time.h>
 
 #include "logmsg.h"
+#include "crc16.h"
 
 #include "p1-parser.h"
 
 
+// Lookup table for long long integer powers of ten
+
+const long long parser_pow10[MAX_DIVIDER_EXP + 1] = {
+        1, 10, 100, 1000, 10000, 100000L, 1000000L, 10000000L, 100000000L, 1000000000L,
+        10000000000LL, 100000000000LL, 1000000000000LL, 10000000000000LL, 100000000000000LL, 
+        1000000000000000LL, 10000000000000000LL, 100000000000000000LL, 1000000000000000000LL};
+
+
 long long int TST_to_time (struct parser *fsm, int arg_idx) {
 	
 	// Get TST timestamp fields from stack and create a UNIX timestamp
 	// The TST fields are: YYMMDDhhmmssX, with X = W for winter time or X = S for summer time
-		
-	struct tm tm;
-	time_t time;
-	
-	tm.tm_year = fsm->arg[arg_idx] + 100;	// Years since 1900, our value was years since 2000
-	tm.tm_mon = fsm->arg[arg_idx + 1] - 1;	// Months since start of year, starts at 0 (for January)
-	tm.tm_mday = fsm->arg[arg_idx + 2];		// Ordinal day of the month
-	tm.tm_hour = fsm->arg[arg_idx + 3];		// Hours past midnight, starts at 0
-	tm.tm_min = fsm->arg[arg_idx + 4];		// Minutes past the hour
-	tm.tm_sec = fsm->arg[arg_idx + 5];		// Seconds past the minute
-	
-	if (fsm->arg[arg_idx + 6] == 'S')		// Daylight saving time flag
-		tm.tm_isdst = 1;						// Positive for daylight saving time (summer time)
-	else if (fsm->arg[arg_idx + 6] == 'W')
-		tm.tm_isdst = 0;						// Zero if DST is not in effect (winter time)
-	else
-		tm.tm_isdst = -1;						// Negative if DST information is not available
 	
-	logmsg(LL_DEBUG, "Time: %d %d %d %d %d %d %d\n", tm.tm_year, tm.tm_mon, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_isdst);
+	logmsg_to(fsm->logger, LL_DEBUG, "Time: %d %d %d %d %d %d %c\n", (int)fsm->arg[arg_idx], (int)fsm->arg[arg_idx + 1], (int)fsm->arg[arg_idx + 2], 
+			(int)fsm->arg[arg_idx + 3], (int)fsm->arg[arg_idx + 4], (int)fsm->arg[arg_idx + 5], (int)fsm->arg[arg_idx + 6]);
 	
 	if (!fsm->meter_timezone)
 		fsm->meter_timezone = METER_TIMEZONE;
 	
-	const char *TZ = "TZ";
-	char *oldval_TZ = getenv(TZ);
-	setenv(TZ, fsm->meter_timezone, 1);		// Set TZ timezone environment variable to meter timezone
-		
-	time = mktime(&tm);
-	
-	if (oldval_TZ)
-		setenv(TZ, oldval_TZ, 1);			// Restore TZ timezone environment variable
+	return meter_tz_to_time(&(fsm->tz), fsm->meter_timezone, 
+			fsm->arg[arg_idx] + 2000,	// Our value is years since 2000
+			fsm->arg[arg_idx + 1],		// Month, starts at 1 (for January)
+			fsm->arg[arg_idx + 2],		// Ordinal day of the month
+			fsm->arg[arg_idx + 3],		// Hours past midnight, starts at 0
+			fsm->arg[arg_idx + 4],		// Minutes past the hour
+			fsm->arg[arg_idx + 5],		// Seconds past the minute
+			fsm->arg[arg_idx + 6]);		// Daylight saving time flag, S for summer time, W for winter time
+}
+
+
+// Helpers to store values in the full data structure and/or the compact one, depending on fsm->output.
+// Strings are only copied to the structures that are in use, units are interned for the compact structure.
+
+#define DATA_UNIT(field) \
+	if (fsm->output & PARSER_OUTPUT_DATA) strncpy((char *)(fsm->data.field), fsm->strarg[0], LEN_UNIT + 1)
+#define DATA_ID(field) \
+	if (fsm->output & PARSER_OUTPUT_DATA) strncpy((char *)(fsm->data.field), fsm->strarg[0], LEN_EQUIPMENT_ID)
+#define COMPACT_SET(bit, field, value) \
+	if (fsm->output & PARSER_OUTPUT_COMPACT) { fsm->compact.field = (value); fsm->compact.present |= (bit); }
+#define COMPACT_UNIT(field) \
+	if (fsm->output & PARSER_OUTPUT_COMPACT) fsm->compact.field = dsmr_unit_intern(fsm->strarg[0])
+#define COMPACT_ID(bit, field) \
+	if (fsm->output & PARSER_OUTPUT_COMPACT) { strncpy((char *)(fsm->compact.field), fsm->strarg[0], LEN_EQUIPMENT_ID); fsm->compact.present |= (bit); }
+
+// Fixed point values are pushed as mantissa and divider (see addfparg). The double is only calculated
+// for the structures that hold doubles, the fixed point structure gets the exact scaled integer.
+
+#define FP_VALUE(arg_idx)	((double)fsm->arg[arg_idx] / (double)fsm->arg[(arg_idx) + 1])
+#define DATA_FP(field, arg_idx) \
+	if (fsm->output & (PARSER_OUTPUT_DATA | PARSER_OUTPUT_COMPACT)) fsm->data.field = FP_VALUE(arg_idx)
+#define FIXED_SET(field, quantity, arg_idx, unit) \
+	if (fsm->output & PARSER_OUTPUT_FIXED) parser_fixed_value(fsm, quantity, fsm->arg[arg_idx], fsm->arg[(arg_idx) + 1], unit, &(fsm->fixed.field))
+
+
+static void parser_field_emit (struct parser *fsm, uint64_t code, int index, int type, long long value, long long divider, uint32_t timestamp, int strarg)
+{
+	// Pass a value to the field callback. The string or unit is taken from the string capture stack,
+	// its length follows from the start of the next string on the stack, or the end of the buffer.
+	
+	parser_field field;
+	const char *end;
+	
+	field.code = code;
+	field.index = index;
+	field.type = type;
+	field.value = value;
+	for (field.scale = 0 ; field.scale < MAX_DIVIDER_EXP && parser_pow10[field.scale] < divider ; field.scale++);
+	field.timestamp = timestamp;
+	field.str = field.unit = NULL;
+	field.len = field.unitlen = 0;
+	
+	if (strarg >= 0 && strarg < fsm->strargc && fsm->strarg[strarg]) {
+		end = (strarg + 1 < fsm->strargc) ? fsm->strarg[strarg + 1] : fsm->buffer + fsm->buflen;
+		if (end > fsm->strarg[strarg] && end[-1] == '\0')
+			end--;
+		if (type == PARSER_FIELD_STRING) {
+			field.str = fsm->strarg[strarg];
+			field.len = end - field.str;
+		} else {
+			field.unit = fsm->strarg[strarg];
+			field.unitlen = end - field.unit;
+		}
+	}
 	
-	return time;
+	fsm->field_callback(fsm, &field, fsm->field_userdata);
 }
 
+// Helpers to pass values to the field callback, if one is set. The OBIS code is that of the current line.
+
+#define FIELD_EMIT(code, index, type, value, divider, timestamp, strarg) \
+	if (fsm->field_callback) parser_field_emit(fsm, code, index, type, value, divider, timestamp, strarg)
+#define FIELD_NUMBER(index, arg_idx) \
+	FIELD_EMIT(obis_line_code(fsm), index, PARSER_FIELD_NUMBER, fsm->arg[arg_idx], fsm->arg[(arg_idx) + 1], 0, 0)
+#define FIELD_INTEGER(index, value) \
+	FIELD_EMIT(obis_line_code(fsm), index, PARSER_FIELD_INTEGER, value, 1, 0, -1)
+#define FIELD_STRING(index) \
+	FIELD_EMIT(obis_line_code(fsm), index, PARSER_FIELD_STRING, 0, 1, 0, 0)
+
 
 /* Ragel state-machine definition */
 
@@ -73,213 +133,340 @@ long long int TST_to_time (struct parser *fsm, int arg_idx) {
 	# Actions associated with commands
 	
 	action header { 
-		logmsg(LL_VERBOSE, "Header: %s\n", fsm->strarg[0]); 
-		strncpy((char *)(fsm->data.header), fsm->strarg[0], LEN_HEADER); 
+		logmsg_to(fsm->logger, LL_VERBOSE, "Header: %s\n", fsm->strarg[0]); 
+		if (fsm->output & PARSER_OUTPUT_DATA)
+			strncpy((char *)(fsm->data.header), fsm->strarg[0], LEN_HEADER); 
+		fsm->compact.present |= HAS_HEADER;
+		FIELD_EMIT(OBIS_CODE_NONE, 0, PARSER_FIELD_STRING, 0, 1, 0, 0);
 	}
 	
 	action crc { 
 		if (fsm->arg[0]) {
-			logmsg(LL_VERBOSE, "CRC: 0x%x\n", (unsigned int)fsm->arg[0]); 
+			logmsg_to(fsm->logger, LL_VERBOSE, "CRC: 0x%x\n", (unsigned int)fsm->arg[0]); 
 		}
 		fsm->crc16 = fsm->arg[0]; 
 	}
 	
+	action telegram_start {
+		// Start of a telegram. Counters are reset here, so that data between telegrams isn't counted as part of the next one.
+		fsm->telegram_state = PARSER_TELEGRAM_DATA;
+		fsm->crcstart = p;
+		fsm->crc16_data = 0;
+		fsm->telegram_len = 0;
+		fsm->parse_errors = 0;
+		fsm->compact.present = 0;
+		memset(&(fsm->fixed), 0, sizeof(fsm->fixed));
+	}
+	
+	action telegram_crc {
+		// The CRC covers the telegram up to and including the '!'. It's only calculated in streaming mode,
+		// framed telegrams already have their CRC calculated by the framer.
+		if (fsm->telegram_state == PARSER_TELEGRAM_DATA) {
+			if (fsm->telegram_callback) {
+				fsm->crc16_data = crc16_update(fsm->crc16_data, (const uint8_t *)(fsm->crcstart), p + 1 - fsm->crcstart);
+				fsm->telegram_len += p + 1 - fsm->crcstart;
+			}
+			fsm->crcstart = p + 1;
+			fsm->telegram_state = PARSER_TELEGRAM_END;
+		}
+	}
+	
+	action telegram_end {
+		if (fsm->telegram_state == PARSER_TELEGRAM_END && fsm->telegram_callback)
+			fsm->telegram_len += p + 1 - fsm->crcstart;
+		if (fsm->telegram_callback)
+			fsm->telegram_callback(fsm, fsm->userdata);
+		fsm->telegram_state = PARSER_TELEGRAM_NONE;
+	}
+	
 	action P1_version { 
 		fsm->data.P1_version_major = fsm->arg[0] >> 4;
 		fsm->data.P1_version_minor = fsm->arg[0] & 0xf;
-		logmsg(LL_VERBOSE, "P1 version: %d.%d\n", (int)(fsm->data.P1_version_major), (int)(fsm->data.P1_version_minor)); 
+		COMPACT_SET(HAS_P1_VERSION, P1_version_major, fsm->data.P1_version_major);
+		COMPACT_SET(HAS_P1_VERSION, P1_version_minor, fsm->data.P1_version_minor);
+		logmsg_to(fsm->logger, LL_VERBOSE, "P1 version: %d.%d\n", (int)(fsm->data.P1_version_major), (int)(fsm->data.P1_version_minor)); 
+		FIELD_EMIT(obis_line_code(fsm), 0, PARSER_FIELD_NUMBER, fsm->data.P1_version_major * 10 + fsm->data.P1_version_minor, 10, 0, -1);
 	}
 	
 	action timestamp {
 		fsm->data.timestamp = TST_to_time(fsm, 0);
-		logmsg(LL_VERBOSE, "Timestamp: %lu\n", (unsigned long)(fsm->data.timestamp));
+		COMPACT_SET(HAS_TIMESTAMP, timestamp, fsm->data.timestamp);
+		logmsg_to(fsm->logger, LL_VERBOSE, "Timestamp: %lu\n", (unsigned long)(fsm->data.timestamp));
+		FIELD_EMIT(obis_line_code(fsm), 0, PARSER_FIELD_TIME, fsm->data.timestamp, 1, fsm->data.timestamp, -1);
 	}
 	
 	action equipment_id { 
-		logmsg(LL_VERBOSE, "Equipment ID: %s\n", fsm->strarg[0]);
-		strncpy((char *)(fsm->data.equipment_id), fsm->strarg[0], LEN_EQUIPMENT_ID); 
+		logmsg_to(fsm->logger, LL_VERBOSE, "Equipment ID: %s\n", fsm->strarg[0]);
+		if (fsm->output & PARSER_OUTPUT_DATA)
+			strncpy((char *)(fsm->data.equipment_id), fsm->strarg[0], LEN_EQUIPMENT_ID); 
+		if (fsm->output & PARSER_OUTPUT_COMPACT)
+			strncpy((char *)(fsm->compact.equipment_id), fsm->strarg[0], LEN_EQUIPMENT_ID); 
+		fsm->compact.present |= HAS_EQUIPMENT_ID;
+		FIELD_STRING(0);
 	}
 	
 	action tariff { 
 		fsm->data.tariff = fsm->arg[0];
-		logmsg(LL_VERBOSE, "Tariff: %u\n", (unsigned int)(fsm->data.tariff));
+		COMPACT_SET(HAS_TARIFF, tariff, fsm->data.tariff);
+		logmsg_to(fsm->logger, LL_VERBOSE, "Tariff: %u\n", (unsigned int)(fsm->data.tariff));
+		FIELD_INTEGER(0, fsm->arg[0]);
 	}
 	
 	action switchpos { 
 		fsm->data.switchpos = fsm->arg[0];
-		logmsg(LL_VERBOSE, "Switch position: %d\n", (int)(fsm->data.switchpos));
+		COMPACT_SET(HAS_SWITCHPOS, switchpos, fsm->data.switchpos);
+		logmsg_to(fsm->logger, LL_VERBOSE, "Switch position: %d\n", (int)(fsm->data.switchpos));
+		FIELD_INTEGER(0, fsm->arg[0]);
 	}	
 	
 	action E_in {
 		unsigned int tariff = fsm->arg[0];
-		double value = (double)fsm->arg[1] / (double)fsm->arg[2];
 		if (tariff > MAX_TARIFFS) {
-			logmsg(LL_ERROR, "Tariff %u out of range, max. %u, E_in %f %s\n", tariff, MAX_TARIFFS, value, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_ERROR, "Tariff %u out of range, max. %u, E_in %f %s\n", tariff, MAX_TARIFFS, FP_VALUE(1), fsm->strarg[0]);
 		} else {
-			fsm->data.E_in[tariff] = value;
-			strncpy((char *)(fsm->data.unit_E_in[tariff]), fsm->strarg[0], LEN_UNIT + 1);
-			logmsg(LL_VERBOSE, "Energy in, tariff %u: %f %s\n", tariff, value, fsm->strarg[0]); 
+			DATA_FP(E_in[tariff], 1);
+			DATA_UNIT(unit_E_in[tariff]);
+			COMPACT_SET(HAS_E_IN(tariff), E_in[tariff], fsm->data.E_in[tariff]);
+			COMPACT_UNIT(unit_E_in[tariff]);
+			FIXED_SET(E_in[tariff], FIXED_ENERGY, 1, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Energy in, tariff %u: %f %s\n", tariff, FP_VALUE(1), fsm->strarg[0]); 
+			FIELD_NUMBER(tariff, 1);
 		}
 	}
 	
 	action E_out {
 		unsigned int tariff = fsm->arg[0];
-		double value = (double)fsm->arg[1] / (double)fsm->arg[2];
 		if (tariff > MAX_TARIFFS) {
-			logmsg(LL_ERROR, "Tariff %u out of range, max. %u, E_out %f %s\n", tariff, MAX_TARIFFS, value, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_ERROR, "Tariff %u out of range, max. %u, E_out %f %s\n", tariff, MAX_TARIFFS, FP_VALUE(1), fsm->strarg[0]);
 		} else {
-			fsm->data.E_out[tariff] = value;
-			strncpy((char *)(fsm->data.unit_E_out[tariff]), fsm->strarg[0], LEN_UNIT + 1);
-			logmsg(LL_VERBOSE, "Energy out, tariff %u: %f %s\n", tariff, value, fsm->strarg[0]); 
+			DATA_FP(E_out[tariff], 1);
+			DATA_UNIT(unit_E_out[tariff]);
+			COMPACT_SET(HAS_E_OUT(tariff), E_out[tariff], fsm->data.E_out[tariff]);
+			COMPACT_UNIT(unit_E_out[tariff]);
+			FIXED_SET(E_out[tariff], FIXED_ENERGY, 1, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Energy out, tariff %u: %f %s\n", tariff, FP_VALUE(1), fsm->strarg[0]); 
+			FIELD_NUMBER(tariff, 1);
 		}
 	}
 	
 	# Deprecated hard-coded tariffs, to be removed
-	action E_in_t1 { logmsg(LL_VERBOSE, "Energy in, tariff 1: %f %s\n", (double)fsm->arg[0] / (double)fsm->arg[1], fsm->strarg[0]); }
-	action E_in_t2 { logmsg(LL_VERBOSE, "Energy in, tariff 2: %f %s\n", (double)fsm->arg[0] / (double)fsm->arg[1], fsm->strarg[0]); }
-	action E_out_t1 { logmsg(LL_VERBOSE, "Energy out, tariff 1: %f %s\n", (double)fsm->arg[0] / (double)fsm->arg[1], fsm->strarg[0]); }
-	action E_out_t2 { logmsg(LL_VERBOSE, "Energy out, tariff 2: %f %s\n", (double)fsm->arg[0] / (double)fsm->arg[1], fsm->strarg[0]); }
+	action E_in_t1 { logmsg_to(fsm->logger, LL_VERBOSE, "Energy in, tariff 1: %f %s\n", (double)fsm->arg[0] / (double)fsm->arg[1], fsm->strarg[0]); }
+	action E_in_t2 { logmsg_to(fsm->logger, LL_VERBOSE, "Energy in, tariff 2: %f %s\n", (double)fsm->arg[0] / (double)fsm->arg[1], fsm->strarg[0]); }
+	action E_out_t1 { logmsg_to(fsm->logger, LL_VERBOSE, "Energy out, tariff 1: %f %s\n", (double)fsm->arg[0] / (double)fsm->arg[1], fsm->strarg[0]); }
+	action E_out_t2 { logmsg_to(fsm->logger, LL_VERBOSE, "Energy out, tariff 2: %f %s\n", (double)fsm->arg[0] / (double)fsm->arg[1], fsm->strarg[0]); }
 	
 	action P_in { 
-		fsm->data.P_in_total = (double)fsm->arg[0] / (double)fsm->arg[1];
-		strncpy((char *)(fsm->data.unit_P_in_total), fsm->strarg[0], LEN_UNIT + 1);
-		logmsg(LL_VERBOSE, "Power in: %f %s\n", fsm->data.P_in_total, fsm->strarg[0]); 
+		DATA_FP(P_in_total, 0);
+		DATA_UNIT(unit_P_in_total);
+		COMPACT_SET(HAS_P_IN_TOTAL, P_in_total, fsm->data.P_in_total);
+		COMPACT_UNIT(unit_P_in_total);
+		FIXED_SET(P_in_total, FIXED_POWER, 0, fsm->strarg[0]);
+		logmsg_to(fsm->logger, LL_VERBOSE, "Power in: %f %s\n", FP_VALUE(0), fsm->strarg[0]); 
+		FIELD_NUMBER(0, 0);
 	}
 
 	action P_out { 
-		fsm->data.P_out_total = (double)fsm->arg[0] / (double)fsm->arg[1];
-		strncpy((char *)(fsm->data.unit_P_out_total), fsm->strarg[0], LEN_UNIT + 1);
-		logmsg(LL_VERBOSE, "Power out: %f %s\n", fsm->data.P_out_total, fsm->strarg[0]); 
+		DATA_FP(P_out_total, 0);
+		DATA_UNIT(unit_P_out_total);
+		COMPACT_SET(HAS_P_OUT_TOTAL, P_out_total, fsm->data.P_out_total);
+		COMPACT_UNIT(unit_P_out_total);
+		FIXED_SET(P_out_total, FIXED_POWER, 0, fsm->strarg[0]);
+		logmsg_to(fsm->logger, LL_VERBOSE, "Power out: %f %s\n", FP_VALUE(0), fsm->strarg[0]); 
+		FIELD_NUMBER(0, 0);
 	}
 
 	action P_threshold { 
-		fsm->data.P_threshold = (double)fsm->arg[0] / (double)fsm->arg[1];
-		strncpy((char *)(fsm->data.unit_P_threshold), fsm->strarg[0], LEN_UNIT + 1);
-		logmsg(LL_VERBOSE, "Power threshold: %f %s\n", fsm->data.P_threshold, fsm->strarg[0]); 
+		DATA_FP(P_threshold, 0);
+		DATA_UNIT(unit_P_threshold);
+		COMPACT_SET(HAS_P_THRESHOLD, P_threshold, fsm->data.P_threshold);
+		COMPACT_UNIT(unit_P_threshold);
+		FIXED_SET(P_threshold, FIXED_POWER, 0, fsm->strarg[0]);
+		logmsg_to(fsm->logger, LL_VERBOSE, "Power threshold: %f %s\n", FP_VALUE(0), fsm->strarg[0]); 
+		FIELD_NUMBER(0, 0);
 	}
 
 	action I_L1 { 
 		if (MAX_PHASES >= 1) {
-			fsm->data.I[0] = (double)fsm->arg[0] / (double)fsm->arg[1];
-			strncpy((char *)(fsm->data.unit_I[0]), fsm->strarg[0], LEN_UNIT + 1);
-			logmsg(LL_VERBOSE, "Current L1: %f %s\n", fsm->data.I[0], fsm->strarg[0]); 
+			DATA_FP(I[0], 0);
+			DATA_UNIT(unit_I[0]);
+			COMPACT_SET(HAS_I(0), I[0], fsm->data.I[0]);
+			COMPACT_UNIT(unit_I[0]);
+			FIXED_SET(I[0], FIXED_CURRENT, 0, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Current L1: %f %s\n", FP_VALUE(0), fsm->strarg[0]); 
+			FIELD_NUMBER(0, 0);
 		}
 	}
 	
 	action I_L2 { 
 		if (MAX_PHASES >= 2) {
-			fsm->data.I[1] = (double)fsm->arg[0] / (double)fsm->arg[1];
-			strncpy((char *)(fsm->data.unit_I[1]), fsm->strarg[0], LEN_UNIT + 1);
-			logmsg(LL_VERBOSE, "Current L2: %f %s\n", fsm->data.I[1], fsm->strarg[0]); 
+			DATA_FP(I[1], 0);
+			DATA_UNIT(unit_I[1]);
+			COMPACT_SET(HAS_I(1), I[1], fsm->data.I[1]);
+			COMPACT_UNIT(unit_I[1]);
+			FIXED_SET(I[1], FIXED_CURRENT, 0, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Current L2: %f %s\n", FP_VALUE(0), fsm->strarg[0]); 
+			FIELD_NUMBER(1, 0);
 		}
 	}
 	
 	action I_L3 { 
 		if (MAX_PHASES >= 3) {
-			fsm->data.I[2] = (double)fsm->arg[0] / (double)fsm->arg[1];
-			strncpy((char *)(fsm->data.unit_I[2]), fsm->strarg[0], LEN_UNIT + 1);
-			logmsg(LL_VERBOSE, "Current L3: %f %s\n", fsm->data.I[2], fsm->strarg[0]); 
+			DATA_FP(I[2], 0);
+			DATA_UNIT(unit_I[2]);
+			COMPACT_SET(HAS_I(2), I[2], fsm->data.I[2]);
+			COMPACT_UNIT(unit_I[2]);
+			FIXED_SET(I[2], FIXED_CURRENT, 0, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Current L3: %f %s\n", FP_VALUE(0), fsm->strarg[0]); 
+			FIELD_NUMBER(2, 0);
 		}
 	}
 	
 	action V_L1 { 
 		if (MAX_PHASES >= 1) {
-			fsm->data.V[0] = (double)fsm->arg[0] / (double)fsm->arg[1];
-			strncpy((char *)(fsm->data.unit_V[0]), fsm->strarg[0], LEN_UNIT + 1);
-			logmsg(LL_VERBOSE, "Voltage L1: %f %s\n", fsm->data.V[0], fsm->strarg[0]); 
+			DATA_FP(V[0], 0);
+			DATA_UNIT(unit_V[0]);
+			COMPACT_SET(HAS_V(0), V[0], fsm->data.V[0]);
+			COMPACT_UNIT(unit_V[0]);
+			FIXED_SET(V[0], FIXED_VOLTAGE, 0, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Voltage L1: %f %s\n", FP_VALUE(0), fsm->strarg[0]); 
+			FIELD_NUMBER(0, 0);
 		}
 	}
 	
 	action V_L2 { 
 		if (MAX_PHASES >= 2) {
-			fsm->data.V[1] = (double)fsm->arg[0] / (double)fsm->arg[1];
-			strncpy((char *)(fsm->data.unit_V[1]), fsm->strarg[0], LEN_UNIT + 1);
-			logmsg(LL_VERBOSE, "Voltage L2: %f %s\n", fsm->data.V[1], fsm->strarg[0]); 
+			DATA_FP(V[1], 0);
+			DATA_UNIT(unit_V[1]);
+			COMPACT_SET(HAS_V(1), V[1], fsm->data.V[1]);
+			COMPACT_UNIT(unit_V[1]);
+			FIXED_SET(V[1], FIXED_VOLTAGE, 0, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Voltage L2: %f %s\n", FP_VALUE(0), fsm->strarg[0]); 
+			FIELD_NUMBER(1, 0);
 		}
 	}
 	
 	action V_L3 { 
 		if (MAX_PHASES >= 3) {
-			fsm->data.V[2] = (double)fsm->arg[0] / (double)fsm->arg[1];
-			strncpy((char *)(fsm->data.unit_V[2]), fsm->strarg[0], LEN_UNIT + 1);
-			logmsg(LL_VERBOSE, "Voltage L3: %f %s\n", fsm->data.V[2], fsm->strarg[0]); 
+			DATA_FP(V[2], 0);
+			DATA_UNIT(unit_V[2]);
+			COMPACT_SET(HAS_V(2), V[2], fsm->data.V[2]);
+			COMPACT_UNIT(unit_V[2]);
+			FIXED_SET(V[2], FIXED_VOLTAGE, 0, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Voltage L3: %f %s\n", FP_VALUE(0), fsm->strarg[0]); 
+			FIELD_NUMBER(2, 0);
 		}
 	}
 	
 	action P_in_L1 { 
 		if (MAX_PHASES >= 1) {
-			fsm->data.P_in[0] = (double)fsm->arg[0] / (double)fsm->arg[1];
-			strncpy((char *)(fsm->data.unit_P_in[0]), fsm->strarg[0], LEN_UNIT + 1);
-			logmsg(LL_VERBOSE, "Power in L1: %f %s\n", fsm->data.P_in[0], fsm->strarg[0]);
+			DATA_FP(P_in[0], 0);
+			DATA_UNIT(unit_P_in[0]);
+			COMPACT_SET(HAS_P_IN(0), P_in[0], fsm->data.P_in[0]);
+			COMPACT_UNIT(unit_P_in[0]);
+			FIXED_SET(P_in[0], FIXED_POWER, 0, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Power in L1: %f %s\n", FP_VALUE(0), fsm->strarg[0]);
+			FIELD_NUMBER(0, 0);
 		}
 	}
 	
 	action P_in_L2 { 
 		if (MAX_PHASES >= 2) {
-			fsm->data.P_in[1] = (double)fsm->arg[0] / (double)fsm->arg[1];
-			strncpy((char *)(fsm->data.unit_P_in[1]), fsm->strarg[0], LEN_UNIT + 1);
-			logmsg(LL_VERBOSE, "Power in L2: %f %s\n", fsm->data.P_in[1], fsm->strarg[0]);
+			DATA_FP(P_in[1], 0);
+			DATA_UNIT(unit_P_in[1]);
+			COMPACT_SET(HAS_P_IN(1), P_in[1], fsm->data.P_in[1]);
+			COMPACT_UNIT(unit_P_in[1]);
+			FIXED_SET(P_in[1], FIXED_POWER, 0, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Power in L2: %f %s\n", FP_VALUE(0), fsm->strarg[0]);
+			FIELD_NUMBER(1, 0);
 		}
 	}
 	
 	action P_in_L3 { 
 		if (MAX_PHASES >= 3) {
-			fsm->data.P_in[2] = (double)fsm->arg[0] / (double)fsm->arg[1];
-			strncpy((char *)(fsm->data.unit_P_in[2]), fsm->strarg[0], LEN_UNIT + 1);
-			logmsg(LL_VERBOSE, "Power in L3: %f %s\n", fsm->data.P_in[2], fsm->strarg[0]);
+			DATA_FP(P_in[2], 0);
+			DATA_UNIT(unit_P_in[2]);
+			COMPACT_SET(HAS_P_IN(2), P_in[2], fsm->data.P_in[2]);
+			COMPACT_UNIT(unit_P_in[2]);
+			FIXED_SET(P_in[2], FIXED_POWER, 0, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Power in L3: %f %s\n", FP_VALUE(0), fsm->strarg[0]);
+			FIELD_NUMBER(2, 0);
 		}
 	}
 
 	action P_out_L1 { 
 		if (MAX_PHASES >= 1) {
-			fsm->data.P_out[0] = (double)fsm->arg[0] / (double)fsm->arg[1];
-			strncpy((char *)(fsm->data.unit_P_out[0]), fsm->strarg[0], LEN_UNIT + 1);
-			logmsg(LL_VERBOSE, "Power out L1: %f %s\n", fsm->data.P_out[0], fsm->strarg[0]);
+			DATA_FP(P_out[0], 0);
+			DATA_UNIT(unit_P_out[0]);
+			COMPACT_SET(HAS_P_OUT(0), P_out[0], fsm->data.P_out[0]);
+			COMPACT_UNIT(unit_P_out[0]);
+			FIXED_SET(P_out[0], FIXED_POWER, 0, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Power out L1: %f %s\n", FP_VALUE(0), fsm->strarg[0]);
+			FIELD_NUMBER(0, 0);
 		}
 	}
 	
 	action P_out_L2 { 
 		if (MAX_PHASES >= 2) {
-			fsm->data.P_out[1] = (double)fsm->arg[0] / (double)fsm->arg[1];
-			strncpy((char *)(fsm->data.unit_P_out[1]), fsm->strarg[0], LEN_UNIT + 1);
-			logmsg(LL_VERBOSE, "Power out L2: %f %s\n", fsm->data.P_out[1], fsm->strarg[0]);
+			DATA_FP(P_out[1], 0);
+			DATA_UNIT(unit_P_out[1]);
+			COMPACT_SET(HAS_P_OUT(1), P_out[1], fsm->data.P_out[1]);
+			COMPACT_UNIT(unit_P_out[1]);
+			FIXED_SET(P_out[1], FIXED_POWER, 0, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Power out L2: %f %s\n", FP_VALUE(0), fsm->strarg[0]);
+			FIELD_NUMBER(1, 0);
 		}
 	}
 	
 	action P_out_L3 { 
 		if (MAX_PHASES >= 3) {
-			fsm->data.P_out[2] = (double)fsm->arg[0] / (double)fsm->arg[1];
-			strncpy((char *)(fsm->data.unit_P_out[2]), fsm->strarg[0], LEN_UNIT + 1);
-			logmsg(LL_VERBOSE, "Power out L3: %f %s\n", fsm->data.P_out[2], fsm->strarg[0]);
+			DATA_FP(P_out[2], 0);
+			DATA_UNIT(unit_P_out[2]);
+			COMPACT_SET(HAS_P_OUT(2), P_out[2], fsm->data.P_out[2]);
+			COMPACT_UNIT(unit_P_out[2]);
+			FIXED_SET(P_out[2], FIXED_POWER, 0, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Power out L3: %f %s\n", FP_VALUE(0), fsm->strarg[0]);
+			FIELD_NUMBER(2, 0);
 		}
 	}
 
 	action pfail { 
 		fsm->data.power_failures = fsm->arg[0];
-		logmsg(LL_VERBOSE, "Power failures: %lu\n", (unsigned long)(fsm->data.power_failures));
+		COMPACT_SET(HAS_POWER_FAILURES, power_failures, fsm->data.power_failures);
+		logmsg_to(fsm->logger, LL_VERBOSE, "Power failures: %lu\n", (unsigned long)(fsm->data.power_failures));
+		FIELD_INTEGER(0, fsm->arg[0]);
 	}
 	
 	action longpfail { 
 		fsm->data.power_failures_long = fsm->arg[0];
-		logmsg(LL_VERBOSE, "Long power failures: %lu\n", (unsigned long)(fsm->data.power_failures_long));
+		COMPACT_SET(HAS_POWER_FAILURES_LONG, power_failures_long, fsm->data.power_failures_long);
+		logmsg_to(fsm->logger, LL_VERBOSE, "Long power failures: %lu\n", (unsigned long)(fsm->data.power_failures_long));
+		FIELD_INTEGER(0, fsm->arg[0]);
 	}
 	
 	action pfailevents { 
 		fsm->data.pfail_events = fsm->arg[0];
+		COMPACT_SET(HAS_PFAIL_EVENTS, pfail_events, fsm->data.pfail_events);
 		fsm->pfaileventcount = 0;
-		logmsg(LL_VERBOSE, "Power failure events: %u\n", (unsigned int)(fsm->data.pfail_events));
+		logmsg_to(fsm->logger, LL_VERBOSE, "Power failure events: %u\n", (unsigned int)(fsm->data.pfail_events));
+		FIELD_INTEGER(0, fsm->arg[0]);
 	}
 	
 	action pfailevent {
 		uint32_t timestamp = TST_to_time(fsm, 0);
 		uint32_t duration = fsm->arg[7];
-		logmsg(LL_VERBOSE, "Power failure event end time %lu, %lu %s\n", (unsigned long)timestamp, (unsigned long)duration, fsm->strarg[0]);
+		logmsg_to(fsm->logger, LL_VERBOSE, "Power failure event end time %lu, %lu %s\n", (unsigned long)timestamp, (unsigned long)duration, fsm->strarg[0]);
+		FIELD_EMIT(obis_line_code(fsm), fsm->pfaileventcount, PARSER_FIELD_INTEGER, duration, 1, timestamp, 0);
 		if (fsm->pfaileventcount < MAX_EVENTS) {
 			fsm->data.pfail_event_end_time[fsm->pfaileventcount] = timestamp;
 			fsm->data.pfail_event_duration[fsm->pfaileventcount] = duration;
-			strncpy((char *)(fsm->data.unit_pfail_event_duration[fsm->pfaileventcount]), fsm->strarg[0], LEN_UNIT + 1);
+			DATA_UNIT(unit_pfail_event_duration[fsm->pfaileventcount]);
+			if (fsm->output & PARSER_OUTPUT_COMPACT) {
+				fsm->compact.pfail_event_end_time[fsm->pfaileventcount] = timestamp;
+				fsm->compact.pfail_event_duration[fsm->pfaileventcount] = duration;
+			}
+			COMPACT_UNIT(unit_pfail_event_duration[fsm->pfaileventcount]);
 		} else {
-			logmsg(LL_ERROR, "Power failure event overflow, count %d, max %d\n", fsm->pfaileventcount, MAX_EVENTS);
+			logmsg_to(fsm->logger, LL_ERROR, "Power failure event overflow, count %d, max %d\n", fsm->pfaileventcount, MAX_EVENTS);
 		}
 		fsm->pfaileventcount++;
 	}
@@ -287,73 +474,95 @@ long long int TST_to_time (struct parser *fsm, int arg_idx) {
 	action V_sags_L1 { 
 		if (MAX_PHASES >= 1) {
 			fsm->data.V_sags[0] = fsm->arg[0];
-			logmsg(LL_VERBOSE, "Voltage sags L1: %lu\n", (unsigned long)(fsm->data.V_sags[0]));
+			COMPACT_SET(HAS_V_SAGS(0), V_sags[0], fsm->data.V_sags[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Voltage sags L1: %lu\n", (unsigned long)(fsm->data.V_sags[0]));
+			FIELD_INTEGER(0, fsm->arg[0]);
 		}
 	}
 		
 	action V_sags_L2 { 
 		if (MAX_PHASES >= 2) {
 			fsm->data.V_sags[1] = fsm->arg[0];
-			logmsg(LL_VERBOSE, "Voltage sags L2: %lu\n", (unsigned long)(fsm->data.V_sags[1]));
+			COMPACT_SET(HAS_V_SAGS(1), V_sags[1], fsm->data.V_sags[1]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Voltage sags L2: %lu\n", (unsigned long)(fsm->data.V_sags[1]));
+			FIELD_INTEGER(1, fsm->arg[0]);
 		}
 	}
 		
 	action V_sags_L3 { 
 		if (MAX_PHASES >= 3) {
 			fsm->data.V_sags[2] = fsm->arg[0];
-			logmsg(LL_VERBOSE, "Voltage sags L3: %lu\n", (unsigned long)(fsm->data.V_sags[2]));
+			COMPACT_SET(HAS_V_SAGS(2), V_sags[2], fsm->data.V_sags[2]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Voltage sags L3: %lu\n", (unsigned long)(fsm->data.V_sags[2]));
+			FIELD_INTEGER(2, fsm->arg[0]);
 		}
 	}
 		
 	action V_swells_L1 { 
 		if (MAX_PHASES >= 1) {
 			fsm->data.V_swells[0] = fsm->arg[0];
-			logmsg(LL_VERBOSE, "Voltage swells L1: %lu\n", (unsigned long)(fsm->data.V_swells[0]));
+			COMPACT_SET(HAS_V_SWELLS(0), V_swells[0], fsm->data.V_swells[0]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Voltage swells L1: %lu\n", (unsigned long)(fsm->data.V_swells[0]));
+			FIELD_INTEGER(0, fsm->arg[0]);
 		}
 	}
 		
 	action V_swells_L2 { 
 		if (MAX_PHASES >= 2) {
 			fsm->data.V_swells[1] = fsm->arg[0];
-			logmsg(LL_VERBOSE, "Voltage swells L2: %lu\n", (unsigned long)(fsm->data.V_swells[1]));
+			COMPACT_SET(HAS_V_SWELLS(1), V_swells[1], fsm->data.V_swells[1]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Voltage swells L2: %lu\n", (unsigned long)(fsm->data.V_swells[1]));
+			FIELD_INTEGER(1, fsm->arg[0]);
 		}
 	}
 		
 	action V_swells_L3 { 
 		if (MAX_PHASES >= 3) {
 			fsm->data.V_swells[2] = fsm->arg[0];
-			logmsg(LL_VERBOSE, "Voltage swells L3: %lu\n", (unsigned long)(fsm->data.V_swells[2]));
+			COMPACT_SET(HAS_V_SWELLS(2), V_swells[2], fsm->data.V_swells[2]);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Voltage swells L3: %lu\n", (unsigned long)(fsm->data.V_swells[2]));
+			FIELD_INTEGER(2, fsm->arg[0]);
 		}
 	}
 	
 	action textmsgcodes { 
-		logmsg(LL_VERBOSE, "Text message codes: %s\n", fsm->strarg[0]);
-		strncpy((char *)(fsm->data.textmsg_codes), fsm->strarg[0], LEN_MESSAGE_CODES + 1);
+		logmsg_to(fsm->logger, LL_VERBOSE, "Text message codes: %s\n", fsm->strarg[0]);
+		if (fsm->output & PARSER_OUTPUT_DATA)
+			strncpy((char *)(fsm->data.textmsg_codes), fsm->strarg[0], LEN_MESSAGE_CODES + 1);
+		fsm->compact.present |= HAS_TEXTMSG_CODES;
+		FIELD_STRING(0);
 	}
 	
 	action textmsg { 
-		logmsg(LL_VERBOSE, "Text message: %s\n", fsm->strarg[0]);
-		strncpy((char *)(fsm->data.textmsg), fsm->strarg[0], LEN_MESSAGE + 1);
+		logmsg_to(fsm->logger, LL_VERBOSE, "Text message: %s\n", fsm->strarg[0]);
+		if (fsm->output & PARSER_OUTPUT_DATA)
+			strncpy((char *)(fsm->data.textmsg), fsm->strarg[0], LEN_MESSAGE + 1);
+		fsm->compact.present |= HAS_TEXTMSG;
+		FIELD_STRING(0);
 	}
 	
 	action dev_type { 
 		unsigned int dev = fsm->arg[0] - 1;
 		unsigned int type = fsm->arg[1];
 		if (dev < MAX_DEVS) {
-			logmsg(LL_VERBOSE, "Device %u type: %u\n", dev + 1, type);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Device %u type: %u\n", dev + 1, type);
 			fsm->data.dev_type[dev] = type;
+			COMPACT_SET(HAS_DEV_TYPE(dev), dev_type[dev], type);
+			FIELD_INTEGER(dev, type);
 		} else {
-			logmsg(LL_ERROR, "Device ID %u out of range, max %u, type %u\n", dev + 1, MAX_DEVS, type);
+			logmsg_to(fsm->logger, LL_ERROR, "Device ID %u out of range, max %u, type %u\n", dev + 1, MAX_DEVS, type);
 		}
 	}
 	
 	action dev_id { 
 		unsigned int dev = fsm->arg[0] - 1;
 		if (dev < MAX_DEVS) {
-			logmsg(LL_VERBOSE, "Device %u ID: %s\n", dev + 1, fsm->strarg[0]);
-			strncpy((char *)(fsm->data.dev_id[dev]), fsm->strarg[0], LEN_EQUIPMENT_ID);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Device %u ID: %s\n", dev + 1, fsm->strarg[0]);
+			DATA_ID(dev_id[dev]);
+			COMPACT_ID(HAS_DEV_ID(dev), dev_id[dev]);
+			FIELD_STRING(dev);
 		} else {
-			logmsg(LL_ERROR, "Device ID %u out of range, max %u, ID %s\n", dev + 1, MAX_DEVS, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_ERROR, "Device ID %u out of range, max %u, ID %s\n", dev + 1, MAX_DEVS, fsm->strarg[0]);
 		}
 	}
 	
@@ -361,24 +570,30 @@ long long int TST_to_time (struct parser *fsm, int arg_idx) {
 		unsigned int dev = fsm->arg[0] - 1;
 		unsigned int valve = fsm->arg[1];
 		if (dev < MAX_DEVS) {
-			logmsg(LL_VERBOSE, "Device %u valve position: %u\n", dev + 1, valve);
+			logmsg_to(fsm->logger, LL_VERBOSE, "Device %u valve position: %u\n", dev + 1, valve);
 			fsm->data.dev_valve[dev] = valve;
+			COMPACT_SET(HAS_DEV_VALVE(dev), dev_valve[dev], valve);
+			FIELD_INTEGER(dev, valve);
 		} else {
-			logmsg(LL_ERROR, "Device ID %u out of range, max %u, valve position %u\n", dev + 1, MAX_DEVS, valve);
+			logmsg_to(fsm->logger, LL_ERROR, "Device ID %u out of range, max %u, valve position %u\n", dev + 1, MAX_DEVS, valve);
 		}
 	}
 	
 	action dev_counter { 
 		unsigned int dev = fsm->arg[0] - 1;
 		uint32_t timestamp = TST_to_time(fsm, 1);
-		double value = (double)fsm->arg[8] / (double)fsm->arg[9];		
 		if (dev < MAX_DEVS) {
-			logmsg(LL_VERBOSE, "Device %u counter at %lu: %f %s\n", dev + 1, (unsigned long)timestamp, value, fsm->strarg[0]);
-			fsm->data.dev_counter[dev] = value;
+			logmsg_to(fsm->logger, LL_VERBOSE, "Device %u counter at %lu: %f %s\n", dev + 1, (unsigned long)timestamp, FP_VALUE(8), fsm->strarg[0]);
+			DATA_FP(dev_counter[dev], 8);
 			fsm->data.dev_counter_timestamp[dev] = timestamp;
-			strncpy((char *)(fsm->data.unit_dev_counter[dev]), fsm->strarg[0], LEN_UNIT + 1);
+			DATA_UNIT(unit_dev_counter[dev]);
+			COMPACT_SET(HAS_DEV_COUNTER(dev), dev_counter[dev], fsm->data.dev_counter[dev]);
+			COMPACT_SET(HAS_DEV_COUNTER(dev), dev_counter_timestamp[dev], timestamp);
+			COMPACT_UNIT(unit_dev_counter[dev]);
+			FIXED_SET(dev_counter[dev], FIXED_COUNTER, 8, NULL);
+			FIELD_EMIT(obis_line_code(fsm), dev, PARSER_FIELD_NUMBER, fsm->arg[8], fsm->arg[9], timestamp, 0);
 		} else {
-			logmsg(LL_ERROR, "Device ID %u out of range, max %u, counter at %lu: %f %s\n", dev + 1, MAX_DEVS, (unsigned long)timestamp, value, fsm->strarg[0]);
+			logmsg_to(fsm->logger, LL_ERROR, "Device ID %u out of range, max %u, counter at %lu: %f %s\n", dev + 1, MAX_DEVS, (unsigned long)timestamp, FP_VALUE(8), fsm->strarg[0]);
 		}
 	}
 	
@@ -394,7 +609,7 @@ long long int TST_to_time (struct parser *fsm, int arg_idx) {
 		int status = fsm->arg[7];
 		unsigned int period = fsm->arg[8];	// Recording period in minutes
 		unsigned int values = fsm->arg[9];
-		logmsg(LL_VERBOSE, "Device %u timeseries, starting time %lu, status %d, period %u, values %u:\n", dev, (unsigned long)timestamp, status, period, values);
+		logmsg_to(fsm->logger, LL_VERBOSE, "Device %u timeseries, starting time %lu, status %d, period %u, values %u:\n", dev, (unsigned long)timestamp, status, period, values);
 		fsm->devcount = dev - 1;
 		fsm->timeseries_time = timestamp;
 		fsm->timeseries_period_minutes = period;
@@ -402,17 +617,19 @@ long long int TST_to_time (struct parser *fsm, int arg_idx) {
 	
 	action dev_timeseries_counter_head { 
 		unsigned int dev = fsm->devcount;
-		logmsg(LL_VERBOSE, "counter values, unit %s\n", fsm->strarg[0]);
+		logmsg_to(fsm->logger, LL_VERBOSE, "counter values, unit %s\n", fsm->strarg[0]);
 		if (dev < MAX_DEVS) {
-			strncpy((char *)(fsm->data.unit_dev_counter[dev]), fsm->strarg[0], LEN_UNIT + 1);
+			DATA_UNIT(unit_dev_counter[dev]);
+			COMPACT_UNIT(unit_dev_counter[dev]);
 		}
 	} 
 
 	action dev_timeseries_counter_cold_head { 
 		unsigned int dev = fsm->devcount;
-		logmsg(LL_VERBOSE, "cold counter values, unit %s\n", fsm->strarg[0]);
+		logmsg_to(fsm->logger, LL_VERBOSE, "cold counter values, unit %s\n", fsm->strarg[0]);
 		if (dev < MAX_DEVS) {
-			strncpy((char *)(fsm->data.unit_dev_counter[dev]), fsm->strarg[0], LEN_UNIT + 1);
+			DATA_UNIT(unit_dev_counter[dev]);
+			COMPACT_UNIT(unit_dev_counter[dev]);
 		}
 	} 
 	
@@ -422,11 +639,14 @@ long long int TST_to_time (struct parser *fsm, int arg_idx) {
 		// which will end up being the most recent one...
 		
 		unsigned int dev = fsm->devcount;
-		double value = (double)fsm->arg[0] / (double)fsm->arg[1];
-		logmsg(LL_VERBOSE, "counter value: %f\n", value); 
+		logmsg_to(fsm->logger, LL_VERBOSE, "counter value: %f\n", FP_VALUE(0)); 
 		if (dev < MAX_DEVS) {
-			fsm->data.dev_counter[dev] = value;
+			DATA_FP(dev_counter[dev], 0);
 			fsm->data.dev_counter_timestamp[dev] = fsm->timeseries_time;
+			COMPACT_SET(HAS_DEV_COUNTER(dev), dev_counter[dev], fsm->data.dev_counter[dev]);
+			COMPACT_SET(HAS_DEV_COUNTER(dev), dev_counter_timestamp[dev], fsm->timeseries_time);
+			FIXED_SET(dev_counter[dev], FIXED_COUNTER, 0, NULL);
+			FIELD_EMIT(obis_line_code(fsm), dev, PARSER_FIELD_NUMBER, fsm->arg[0], fsm->arg[1], fsm->timeseries_time, -1);
 		}
 		fsm->timeseries_time += (fsm->timeseries_period_minutes * 60);
 	}
@@ -436,28 +656,93 @@ long long int TST_to_time (struct parser *fsm, int arg_idx) {
 	# We will use a fixed device ID for these...
 	
 	action gas_id_old { 
-		logmsg(LL_VERBOSE, "Gas meter ID: %s\n", fsm->strarg[0]);
+		logmsg_to(fsm->logger, LL_VERBOSE, "Gas meter ID: %s\n", fsm->strarg[0]);
 		fsm->data.dev_type[0] = 3;	// Gas meter
-		strncpy((char *)(fsm->data.dev_id[0]), fsm->strarg[0], LEN_EQUIPMENT_ID);
+		COMPACT_SET(HAS_DEV_TYPE(0), dev_type[0], 3);
+		DATA_ID(dev_id[0]);
+		COMPACT_ID(HAS_DEV_ID(0), dev_id[0]);
+		FIELD_STRING(0);
 	}
 	
 	action gas_count_old { 
 		unsigned int dev = 0;
-		double value = (double)fsm->arg[0] / (double)fsm->arg[1];
-		logmsg(LL_VERBOSE, "Gas meter counter: %f %s\n", value, fsm->strarg[0]); 
-		fsm->data.dev_counter[dev] = value;
+		logmsg_to(fsm->logger, LL_VERBOSE, "Gas meter counter: %f %s\n", FP_VALUE(0), fsm->strarg[0]); 
+		DATA_FP(dev_counter[dev], 0);
 		fsm->data.dev_counter_timestamp[dev] = fsm->data.timestamp;
-		strncpy((char *)(fsm->data.unit_dev_counter[dev]), fsm->strarg[0], LEN_UNIT + 1);
+		DATA_UNIT(unit_dev_counter[dev]);
+		COMPACT_SET(HAS_DEV_COUNTER(dev), dev_counter[dev], fsm->data.dev_counter[dev]);
+		COMPACT_SET(HAS_DEV_COUNTER(dev), dev_counter_timestamp[dev], fsm->data.timestamp);
+		COMPACT_UNIT(unit_dev_counter[dev]);
+		FIXED_SET(dev_counter[dev], FIXED_COUNTER, 0, NULL);
+		FIELD_EMIT(obis_line_code(fsm), dev, PARSER_FIELD_NUMBER, fsm->arg[0], fsm->arg[1], fsm->data.timestamp, 0);
 	}
 	
 	action gas_valve_old { 
 		fsm->data.dev_valve[0] = fsm->arg[0];
-		logmsg(LL_VERBOSE, "Gas meter valve position: %d\n", (int)(fsm->data.dev_valve[0]));
+		COMPACT_SET(HAS_DEV_VALVE(0), dev_valve[0], fsm->data.dev_valve[0]);
+		logmsg_to(fsm->logger, LL_VERBOSE, "Gas meter valve position: %d\n", (int)(fsm->data.dev_valve[0]));
+		FIELD_INTEGER(0, fsm->arg[0]);
 	}	
 
-	action error {logmsg(LL_VERBOSE, "Error while parsing\n"); fsm->parse_errors++ ; fhold ; fgoto rest_of_line; } 
+	# Generic OBIS lines, see p1-obis.c
+	
+	action obis_start {
+		// First digit of a line
+		fsm->obis_nfield = 0;
+		fsm->obis_field[0] = fc - '0';
+		fsm->obis_buflen = 0;
+		fsm->obis_ngroups = 0;
+		fsm->obis_skip = 0;
+		fsm->obis_pending = 0;		// Left set if the previous line didn't end properly
+	}
+	
+	action obis_digit {
+		if (fsm->obis_field[fsm->obis_nfield] < 1000)		// Larger values don't fit in a code anyway
+			fsm->obis_field[fsm->obis_nfield] = fsm->obis_field[fsm->obis_nfield] * 10 + (fc - '0');
+	}
+	
+	action obis_next {
+		if (fsm->obis_nfield < OBIS_FIELDS - 1)
+			fsm->obis_field[++(fsm->obis_nfield)] = 0;
+	}
+	
+	action obis_group_start {
+		if (fsm->obis_ngroups == 0)		// The code is complete, look it up before collecting its values
+			obis_line_start(fsm);
+		if (fsm->obis_ngroups < OBIS_MAXGROUPS)
+			fsm->obis_group[fsm->obis_ngroups] = fsm->obis_buflen;
+	}
+	
+	action obis_char {
+		if (!fsm->obis_skip && fsm->obis_ngroups < OBIS_MAXGROUPS && fsm->obis_buflen < OBIS_BUFLEN)
+			fsm->obis_buffer[fsm->obis_buflen++] = fc;
+	}
+	
+	action obis_group_end {
+		if (fsm->obis_ngroups < OBIS_MAXGROUPS) {
+			fsm->obis_buffer[fsm->obis_buflen++] = 0;
+			fsm->obis_ngroups++;
+		}
+	}
+	
+	action obis_line { obis_dispatch(fsm); }
+	
+	action grammar_line { fsm->obis_matched = 1; }
+	
+	action obis_check {
+		// A line with a code that has a rule of its own, which only the generic rule matched, has an invalid value
+		if (fsm->obis_pending && !fsm->obis_matched) {
+			logmsg_to(fsm->logger, LL_VERBOSE, "Invalid value for OBIS code %u-%u:%u.%u.%u\n",
+					fsm->obis_field[0], fsm->obis_field[1], fsm->obis_field[2], fsm->obis_field[3], fsm->obis_field[4]);
+			fsm->parse_errors++;
+		}
+		fsm->obis_pending = 0;
+		fsm->obis_matched = 0;
+	}
+
+	action error {logmsg_to(fsm->logger, LL_VERBOSE, "Error while parsing\n"); fsm->parse_errors++ ; fhold ; fgoto rest_of_line; } 
 	
-	action unknown { logmsg(LL_VERBOSE, "Unknown: %s\n", fsm->strarg[0]); fsm->strargc = 0 ; fsm->buflen = 0; }
+	action unknown { logmsg_to(fsm->logger, LL_VERBOSE, "Unknown: %s\n", fsm->strarg[0]); fsm->strargc = 0 ; fsm->buflen = 0; }
 
 	# Helpers that collect arguments
 	
@@ -485,8 +770,8 @@ long long int TST_to_time (struct parser *fsm, int arg_idx) {
 	msgstr = hexstring;
 	idstr = hexstring;
 	
-	header = '/' headerstr crlf crlf @header @clearargs;	
-	end = '!' hexint? crlf @crc @clearargs;		# Telegram end with optional CRC
+	header = '/' @telegram_start headerstr crlf crlf @header @clearargs;	
+	end = '!' @telegram_crc hexint? crlf @crc @telegram_end @clearargs;		# Telegram end with optional CRC
 	
 	strval = ([^)!]+ >addstr $str_append %str_term);
 	fixedpointval = '(' fixedpoint unit ')';	# The value can be either integer or non-integer
@@ -578,6 +863,14 @@ long long int TST_to_time (struct parser *fsm, int arg_idx) {
 	#cold_count_old = '6-0:1.0.0' tstval fixedpointval crlf @cold_count_old;
 	#water_count_old = '8-0:1.0.0' tstval fixedpointval crlf @water_count_old;
 	
+	# Generic COSEM-object, matched along with the rules above, and dispatched through the OBIS registry.
+	# This handles codes that don't have a rule of their own, without adding them to the state machine.
+	
+	obis_value_group = (digit @obis_digit)+;
+	obis_code = (digit @obis_start) (digit @obis_digit)* ('-' @obis_next) obis_value_group (':' @obis_next) obis_value_group ('.' @obis_next) obis_value_group ('.' @obis_next) obis_value_group billing_period;
+	obis_value = '(' @obis_group_start ([^()\r\n] $obis_char)* ')' @obis_group_end;
+	generic_object = obis_code obis_value+ crlf @obis_line;
+	
 	# "Telegram" message components
 	
 	equipment_id = equipment_id_p1 | equipment_id_iec;
@@ -591,10 +884,12 @@ long long int TST_to_time (struct parser *fsm, int arg_idx) {
 	slavedev_legacy_object = gas_id_old | gas_count_old;
 	message_object = textmsgcodes | textmsg | textmsgcodes_empty | textmsg_empty;
 	
-	object = 	metadata_object | emeter_object | power_object | current_object | voltage_object | power_quality_object |
-				message_object | mbusdev_object | slavedev_legacy_object;
+	grammar_object = 	metadata_object | emeter_object | power_object | current_object | voltage_object | power_quality_object |
+						message_object | mbusdev_object | slavedev_legacy_object;
+	
+	object = (grammar_object @grammar_line) | generic_object;
 	
-	line = object $err(error) @clearargs;	# Clear argument stacks at the end of each line, handle parsing errors
+	line = object $err(error) @obis_check @clearargs;	# Clear argument stacks at the end of each line, handle parsing errors
 	
 	telegram = header? line* end;	# Make header optional, so we can recover from errors in the middle of a telegram
 	
@@ -607,6 +902,123 @@ long long int TST_to_time (struct parser *fsm, int arg_idx) {
 
 void parser_init( struct parser *fsm )
 {
+	// Initialise the parser, including settings and caches that are kept between telegrams
+	
+	int quantity;
+	
+	fsm->meter_timezone = NULL;
+	fsm->output = PARSER_OUTPUT_DATA;
+	meter_tz_init(&(fsm->tz));
+	parser_set_logger(fsm, &logger);
+	parser_set_callback(fsm, NULL, NULL);
+	parser_set_field_callback(fsm, NULL, NULL);
+	parser_set_obis_registry(fsm, NULL);
+	for (quantity = 0 ; quantity < FIXED_QUANTITIES ; quantity++)
+		fsm->fixed_scale[quantity] = FIXED_SCALE_DEFAULT;
+	
+	parser_reset(fsm);
+}
+
+void parser_set_logger( struct parser *fsm, messagelogger *lg )
+{
+	// Set the logger used by this parser, so that parsers in different threads can log independently
+	
+	fsm->logger = lg;
+	fsm->tz.logger = lg;
+}
+
+void parser_set_callback( struct parser *fsm, parser_telegram_callback callback, void *userdata )
+{
+	// Set a function to be called at the end of every telegram. This allows input to be fed to
+	// parser_execute() in chunks of any size, without resetting the parser between telegrams.
+	// The callback is called from within parser_execute(), and must not call it itself.
+	
+	fsm->telegram_callback = callback;
+	fsm->userdata = userdata;
+}
+
+void parser_set_field_callback( struct parser *fsm, parser_field_callback callback, void *userdata )
+{
+	// Set a function to be called for every value, as soon as it is parsed. Like the telegram callback,
+	// this is called from within parser_execute(), and must not call it itself.
+	
+	fsm->field_callback = callback;
+	fsm->field_userdata = userdata;
+}
+
+int parser_set_fixed_scale( struct parser *fsm, int quantity, int decimals )
+{
+	// Set the number of decimals of a quantity (FIXED_*) in the fixed point structure,
+	// for instance 3 to store energy in Wh and voltage in mV (the default)
+	
+	if (quantity < 0 || quantity >= FIXED_QUANTITIES || decimals < 0 || decimals > MAX_DIVIDER_EXP) {
+		logmsg_to(fsm->logger, LL_ERROR, "Invalid fixed point scale %d for quantity %d\n", decimals, quantity);
+		return -1;
+	}
+	
+	fsm->fixed_scale[quantity] = decimals;
+	return 0;
+}
+
+static int parser_fixed_invalid( struct parser *fsm, int quantity, long long mantissa, long long divider )
+{
+	// Count a fixed point value that can't be represented as a parse error
+	
+	logmsg_to(fsm->logger, LL_VERBOSE, "Fixed point value %lld/%lld doesn't fit at %d decimals\n", mantissa, divider, fsm->fixed_scale[quantity]);
+	fsm->parse_errors++;
+	return -1;
+}
+
+int parser_fixed_value( struct parser *fsm, int quantity, long long mantissa, long long divider, const char *unit, int64_t *value )
+{
+	// Convert a fixed point value (mantissa / divider, with the divider a power of ten) to an integer
+	// at the scale of the quantity. Energy and power in Wh or W are converted to kWh or kW.
+	// The result is exact if the meter gives no more decimals than the scale, otherwise it is
+	// rounded half away from zero. Returns 0 on success, or -1 (and counts a parse error, leaving
+	// the value as it is) for an invalid divider or a value that doesn't fit in 64 bits at this scale.
+	
+	int scale = fsm->fixed_scale[quantity];
+	long long multiplier, scaled = divider, result;
+	
+	if (divider <= 0)
+		return parser_fixed_invalid(fsm, quantity, mantissa, divider);
+	
+	if ((quantity == FIXED_ENERGY || quantity == FIXED_POWER) && unit && unit[0] == 'W')
+		scale -= 3;
+	if (scale < 0) {
+		if (scaled > parser_pow10[MAX_DIVIDER_EXP + scale])
+			return parser_fixed_invalid(fsm, quantity, mantissa, divider);
+		scaled *= parser_pow10[-scale];
+		scale = 0;
+	}
+	
+	multiplier = parser_pow10[scale];
+	if (multiplier >= scaled) {
+		if (__builtin_mul_overflow(mantissa, multiplier / scaled, &result))
+			return parser_fixed_invalid(fsm, quantity, mantissa, divider);
+	} else {
+		scaled /= multiplier;
+		if (__builtin_add_overflow(mantissa, mantissa >= 0 ? scaled / 2 : -(scaled / 2), &result))
+			return parser_fixed_invalid(fsm, quantity, mantissa, divider);
+		result /= scaled;
+	}
+	
+	*value = result;
+	return 0;
+}
+
+void parser_set_obis_registry( struct parser *fsm, const obis_registry *reg )
+{
+	// Set the registry of extra OBIS codes and their handlers, NULL for none.
+	// Codes without a rule in the grammar are still looked up in the table of known codes.
+	
+	fsm->obis_registry = reg;
+}
+
+void parser_reset( struct parser *fsm )
+{
+	// Reset the parser state before parsing a new telegram
+	
 	int arg;
 	
 	fsm->buflen = 0;
@@ -619,7 +1031,20 @@ void parser_init( struct parser *fsm )
 	for (arg = 0 ; arg < PARSER_MAXARGS ; arg++)
 		fsm->strarg[arg] = NULL;
 	fsm->parse_errors = 0;
-	fsm->meter_timezone = NULL;
+	fsm->compact.present = 0;
+	memset(&(fsm->fixed), 0, sizeof(fsm->fixed));
+	fsm->telegram_state = PARSER_TELEGRAM_NONE;
+	fsm->crcstart = NULL;
+	fsm->crc16_data = 0;
+	fsm->telegram_len = 0;
+	fsm->obis_nfield = 0;
+	fsm->obis_buflen = 0;
+	fsm->obis_ngroups = 0;
+	fsm->obis_entry = NULL;
+	fsm->obis_reg = NULL;
+	fsm->obis_skip = 0;
+	fsm->obis_pending = 0;
+	fsm->obis_matched = 0;
 	
 	%% write init;
 }
@@ -633,8 +1058,19 @@ void parser_execute(struct parser *fsm, const char *data, int len, int eofflag)
 	if (eofflag)
 		eof = pe;
 	
+	fsm->crcstart = data;
+	
 	%% write exec;
 	
+	// In streaming mode, add the rest of this chunk to the CRC and length of an unfinished telegram
+	
+	if (fsm->telegram_callback) {
+		if (fsm->telegram_state == PARSER_TELEGRAM_DATA)
+			fsm->crc16_data = crc16_update(fsm->crc16_data, (const uint8_t *)(fsm->crcstart), pe - fsm->crcstart);
+		if (fsm->telegram_state != PARSER_TELEGRAM_NONE)
+			fsm->telegram_len += pe - fsm->crcstart;
+	}
+	
 	fsm->pe = pe;
 }
 
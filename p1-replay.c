@@ -0,0 +1,67 @@
+#include <time.h>
+
+#include "logmsg.h"
+
+#include "p1-archive.h"
+
+
+void telegram_replayed (const telegram_archive_record *rec, void *userdata)
+{
+	logmsg(LL_VERBOSE, "Offset %lu: telegram of %lu bytes, status %d, result %d, timestamp %lu, power in %f, power out %f\n", 
+		(unsigned long)rec->offset, (unsigned long)rec->len, rec->status, rec->result, 
+		(unsigned long)rec->data.timestamp, rec->data.P_in_total, rec->data.P_out_total);
+}
+
+
+int main (int argc, char **argv)
+{
+	
+	init_msglogger();
+	logger.loglevel = LL_NORMAL;
+	
+	char *infile;
+	int threads = 0, result;
+	size_t chunksize = 0;
+	struct timespec start, end;
+	double seconds;
+	telegram_archive archive;
+	
+	if (argc < 2) {
+		logmsg(LL_NORMAL, "Usage: %s <capture file> [<threads> [<chunk size in kB> [<verbose>]]]\n", argv[0]);
+		exit(1);
+	}
+	
+	infile = argv[1];
+	if (argc >= 3)
+		threads = atoi(argv[2]);
+	if (argc >= 4)
+		chunksize = (size_t)atol(argv[3]) * 1024;
+	if (argc >= 5)
+		logger.loglevel = LL_VERBOSE;
+	
+	if (telegram_archive_open(&archive, infile, chunksize) < 0) {
+		exit(2);
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	result = telegram_archive_replay(&archive, threads, telegram_replayed, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	
+	if (result < 0) {
+		telegram_archive_close(&archive);
+		exit(3);
+	}
+	
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (seconds <= 0)
+		seconds = 1e-9;
+	
+	logmsg(LL_NORMAL, "%lu telegrams (%lu with errors), %lu bytes skipped, %lu chunks\n", 
+		(unsigned long)archive.telegrams, (unsigned long)archive.errors, (unsigned long)archive.failed, (unsigned long)archive.nchunks);
+	logmsg(LL_NORMAL, "%.3f s, %.0f telegrams/s, %.1f MB/s\n", 
+		seconds, archive.telegrams / seconds, archive.size / seconds / 1e6);
+	
+	telegram_archive_close(&archive);
+	
+	return 0;
+}
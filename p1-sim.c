@@ -0,0 +1,401 @@
+#define _GNU_SOURCE	1
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/stat.h>
+
+#include "logmsg.h"
+
+#include "p1-lib.h"
+#include "p1-gen.h"
+
+
+// Smart meter simulator: creates a number of pseudo-terminals and writes telegrams to each
+// of them at the DSMR cadence, paced at the line speed of the simulated meter. Telegrams are
+// either generated, or replayed from a file (an example telegram or a capture).
+//
+// If a reader sets a different baud rate on the terminal than the meter uses, it only receives
+// noise, like it would from a real serial port. Data the reader doesn't pick up is dropped
+// once the terminal buffer is full, as a meter doesn't wait for its readers either.
+
+#define SIM_MAXBAUDS	16
+#define SIM_TICK		10			// Time between writes, in milliseconds
+#define SIM_STATS		10			// Time between statistics, in seconds
+
+
+typedef struct {
+
+	int master, slave;				// Pseudo-terminal file descriptors
+	char name[64];					// Name of the terminal device (slave)
+	speed_t speed;					// Line speed of the simulated meter
+	int baud;						// Line speed in bits per second
+	double interval;				// Time between telegrams, in (accelerated) seconds
+	double next;					// Time at which the next telegram is due
+	double credit;					// Number of bytes that can be written at the line speed
+
+	telegram_generator gen;			// Telegram generator, also used to damage replayed telegrams
+	size_t replay;					// Index of the next replayed telegram
+
+	uint8_t buf[GEN_MAXLEN];		// Telegram being written
+	size_t len, pos;
+
+	uint64_t telegrams, bytes, dropped, mismatched;
+
+} sim_port;
+
+
+typedef struct {
+
+	const uint8_t **telegrams;		// Telegrams read from a file, NULL if telegrams are generated
+	size_t *lengths;
+	size_t count;
+
+} sim_replay;
+
+
+static speed_t sim_speed (int baud)
+{
+	switch (baud) {
+		case 1200:		return B1200;
+		case 2400:		return B2400;
+		case 4800:		return B4800;
+		case 9600:		return B9600;
+		case 19200:		return B19200;
+		case 38400:		return B38400;
+		case 57600:		return B57600;
+		case 115200:	return B115200;
+		case 230400:	return B230400;
+	}
+
+	return 0;
+}
+
+
+static double sim_now (void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+static int sim_port_open (sim_port *port, const char *link)
+{
+	// Create a pseudo-terminal, and set it up like a serial port that hasn't been configured yet
+
+	struct termios tio;
+	char *name;
+
+	port->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (port->master < 0 || grantpt(port->master) < 0 || unlockpt(port->master) < 0 || (name = ptsname(port->master)) == NULL) {
+		logmsg(LL_ERROR, "Could not create pseudo-terminal: %s\n", strerror(errno));
+		return -1;
+	}
+	strncpy(port->name, name, sizeof(port->name) - 1);
+
+	// Keep the terminal open ourselves, so readers can come and go, and so we can check their line speed
+
+	port->slave = open(port->name, O_RDWR | O_NOCTTY);
+	if (port->slave < 0) {
+		logmsg(LL_ERROR, "Could not open %s: %s\n", port->name, strerror(errno));
+		close(port->master);
+		return -2;
+	}
+
+	tcgetattr(port->slave, &tio);
+	cfmakeraw(&tio);
+	cfsetispeed(&tio, port->speed);
+	cfsetospeed(&tio, port->speed);
+	tcsetattr(port->slave, TCSANOW, &tio);
+
+	fcntl(port->master, F_SETFL, fcntl(port->master, F_GETFL) | O_NONBLOCK);
+
+	if (link) {
+		unlink(link);
+		if (symlink(port->name, link) < 0) {
+			logmsg(LL_WARNING, "Could not link %s to %s: %s\n", link, port->name, strerror(errno));
+		}
+	}
+
+	return 0;
+}
+
+
+static void sim_port_telegram (sim_port *port, const sim_replay *replay)
+{
+	// Get the next telegram of a port, from the generator or the replayed file
+
+	struct termios tio;
+	size_t i;
+
+	if (replay->telegrams) {
+		port->len = replay->lengths[port->replay];
+		memcpy(port->buf, replay->telegrams[port->replay], port->len);
+		port->replay = (port->replay + 1) % replay->count;
+		telegram_generator_damage(&(port->gen), port->buf, &(port->len), GEN_MAXLEN);
+	} else {
+		port->len = telegram_generator_next(&(port->gen), port->buf, GEN_MAXLEN);
+	}
+	port->pos = 0;
+
+	// A reader at the wrong line speed receives noise
+
+	if (tcgetattr(port->slave, &tio) == 0 && cfgetispeed(&tio) != port->speed) {
+		for (i = 0 ; i < port->len ; i++) {
+			port->buf[i] = (port->buf[i] * 167 + i) ^ 0x5a;
+		}
+		port->mismatched++;
+	}
+
+	port->telegrams++;
+}
+
+
+static void sim_port_write (sim_port *port, double seconds, double accel)
+{
+	// Write as much of the current telegram as the line speed allows
+
+	ssize_t len;
+	size_t n;
+
+	port->credit += seconds * accel * port->baud / 10;		// 10 bits per byte (start bit, 8 data bits, stop bit)
+	n = port->len - port->pos;
+	if (n > port->credit)
+		n = port->credit;
+	if (n == 0)
+		return;
+
+	len = write(port->master, port->buf + port->pos, n);
+	if (len < 0) {
+		if (errno != EAGAIN)
+			logmsg(LL_WARNING, "Writing to %s: %s\n", port->name, strerror(errno));
+		len = 0;
+	}
+
+	port->bytes += len;
+	port->dropped += n - len;		// Nobody is reading, the data is lost
+	port->pos += n;
+	port->credit -= n;
+	if (port->pos >= port->len)
+		port->credit = 0;			// Idle line until the next telegram
+}
+
+
+static int sim_replay_load (sim_replay *replay, const char *infile)
+{
+	// Read a file with one or more telegrams, and locate the telegrams in it
+
+	telegram_framer framer;
+	const uint8_t *telegram;
+	uint8_t *data;
+	struct stat st;
+	size_t len, max = 0;
+	int fd;
+
+	fd = open(infile, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		logmsg(LL_ERROR, "Could not open %s: %s\n", infile, strerror(errno));
+		return -1;
+	}
+
+	data = malloc(st.st_size);
+	if (data == NULL || read(fd, data, st.st_size) != st.st_size) {
+		logmsg(LL_ERROR, "Could not read %s\n", infile);
+		close(fd);
+		return -2;
+	}
+	close(fd);
+
+	replay->telegrams = NULL;
+	replay->lengths = NULL;
+	replay->count = 0;
+
+	telegram_framer_attach(&framer, data, st.st_size);
+	framer.logger = &logger;
+	while ((len = telegram_framer_next(&framer, &telegram)) > 0) {
+		if (len > GEN_MAXLEN - 64) {
+			continue;
+		}
+		if (replay->count == max) {
+			max = max ? max * 2 : 64;
+			replay->telegrams = realloc(replay->telegrams, max * sizeof(uint8_t *));
+			replay->lengths = realloc(replay->lengths, max * sizeof(size_t));
+			if (replay->telegrams == NULL || replay->lengths == NULL) {
+				logmsg(LL_ERROR, "Could not allocate memory for telegrams\n");
+				return -3;
+			}
+		}
+		replay->telegrams[replay->count] = telegram;
+		replay->lengths[replay->count++] = len;
+	}
+
+	if (replay->count == 0) {
+		logmsg(LL_ERROR, "No telegrams found in %s\n", infile);
+		return -4;
+	}
+
+	return 0;
+}
+
+
+int main (int argc, char **argv)
+{
+
+	init_msglogger();
+	logger.loglevel = LL_NORMAL;
+
+	int nports = 1, version = GEN_DSMR50, bauds[SIM_MAXBAUDS] = { 115200 }, nbauds = 1;
+	double accel = 1, interval = 0, error_rate = 0, duration = 0;
+	char *infile = NULL, *linkprefix = NULL, *arg, link[256];
+	sim_replay replay = { NULL, NULL, 0 };
+	sim_port *ports;
+	uint64_t telegrams, bytes, dropped, mismatched;
+	double start, now, last, stats;
+	struct timespec tick;
+	int opt, p;
+
+	while ((opt = getopt(argc, argv, "n:v:b:x:i:e:f:l:t:")) != -1) {
+		switch (opt) {
+			case 'n':
+				nports = atoi(optarg);
+				break;
+			case 'v':
+				version = atoi(optarg);
+				break;
+			case 'b':
+				nbauds = 0;
+				for (arg = strtok(optarg, ",") ; arg && nbauds < SIM_MAXBAUDS ; arg = strtok(NULL, ",")) {
+					bauds[nbauds] = atoi(arg);
+					if (sim_speed(bauds[nbauds]) == 0) {
+						logmsg(LL_ERROR, "Unsupported baud rate %s\n", arg);
+						exit(1);
+					}
+					nbauds++;
+				}
+				break;
+			case 'x':
+				accel = atof(optarg);
+				break;
+			case 'i':
+				interval = atof(optarg);
+				break;
+			case 'e':
+				error_rate = atof(optarg);
+				break;
+			case 'f':
+				infile = optarg;
+				break;
+			case 'l':
+				linkprefix = optarg;
+				break;
+			case 't':
+				duration = atof(optarg);
+				break;
+			default:
+				logmsg(LL_NORMAL, "Usage: %s [-n <ports>] [-v <DSMR version: 22, 30, 40 or 50>] [-f <telegram file>]\n"
+					"\t[-b <baud rate>[,<baud rate>...]] [-x <acceleration>] [-i <interval in seconds>]\n"
+					"\t[-e <fraction of damaged telegrams>] [-l <link prefix>] [-t <duration in seconds>]\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	if (nports < 1 || nbauds < 1 || accel <= 0) {
+		logmsg(LL_ERROR, "Invalid number of ports, baud rates or acceleration\n");
+		exit(1);
+	}
+
+	if (infile && sim_replay_load(&replay, infile) < 0) {
+		exit(2);
+	}
+
+	ports = calloc(nports, sizeof(sim_port));
+	if (ports == NULL) {
+		logmsg(LL_ERROR, "Could not allocate %d ports\n", nports);
+		exit(3);
+	}
+
+	// Ports start at random moments within the first interval, like meters that were switched on at different times
+
+	start = sim_now();
+	for (p = 0 ; p < nports ; p++) {
+		ports[p].baud = bauds[p % nbauds];
+		ports[p].speed = sim_speed(ports[p].baud);
+		if (linkprefix)
+			snprintf(link, sizeof(link), "%s%d", linkprefix, p);
+		if (sim_port_open(ports + p, linkprefix ? link : NULL) < 0) {
+			exit(4);
+		}
+
+		telegram_generator_init(&(ports[p].gen), version, time(NULL), p + 1);
+		ports[p].gen.error_rate = error_rate;
+		if (replay.telegrams) {
+			ports[p].replay = p % replay.count;
+			ports[p].interval = interval ? interval : (memmem(replay.telegrams[0], replay.lengths[0], "1-3:0.2.8(50)", 13) ? 1 : 10);
+		} else {
+			ports[p].interval = interval ? interval : ports[p].gen.interval;
+		}
+		ports[p].interval /= accel;
+		ports[p].next = start + ports[p].interval * (p + 0.5) / nports;
+
+		logmsg(LL_NORMAL, "Port %d: %s, %d baud, telegram every %.3f seconds\n", p, ports[p].name, ports[p].baud, ports[p].interval);
+	}
+
+	// Write telegrams until the time is up
+
+	clock_gettime(CLOCK_MONOTONIC, &tick);
+	last = stats = start;
+	do {
+		tick.tv_nsec += SIM_TICK * 1000000;
+		if (tick.tv_nsec >= 1000000000) {
+			tick.tv_sec++;
+			tick.tv_nsec -= 1000000000;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL);
+
+		now = sim_now();
+		for (p = 0 ; p < nports ; p++) {
+			if (ports[p].pos >= ports[p].len && now >= ports[p].next) {
+				sim_port_telegram(ports + p, &replay);
+				ports[p].next += ports[p].interval;
+				if (ports[p].next < now)
+					ports[p].next = now;		// Don't try to catch up if we fell behind
+			}
+			if (ports[p].pos < ports[p].len)
+				sim_port_write(ports + p, now - last, accel);
+		}
+		last = now;
+
+		if (now - stats >= SIM_STATS) {
+			telegrams = bytes = dropped = mismatched = 0;
+			for (p = 0 ; p < nports ; p++) {
+				telegrams += ports[p].telegrams;
+				bytes += ports[p].bytes;
+				dropped += ports[p].dropped;
+				mismatched += ports[p].mismatched;
+			}
+			logmsg(LL_NORMAL, "%.0f s: %lu telegrams (%lu at the wrong line speed), %lu bytes written, %lu bytes dropped\n",
+				now - start, (unsigned long)telegrams, (unsigned long)mismatched, (unsigned long)bytes, (unsigned long)dropped);
+			stats = now;
+		}
+
+	} while (duration <= 0 || now - start < duration);
+
+	for (p = 0 ; p < nports ; p++) {
+		close(ports[p].master);
+		close(ports[p].slave);
+		if (linkprefix) {
+			snprintf(link, sizeof(link), "%s%d", linkprefix, p);
+			unlink(link);
+		}
+	}
+	free(ports);
+
+	return 0;
+}
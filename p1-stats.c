@@ -0,0 +1,176 @@
+/*
+   File: p1-stats.c
+
+   	  Export of per-meter telegram statistics, see p1-stats.h.
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "logmsg.h"
+
+#include "p1-stats.h"
+
+
+void telegram_stats_init (telegram_stats *stats, const char *name)
+{
+	memset(stats, 0, sizeof(telegram_stats));
+	strncpy(stats->name, name ? name : "", STATS_NAMELEN - 1);
+}
+
+
+static uint64_t stats_bucket_limit (int bucket)
+{
+	// Highest value recorded in a bucket
+
+	int exp;
+
+	if (bucket < STATS_SUBBUCKETS) {
+		return bucket;
+	}
+
+	exp = bucket / STATS_SUBBUCKETS + STATS_SUBBITS - 1;
+	return ((uint64_t)(STATS_SUBBUCKETS + bucket % STATS_SUBBUCKETS + 1) << (exp - STATS_SUBBITS)) - 1;
+}
+
+
+uint64_t telegram_histogram_quantile (const telegram_histogram *h, double q)
+{
+	// Return the value below which a fraction q of the recorded values lies (rounded up to the
+	// end of its bucket, but not beyond the maximum), or 0 if nothing has been recorded
+
+	uint64_t count = stats_get(&(h->count)), max = stats_get(&(h->max)), seen = 0, rank, limit;
+	int b;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	rank = (q <= 0) ? 1 : (q >= 1) ? count : (uint64_t)(q * count + 0.5);
+	if (rank == 0)
+		rank = 1;
+
+	for (b = 0 ; b < STATS_BUCKETS ; b++) {
+		seen += stats_get(h->buckets + b);
+		if (seen >= rank) {
+			limit = stats_bucket_limit(b);
+			return (limit < max) ? limit : max;
+		}
+	}
+
+	return max;		// The buckets are updated after the count, so a concurrent update may not be visible yet
+}
+
+
+static void stats_write_label (FILE *f, const char *name)
+{
+	// Write a label value, escaped as required by the Prometheus text format
+
+	for ( ; *name ; name++) {
+		if (*name == '\\' || *name == '"')
+			fputc('\\', f);
+		if (*name == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*name, f);
+	}
+}
+
+
+static void stats_write_counter (FILE *f, telegram_stats *const *stats, int n, const char *metric, const char *help, size_t offset)
+{
+	int i;
+
+	fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", metric, help, metric);
+	for (i = 0 ; i < n ; i++) {
+		fprintf(f, "%s{meter=\"", metric);
+		stats_write_label(f, stats[i]->name);
+		fprintf(f, "\"} %" PRIu64 "\n", stats_get((const stats_counter *)((const char *)(stats[i]) + offset)));
+	}
+}
+
+
+static void stats_write_summary (FILE *f, telegram_stats *const *stats, int n, const char *metric, const char *help, size_t offset)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	const telegram_histogram *h;
+	size_t j;
+	int i;
+
+	fprintf(f, "# HELP %s %s\n# TYPE %s summary\n", metric, help, metric);
+	for (i = 0 ; i < n ; i++) {
+		h = (const telegram_histogram *)((const char *)(stats[i]) + offset);
+		for (j = 0 ; j < sizeof(quantiles) / sizeof(quantiles[0]) ; j++) {
+			fprintf(f, "%s{meter=\"", metric);
+			stats_write_label(f, stats[i]->name);
+			fprintf(f, "\",quantile=\"%g\"} %.9f\n", quantiles[j], telegram_histogram_quantile(h, quantiles[j]) / 1e9);
+		}
+		fprintf(f, "%s_sum{meter=\"", metric);
+		stats_write_label(f, stats[i]->name);
+		fprintf(f, "\"} %.9f\n", stats_get(&(h->sum)) / 1e9);
+		fprintf(f, "%s_count{meter=\"", metric);
+		stats_write_label(f, stats[i]->name);
+		fprintf(f, "\"} %" PRIu64 "\n", stats_get(&(h->count)));
+	}
+}
+
+
+int telegram_stats_write (FILE *f, telegram_stats *const *stats, int n)
+{
+	// Write the statistics of n meters in the Prometheus text format. Returns 0 on success,
+	// or a negative value on error.
+
+	if (f == NULL || (stats == NULL && n > 0)) {
+		return -1;
+	}
+
+	stats_write_counter(f, stats, n, "p1_bytes_read_total", "Bytes read from the meter.", offsetof(telegram_stats, bytes_read));
+	stats_write_counter(f, stats, n, "p1_garbage_bytes_total", "Bytes skipped outside of valid telegrams.", offsetof(telegram_stats, garbage_bytes));
+	stats_write_counter(f, stats, n, "p1_telegrams_total", "Telegrams framed and parsed.", offsetof(telegram_stats, telegrams));
+	stats_write_counter(f, stats, n, "p1_parse_errors_total", "Telegrams with parse errors.", offsetof(telegram_stats, parse_errors));
+	stats_write_counter(f, stats, n, "p1_crc_failures_total", "Telegrams with a CRC mismatch.", offsetof(telegram_stats, crc_failures));
+	stats_write_counter(f, stats, n, "p1_baud_switches_total", "Baud rate switches while looking for telegrams.", offsetof(telegram_stats, baud_switches));
+	stats_write_counter(f, stats, n, "p1_timeouts_total", "Reads that ended without a telegram.", offsetof(telegram_stats, timeouts));
+	stats_write_counter(f, stats, n, "p1_read_errors_total", "Failed reads.", offsetof(telegram_stats, read_errors));
+	stats_write_summary(f, stats, n, "p1_telegram_latency_seconds", "Time from the arrival of the telegram terminator to the end of parsing.", offsetof(telegram_stats, latency));
+	stats_write_summary(f, stats, n, "p1_parse_seconds", "Time spent parsing a telegram.", offsetof(telegram_stats, parse_time));
+
+	return ferror(f) ? -2 : 0;
+}
+
+
+int telegram_stats_write_file (const char *filename, telegram_stats *const *stats, int n)
+{
+	// Rewrite a statistics file. The statistics are written to a temporary file, which then
+	// replaces the old file, so that readers never see a partly written file.
+
+	char tmpname[PATH_MAX];
+	FILE *f;
+	int result;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+	f = fopen(tmpname, "w");
+	if (f == NULL) {
+		logmsg(LL_ERROR, "Could not open statistics file %s: %s\n", tmpname, strerror(errno));
+		return -1;
+	}
+
+	result = telegram_stats_write(f, stats, n);
+	if (fclose(f) != 0 || result < 0) {
+		logmsg(LL_ERROR, "Could not write statistics file %s\n", tmpname);
+		remove(tmpname);
+		return -2;
+	}
+
+	if (rename(tmpname, filename) < 0) {
+		logmsg(LL_ERROR, "Could not replace statistics file %s: %s\n", filename, strerror(errno));
+		remove(tmpname);
+		return -3;
+	}
+
+	return 0;
+}
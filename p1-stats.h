@@ -0,0 +1,118 @@
+/*
+   File: p1-stats.h
+
+   	  Per-meter counters and latency histograms of telegram parser objects.
+
+   	  Every telegram parser object has a telegram_stats structure, which is updated by the thread
+   	  reading from the meter and can be read at any time by other threads: all fields are atomics,
+   	  so no locks are taken. Statistics can be exported in the Prometheus text format, to a stream
+   	  or to a file that is rewritten periodically (e.g. for the node_exporter textfile collector).
+
+   	  Histograms are log-linear (as in HdrHistogram): every power of two is divided into
+   	  STATS_SUBBUCKETS buckets, so values are recorded with a relative error of at most 1/STATS_SUBBUCKETS.
+*/
+
+#ifndef P1_STATS_H
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+#include <stdatomic.h>
+
+
+#define STATS_SUBBITS		3							// Histogram precision: 2^STATS_SUBBITS buckets per power of two
+#define STATS_SUBBUCKETS	(1 << STATS_SUBBITS)
+#define STATS_MAXBITS		40							// Values are recorded up to 2^STATS_MAXBITS - 1 (in ns, about 18 minutes)
+#define STATS_BUCKETS		((STATS_MAXBITS - STATS_SUBBITS + 1) * STATS_SUBBUCKETS)
+#define STATS_NAMELEN		64
+
+typedef _Atomic uint64_t stats_counter;
+
+
+typedef struct telegram_histogram_struct {
+
+	stats_counter count;
+	stats_counter sum;
+	stats_counter max;
+	stats_counter buckets[STATS_BUCKETS];
+
+} telegram_histogram;
+
+
+typedef struct telegram_stats_struct {
+
+	char name[STATS_NAMELEN];		// Meter name, used as label when exporting (the input device by default)
+
+	stats_counter bytes_read;		// Bytes read from the input
+	stats_counter garbage_bytes;	// Bytes skipped by the framer, outside of valid telegrams
+	stats_counter telegrams;		// Telegrams framed and parsed
+	stats_counter parse_errors;		// Telegrams with parse errors
+	stats_counter crc_failures;		// Telegrams with a CRC (or LRC) mismatch
+	stats_counter baud_switches;	// Baud rate switches while looking for telegrams
+	stats_counter timeouts;			// Reads from a serial device that ended without a telegram
+	stats_counter read_errors;		// Failed reads
+
+	telegram_histogram latency;		// Time from the arrival of the telegram terminator to the end of parsing, in ns
+	telegram_histogram parse_time;	// Time spent parsing a telegram, in ns
+
+} telegram_stats;
+
+
+// Updates. Every stats structure has a single writer (the thread reading from its meter),
+// so a relaxed load and store is enough, and no atomic read-modify-write is needed.
+
+static inline void stats_add (stats_counter *c, uint64_t n)
+{
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline uint64_t stats_get (const stats_counter *c)
+{
+	return atomic_load_explicit((stats_counter *)c, memory_order_relaxed);
+}
+
+static inline uint64_t stats_now (void)
+{
+	// Monotonic time in ns
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int stats_bucket (uint64_t value)
+{
+	// Bucket of a value: values below STATS_SUBBUCKETS have a bucket of their own, larger values
+	// share a bucket with the values that have the same highest STATS_SUBBITS + 1 bits
+
+	int exp;
+
+	if (value < STATS_SUBBUCKETS) {
+		return value;
+	}
+	if (value >> STATS_MAXBITS) {
+		return STATS_BUCKETS - 1;
+	}
+
+	exp = 63 - __builtin_clzll(value);
+	return (exp - STATS_SUBBITS + 1) * STATS_SUBBUCKETS + ((value >> (exp - STATS_SUBBITS)) & (STATS_SUBBUCKETS - 1));
+}
+
+static inline void stats_record (telegram_histogram *h, uint64_t value)
+{
+	stats_add(h->buckets + stats_bucket(value), 1);
+	stats_add(&(h->count), 1);
+	stats_add(&(h->sum), value);
+	if (value > stats_get(&(h->max)))
+		atomic_store_explicit(&(h->max), value, memory_order_relaxed);
+}
+
+
+void telegram_stats_init (telegram_stats *stats, const char *name);
+uint64_t telegram_histogram_quantile (const telegram_histogram *h, double q);
+int telegram_stats_write (FILE *f, telegram_stats *const *stats, int n);
+int telegram_stats_write_file (const char *filename, telegram_stats *const *stats, int n);
+
+#define P1_STATS_H	1
+#endif
@@ -0,0 +1,119 @@
+#include <string.h>
+
+#include "logmsg.h"
+
+#include "p1-archive.h"
+#include "dsmr-store.h"
+
+
+// Convert a telegram capture to a column store, then read the store back and check
+// that it holds exactly the data parsed from the capture.
+
+
+typedef struct {
+	dsmr_store_reader reader;
+	struct dsmr_data_struct *rows;
+	ssize_t nrows, row;
+	size_t mismatches;
+} store_check;
+
+
+void telegram_store (const telegram_archive_record *rec, void *userdata)
+{
+	dsmr_store_append((dsmr_store_writer *)userdata, &(rec->data));
+}
+
+
+void telegram_check (const telegram_archive_record *rec, void *userdata)
+{
+	store_check *check = userdata;
+
+	if (check->row >= check->nrows) {
+		check->nrows = dsmr_store_next_block(&(check->reader));
+		if (check->nrows <= 0 || dsmr_store_read_rows(&(check->reader), check->rows) < 0) {
+			check->mismatches++;
+			check->nrows = 0;
+			return;
+		}
+		check->row = 0;
+	}
+
+	if (memcmp(&(rec->data), check->rows + check->row, sizeof(struct dsmr_data_struct))) {
+		check->mismatches++;
+	}
+	check->row++;
+}
+
+
+int main (int argc, char **argv)
+{
+
+	init_msglogger();
+	logger.loglevel = LL_NORMAL;
+
+	char *infile, *outfile;
+	telegram_archive archive;
+	dsmr_store_writer writer;
+	store_check check;
+	const double *values;
+	double sum = 0;
+	ssize_t rows, row;
+	int col;
+
+	if (argc < 3) {
+		logmsg(LL_NORMAL, "Usage: %s <capture file> <column store>\n", argv[0]);
+		exit(1);
+	}
+
+	infile = argv[1];
+	outfile = argv[2];
+
+	if (telegram_archive_open(&archive, infile, 0) < 0) {
+		exit(2);
+	}
+
+	if (dsmr_store_writer_open(&writer, outfile, 0) < 0) {
+		telegram_archive_close(&archive);
+		exit(3);
+	}
+
+	telegram_archive_replay(&archive, 0, telegram_store, &writer);
+	dsmr_store_writer_close(&writer);
+
+	logmsg(LL_NORMAL, "%lu telegrams, %lu bytes of capture, %lu bytes stored, %.2f bytes per reading (%lu in memory)\n",
+		(unsigned long)writer.readings, (unsigned long)archive.size, (unsigned long)writer.bytes,
+		writer.readings ? (double)writer.bytes / writer.readings : 0.0, (unsigned long)sizeof(struct dsmr_data_struct));
+
+	// Check the stored data against a second replay of the capture
+
+	memset(&check, 0, sizeof(check));
+	check.rows = malloc(STORE_BLOCKROWS * sizeof(struct dsmr_data_struct));
+	if (check.rows == NULL || dsmr_store_reader_open(&(check.reader), outfile) < 0) {
+		telegram_archive_close(&archive);
+		exit(4);
+	}
+
+	telegram_archive_replay(&archive, 0, telegram_check, &check);
+	logmsg(LL_NORMAL, "%lu readings differ from the capture\n", (unsigned long)check.mismatches);
+
+	// Read a single column, without decoding the rest of the store
+
+	dsmr_store_reader_close(&(check.reader));
+	dsmr_store_reader_open(&(check.reader), outfile);
+	col = dsmr_store_column_lookup("P_in_total");
+	while ((rows = dsmr_store_next_block(&(check.reader))) > 0) {
+		if (dsmr_store_read_values(&(check.reader), col, &values) < 0) {
+			break;
+		}
+		for (row = 0 ; row < rows ; row++) {
+			sum += values[row];
+		}
+	}
+	logmsg(LL_NORMAL, "Average power in: %f kW\n", writer.readings ? sum / writer.readings : 0.0);
+
+	dsmr_store_reader_close(&(check.reader));
+	free(check.rows);
+	telegram_archive_close(&archive);
+
+	return check.mismatches ? 5 : 0;
+}
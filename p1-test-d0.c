@@ -25,6 +25,7 @@ int main (int argc, char **argv)
 	telegram_parser parser;
 	
 	telegram_parser_open_d0(&parser, infile, 0, 0, dumpfile);
+	telegram_parser_d0_session(&parser, 1);		// Only wake the meter up when needed, and learn its timing
 		
 	do {
 		
@@ -0,0 +1,60 @@
+#include <string.h>
+
+#include "logmsg.h"
+
+#include "p1-mux.h"
+
+
+void telegram_received (telegram_parser *obj, int port, int result, void *userdata)
+{
+	logmsg(LL_NORMAL, "Port %d: telegram of %lu bytes, status %d, result %d, timestamp %lu, power in %f, power out %f\n", 
+		port, (unsigned long)obj->len, obj->status, result, (unsigned long)obj->data->timestamp, obj->data->P_in_total, obj->data->P_out_total);
+}
+
+
+int main (int argc, char **argv)
+{
+	
+	init_msglogger();
+	logger.loglevel = LL_NORMAL;
+	
+	int arg = 1, ports = 0;
+	char *statsfile = NULL;
+	
+	if (argc >= 3 && !strcmp(argv[1], "-s")) {
+		statsfile = argv[2];		// Statistics of all ports, in the Prometheus text format
+		arg = 3;
+	}
+	
+	if (argc <= arg) {
+		logmsg(LL_NORMAL, "Usage: %s [-s <statistics file>] <serial device> [<serial device> ...]\n", argv[0]);
+		exit(1);
+	}
+	
+	telegram_mux mux;
+	
+	logmsg_start_async(&logger, 0);		// Don't let log output hold up reading from the ports
+	
+	if (telegram_mux_init(&mux, argc - arg, telegram_received, NULL) < 0) {
+		exit(2);
+	}
+	
+	if (statsfile && telegram_mux_set_stats_file(&mux, statsfile, 10) < 0) {
+		exit(3);
+	}
+	
+	for ( ; arg < argc ; arg++) {
+		if (telegram_mux_add(&mux, argv[arg], 0, 0, NULL) >= 0) {
+			ports++;
+		}
+	}
+	
+	while (ports && telegram_mux_run(&mux, -1) >= 0) {
+		// Telegrams are handled by the callback
+	}
+	
+	telegram_mux_close(&mux);
+	logmsg_stop_async(&logger);
+	
+	return 0;
+}
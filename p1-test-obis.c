@@ -0,0 +1,112 @@
+#include <stdio.h>
+
+#include "logmsg.h"
+
+#include "p1-lib.h"
+
+
+// Parse telegrams with extra OBIS codes, registered at runtime: Belgian and Luxembourg extensions,
+// and M-bus devices on channels that the grammar doesn't cover. Values are printed as they are parsed.
+
+
+void print_value (struct parser *fsm, const obis_value *v, void *userdata)
+{
+	const char *name = userdata;
+
+	if (!v->valid) {
+		logmsg(LL_NORMAL, "%s: invalid value (%s)\n", name, v->ngroups ? v->group[v->ngroups - 1] : "");
+		return;
+	}
+
+	switch (v->type) {
+		case OBIS_TYPE_NUMBER:
+			logmsg(LL_NORMAL, "%s: %f %s\n", name, v->value, v->unit);
+			break;
+		case OBIS_TYPE_TIMESTAMPED:
+			logmsg(LL_NORMAL, "%s: %f %s at %lu\n", name, v->value, v->unit, (unsigned long)(v->timestamp));
+			break;
+		case OBIS_TYPE_STRING:
+		case OBIS_TYPE_HEXSTRING:
+			logmsg(LL_NORMAL, "%s: %s\n", name, v->string);
+			break;
+		default:
+			logmsg(LL_NORMAL, "%s: %d values, first %s\n", name, v->ngroups, v->ngroups ? v->group[0] : "");
+	}
+}
+
+
+int main (int argc, char **argv)
+{
+
+	init_msglogger();
+	logger.loglevel = LL_NORMAL;
+
+	telegram_parser parser;
+	obis_registry registry;
+	char code[16];
+	int channel, result, errors;
+	static const char malformed[] = "/ISk5\\2MT382-1000\r\n\r\n1-0:1.8.1(12#45.6*kWh)\r\n1-0:1.8.2(12345.678*kWh)\r\n!\r\n";
+
+	if (argc < 2) {
+		logmsg(LL_NORMAL, "Usage: %s <input file or device> [<verbose>]\n", argv[0]);
+		exit(1);
+	}
+
+	if (argc >= 3)
+		logger.loglevel = LL_VERBOSE;
+
+	if (obis_registry_init(&registry) < 0) {
+		exit(2);
+	}
+
+	obis_register(&registry, "0-0:96.1.4", OBIS_TYPE_STRING, print_value, "Belgian P1 version");
+	obis_register(&registry, "1-0:1.4.0", OBIS_TYPE_NUMBER, print_value, "Average demand, current quarter-hour");
+	obis_register(&registry, "1-0:1.6.0", OBIS_TYPE_TIMESTAMPED, print_value, "Maximum demand, current month");
+	obis_register(&registry, "0-0:98.1.0", OBIS_TYPE_RAW, print_value, "Maximum demand, last 13 months");
+	obis_register(&registry, "1-0:31.4.0", OBIS_TYPE_NUMBER, print_value, "Current limit");
+	obis_register(&registry, "1-0:3.8.0", OBIS_TYPE_NUMBER, print_value, "Reactive energy in");
+	obis_register(&registry, "1-0:4.8.0", OBIS_TYPE_NUMBER, print_value, "Reactive energy out");
+	obis_register(&registry, "1-0:3.7.0", OBIS_TYPE_NUMBER, print_value, "Reactive power in");
+	obis_register(&registry, "1-0:4.7.0", OBIS_TYPE_NUMBER, print_value, "Reactive power out");
+	obis_register(&registry, "0-0:42.0.0", OBIS_TYPE_HEXSTRING, print_value, "Logical device name");
+
+	// Water and heat meters on any M-bus channel, including channels beyond MAX_DEVS
+
+	for (channel = 1 ; channel <= 8 ; channel++) {
+		snprintf(code, sizeof(code), "0-%d:24.2.1", channel);
+		obis_register(&registry, code, OBIS_TYPE_TIMESTAMPED, print_value, "M-bus counter");
+		snprintf(code, sizeof(code), "0-%d:24.2.3", channel);
+		obis_register(&registry, code, OBIS_TYPE_TIMESTAMPED, print_value, "M-bus counter (e-MUCS)");
+	}
+
+	if (telegram_parser_open(&parser, argv[1], 0, 0, NULL) < 0) {
+		exit(3);
+	}
+	parser_set_obis_registry(&(parser.parser), &registry);
+
+	for (;;) {
+		result = telegram_parser_read(&parser);
+		if (parser.len == 0 && !parser.terminal)
+			break;
+		logmsg(LL_NORMAL, "Telegram of %lu bytes, result %d, %d parse errors, device 1 counter %f %s\n",
+				(unsigned long)parser.len, result, parser.parser.parse_errors, parser.data->dev_counter[0], parser.data->unit_dev_counter[0]);
+	}
+
+	// A corrupted value on a line that has a rule of its own is matched by the generic rule as well,
+	// but must still count as a parse error (old telegrams have no CRC to catch it)
+
+	parser_reset(&(parser.parser));
+	parser_execute(&(parser.parser), malformed, sizeof(malformed) - 1, 1);
+	errors = parser.parser.parse_errors;
+	logmsg(LL_NORMAL, "Telegram with a malformed known line, %d parse errors\n", errors);
+
+	telegram_parser_close(&parser);
+	obis_registry_free(&registry);
+
+	if (errors != 1) {
+		logmsg(LL_ERROR, "Expected 1 parse error in the malformed telegram, got %d\n", errors);
+		return 4;
+	}
+
+	return 0;
+}
@@ -0,0 +1,129 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "logmsg.h"
+
+#include "p1-lib.h"
+
+
+// Parse telegrams in streaming mode, feeding the input to the parser in chunks of a given size
+// (or of random sizes). For files, the results are checked against those of telegram_parser_read().
+
+
+typedef struct {
+	struct dsmr_data_struct *data;	// Data of every telegram parsed in streaming mode
+	int *results;
+	size_t count, max;
+} stream_results;
+
+
+void telegram_streamed (telegram_parser *obj, int result, void *userdata)
+{
+	stream_results *sr = userdata;
+
+	logmsg(LL_VERBOSE, "Telegram of %lu bytes, result %d, %d parse errors, timestamp %lu, power in %f, power out %f\n",
+		(unsigned long)obj->len, result, obj->parser.parse_errors, (unsigned long)obj->data->timestamp, obj->data->P_in_total, obj->data->P_out_total);
+
+	if (sr->count == sr->max) {
+		sr->max = sr->max ? sr->max * 2 : 1024;
+		sr->data = realloc(sr->data, sr->max * sizeof(struct dsmr_data_struct));
+		sr->results = realloc(sr->results, sr->max * sizeof(int));
+		if (sr->data == NULL || sr->results == NULL) {
+			logmsg(LL_FATAL, "Could not allocate memory for %lu telegrams\n", (unsigned long)sr->max);
+			exit(4);
+		}
+	}
+
+	memcpy(sr->data + sr->count, obj->data, sizeof(struct dsmr_data_struct));
+	sr->results[sr->count++] = result;
+}
+
+
+int main (int argc, char **argv)
+{
+
+	init_msglogger();
+	logger.loglevel = LL_NORMAL;
+
+	char *infile;
+	size_t chunksize = 0, len, pos, filelen, i, mismatches = 0;
+	uint8_t *data;
+	stream_results sr = { NULL, NULL, 0, 0 };
+	telegram_parser parser;
+	ssize_t n;
+
+	if (argc < 2) {
+		logmsg(LL_NORMAL, "Usage: %s <input file or device> [<chunk size, 0 for random sizes> [<verbose>]]\n", argv[0]);
+		exit(1);
+	}
+
+	infile = argv[1];
+	if (argc >= 3)
+		chunksize = atol(argv[2]);
+	if (argc >= 4)
+		logger.loglevel = LL_VERBOSE;
+
+	if (telegram_parser_open(&parser, infile, 0, 0, NULL) < 0) {
+		exit(2);
+	}
+	telegram_parser_set_callback(&parser, telegram_streamed, &sr);
+	memset(parser.data, 0, sizeof(struct dsmr_data_struct));
+
+	if (parser.terminal) {
+		// Serial device, read whatever comes in
+
+		logger.loglevel = LL_VERBOSE;
+		while (telegram_parser_stream_read(&parser) >= 0) {
+			// Telegrams are handled by the callback
+		}
+		telegram_parser_close(&parser);
+		return 0;
+	}
+
+	// File, read it completely and feed it to the parser in chunks
+
+	filelen = lseek(parser.fd, 0, SEEK_END);
+	lseek(parser.fd, 0, SEEK_SET);
+	data = malloc(filelen ? filelen : 1);
+	if (data == NULL || read(parser.fd, data, filelen) != (ssize_t)filelen) {
+		logmsg(LL_ERROR, "Could not read %s\n", infile);
+		exit(3);
+	}
+
+	srand(1);
+	for (pos = 0 ; pos < filelen ; pos += len) {
+		len = chunksize ? chunksize : 1 + rand() % 4096;
+		if (len > filelen - pos)
+			len = filelen - pos;
+		telegram_parser_feed(&parser, data + pos, len);
+	}
+
+	// Parse the file again, one framed telegram at a time, and compare
+
+	telegram_parser_set_callback(&parser, NULL, NULL);
+	lseek(parser.fd, 0, SEEK_SET);
+	telegram_framer_reset(&(parser.framer));
+	memset(parser.data, 0, sizeof(struct dsmr_data_struct));
+
+	i = 0;
+	for (;;) {
+		n = telegram_parser_read(&parser);
+		if (parser.len == 0)
+			break;
+		if (i >= sr.count || n != sr.results[i] || memcmp(parser.data, sr.data + i, sizeof(struct dsmr_data_struct))) {
+			logmsg(LL_VERBOSE, "Telegram %lu differs from the one parsed in streaming mode\n", (unsigned long)i);
+			mismatches++;
+		}
+		i++;
+	}
+
+	logmsg(LL_NORMAL, "%lu telegrams in streaming mode, %lu framed, %lu differ\n", (unsigned long)sr.count, (unsigned long)i, (unsigned long)mismatches);
+
+	telegram_parser_close(&parser);
+	free(data);
+	free(sr.data);
+	free(sr.results);
+
+	return (mismatches || i != sr.count) ? 5 : 0;
+}
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE	1		// For memmem()
+
+#include <pthread.h>
+#include <string.h>
+
+#include "logmsg.h"
+
+#include "p1-lib.h"
+
+
+// Stress test for running parsers in several threads at the same time.
+// Every thread parses the same telegram files over and over with a parser object
+// and logger of its own, and compares the results with those of a reference run.
+
+#define THREADS		8
+#define ITERATIONS	1000
+
+
+struct thread_arg {
+	int id;
+	int nfiles;
+	char **files;
+	struct dsmr_data_struct *reference;
+	long errors;
+};
+
+
+static int parse_file (telegram_parser *parser, char *infile, char *zone, messagelogger *lg, struct dsmr_data_struct *data)
+{
+	// Parse a single telegram file and return a copy of the parsed data
+
+	int result;
+
+	memset(parser, 0, sizeof(telegram_parser));
+	if (telegram_parser_open(parser, infile, 0, 0, NULL) < 0) {
+		return -1;
+	}
+	telegram_parser_set_logger(parser, lg);
+	parser->parser.meter_timezone = zone;
+
+	result = telegram_parser_read(parser);
+	if (parser->len == 0) {
+		telegram_parser_close(parser);
+		return -1;
+	}
+
+	memcpy(data, parser->data, sizeof(struct dsmr_data_struct));
+	if (! memmem(parser->telegram, parser->len, "0-0:1.0.0(", 10)) {
+		data->timestamp = 0;		// Timestamp is the current time if the meter doesn't report one
+	}
+
+	telegram_parser_close(parser);
+
+	return result;
+}
+
+
+static void *parse_thread (void *arg)
+{
+	struct thread_arg *targ = arg;
+	telegram_parser parser;
+	struct dsmr_data_struct data;
+	messagelogger lg;
+	int iter, file;
+	char *zone;
+
+	init_msglogger_struct(&lg);
+	lg.loglevel = LL_ERROR;
+
+	// Odd threads use a zoneinfo name instead of the default POSIX TZ string
+
+	zone = (targ->id & 1) ? "Europe/Amsterdam" : NULL;
+
+	for (iter = 0 ; iter < ITERATIONS ; iter++) {
+		for (file = 0 ; file < targ->nfiles ; file++) {
+			memset(&data, 0, sizeof(data));
+			if (parse_file(&parser, targ->files[file], zone, &lg, &data) < 0 ||
+				memcmp(&data, &(targ->reference[file]), sizeof(data))) {
+				targ->errors++;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+int main (int argc, char **argv)
+{
+
+	init_msglogger();
+	logger.loglevel = LL_NORMAL;
+
+	int file, thread, nfiles;
+	long errors = 0;
+	telegram_parser parser;
+	struct dsmr_data_struct *reference;
+	pthread_t threads[THREADS];
+	struct thread_arg args[THREADS];
+
+	if (argc < 2) {
+		logmsg(LL_NORMAL, "Usage: %s <telegram file> [<telegram file> ...]\n", argv[0]);
+		exit(1);
+	}
+
+	nfiles = argc - 1;
+	reference = calloc(nfiles, sizeof(struct dsmr_data_struct));
+	if (! reference) {
+		logmsg(LL_ERROR, "Could not allocate memory\n");
+		exit(2);
+	}
+
+	// Reference run in the main thread
+
+	for (file = 0 ; file < nfiles ; file++) {
+		if (parse_file(&parser, argv[file + 1], NULL, &logger, &(reference[file])) < 0) {
+			logmsg(LL_ERROR, "Could not parse %s\n", argv[file + 1]);
+			exit(3);
+		}
+	}
+
+	for (thread = 0 ; thread < THREADS ; thread++) {
+		args[thread].id = thread;
+		args[thread].nfiles = nfiles;
+		args[thread].files = argv + 1;
+		args[thread].reference = reference;
+		args[thread].errors = 0;
+		if (pthread_create(&(threads[thread]), NULL, parse_thread, &(args[thread]))) {
+			logmsg(LL_ERROR, "Could not create thread %d\n", thread);
+			exit(4);
+		}
+	}
+
+	for (thread = 0 ; thread < THREADS ; thread++) {
+		pthread_join(threads[thread], NULL);
+		logmsg(LL_NORMAL, "Thread %d: %d telegrams, %ld mismatches\n", thread, ITERATIONS * nfiles, args[thread].errors);
+		errors += args[thread].errors;
+	}
+
+	free(reference);
+
+	return errors ? 5 : 0;
+}
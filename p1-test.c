@@ -12,7 +12,7 @@ int main (int argc, char **argv)
 	char *infile, *dumpfile;
 	
 	if (argc < 2) {
-		logmsg(LL_NORMAL, "Usage: %s <input file or device> [<output for telegrams with parse errors>]\n", argv[0]);
+		logmsg(LL_NORMAL, "Usage: %s <input file or device> [<output for telegrams with parse errors> [<low latency>]]\n", argv[0]);
 		exit(1);
 	}
 	
@@ -25,6 +25,10 @@ int main (int argc, char **argv)
 	telegram_parser parser;
 	
 	telegram_parser_open(&parser, infile, 0, 0, dumpfile);
+	
+	if (argc >= 4 && atoi(argv[3]) && parser.terminal) {
+		telegram_parser_low_latency(&parser, 1);
+	}
 		
 	do {
 		
@@ -0,0 +1,499 @@
+/*
+   File: p1-time.c
+
+   	  Conversion of meter timestamps (local time in the meter timezone) to UNIX time.
+
+   	  The DST rules of the meter timezone are parsed once from a POSIX TZ string
+   	  (e.g. "CET-1CEST,M3.5.0/2,M10.5.0/3"), the transition times are calculated once per year,
+   	  and conversions are done with integer arithmetic only. For timezone names (e.g. "Europe/Amsterdam")
+   	  we use the POSIX TZ string at the end of the timezone database file, so only timezones that 
+   	  can't be resolved this way fall back to mktime(), which changes the TZ environment variable.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logmsg.h"
+
+#include "p1-time.h"
+
+
+int64_t days_from_civil (int year, int month, int day)
+{
+	// Number of days since 1970-01-01 for a date in the proleptic Gregorian calendar
+
+	int64_t y = (month <= 2) ? year - 1 : year;
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	int64_t yoe = y - era * 400;											// Year of era [0, 399]
+	int64_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;	// Day of year, starting at March 1st [0, 365]
+	int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;					// Day of era [0, 146096]
+
+	return era * 146097 + doe - 719468;
+}
+
+
+static int is_leap (int year)
+{
+	return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+
+static int days_in_month (int year, int month)
+{
+	static const int days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+	if (month == 2 && is_leap(year))
+		return 29;
+	return days[month - 1];
+}
+
+
+static const char *parse_tz_name (const char *p)
+{
+	// Skip a timezone abbreviation, either alphabetic or quoted in angle brackets
+
+	const char *start = p;
+
+	if (*p == '<') {
+		while (*p && *p != '>')
+			p++;
+		return (*p == '>' && p - start > 1) ? p + 1 : NULL;
+	}
+
+	while (isalpha((unsigned char)*p))
+		p++;
+
+	return (p - start >= 3) ? p : NULL;
+}
+
+
+static const char *parse_tz_time (const char *p, long *seconds)
+{
+	// Parse a time or offset in the format [+|-]hh[:mm[:ss]]
+
+	long sign = 1, hours = 0, minutes = 0, secs = 0;
+
+	if (*p == '+') {
+		p++;
+	} else if (*p == '-') {
+		sign = -1;
+		p++;
+	}
+
+	if (!isdigit((unsigned char)*p))
+		return NULL;
+
+	hours = strtol(p, (char **)&p, 10);
+	if (*p == ':') {
+		minutes = strtol(p + 1, (char **)&p, 10);
+		if (*p == ':')
+			secs = strtol(p + 1, (char **)&p, 10);
+	}
+
+	*seconds = sign * (hours * 3600 + minutes * 60 + secs);
+
+	return p;
+}
+
+
+static const char *parse_tz_rule (const char *p, struct tz_rule *rule)
+{
+	// Parse a DST transition rule: Mm.w.d, Jn or n, with an optional /time
+
+	if (*p == 'M') {
+		rule->type = 'M';
+		rule->month = strtol(p + 1, (char **)&p, 10);
+		if (*p++ != '.')
+			return NULL;
+		rule->week = strtol(p, (char **)&p, 10);
+		if (*p++ != '.')
+			return NULL;
+		rule->day = strtol(p, (char **)&p, 10);
+		if (rule->month < 1 || rule->month > 12 || rule->week < 1 || rule->week > 5 || rule->day < 0 || rule->day > 6)
+			return NULL;
+	} else if (*p == 'J') {
+		rule->type = 'J';
+		rule->day = strtol(p + 1, (char **)&p, 10);
+		if (rule->day < 1 || rule->day > 365)
+			return NULL;
+	} else if (isdigit((unsigned char)*p)) {
+		rule->type = 'D';
+		rule->day = strtol(p, (char **)&p, 10);
+		if (rule->day > 365)
+			return NULL;
+	} else {
+		return NULL;
+	}
+
+	rule->time = 7200;		// Default transition time is 02:00:00
+	if (*p == '/') {
+		p = parse_tz_time(p + 1, &(rule->time));
+	}
+
+	return p;
+}
+
+
+static int64_t rule_to_days (const struct tz_rule *rule, int year)
+{
+	// Calculate the date on which a DST transition rule takes effect in a given year, as days since 1970-01-01
+
+	int64_t first;
+	int weekday, mday;
+
+	switch (rule->type) {
+	case 'M':
+		first = days_from_civil(year, rule->month, 1);
+		weekday = (int)((first % 7 + 11) % 7);		// 1970-01-01 was a Thursday, 0 is Sunday
+		mday = 1 + (rule->day - weekday + 7) % 7 + (rule->week - 1) * 7;
+		if (mday > days_in_month(year, rule->month))
+			mday -= 7;
+		return first + mday - 1;
+	case 'J':
+		// Day 1-365, February 29th is never counted
+		return days_from_civil(year, 1, 1) + rule->day - 1 + ((is_leap(year) && rule->day >= 60) ? 1 : 0);
+	default:
+		return days_from_civil(year, 1, 1) + rule->day;
+	}
+}
+
+
+void meter_tz_init (struct meter_tz *tz)
+{
+	tz->name[0] = '\0';
+	tz->valid = -1;
+	tz->has_dst = 0;
+	tz->std_offset = tz->dst_offset = 0;
+	tz->year = 0;
+	tz->dst_start = tz->dst_end = 0;
+	tz->cache_date = -1;
+	tz->cache_days = 0;
+	tz->logger = &logger;
+}
+
+
+static int meter_tz_parse (struct meter_tz *tz, const char *rules)
+{
+	// Parse a POSIX TZ string, e.g. "CET-1CEST,M3.5.0/2,M10.5.0/3", returns 1 on success
+
+	const char *p = rules;
+	long offset;
+
+	// Standard time name and offset (POSIX offsets are west of UTC, so we negate them)
+
+	if ((p = parse_tz_name(p)) == NULL || (p = parse_tz_time(p, &offset)) == NULL) {
+		return 0;
+	}
+	tz->std_offset = -offset;
+	tz->dst_offset = tz->std_offset + 3600;	// Used if a timestamp claims summer time anyway, like mktime() does
+	tz->has_dst = 0;
+
+	if (*p == '\0') {
+		return 1;		// No daylight saving time
+	}
+
+	// Summer time name, optional offset (one hour ahead of standard time by default) and rules
+
+	if ((p = parse_tz_name(p)) == NULL) {
+		return 0;
+	}
+
+	if (*p && *p != ',') {
+		if ((p = parse_tz_time(p, &offset)) == NULL) {
+			return 0;
+		}
+		tz->dst_offset = -offset;
+	}
+
+	// Without explicit rules, the C library uses rules from the timezone database, so we do the same
+
+	if (*p++ != ',' || (p = parse_tz_rule(p, &(tz->start))) == NULL ||
+		*p++ != ',' || (p = parse_tz_rule(p, &(tz->end))) == NULL || *p != '\0') {
+		return 0;
+	}
+
+	tz->has_dst = 1;
+
+	return 1;
+}
+
+
+static int tzfile_rules (const char *zone, char *rules, size_t len)
+{
+	// Get the POSIX TZ string that describes the current rules of a timezone database entry
+	// (e.g. "Europe/Amsterdam"). TZif files of version 2 and up end with this string on a line of its own.
+
+	char path[256], buf[8192];
+	const char *tzdir;
+	size_t size, end, start;
+	FILE *file;
+
+	if (*zone == ':')
+		zone++;
+
+	if (*zone == '/') {
+		snprintf(path, sizeof(path), "%s", zone);
+	} else {
+		tzdir = getenv("TZDIR");
+		snprintf(path, sizeof(path), "%s/%s", tzdir ? tzdir : "/usr/share/zoneinfo", zone);
+	}
+
+	if (strstr(zone, "..") || (file = fopen(path, "r")) == NULL) {
+		return 0;
+	}
+
+	if (fread(buf, 1, 5, file) != 5 || memcmp(buf, "TZif", 4) || buf[4] < '2' || fseek(file, 0, SEEK_END) < 0) {
+		fclose(file);
+		return 0;
+	}
+
+	// Read the end of the file, and find the last line
+
+	size = ftell(file);
+	if (size > sizeof(buf))
+		size = sizeof(buf);
+	if (fseek(file, -(long)size, SEEK_END) < 0 || fread(buf, 1, size, file) != size || size < 2 || buf[size - 1] != '\n') {
+		fclose(file);
+		return 0;
+	}
+	fclose(file);
+
+	end = size - 1;
+	start = end;
+	while (start > 0 && buf[start - 1] != '\n')
+		start--;
+
+	if (start == 0 || end - start >= len) {
+		return 0;
+	}
+
+	memcpy(rules, buf + start, end - start);
+	rules[end - start] = '\0';
+
+	return end > start;
+}
+
+
+int meter_tz_set (struct meter_tz *tz, const char *zone)
+{
+	// Set up the timezone context from a POSIX TZ string, e.g. "CET-1CEST,M3.5.0/2,M10.5.0/3",
+	// or from the current rules of a timezone database entry, e.g. "Europe/Amsterdam".
+	// Returns 1 on success, or 0 if conversions will fall back to mktime()
+
+	messagelogger *lg = tz->logger;
+	char rules[LEN_TZ_NAME];
+
+	meter_tz_init(tz);
+	tz->logger = lg;
+	strncpy(tz->name, zone, LEN_TZ_NAME - 1);
+	tz->name[LEN_TZ_NAME - 1] = '\0';
+	tz->valid = 0;
+
+	if (strlen(zone) >= LEN_TZ_NAME) {
+		logmsg_to(tz->logger, LL_WARNING, "Timezone %s is too long, using mktime()\n", zone);
+		return 0;
+	}
+
+	if (meter_tz_parse(tz, zone)) {
+		tz->valid = 1;
+		return 1;
+	}
+
+	if (tzfile_rules(zone, rules, sizeof(rules)) && meter_tz_parse(tz, rules)) {
+		logmsg_to(tz->logger, LL_VERBOSE, "Using rules %s for timezone %s\n", rules, zone);
+		tz->valid = 1;
+		return 1;
+	}
+
+	logmsg_to(tz->logger, LL_WARNING, "Timezone %s has no usable POSIX TZ rules, using mktime()\n", zone);
+
+	return 0;
+}
+
+
+static void meter_tz_year (struct meter_tz *tz, int year)
+{
+	// Calculate the DST transitions for a given year, as UNIX time
+	// Summer time starts at the given local standard time, and ends at the given local summer time
+
+	tz->dst_start = rule_to_days(&(tz->start), year) * 86400 + tz->start.time - tz->std_offset;
+	tz->dst_end = rule_to_days(&(tz->end), year) * 86400 + tz->end.time - tz->dst_offset;
+	tz->year = year;
+}
+
+
+static int meter_tz_is_dst (struct meter_tz *tz, int year, int64_t time)
+{
+	// Check whether summer time is in effect at a given UNIX time within a given (local) year
+
+	if (!tz->has_dst)
+		return 0;
+
+	if (tz->year != year)
+		meter_tz_year(tz, year);
+
+	if (tz->dst_start < tz->dst_end)
+		return time >= tz->dst_start && time < tz->dst_end;
+	else
+		return time >= tz->dst_start || time < tz->dst_end;	// Southern hemisphere
+}
+
+
+// The fall-backs below change the TZ environment variable, which is shared by all threads
+
+static pthread_mutex_t tz_env_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int64_t mktime_in_zone (const char *zone, int year, int month, int day, int hour, int min, int sec, int dstflag)
+{
+	// Fall-back for timezones we can't parse: temporarily set the TZ environment variable and use mktime()
+
+	struct tm tm;
+	time_t time;
+
+	tm.tm_year = year - 1900;
+	tm.tm_mon = month - 1;
+	tm.tm_mday = day;
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_sec = sec;
+
+	if (dstflag == 'S')
+		tm.tm_isdst = 1;
+	else if (dstflag == 'W')
+		tm.tm_isdst = 0;
+	else
+		tm.tm_isdst = -1;
+
+	pthread_mutex_lock(&tz_env_lock);
+
+	const char *TZ = "TZ";
+	char *oldval_TZ = getenv(TZ);
+	setenv(TZ, zone, 1);		// Set TZ timezone environment variable to meter timezone
+
+	time = mktime(&tm);
+
+	if (oldval_TZ)
+		setenv(TZ, oldval_TZ, 1);			// Restore TZ timezone environment variable
+	else
+		unsetenv(TZ);
+
+	pthread_mutex_unlock(&tz_env_lock);
+
+	return time;
+}
+
+
+static long localtime_offset_in_zone (const char *zone, int64_t time)
+{
+	// Fall-back for timezones we can't parse: get the UTC offset from localtime_r() in the meter timezone
+
+	struct tm tm;
+	time_t t = time;
+
+	pthread_mutex_lock(&tz_env_lock);
+
+	const char *TZ = "TZ";
+	char *oldval_TZ = getenv(TZ);
+	setenv(TZ, zone, 1);
+	tzset();
+
+	localtime_r(&t, &tm);
+
+	if (oldval_TZ)
+		setenv(TZ, oldval_TZ, 1);
+	else
+		unsetenv(TZ);
+	tzset();
+
+	pthread_mutex_unlock(&tz_env_lock);
+
+	return tm.tm_gmtoff;
+}
+
+
+int64_t meter_tz_to_time (struct meter_tz *tz, const char *zone, int year, int month, int day, int hour, int min, int sec, int dstflag)
+{
+	// Convert a local meter time to UNIX time. The dstflag is 'S' for summer time, 'W' for winter time,
+	// anything else if unknown (in which case we determine it from the DST rules).
+
+	long date;
+	int64_t local, time;
+
+	if (tz->valid < 0 || strcmp(tz->name, zone)) {
+		meter_tz_set(tz, zone);
+	}
+
+	if (!tz->valid) {
+		return mktime_in_zone(zone, year, month, day, hour, min, sec, dstflag);
+	}
+
+	// Most timestamps in a telegram share the same date, so we cache the day number
+
+	date = (long)year * 10000 + month * 100 + day;
+	if (date != tz->cache_date) {
+		tz->cache_days = days_from_civil(year, month, day);
+		tz->cache_date = date;
+	}
+
+	local = tz->cache_days * 86400 + hour * 3600 + min * 60 + sec;
+
+	if (dstflag == 'W' || (!tz->has_dst && dstflag != 'S')) {
+		return local - tz->std_offset;
+	} else if (dstflag == 'S') {
+		return local - tz->dst_offset;
+	}
+
+	// DST flag unknown: use summer time only if the time falls within the summer time period.
+	// Like mktime(), we assume standard time for the ambiguous hour at the end of summer time,
+	// and for non-existent times in the hour skipped at the start of summer time.
+
+	time = local - tz->dst_offset;
+	if (meter_tz_is_dst(tz, year, time) && meter_tz_is_dst(tz, year, local - tz->std_offset))
+		return time;
+
+	return local - tz->std_offset;
+}
+
+
+long meter_tz_offset (struct meter_tz *tz, const char *zone, int64_t time)
+{
+	// Get the offset of local meter time from UTC (in seconds east of UTC) at a given UNIX time
+
+	int64_t days;
+	int year;
+
+	if (tz->valid < 0 || strcmp(tz->name, zone)) {
+		meter_tz_set(tz, zone);
+	}
+
+	if (!tz->valid) {
+		return localtime_offset_in_zone(zone, time);
+	}
+
+	if (!tz->has_dst)
+		return tz->std_offset;
+
+	// Determine the local year (transitions never cross a year boundary in practice, so standard time is good enough)
+
+	days = (time + tz->std_offset) / 86400;
+	if ((time + tz->std_offset) % 86400 < 0)
+		days--;
+	{
+		// Civil year from days since epoch
+		int64_t z = days + 719468;
+		int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+		int64_t doe = z - era * 146097;
+		int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+		int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+		int64_t mp = (5 * doy + 2) / 153;
+		year = (int)(yoe + era * 400 + (mp >= 10 ? 1 : 0));
+	}
+
+	return meter_tz_is_dst(tz, year, time) ? tz->dst_offset : tz->std_offset;
+}
@@ -0,0 +1,54 @@
+/*
+   File: p1-time.h
+
+   	  Conversion of meter timestamps (local time in the meter timezone) to UNIX time,
+   	  using DST transition rules parsed from a POSIX TZ string.
+*/
+
+#ifndef P1_TIME_H
+
+#include <inttypes.h>
+
+#include "logmsg.h"
+
+#define LEN_TZ_NAME	64		// Maximum length of a cached TZ string
+
+
+// DST transition rule, as used in POSIX TZ strings
+
+struct tz_rule {
+	char type;				// 'M' for month.week.day, 'J' for Julian day (1-365, ignoring leap days), 'D' for day of year (0-365)
+	int month, week, day;	// Month (1-12), week (1-5, 5 is last) and weekday (0 is Sunday), or day number for 'J' and 'D'
+	long time;				// Local time of the transition, in seconds after midnight
+};
+
+
+// Timezone context, holding the parsed rules, the transitions of the current year and a conversion cache
+
+struct meter_tz {
+
+	char name[LEN_TZ_NAME];		// TZ string the context was set up for
+	int valid;					// 1 if the TZ string was parsed, 0 if we fall back to mktime(), -1 if not set up
+
+	int has_dst;				// Flag to indicate that the timezone has daylight saving time
+	long std_offset, dst_offset;	// Offset of standard and summer time, in seconds east of UTC
+	struct tz_rule start, end;	// Rules for the start and end of daylight saving time
+
+	int year;					// Year for which transition times have been calculated
+	int64_t dst_start, dst_end;	// Start and end of daylight saving time in that year, as UNIX time
+
+	long cache_date;			// Date (YYYYMMDD) of the last conversion
+	int64_t cache_days;			// Days since 1970-01-01 for that date
+	
+	messagelogger *logger;		// Logger used for messages about the timezone
+};
+
+
+void meter_tz_init (struct meter_tz *tz);
+int meter_tz_set (struct meter_tz *tz, const char *zone);
+int64_t meter_tz_to_time (struct meter_tz *tz, const char *zone, int year, int month, int day, int hour, int min, int sec, int dstflag);
+long meter_tz_offset (struct meter_tz *tz, const char *zone, int64_t time);
+int64_t days_from_civil (int year, int month, int day);
+
+#define P1_TIME_H	1
+#endif
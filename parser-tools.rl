@@ -48,7 +48,7 @@
 		// Add divider, calculated as 10^decimalpos, the decimal position from the end
 		//printf("Decimal position: %d\n", fsm->decimalpos);
 		if (fsm->decimalpos >= 0 && fsm->decimalpos <= MAX_DIVIDER_EXP)
-			fsm->arg[fsm->argc] = pow10[fsm->decimalpos];
+			fsm->arg[fsm->argc] = parser_pow10[fsm->decimalpos];
 		else if (fsm->decimalpos == -1)
 			fsm->arg[fsm->argc] = 1;
 		else